@@ -0,0 +1,107 @@
+#include "admission.h"
+#include "config.h"
+
+#include "io.h"
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define DEBUG_MODE ADMISSION_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+#define STRINGIFY_IMPL(x) #x
+#define STRINGIFY(x) STRINGIFY_IMPL(x)
+
+static const char OVERLOAD_RESPONSE[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Retry-After: " STRINGIFY(OVERLOAD_RETRY_AFTER) "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char HEALTH_CHECK_RESPONSE[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 3\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "ok\n";
+
+static const char HEALTH_CHECK_REQUEST[] = "GET " HEALTH_CHECK_PATH;
+
+static int g_listen_fd = -1;
+static const struct TWorkerPool* g_pool = NULL;
+static unsigned g_inflight = 0;  // admitted and not yet closed connections
+
+bool Admission_Init(int listen_fd, const struct TWorkerPool* pool) {
+    g_listen_fd = listen_fd;
+    g_pool = pool;
+
+    // accept() returns only once the first data segment has arrived (or the timeout passes)
+    int seconds = HEADER_READ_TIMEOUT / 1000;
+    if (setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1) {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+        return false;
+    }
+    return true;
+}
+
+// Connections completed by the kernel but not accepted yet, they wait just like queued work
+static unsigned GetAcceptQueueLength(void) {
+    struct tcp_info info;
+    socklen_t size = sizeof(info);
+    if (getsockopt(g_listen_fd, IPPROTO_TCP, TCP_INFO, &info, &size) == -1) {
+        return 0;
+    }
+    return info.tcpi_unacked;  // for a listening socket: the current accept queue length
+}
+
+static bool IsOverloaded(void) {
+    if (__atomic_load_n(&g_inflight, __ATOMIC_RELAXED) >= MAX_INFLIGHT_CONNECTIONS) {
+        return true;
+    }
+    return TWorkerPool_GetPending(g_pool) + GetAcceptQueueLength() >= MAX_QUEUED_CONNECTIONS;
+}
+
+static bool IsHealthCheck(int fd) {
+    char buf[sizeof(HEALTH_CHECK_REQUEST)];
+    ssize_t ret = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if (ret != sizeof(buf)) {
+        return false;
+    }
+    const char next = buf[sizeof(buf) - 1];
+    return memcmp(buf, HEALTH_CHECK_REQUEST, sizeof(buf) - 1) == 0 && (next == ' ' || next == '?');
+}
+
+bool Admission_Admit(int fd) {
+    if (IsHealthCheck(fd)) {
+        DEBUG_PRINT("admission: fd %d is a health check\n", fd);
+        AnswerAndClose(fd, HEALTH_CHECK_RESPONSE, sizeof(HEALTH_CHECK_RESPONSE) - 1);
+        return false;
+    }
+    if (IsOverloaded()) {
+        DEBUG_PRINT("admission: overloaded, shedding fd %d\n", fd);
+        AnswerAndClose(fd, OVERLOAD_RESPONSE, sizeof(OVERLOAD_RESPONSE) - 1);
+        return false;
+    }
+    __atomic_add_fetch(&g_inflight, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void Admission_Close(int fd) {
+    close(fd);
+    __atomic_sub_fetch(&g_inflight, 1, __ATOMIC_RELAXED);
+}
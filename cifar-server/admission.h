@@ -0,0 +1,23 @@
+#pragma once
+
+#include "worker_pool.h"
+
+#include <stdbool.h>
+
+/**
+ * Admission control for the thread pool.
+ *
+ * The acceptor decides right after accept() whether a connection may enter the server.
+ * Above MAX_INFLIGHT_CONNECTIONS open connections, or MAX_QUEUED_CONNECTIONS sockets
+ * waiting for a worker (the pool queues plus the kernel accept queue), it answers with a
+ * precomputed 503 and closes the socket without ever touching a worker, so the admitted
+ * requests keep their latency during spikes. Requests for HEALTH_CHECK_PATH are answered
+ * by the acceptor itself and never wait in a queue.
+ */
+
+// Prepares the listening socket: TCP_DEFER_ACCEPT so the request is there to be peeked at
+bool Admission_Init(int listen_fd, const struct TWorkerPool* pool);
+// Returns true if the connection is admitted, otherwise it has been answered and closed
+bool Admission_Admit(int fd);
+// Closes an admitted connection
+void Admission_Close(int fd);
@@ -0,0 +1,133 @@
+#include "config.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "resources.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_ITERATIONS 1000000
+#define BENCH_PAGE_ITERATIONS 100000
+
+// what a browser sends for a page, a bare loader request and a heavier API-like head
+static const char* g_requests[] = {
+    "GET /?page=3 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n",
+
+    "GET /images/42.bmp HTTP/1.1\r\n"
+    "Host: x\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+
+    "GET /static/bootstrap.min.css?v=5.3.2 HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: loader/1.0\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://localhost:8080/?page=1\r\n"
+    "If-None-Match: \"5f2c-17a3b0c1\"\r\n"
+    "If-Modified-Since: Tue, 01 Aug 2023 10:00:00 GMT\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+    "\r\n",
+};
+
+static uint64_t NowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The request is copied into the buffer first, as recv() would do: the parser overwrites its delimiters
+static double BenchParse(const char* text, bool parse) {
+    static char buf[MAX_REQUEST_HEAD_SIZE];
+    const size_t size = strlen(text);
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    size_t checksum = 0;
+
+    const uint64_t start = NowNs();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        memcpy(buf, text, size);
+        if (parse) {
+            THttpRequestParser_Init(&parser);
+            THttpRequest_Init(&request);
+            checksum += THttpRequestParser_Parse(&parser, buf, size, &request) + request.HeaderCount;
+        } else {
+            checksum += (unsigned char)buf[i % size];
+        }
+    }
+    const uint64_t elapsed = NowNs() - start;
+    assert(checksum != 0);  // keeps the loop from being optimized away
+    return (double)elapsed / BENCH_ITERATIONS;
+}
+
+// Without preload_pictures() there is no page cache, so every page is generated
+static double BenchIndexPage(void) {
+    size_t checksum = 0;
+    const uint64_t start = NowNs();
+    for (int i = 0; i < BENCH_PAGE_ITERATIONS; ++i) {
+        struct THttpResponse response;
+        THttpResponse_Init(&response);
+        CreateIndexPage(&response, i % 100);
+        checksum += THttpResponse_GetContentLength(&response);
+        THttpResponse_Destroy(&response);
+    }
+    const uint64_t elapsed = NowNs() - start;
+    assert(checksum != 0);
+    return (double)elapsed / BENCH_PAGE_ITERATIONS;
+}
+
+// The head of a cached image and of a 404, as the connections format them for every response
+static double BenchResponseHeaders(void) {
+    struct THttpResponse image;
+    struct THttpResponse missing;
+    struct TStringBuilder headers;
+    THttpResponse_Init(&image);
+    THttpResponse_Init(&missing);
+    TStringBuilder_Init(&headers);
+    TStringBuilder_AppendBuf(&image.Body, "BM", 2);
+    image.ContentType = CONTENT_TYPE_BMP;
+    image.KeepAlive = true;
+    image.KeepAliveMax = MAX_REQUESTS_PER_CONNECTION;
+    image.file_modification_time = 1690884000;
+    snprintf(image.ETag, ETAG_SIZE, "\"5f2c-17a3b0c1\"");
+    image.CacheControl = IMAGES_CACHE_CONTROL;
+    CreateErrorPage(&missing, HTTP_NOT_FOUND);
+    size_t checksum = 0;
+
+    const uint64_t start = NowNs();
+    for (int i = 0; i < BENCH_ITERATIONS; ++i) {
+        TStringBuilder_Clear(&headers);
+        THttpResponse_FormatHeaders(i % 2 == 0 ? &image : &missing, &headers);
+        checksum += headers.Length;
+    }
+    const uint64_t elapsed = NowNs() - start;
+    assert(checksum != 0);
+    TStringBuilder_Destroy(&headers);
+    THttpResponse_Destroy(&missing);
+    THttpResponse_Destroy(&image);
+    return (double)elapsed / BENCH_ITERATIONS;
+}
+
+int main(void) {
+    printf("%-10s %8s %10s %10s %10s\n", "request", "bytes", "copy ns", "parse ns", "total ns");
+    for (size_t i = 0; i < sizeof(g_requests) / sizeof(g_requests[0]); ++i) {
+        const double copy = BenchParse(g_requests[i], false);
+        const double total = BenchParse(g_requests[i], true);
+        printf("%-10zu %8zu %10.1f %10.1f %10.1f\n", i, strlen(g_requests[i]), copy, total - copy, total);
+    }
+    printf("\nindex page (body and Link header) %.1f ns\n", BenchIndexPage());
+    printf("response headers %.1f ns\n", BenchResponseHeaders());
+    return 0;
+}
@@ -11,28 +11,167 @@
 #define SHOULD_USE_TCP_CORK FALSE
 #define SHOULD_USE_THREADS TRUE
 #define USING_THREAD_POOL TRUE
-#define NUM_THREADS 5
+#define NUM_THREADS 5  // thread per connection mode only, the pool sizes itself
+// Idle keep-alive connections wait in a central epoll instead of blocking a pool worker
+#define USING_KEEP_ALIVE_PARKING TRUE
+#define USING_EPOLL_REACTOR FALSE  // takes precedence over SHOULD_USE_THREADS when enabled
+// Without threads: NUM_PREFORK_WORKERS long-lived processes, each running one epoll reactor
+// on the shared listener and supervised by the master, instead of a fork() per connection
+#define USING_PREFORK TRUE
+#define NUM_PREFORK_WORKERS 4
+
+
+// lifecycle config
+// SIGUSR2 starts the new binary on the same listening sockets, SIGTERM stops accepting. Either way
+// the old process serves what is already in flight for at most DRAIN_TIMEOUT and exits.
+#define LIFECYCLE_DEBUG_MODE FALSE
+#define DRAIN_TIMEOUT (15 * 1000)
+#define UPGRADE_READY_TIMEOUT (5 * 1000)  // the new binary has to take the listeners over within it
+
+// admission control config (thread pool)
+#define USING_ADMISSION_CONTROL TRUE
+#define ADMISSION_DEBUG_MODE FALSE
+
+#define MAX_INFLIGHT_CONNECTIONS 4096  // open connections, parked ones included
+#define MAX_QUEUED_CONNECTIONS 256  // waiting for a worker or in the accept queue, also the backlog
+#define OVERLOAD_RETRY_AFTER 1  // seconds, sent with 503
+#define HEALTH_CHECK_PATH "/healthz"  // answered by the acceptor, never queued
+
+
+// rate limiter config
+// Token buckets per client address, checked when a connection is accepted and per request
+#define USING_RATE_LIMITER TRUE
+#define RATE_LIMITER_DEBUG_MODE FALSE
+
+#define RATE_LIMIT_CONNECTIONS_PER_SEC 50
+#define RATE_LIMIT_CONNECTIONS_BURST 100
+#define RATE_LIMIT_REQUESTS_PER_SEC 200
+#define RATE_LIMIT_REQUESTS_BURST 400
+#define RATE_LIMIT_RETRY_AFTER 1  // seconds, sent with 429
+#define RATE_LIMIT_SHARDS 64
+#define RATE_LIMIT_SHARD_SLOTS 1024  // must be a power of two
+#define RATE_LIMIT_PROBES 8  // slots tried before a client is let through untracked
+#define RATE_LIMIT_IDLE_EVICTION (60 * 1000)  // ms after which a client's slot may be reused
+
+
+// worker pool config
+// The pool is sized from the CPUs the process may use (affinity and cgroup quota)
+#define WORKER_POOL_DEBUG_MODE FALSE
+
+#define POOL_MIN_THREADS_PER_CPU 1
+#define POOL_MAX_THREADS_PER_CPU 16  // workers block on sockets, so many more threads than CPUs pay off
+#define POOL_MAX_THREADS 1024
+#define POOL_WORKER_QUEUE_DEPTH 256  // per worker, the pool holds up to POOL_MAX_THREADS of them
+#define POOL_GROW_LATENCY_MS 5  // average queueing delay above which workers are added
+#define POOL_IDLE_TIMEOUT_MS (30 * 1000)  // an idle worker above the minimum exits after this
+#define POOL_ADJUST_INTERVAL_MS 10
+
+
+// reactor config
+#define REACTOR_DEBUG_MODE FALSE
+#define CONNECTION_DEBUG_MODE FALSE
+
+#define NUM_REACTOR_THREADS 4
+#define REACTOR_MAX_EVENTS 256  // events fetched by one epoll_wait call
+#define REACTOR_BACKLOG 4096  // the reactor drains the accept queue quickly, so it may be long
+
+// One SO_REUSEPORT listener and one reactor per allowed CPU instead of NUM_REACTOR_THREADS
+// reactors sharing a single listener. A connection is accepted, parsed and answered on the
+// CPU that received its packets.
+#define USING_REUSEPORT_SHARDS TRUE
+#define SHOULD_PIN_REACTORS TRUE
+#define MAX_REACTOR_SHARDS 64
+
+
+// io_uring config
+// Takes precedence over all the other modes, falls back to them when the kernel lacks support
+#define USING_IO_URING FALSE
+#define URING_DEBUG_MODE FALSE
+
+#define NUM_URING_THREADS NUM_REACTOR_THREADS
+#define URING_ENTRIES 4096
+#define URING_RECV_BUFFERS 1024  // provided receive buffers per ring, must be a power of two
+#define URING_SPLICE_CHUNK (64 * 1024)  // the default pipe capacity
+#define URING_MAX_CONNECTIONS 65536  // fixed file table size per ring
+
+
+// parking lot config
+#define PARKING_LOT_DEBUG_MODE FALSE
+
+#define PARKING_LOT_MAX_EVENTS 256
+
+
+// io pool config (reactor backends)
+// Static files are resolved and their page cache misses are read by a few dedicated threads,
+// the reactors only send what is already cached
+#define USING_IO_POOL TRUE
+#define IO_POOL_DEBUG_MODE FALSE
+
+#define IO_POOL_THREADS 4
+#define IO_POOL_QUEUE_DEPTH 1024  // with a full queue the reactor does the work itself
+#define IO_POOL_CHUNK (256 * 1024)  // the page cache residency is checked and filled by this much
+
+
+// connection deadlines config
+// Every backend except io_uring tracks them in a timer wheel, in the blocking modes the
+// send progress deadline is enforced with SO_SNDTIMEO instead.
+#define TIMER_WHEEL_TICK_MS 100  // deadline granularity
+#define HEADER_READ_TIMEOUT (10 * 1000)  // from the first byte of a request head to its end
+#define SEND_PROGRESS_TIMEOUT (10 * 1000)  // how long a response may not move at all
+#define MAX_REQUESTS_PER_CONNECTION 1000
 
 
 // hadler config
 #define HANDLER_DEBUG_MODE FALSE
 
 
+// router config
+#define ROUTER_MAX_PARAMS 4  // "{int}" captures of a route
+#define ROUTER_MAX_QUERY_PARAMS 16  // the query string fields past these are ignored
+
+
 // http_request config
 #define RECV_BUF_SIZE 4096
-#define TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS 10 * 1000  // 10 seconds
+#define MAX_REQUEST_HEAD_SIZE (8 * 1024)  // request line and headers, larger heads get 431
+#define MAX_REQUEST_HEADERS 32  // so are requests with more headers
+#define TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS (10 * 1000)  // 10 seconds, advertised in the Keep-Alive header
+// responses to pipelined requests are collected up to this much before they are sent together
+#define PIPELINE_MAX_BATCH (64 * 1024)
+
+
+// http2 config
+// h2c, with prior knowledge or upgraded from HTTP/1.1, in the thread pool and epoll reactor modes
+#define USING_HTTP2 TRUE
+#define HTTP2_DEBUG_MODE FALSE
+
+#define HTTP2_MAX_CONCURRENT_STREAMS 128  // advertised, more streams are refused
+#define HTTP2_HEADER_TABLE_SIZE 4096  // the HPACK dynamic table, the protocol default
+#define HTTP2_MAX_FRAME_SIZE (16 * 1024)  // the protocol default, sent and accepted
+// frames of all the streams are collected up to this much before they are written together
+#define HTTP2_OUTPUT_BATCH (64 * 1024)
 
 
 // http_response config
 #define HTTP_RESPONSE_DEBUG_MODE FALSE
 
-#define TIME_BUFFER_SIZE 1000
+// a streamed body (directory listings) is generated and sent in chunks of about this size
+#define BODY_STREAM_CHUNK (16 * 1024)
+#define MAX_BYTE_RANGES 16  // a Range header with more is ignored, the whole file is sent instead
 
 
 // io.c config
 #define IO_C_DEBUG_MODE FALSE
 
 #define MAX_RESEND_ATTEMPTS 5
+// counts the responses and the syscalls writing them, in memory shared by all the processes
+#define USING_IO_STATS TRUE
+#define IO_STATS_PATH "/stats"  // serves the counters as text
+// Cached bodies of at least ZEROCOPY_MIN_SIZE bytes are sent with MSG_ZEROCOPY by the blocking workers,
+// the kernel takes them from the shared cache instead of copying. Smaller ones are cheaper to copy
+// than to pin and to reap the completion of: the cached pages (about 6.5 KB) qualify, the bitmaps
+// (3126 bytes) do not.
+#define USING_ZEROCOPY_SEND TRUE
+#define ZEROCOPY_MIN_SIZE (4 * 1024)
 
 
 // resources config
@@ -40,6 +179,14 @@
 
 #define USING_SENDFILE TRUE
 #define USING_MMAP_INSTEAD_READ TRUE
+// generated bitmaps and index pages are kept in memory shared by all the processes
+#define USING_SHARED_CACHE TRUE
+#define SHARED_CACHE_PAGE_SLOT (16 * 1024)  // larger index pages are not cached
+// the dataset never changes: browsers keep the images for a year without revalidating them
+#define IMAGES_CACHE_CONTROL "public, max-age=31536000, immutable"
+// Index pages list the stylesheet, the logo and their images in a Link header (rel=preload).
+// No 103 Early Hints: a page is ready in microseconds, an interim response would only repeat the links.
+#define PREFETCH_NEXT_PAGE FALSE  // the Link header also names the next page's images (rel=prefetch)
 
 
 
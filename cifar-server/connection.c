@@ -0,0 +1,552 @@
+#include "connection.h"
+#include "config.h"
+
+#include "handler.h"
+#include "http2.h"
+#include "io.h"
+#include "io_pool.h"
+#include "lifecycle.h"
+#include "rate_limiter.h"
+#include "resources.h"
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define DEBUG_MODE CONNECTION_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+enum EIoResult {
+    IO_RESULT_DONE,
+    IO_RESULT_WOULD_BLOCK,
+    IO_RESULT_FAILED,
+    IO_RESULT_WAITING_DISK,
+};
+
+static void StartRequest(struct TConnection* self) {
+    THttpRequestParser_Init(&self->Parser);
+    THttpRequest_Init(&self->Request);
+    THttpResponse_Init(&self->Response);
+    self->FileFd = -1;
+    self->FilePart = 0;
+    self->FileOffset = 0;
+    self->FileRemaining = 0;
+    self->FileCachedUntil = 0;
+    self->State = CONNECTION_STATE_READING;
+    self->PhaseStartMs = MonotonicMs();
+}
+
+static void FinishRequest(struct TConnection* self) {
+    if (self->FileFd != -1) {
+        close(self->FileFd);
+        self->FileFd = -1;
+    }
+    THttpResponse_Destroy(&self->Response);
+}
+
+void TConnection_Init(struct TConnection* self, int fd) {
+    self->Fd = fd;
+    self->KeepAlive = false;
+    self->RequestsServed = 0;
+    self->ClientKey = 0;
+    self->Http2 = NULL;
+    self->DiskCompletions = NULL;
+    TTimer_Init(&self->Timer);
+    THttpInputBuffer_Init(&self->Input);
+    TStringBuilder_Init(&self->Output);
+    self->OutputSent = 0;
+    StartRequest(self);
+}
+
+void TConnection_Destroy(struct TConnection* self) {
+    if (self->Http2 != NULL) {
+        THttp2Session_Destroy(self->Http2);
+        free(self->Http2);
+    }
+    FinishRequest(self);
+    TStringBuilder_Destroy(&self->Output);
+    THttpInputBuffer_Destroy(&self->Input);
+}
+
+static enum EIoResult ReadRequest(struct TConnection* self) {
+    // a pipelined request may already be buffered, entirely or in part
+    while (!TConnection_ParseInput(self)) {
+        ssize_t ret = THttpInputBuffer_Recv(&self->Input, self->Fd);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_RESULT_WOULD_BLOCK;
+            }
+            perror("recv");
+            return IO_RESULT_FAILED;
+        }
+        if (ret == 0) {
+            // other peer has disconnected
+            return IO_RESULT_FAILED;
+        }
+    }
+    return IO_RESULT_DONE;
+}
+
+bool TConnection_ParseInput(struct TConnection* self) {
+    if (self->Parser.HeadSize == 0 && THttpInputBuffer_HasData(&self->Input)) {
+        self->PhaseStartMs = MonotonicMs();  // the idle wait is over, the head read deadline starts
+    }
+    return THttpInputBuffer_Feed(&self->Input, &self->Parser, &self->Request);
+}
+
+bool TConnection_FeedInput(struct TConnection* self, const char* data, size_t size) {
+    // the head is parsed in place, so it has to be kept together with what came before it
+    if (!THttpInputBuffer_Append(&self->Input, data, size)) {
+        self->Parser.TooLarge = true;  // only a head beyond MAX_REQUEST_HEAD_SIZE leaves no room for a receive
+        return true;
+    }
+    return TConnection_ParseInput(self);
+}
+
+static void SetFilePart(struct TConnection* self, size_t index) {
+    const struct THttpByteRange part = THttpResponse_GetFilePart(&self->Response, index);
+    self->FilePart = index;
+    self->FileOffset = part.Offset;
+    self->FileRemaining = part.Length;
+    self->FileCachedUntil = part.Offset;
+}
+
+// Everything that may touch the filesystem. On an I/O thread it must not touch the fields
+// the owner looks at meanwhile: State, PhaseStartMs, Timer and Parser.
+static void ResolveResponse(struct TConnection* self) {
+    struct THttpResponse* response = &self->Response;
+
+    if (self->Parser.TooLarge) {
+        // the rest of the head is still in flight, the connection can not be reused
+        CreateErrorPage(response, HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE);
+        self->KeepAlive = false;
+    } else if (self->Parser.Invalid) {
+        CreateErrorPage(response, HTTP_BAD_REQUEST);
+        self->KeepAlive = false;
+    } else if (!RateLimiter_Take(self->ClientKey, RATE_LIMIT_REQUESTS, MonotonicMs())) {
+        CreateErrorPage(response, HTTP_TOO_MANY_REQUESTS);
+        self->KeepAlive = false;
+    } else {
+        Handle(&self->Request, response);
+        // a draining server tells the client to reconnect elsewhere
+        self->KeepAlive = self->Request.should_keep_alive &&
+                          ++self->RequestsServed < MAX_REQUESTS_PER_CONNECTION && !Lifecycle_IsStopping();
+    }
+    response->KeepAlive = self->KeepAlive;
+    response->KeepAliveMax = MAX_REQUESTS_PER_CONNECTION - self->RequestsServed;
+
+    if (response->should_use_sendfile) {
+        assert(response->file_path_requested != NULL);
+        self->FileFd = open(response->file_path_requested, O_RDONLY | O_CLOEXEC);
+        if (self->FileFd == -1) {
+            perror("open file:");
+            THttpResponse_Destroy(response);
+            THttpResponse_Init(response);
+            CreateErrorPage(response, HTTP_NOT_FOUND);
+        } else {
+            SetFilePart(self, 0);
+        }
+    }
+}
+
+static void FinishResponse(struct TConnection* self) {
+    struct THttpResponse* response = &self->Response;
+    THttpResponse_FormatHeaders(response, &self->Output);
+    TStringBuilder_AppendBuf(&self->Output, response->Body.Data, response->Body.Length);
+    TRope_CopyTo(&response->BodyRope, &self->Output);  // a non-blocking write may stop anywhere in it
+    IoStats_Add(IO_STAT_RESPONSES, 1);
+    if (self->FileFd != -1) {
+        THttpResponse_FormatFilePartHeader(response, 0, &self->Output);
+    }
+    self->State = CONNECTION_STATE_WRITING;
+    self->PhaseStartMs = MonotonicMs();
+}
+
+void TConnection_PrepareResponse(struct TConnection* self) {
+    ResolveResponse(self);
+    FinishResponse(self);
+}
+
+// The response just prepared is all in Output, so the next one can follow it there. Only a head
+// that is already complete is taken: waiting for the rest of it would hold the batch back.
+static bool StartBufferedRequest(struct TConnection* self) {
+    if (!self->KeepAlive || self->FileFd != -1 || self->Response.BodyStream != NULL ||
+        self->Output.Length - self->OutputSent >= PIPELINE_MAX_BATCH ||
+        !THttpInputBuffer_HasCompleteHead(&self->Input)) {
+        return false;
+    }
+    DEBUG_PRINT("fd %d: answering a pipelined request in the same batch\n", self->Fd);
+    FinishRequest(self);
+    StartRequest(self);
+    return true;
+}
+
+bool TConnection_PrepareBufferedResponse(struct TConnection* self) {
+    if (!StartBufferedRequest(self)) {
+        return false;
+    }
+    TConnection_ParseInput(self);
+    TConnection_PrepareResponse(self);
+    return true;
+}
+
+// Everything before it is sent, so Output is reused for the next chunk of the streamed body
+static bool NextBodyChunk(struct TConnection* self) {
+    TStringBuilder_Clear(&self->Output);
+    self->OutputSent = 0;
+    if (THttpResponse_AppendChunk(&self->Response, &self->Output) == BODY_STREAM_FAILED) {
+        // the body ends without its last chunk, closing the connection tells the client it is cut short
+        self->KeepAlive = false;
+        return false;
+    }
+    return true;
+}
+
+static void RunResolveJob(struct TIoJob* job) {
+    ResolveResponse((struct TConnection*)((char*)job - offsetof(struct TConnection, DiskJob)));
+}
+
+static void RunWarmJob(struct TIoJob* job) {
+    const struct TConnection* self = (struct TConnection*)((char*)job - offsetof(struct TConnection, DiskJob));
+    WarmFileRange(self->FileFd, self->FileOffset, self->FileCachedUntil - self->FileOffset);
+}
+
+static void RunStreamJob(struct TIoJob* job) {
+    NextBodyChunk((struct TConnection*)((char*)job - offsetof(struct TConnection, DiskJob)));
+}
+
+static bool SubmitDiskJob(struct TConnection* self, TIoJobFunc run) {
+    self->DiskJob.Run = run;
+    self->DiskJob.Owner = self->DiskCompletions;
+    if (!IoPool_Submit(&self->DiskJob)) {
+        return false;  // the pool is saturated, the disk is touched inline instead
+    }
+    self->State = CONNECTION_STATE_WAITING_DISK;
+    self->PhaseStartMs = MonotonicMs();
+    return true;
+}
+
+// A static file request is resolved on the I/O pool: realpath(), stat() and directory listings may all wait for the disk
+static bool StartResolvingOnIoPool(struct TConnection* self) {
+#if (USING_IO_POOL)
+    if (self->DiskCompletions != NULL && !self->Parser.TooLarge && !self->Parser.Invalid &&
+        IsFilesystemRequest(&self->Request)) {
+        return SubmitDiskJob(self, RunResolveJob);
+    }
+#else
+    (void) self;
+#endif
+    return false;
+}
+
+// How much of the file sendfile() may send without waiting for the disk
+static size_t GetSendableFileBytes(struct TConnection* self) {
+#if (USING_IO_POOL)
+    if (self->DiskCompletions == NULL) {
+        return self->FileRemaining;
+    }
+    if (self->FileOffset >= self->FileCachedUntil) {
+        const size_t chunk = self->FileRemaining < IO_POOL_CHUNK ? self->FileRemaining : IO_POOL_CHUNK;
+        const bool cached = IsFileRangeCached(self->FileFd, self->FileOffset, chunk);
+        self->FileCachedUntil = self->FileOffset + chunk;
+        if (!cached && SubmitDiskJob(self, RunWarmJob)) {
+            return 0;
+        }
+    }
+    return self->FileCachedUntil - self->FileOffset;
+#else
+    return self->FileRemaining;
+#endif
+}
+
+static enum EIoResult WriteOutputAndFile(struct TConnection* self) {
+    // the file follows right away, the end of Output waits for it to fill a segment
+    const int flags = MSG_NOSIGNAL | (self->FileRemaining != 0 ? MSG_MORE : 0);
+    while (self->OutputSent < self->Output.Length) {
+        IoStats_Add(IO_STAT_SEND_CALLS, 1);
+        ssize_t ret = send(self->Fd, self->Output.Data + self->OutputSent,
+                           self->Output.Length - self->OutputSent, flags);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_RESULT_WOULD_BLOCK;
+            }
+            DEBUG_PRINT("send failed: errno %d\n", errno);
+            return IO_RESULT_FAILED;
+        }
+        self->OutputSent += ret;
+        self->PhaseStartMs = MonotonicMs();
+    }
+
+    while (self->FileRemaining != 0) {
+        const size_t sendable = GetSendableFileBytes(self);
+        if (sendable == 0) {
+            return IO_RESULT_WAITING_DISK;
+        }
+        IoStats_Add(IO_STAT_SENDFILE_CALLS, 1);
+        ssize_t ret = sendfile(self->Fd, self->FileFd, &self->FileOffset, sendable);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return IO_RESULT_WOULD_BLOCK;
+            }
+            perror("sendfile error:");
+            return IO_RESULT_FAILED;
+        }
+        if (ret == 0) {
+            // the file was truncated after stat(), the promised Content-Length can not be honoured
+            return IO_RESULT_FAILED;
+        }
+        self->FileRemaining -= ret;
+        self->PhaseStartMs = MonotonicMs();
+    }
+    return IO_RESULT_DONE;
+}
+
+bool TConnection_NextResponsePart(struct TConnection* self) {
+    if (self->Response.BodyStream != NULL) {
+        return NextBodyChunk(self);
+    }
+    const size_t count = THttpResponse_GetFilePartCount(&self->Response);
+    if (self->FileFd == -1 || self->FilePart >= count) {
+        return false;
+    }
+    const size_t outputLength = self->Output.Length;
+    if (self->FilePart + 1 < count) {
+        SetFilePart(self, self->FilePart + 1);
+    } else {
+        self->FilePart = count;
+    }
+    // the delimiter before the next part, or the closing one after the last
+    THttpResponse_FormatFilePartHeader(&self->Response, self->FilePart, &self->Output);
+    return self->FilePart != count || self->Output.Length != outputLength;
+}
+
+// The chunks of a streamed body are generated on the I/O pool: a directory listing reads the disk
+static bool StartStreamingOnIoPool(struct TConnection* self) {
+#if (USING_IO_POOL)
+    return self->DiskCompletions != NULL && self->Response.BodyStream != NULL && SubmitDiskJob(self, RunStreamJob);
+#else
+    (void) self;
+    return false;
+#endif
+}
+
+static enum EIoResult WriteResponse(struct TConnection* self) {
+    do {
+        enum EIoResult result = WriteOutputAndFile(self);
+        if (result != IO_RESULT_DONE) {
+            return result;
+        }
+        if (StartStreamingOnIoPool(self)) {
+            return IO_RESULT_WAITING_DISK;
+        }
+    } while (TConnection_NextResponsePart(self));
+    return IO_RESULT_DONE;
+}
+
+void TConnection_CompleteDiskJob(struct TConnection* self) {
+    assert(self->State == CONNECTION_STATE_WAITING_DISK);
+    if (self->DiskJob.Run == RunResolveJob) {
+        FinishResponse(self);
+    } else {
+        // FileCachedUntil was set when the range was handed off, or the next chunk is in Output
+        self->State = CONNECTION_STATE_WRITING;
+        self->PhaseStartMs = MonotonicMs();
+    }
+}
+
+uint64_t TConnection_GetDeadline(const struct TConnection* self) {
+#if (USING_HTTP2)
+    // bytes received do not move the deadline of a session, its whole frames do
+    if (self->Http2 != NULL && self->State != CONNECTION_STATE_WRITING) {
+        return THttp2Session_GetDeadline(self->Http2);
+    }
+#endif
+    if (self->State == CONNECTION_STATE_WRITING || self->State == CONNECTION_STATE_WAITING_DISK) {
+        return self->PhaseStartMs + SEND_PROGRESS_TIMEOUT;
+    }
+    if (self->Parser.HeadSize != 0) {
+        return self->PhaseStartMs + HEADER_READ_TIMEOUT;
+    }
+    return self->PhaseStartMs + TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS;
+}
+
+bool TConnection_StartNextRequest(struct TConnection* self) {
+    if (!self->KeepAlive) {
+        return false;
+    }
+    DEBUG_PRINT("fd %d: response is sent, waiting for the next request\n", self->Fd);
+    FinishRequest(self);
+    StartRequest(self);
+    TStringBuilder_Clear(&self->Output);
+    self->OutputSent = 0;
+    return true;
+}
+
+#if (USING_HTTP2)
+// Every stream is a request of its own for the rate limiter
+static void HandleStream(const struct THttpRequest* request, struct THttpResponse* response, void* context) {
+    const struct TConnection* self = context;
+    if (!RateLimiter_Take(self->ClientKey, RATE_LIMIT_REQUESTS, MonotonicMs())) {
+        CreateErrorPage(response, HTTP_TOO_MANY_REQUESTS);
+        return;
+    }
+    Handle(request, response);
+}
+
+// Switches to HTTP/2 if the request asks for it, the upgrade request is answered as stream 1
+static bool StartHttp2(struct TConnection* self) {
+    if (self->Parser.TooLarge || self->Parser.Invalid) {
+        return false;
+    }
+    const bool priorKnowledge = Http2_IsPriorKnowledge(&self->Request);
+    const bool upgrade = !priorKnowledge && !Lifecycle_IsStopping() &&
+                         self->RequestsServed + 1 < MAX_REQUESTS_PER_CONNECTION && Http2_IsUpgrade(&self->Request);
+    if (!priorKnowledge && !upgrade) {
+        return false;
+    }
+    self->Http2 = malloc(sizeof(struct THttp2Session));
+    if (self->Http2 == NULL) {
+        return false;
+    }
+    DEBUG_PRINT("fd %d: switching to HTTP/2\n", self->Fd);
+    THttp2Session_Init(self->Http2, HandleStream, self, MAX_REQUESTS_PER_CONNECTION - self->RequestsServed);
+    THttp2Session_Start(self->Http2, upgrade ? &self->Request : NULL);
+    THttp2Session_Feed(self->Http2, self->Input.Data + self->Input.Begin, self->Input.End - self->Input.Begin);
+    THttpInputBuffer_Clear(&self->Input);
+    THttpRequestParser_Init(&self->Parser);
+    self->State = CONNECTION_STATE_WRITING;
+    return true;
+}
+
+// Writes the frames, collects more of them and reads whenever there is nothing to write
+static enum EConnectionState ProcessHttp2(struct TConnection* self) {
+    struct THttp2Session* session = self->Http2;
+    while (true) {
+        while (self->OutputSent < session->Output.Length) {
+            IoStats_Add(IO_STAT_SEND_CALLS, 1);
+            ssize_t ret = send(self->Fd, session->Output.Data + self->OutputSent,
+                               session->Output.Length - self->OutputSent, MSG_NOSIGNAL);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    self->State = CONNECTION_STATE_WRITING;
+                    return self->State;
+                }
+                DEBUG_PRINT("send failed: errno %d\n", errno);
+                self->State = CONNECTION_STATE_CLOSED;
+                return self->State;
+            }
+            self->OutputSent += ret;
+            self->PhaseStartMs = MonotonicMs();
+        }
+        TStringBuilder_Clear(&session->Output);
+        self->OutputSent = 0;
+        if (Lifecycle_IsStopping()) {
+            THttp2Session_Shutdown(session);
+        }
+        if (THttp2Session_IsDone(session)) {
+            self->State = CONNECTION_STATE_CLOSED;
+            return self->State;
+        }
+        THttp2Session_WriteFrames(session);
+        if (session->Output.Length != 0) {
+            continue;
+        }
+
+        ssize_t ret = THttpInputBuffer_Recv(&self->Input, self->Fd);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                self->State = CONNECTION_STATE_READING;
+                return self->State;
+            }
+            perror("recv");
+        }
+        if (ret <= 0) {
+            self->State = CONNECTION_STATE_CLOSED;
+            return self->State;
+        }
+        THttp2Session_Feed(session, self->Input.Data + self->Input.Begin, self->Input.End - self->Input.Begin);
+        THttpInputBuffer_Clear(&self->Input);
+    }
+}
+#endif
+
+enum EConnectionState TConnection_Process(struct TConnection* self) {
+#if (USING_HTTP2)
+    if (self->Http2 != NULL) {
+        return ProcessHttp2(self);
+    }
+#endif
+    while (true) {
+        switch (self->State) {
+            case CONNECTION_STATE_READING:
+            {
+                enum EIoResult result = ReadRequest(self);
+                if (result == IO_RESULT_WOULD_BLOCK) {
+                    return self->State;
+                }
+                if (result == IO_RESULT_FAILED) {
+                    self->State = CONNECTION_STATE_CLOSED;
+                    break;
+                }
+#if (USING_HTTP2)
+                if (StartHttp2(self)) {
+                    return ProcessHttp2(self);
+                }
+#endif
+                if (StartResolvingOnIoPool(self)) {
+                    return self->State;
+                }
+                TConnection_PrepareResponse(self);
+                break;
+            }
+            case CONNECTION_STATE_WRITING:
+            {
+                if (StartBufferedRequest(self)) {
+                    break;  // its head is parsed from Input right away
+                }
+                enum EIoResult result = WriteResponse(self);
+                if (result == IO_RESULT_WOULD_BLOCK || result == IO_RESULT_WAITING_DISK) {
+                    return self->State;
+                }
+                if (result == IO_RESULT_FAILED || !TConnection_StartNextRequest(self)) {
+                    self->State = CONNECTION_STATE_CLOSED;
+                }
+                break;
+            }
+            case CONNECTION_STATE_WAITING_DISK:
+            case CONNECTION_STATE_CLOSED:
+                return self->State;
+            default:
+                assert(false);  // unreachable
+        }
+    }
+}
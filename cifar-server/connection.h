@@ -0,0 +1,105 @@
+#pragma once
+
+#include "http_request.h"
+#include "http_response.h"
+#include "io_pool.h"
+#include "stringbuilder.h"
+#include "timer_wheel.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct THttp2Session;
+
+/**
+ * Non-blocking HTTP connection driven by readiness events.
+ *
+ * The connection alternates between reading a request head and writing the
+ * response (headers and in-memory body from `Output`, then the file via sendfile).
+ * A multipart 206 alternates between the two: the delimiter of each part is appended
+ * to `Output` once the previous range of the file has been sent.
+ * TConnection_Process() never blocks: it advances as far as the socket allows
+ * and reports what the connection is waiting for.
+ *
+ * Bytes received past a request head stay in `Input`. While the next pipelined head is
+ * already there and the response just prepared has no file part, that request is answered
+ * too and its response is appended to `Output`, so a batch of up to PIPELINE_MAX_BATCH
+ * bytes of responses goes out in a single write.
+ *
+ * The connection also knows its own deadline: idle keep-alive while no byte of the next
+ * request has arrived, HEADER_READ_TIMEOUT for the whole head once it has started, and
+ * SEND_PROGRESS_TIMEOUT since the last byte of the response that was accepted by the socket.
+ *
+ * A connection upgraded to HTTP/2 (or started with its preface) hands everything it receives
+ * to the session in `Http2` and writes the frames it collects, in the same two states.
+ * Its streams are handled inline, without the I/O pool.
+ *
+ * With DiskCompletions set, whatever may wait for the disk (resolving a static file, sending
+ * a part of it that is not in the page cache) runs on the I/O pool: the connection waits in
+ * CONNECTION_STATE_WAITING_DISK until its owner hands the finished job back.
+ */
+
+enum EConnectionState {
+    CONNECTION_STATE_READING,
+    CONNECTION_STATE_WRITING,
+    CONNECTION_STATE_WAITING_DISK,
+    CONNECTION_STATE_CLOSED,
+};
+
+struct TConnection {
+    int Fd;
+    enum EConnectionState State;
+    bool KeepAlive;
+    unsigned RequestsServed;
+    uint64_t ClientKey;  // rate limiter key, 0 if the client is not limited
+
+    struct TTimer Timer;  // owned by the backend's timer wheel
+    uint64_t PhaseStartMs;  // when the current wait (idle, head, send progress) began
+
+    struct THttpInputBuffer Input;
+    struct THttpRequestParser Parser;
+    struct THttpRequest Request;
+    struct THttpResponse Response;
+
+    struct TStringBuilder Output;  // serialized headers and in-memory bodies of one or more responses
+    size_t OutputSent;
+
+    int FileFd;  // -1 when the response has no file part
+    size_t FilePart;  // being sent, one of the ranges of a 206 (see THttpResponse_GetFilePart)
+    off_t FileOffset;
+    size_t FileRemaining;  // of the current part
+    off_t FileCachedUntil;  // the file is known to be in the page cache up to here
+
+    struct THttp2Session* Http2;  // NULL while the connection speaks HTTP/1.x
+
+    struct TIoCompletions* DiskCompletions;  // NULL: the disk is touched inline
+    struct TIoJob DiskJob;  // owned by the I/O pool while waiting for the disk
+};
+
+void TConnection_Init(struct TConnection* self, int fd);
+enum EConnectionState TConnection_Process(struct TConnection* self);
+
+// The steps of TConnection_Process for backends that do the I/O themselves (io_uring).
+// Returns true once the request head is complete (or known to be invalid).
+bool TConnection_FeedInput(struct TConnection* self, const char* data, size_t size);
+// The same for the bytes already in Input
+bool TConnection_ParseInput(struct TConnection* self);
+// Handles the request: appends to Output, opens the file part, switches to CONNECTION_STATE_WRITING
+void TConnection_PrepareResponse(struct TConnection* self);
+// Called after TConnection_PrepareResponse: if the next pipelined request is already buffered
+// and may join the batch, handles it as well and returns true
+bool TConnection_PrepareBufferedResponse(struct TConnection* self);
+// Called once Output and the current part of the file are sent: queues the next part (its
+// multipart delimiter in Output and its range of the file, or the next chunk of a streamed
+// body in place of Output), returns false if nothing is left
+bool TConnection_NextResponsePart(struct TConnection* self);
+// Called after the response is fully sent, returns false if the connection must be closed
+bool TConnection_StartNextRequest(struct TConnection* self);
+// Called by the owner for the DiskJob taken from DiskCompletions, TConnection_Process continues from there
+void TConnection_CompleteDiskJob(struct TConnection* self);
+// Monotonic ms when the connection should be closed if it does not advance
+uint64_t TConnection_GetDeadline(const struct TConnection* self);
+// Does not close the socket, the owner of the connection is responsible for it
+void TConnection_Destroy(struct TConnection* self);
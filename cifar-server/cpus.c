@@ -0,0 +1,119 @@
+#include "cpus.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_CGROUP_PATH 512
+
+int GetAllowedCpus(int* cpus, int max_count) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_getaffinity");
+        cpus[0] = 0;
+        return 1;
+    }
+
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max_count; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[count++] = cpu;
+        }
+    }
+    if (count == 0) {
+        cpus[0] = 0;
+        count = 1;
+    }
+    return count;
+}
+
+// Parses "<quota> <period>" (cgroup v2) or two files with a number each (v1), -1 means no limit
+static int ReadQuota(const char* quota_path, const char* period_path) {
+    FILE* file = fopen(quota_path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    long long quota = -1;
+    long long period = 0;
+    char max[4];
+    if (fscanf(file, "%lld", &quota) != 1) {
+        // "max" is the cgroup v2 spelling of no limit
+        quota = (fscanf(file, "%3s", max) == 1 && strcmp(max, "max") == 0) ? -1 : -2;
+    }
+    if (period_path == NULL && fscanf(file, "%lld", &period) != 1) {
+        period = 0;
+    }
+    fclose(file);
+    if (period_path != NULL) {
+        file = fopen(period_path, "r");
+        if (file == NULL) {
+            return -1;
+        }
+        if (fscanf(file, "%lld", &period) != 1) {
+            period = 0;
+        }
+        fclose(file);
+    }
+    if (quota <= 0 || period <= 0) {
+        return -1;
+    }
+    return (int)((quota + period - 1) / period);
+}
+
+// The cgroup v2 directory of the process, relative to /sys/fs/cgroup
+static bool GetCgroupPath(char* path, size_t size) {
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return false;
+    }
+    char line[MAX_CGROUP_PATH];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(path, size, "%s", line + 3);
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+int GetCpuBudget(void) {
+    int cpus[CPU_SETSIZE];
+    int budget = GetAllowedCpus(cpus, CPU_SETSIZE);
+
+    int quota = -1;
+    char cgroup[MAX_CGROUP_PATH];
+    if (GetCgroupPath(cgroup, sizeof(cgroup))) {
+        char path[MAX_CGROUP_PATH + 32];
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", cgroup);
+        quota = ReadQuota(path, NULL);
+    }
+    if (quota == -1) {
+        // inside a container the own cgroup is usually mounted as the root
+        quota = ReadQuota("/sys/fs/cgroup/cpu.max", NULL);
+    }
+    if (quota == -1) {
+        quota = ReadQuota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    }
+    if (quota > 0 && quota < budget) {
+        budget = quota;
+    }
+    return budget;
+}
+
+bool PinCurrentThread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_setaffinity_np: %s\n", strerror(ret));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Fills `cpus` with the ids of the CPUs this process is allowed to run on (sched_getaffinity),
+// returns their number (at least 1, at most max_count).
+int GetAllowedCpus(int* cpus, int max_count);
+
+// How many CPUs worth of time the process may use: the allowed CPUs, further limited by
+// the cgroup CPU quota (cgroup v2 cpu.max or v1 cpu.cfs_quota_us), rounded up. At least 1.
+int GetCpuBudget(void);
+
+// Pins the calling thread to a single CPU
+bool PinCurrentThread(int cpu);
@@ -0,0 +1,58 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // reversed
+
+static uint32_t g_table[256];
+static pthread_once_t g_table_once = PTHREAD_ONCE_INIT;
+
+static void InitTable(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+        }
+        g_table[i] = crc;
+    }
+}
+
+static uint32_t Crc32cTable(uint32_t crc, const uint8_t* p, size_t size) {
+    pthread_once(&g_table_once, InitTable);
+    while (size-- != 0) {
+        crc = g_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHardware(uint32_t crc, const uint8_t* p, size_t size) {
+    uint64_t crc64 = crc;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));  // the blobs are not aligned
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; size != 0; ++p, --size) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+uint32_t Crc32c(uint32_t crc, const void* data, size_t size) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~Crc32cHardware(crc, data, size);
+    }
+#endif
+    return ~Crc32cTable(crc, data, size);
+}
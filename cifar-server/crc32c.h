@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC-32C (Castagnoli), the checksum behind the strong ETags of the dataset images.
+ *
+ * Uses the SSE4.2 crc32 instruction, 8 bytes per step, when the CPU has it
+ * and a byte-wise table otherwise. Both give the same result.
+ */
+
+// Continues `crc` over the data, start with 0
+uint32_t Crc32c(uint32_t crc, const void* data, size_t size);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+// Sleeps while *addr == expected (spurious wakeups are possible)
+static inline void FutexWait(uint32_t* addr, uint32_t expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+// Same as FutexWait, returns false if timeout_ms has passed without a wakeup
+static inline bool FutexWaitTimeout(uint32_t* addr, uint32_t expected, int timeout_ms) {
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+    return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, &timeout, NULL, 0) == 0 || errno != ETIMEDOUT;
+}
+
+static inline void FutexWake(uint32_t* addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
@@ -1,12 +1,23 @@
 #include "handler.h"
 
+#include "http2.h"
 #include "http_request.h"
+#include "io.h"
 #include "http_response.h"
+#include "lifecycle.h"
+#include "rate_limiter.h"
 #include "resources.h"
+#include "router.h"
 #include "stringutils.h"
+#include "timer_wheel.h"
 #include "config.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -29,88 +40,292 @@ static const char* SafeStr(const char* value) {
 #define DEBUG_PRINT_IF(condition, ...)
 #endif
 
-static void Handle(const struct THttpRequest* request, struct THttpResponse* response) {
+static void ServeHealthCheck(const struct THttpRequest* request, struct THttpResponse* response,
+                             const struct TRouteMatch* match) {
+    (void) request;
+    (void) match;
+    // the thread pool answers fresh health check connections from the acceptor,
+    // this serves them on kept-alive connections and in the other modes
+    response->ContentType = CONTENT_TYPE_PLAIN;
+    TStringBuilder_AppendCStr(&response->Body, "ok\n");
+}
+
+static void ServeIndexPage(const struct THttpRequest* request, struct THttpResponse* response,
+                           const struct TRouteMatch* match) {
+    (void) request;
+    CreateIndexPage(response, TRouteMatch_GetIntQuery(match, "page", 0));
+}
+
+static void ServeImage(const struct THttpRequest* request, struct THttpResponse* response,
+                       const struct TRouteMatch* match) {
+    SendCifarBitmap(response, request, match->Params[0]);
+}
+
+static void ServeStaticFile(const struct THttpRequest* request, struct THttpResponse* response,
+                            const struct TRouteMatch* match) {
+    (void) match;
+    SendStaticFile(response, request, request->Path.Data + 1);
+    // chunks are HTTP/1.1, an HTTP/1.0 client gets the listing built whole
+    if (response->BodyStream != NULL && request->VersionMinor == 0 && !THttpResponse_DrainBodyStream(response)) {
+        TStringBuilder_Clear(&response->Body);
+        CreateErrorPage(response, HTTP_INTERNAL_SERVER_ERROR);
+    }
+}
+
+#if (USING_IO_STATS)
+static void ServeStats(const struct THttpRequest* request, struct THttpResponse* response,
+                       const struct TRouteMatch* match) {
+    (void) request;
+    (void) match;
+    const uint64_t responses = IoStats_Get(IO_STAT_RESPONSES);
+    const uint64_t sends = IoStats_Get(IO_STAT_SEND_CALLS);
+    const uint64_t sendfiles = IoStats_Get(IO_STAT_SENDFILE_CALLS);
+    const uint64_t zerocopySends = IoStats_Get(IO_STAT_ZEROCOPY_SENDS);
+    const uint64_t zerocopyCopied = IoStats_Get(IO_STAT_ZEROCOPY_COPIED);
+    // this response is counted once it is sent
+    response->ContentType = CONTENT_TYPE_PLAIN;
+    TStringBuilder_Sprintf(&response->Body,
+        "responses %" PRIu64 "\nsend_calls %" PRIu64 "\nsendfile_calls %" PRIu64 "\nsyscalls_per_response %.3f\n"
+        "zerocopy_sends %" PRIu64 "\nzerocopy_copied %" PRIu64 "\n",
+        responses, sends, sendfiles, responses != 0 ? (double)(sends + sendfiles) / responses : 0.0,
+        zerocopySends, zerocopyCopied);
+}
+#endif
+
+static struct TRouter g_router;
+static pthread_once_t g_router_once = PTHREAD_ONCE_INIT;
+
+static void BuildRouter(void) {
+    TRouter_Init(&g_router);
+    bool built = TRouter_Add(&g_router, HEALTH_CHECK_PATH, ServeHealthCheck) &&
+                 TRouter_Add(&g_router, "/", ServeIndexPage) &&
+                 TRouter_Add(&g_router, "/images/{int}.bmp", ServeImage) &&
+                 TRouter_Add(&g_router, "/static/*", ServeStaticFile);
+#if (USING_IO_STATS)
+    built = built && TRouter_Add(&g_router, IO_STATS_PATH, ServeStats);
+#endif
+    assert(built);
+    (void) built;
+}
+
+static TRouteHandler Route(const struct THttpRequest* request, struct TRouteMatch* match) {
+    pthread_once(&g_router_once, BuildRouter);
+    return TRouter_Match(&g_router, request->Path, match);
+}
+
+void Handle(const struct THttpRequest* request, struct THttpResponse* response) {
     #ifdef DEBUG
     fprintf(
         stderr, "method: '%s'; path: '%s'; qs: '%s'\n",
-        SafeStr(request->Method), SafeStr(request->Path), SafeStr(request->QueryString)
+        request->Method.Data, request->Path.Data, SafeStr(request->QueryString.Data)
     );
     #endif
 
-    if (strcasecmp(request->Method, "GET") != 0) { // case-insensitive compare
+    if (request->VersionMajor != 1) {
+        CreateErrorPage(response, HTTP_VERSION_NOT_SUPPORTED);
+        return;
+    }
+    if (!TStringView_EqualsCI(request->Method, "GET")) {
         CreateErrorPage(response, HTTP_METHOD_NOT_ALLOWED);
         return;
     }
 
-    if (strcmp(request->Path, "/") == 0) {
-        int page = request->QueryString ? GetIntParam(request->QueryString, "page") : 0;
-        CreateIndexPage(response, page);
+    struct TRouteMatch match;
+    const TRouteHandler handler = Route(request, &match);
+    if (handler == NULL) {
+        CreateErrorPage(response, HTTP_NOT_FOUND);
         return;
     }
-    if (StartsWith(request->Path, "/images/")) {
-        int n;
-        if (sscanf(request->Path, "/images/%d.bmp", &n) == 1) {
-            SendCifarBitmap(response, n);
-            return;
-        }
+    if (request->QueryString.Data != NULL) {
+        TRouteMatch_ParseQuery(&match, request->QueryString);
     }
-    if (StartsWith(request->Path, "/static/")) {
-        SendStaticFile(response, request->Path + 1);
-        return;
+    handler(request, response, &match);
+}
+
+bool IsFilesystemRequest(const struct THttpRequest* request) {
+    struct TRouteMatch match;
+    if (!TStringView_EqualsCI(request->Method, "GET")) {
+        return false;
     }
+    const TRouteHandler handler = Route(request, &match);
+    return handler == ServeStaticFile || (handler == ServeImage && !IsCifarBitmapInMemory(match.Params[0]));
+}
 
-    CreateErrorPage(response, HTTP_NOT_FOUND);
+unsigned GetRequestsLeft(unsigned served) {
+    if (served >= MAX_REQUESTS_PER_CONNECTION || Lifecycle_IsStopping()) {
+        return 0;
+    }
+    return MAX_REQUESTS_PER_CONNECTION - served;
 }
 
-void ServeClient(int sockfd) {
-    bool should_keep_alive = true;
+#if (USING_HTTP2)
+// Every stream is a request of its own for the rate limiter, the context is the socket
+static void HandleStream(const struct THttpRequest* request, struct THttpResponse* response, void* context) {
+    const int sockfd = (int)(intptr_t)context;
+    if (!RateLimiter_AllowRequest(sockfd)) {
+        CreateErrorPage(response, HTTP_TOO_MANY_REQUESTS);
+        return;
+    }
+    Handle(request, response);
+}
 
-    while(should_keep_alive)
-    {
-        struct THttpRequest req;
-        struct THttpResponse resp;
-
-        THttpRequest_Init(&req);
-        THttpResponse_Init(&resp);
-
-        http_receive_result_t receive_result = THttpRequest_Receive(&req, sockfd, should_keep_alive);
-        if (RECEIVE_RESULT_SUCCESS == receive_result) 
-        {
-            DEBUG_PRINT("received good request, now handling it\n");
-
-            Handle(&req, &resp);
-            THttpResponse_Send(&resp, sockfd);
-
-            DEBUG_PRINT_IF(req.should_keep_alive, 
-                           "received keep alive connection flag so not closing the socket\n");
-            should_keep_alive &= req.should_keep_alive;
-        } 
-        else if(RECEIVE_RESULT_BAD_REQUEST == receive_result)
-        {
-            CreateErrorPage(&resp, HTTP_BAD_REQUEST);
-            THttpResponse_Send(&resp, sockfd);
-            should_keep_alive = false;
+bool ServeHttp2(int sockfd, struct THttpInputBuffer* input, struct THttp2Session* session, bool can_park) {
+    bool alive = THttp2Session_Feed(session, input->Data + input->Begin, input->End - input->Begin);
+    THttpInputBuffer_Clear(input);
+
+    const int stopFd = Lifecycle_GetStopFd();
+    while (true) {
+        THttp2Session_WriteFrames(session);
+        if (session->Output.Length != 0) {
+            if (!SendAll(sockfd, session->Output.Data, session->Output.Length, false)) {
+                break;
+            }
+            TStringBuilder_Clear(&session->Output);
         }
-        else if(RECEIVE_RESULT_ERROR == receive_result)
-        {
-            CreateErrorPage(&resp, HTTP_INTERNAL_SERVER_ERROR);
-            THttpResponse_Send(&resp, sockfd);
-            should_keep_alive = false;
+        if (!alive || THttp2Session_IsDone(session)) {
+            break;
         }
-        else if(RECEIVE_RESULT_DISCONNECTED == receive_result)
-        {
-            DEBUG_PRINT("the connection was interrupted so closing the socket\n");
 
-            close(sockfd);
-            return;
+        // the deadline moves with whole frames only, not with every byte received
+        const uint64_t now = MonotonicMs();
+        const uint64_t deadline = THttp2Session_GetDeadline(session);
+        if (now >= deadline) {
+            if (!THttp2Session_OnDeadline(session)) {
+                break;  // the client does not read the responses or does not finish a frame
+            }
+            continue;
+        }
+        // a parked session waits for the client without holding a worker, a draining one is finished here
+        const bool park = can_park && !Lifecycle_IsStopping();
+        const int timeout = (THttp2Session_WantsWrite(session) || park) ? 0 : (int)(deadline - now);
+        struct pollfd fds[2] = {
+            { .fd = sockfd, .events = POLLIN },
+            { .fd = stopFd, .events = POLLIN },
+        };
+        const int ready = poll(fds, 2, timeout);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (ready == 0 && park && !THttp2Session_WantsWrite(session)) {
+            return true;
+        }
+        if (fds[1].revents & POLLIN) {
+            Lifecycle_SetStopping();  // a forked child only has the stop fd
+            THttp2Session_Shutdown(session);
         }
-        else
-        {
-            assert(false); // unreachable
+        if (fds[0].revents == POLLERR && ReapZeroCopy(sockfd) != 0) {
+            continue;  // the completions of zero-copy sends made before the upgrade
         }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            const ssize_t ret = THttpInputBuffer_Recv(input, sockfd);
+            if (ret == 0 || (ret == -1 && errno != EINTR && errno != EAGAIN)) {
+                break;
+            }
+            if (ret > 0) {
+                alive = THttp2Session_Feed(session, input->Data + input->Begin, input->End - input->Begin);
+                THttpInputBuffer_Clear(input);
+            }
+        }
+    }
+
+    THttp2Session_Destroy(session);
+    free(session);
+    return false;
+}
+
+// Switches the connection to HTTP/2 and serves it, see ServeHttp2()
+static bool StartHttp2(int sockfd, struct THttpInputBuffer* input, const struct THttpRequest* upgrade,
+                       unsigned requests_left, struct THttp2Session** parked) {
+    // too large for the stack of a pool worker
+    struct THttp2Session* session = malloc(sizeof(*session));
+    if (session == NULL) {
+        return false;
+    }
+    THttp2Session_Init(session, HandleStream, (void*)(intptr_t)sockfd, requests_left);
+    THttp2Session_Start(session, upgrade);
+    if (!ServeHttp2(sockfd, input, session, parked != NULL)) {
+        return false;
+    }
+    *parked = session;
+    return true;
+}
+#endif
+
+bool ServeRequest(int sockfd, struct THttpInputBuffer* input, unsigned requests_left, struct THttp2Session** parked) {
+    bool should_keep_alive = false;
+
+    struct THttpRequest req;
+    struct THttpResponse resp;
+
+    THttpRequest_Init(&req);
+    THttpResponse_Init(&resp);
+
+    http_receive_result_t receive_result = THttpRequest_Receive(&req, sockfd, input, true);
+    // with the next pipelined request already here the responses are coalesced into full segments
+    const bool more = THttpInputBuffer_HasCompleteHead(input);
+    if (RECEIVE_RESULT_SUCCESS == receive_result && !RateLimiter_AllowRequest(sockfd))
+    {
+        // a client over its request rate is answered cheaply and loses the connection
+        CreateErrorPage(&resp, HTTP_TOO_MANY_REQUESTS);
+        THttpResponse_Send(&resp, sockfd, false);
+    }
+#if (USING_HTTP2)
+    else if (RECEIVE_RESULT_SUCCESS == receive_result &&
+             (Http2_IsPriorKnowledge(&req) || (requests_left != 0 && Http2_IsUpgrade(&req))))
+    {
+        // the rest of the connection is served over HTTP/2
+        should_keep_alive = StartHttp2(sockfd, input, Http2_IsPriorKnowledge(&req) ? NULL : &req, requests_left, parked);
+    }
+#endif
+    else if (RECEIVE_RESULT_SUCCESS == receive_result) 
+    {
+        DEBUG_PRINT("received good request, now handling it\n");
+
+        Handle(&req, &resp);
+        resp.KeepAlive = req.should_keep_alive && requests_left != 0;
+        resp.KeepAliveMax = requests_left;
+        bool is_sent = THttpResponse_Send(&resp, sockfd, more && resp.KeepAlive);
 
-        THttpResponse_Destroy(&resp);
-        THttpRequest_Destroy(&req);
+        DEBUG_PRINT_IF(resp.KeepAlive, "the connection is persistent so not closing the socket\n");
+        should_keep_alive = is_sent && resp.KeepAlive;
+    } 
+    else if(RECEIVE_RESULT_HEADERS_TOO_LARGE == receive_result)
+    {
+        // the rest of the head is not read, so the connection is closed after the answer
+        CreateErrorPage(&resp, HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE);
+        THttpResponse_Send(&resp, sockfd, false);
     }
+    else if(RECEIVE_RESULT_BAD_REQUEST == receive_result)
+    {
+        CreateErrorPage(&resp, HTTP_BAD_REQUEST);
+        THttpResponse_Send(&resp, sockfd, false);
+    }
+    else if(RECEIVE_RESULT_ERROR == receive_result)
+    {
+        CreateErrorPage(&resp, HTTP_INTERNAL_SERVER_ERROR);
+        THttpResponse_Send(&resp, sockfd, false);
+    }
+    else if(RECEIVE_RESULT_DISCONNECTED == receive_result)
+    {
+        // the socket itself is closed by the caller
+        DEBUG_PRINT("the connection was interrupted so closing the socket\n");
+    }
+    else
+    {
+        assert(false); // unreachable
+    }
+
+    THttpResponse_Destroy(&resp);
+    return should_keep_alive;
+}
 
+void ServeClient(int sockfd) {
+    struct THttpInputBuffer input;
+    THttpInputBuffer_Init(&input);
+    unsigned served = 0;
+    while (ServeRequest(sockfd, &input, GetRequestsLeft(++served), NULL))
+    {
+    }
+    THttpInputBuffer_Destroy(&input);
 }
@@ -1,3 +1,30 @@
 #pragma once
 
+#include <stdbool.h>
+
+struct THttp2Session;
+struct THttpInputBuffer;
+struct THttpRequest;
+struct THttpResponse;
+
+void Handle(const struct THttpRequest* request, struct THttpResponse* response);
+// True if Handle may wait for the disk answering the request (static files, directory listings
+// and the images read from the dataset for the first time)
+bool IsFilesystemRequest(const struct THttpRequest* request);
+
+// Serves requests until the connection is closed, stops being kept alive
+// or reaches MAX_REQUESTS_PER_CONNECTION
 void ServeClient(int sockfd);
+// Serves a single request, returns true if the connection should be kept alive.
+// `input` keeps the bytes received past the request for the next call on the same connection.
+// `requests_left` is how many more requests the connection may serve, 0 closes it afterwards.
+// A caller that parks connections passes `parked`: a connection switched to HTTP/2 returns true
+// with the session there once it waits for the client, see ServeHttp2.
+bool ServeRequest(int sockfd, struct THttpInputBuffer* input, unsigned requests_left, struct THttp2Session** parked);
+// Runs the session (USING_HTTP2) until the connection is done with: returns false, the session is freed.
+// With `can_park` it returns true instead as soon as the session waits for the client, to be parked
+// until THttp2Session_GetDeadline(). The frames are sent as soon as a batch is collected.
+bool ServeHttp2(int sockfd, struct THttpInputBuffer* input, struct THttp2Session* session, bool can_park);
+// The `requests_left` of a connection that has started `served` requests: a draining server
+// answers the request in flight and lets the client reconnect elsewhere
+unsigned GetRequestsLeft(unsigned served);
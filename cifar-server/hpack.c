@@ -0,0 +1,379 @@
+#include "hpack.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HPACK_STATIC_TABLE_SIZE 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_INTEGER (1U << 28)  // more than any length or index that can be valid here
+#define HUFFMAN_EOS 256
+#define HUFFMAN_MAX_CODE_LENGTH 30
+
+static const struct {
+    const char* Name;
+    const char* Value;
+} STATIC_TABLE[HPACK_STATIC_TABLE_SIZE] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+// The code is canonical (RFC 7541 Appendix B): the lengths alone define it, EOS has the longest one
+static const uint8_t HUFFMAN_CODE_LENGTHS[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+// The symbols ordered by code, and how many codes there are of each length
+static uint16_t g_huffman_symbols[257];
+static uint16_t g_huffman_counts[HUFFMAN_MAX_CODE_LENGTH + 1];
+static pthread_once_t g_huffman_once = PTHREAD_ONCE_INIT;
+
+static void InitHuffman(void) {
+    size_t n = 0;
+    for (int length = 1; length <= HUFFMAN_MAX_CODE_LENGTH; ++length) {
+        for (int symbol = 0; symbol < 256; ++symbol) {
+            if (HUFFMAN_CODE_LENGTHS[symbol] == length) {
+                g_huffman_symbols[n++] = symbol;
+                g_huffman_counts[length]++;
+            }
+        }
+    }
+    g_huffman_symbols[n] = HUFFMAN_EOS;
+    g_huffman_counts[HUFFMAN_MAX_CODE_LENGTH]++;
+}
+
+// Canonical decoding one bit at a time: the codes of each length follow those of the previous one
+static bool DecodeHuffman(const uint8_t* data, size_t size, struct TStringBuilder* out) {
+    pthread_once(&g_huffman_once, InitHuffman);
+    int32_t code = 0;
+    int32_t first = 0;
+    int32_t index = 0;
+    int length = 0;
+    bool allOnes = true;
+    for (size_t i = 0; i < size; ++i) {
+        for (int bit = 7; bit >= 0; --bit) {
+            const int value = (data[i] >> bit) & 1;
+            code |= value;
+            allOnes &= value;
+            ++length;
+            const int32_t count = g_huffman_counts[length];
+            if (code - first < count) {
+                const uint16_t symbol = g_huffman_symbols[index + code - first];
+                if (symbol == HUFFMAN_EOS) {
+                    return false;
+                }
+                if (symbol == 0) {
+                    return false;  // see DecodeString()
+                }
+                const char c = (char)symbol;
+                TStringBuilder_AppendBuf(out, &c, 1);
+                code = first = index = length = 0;
+                allOnes = true;
+                continue;
+            }
+            if (length == HUFFMAN_MAX_CODE_LENGTH) {
+                return false;
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    // the padding is a prefix of EOS shorter than a byte
+    return length < 8 && allOnes;
+}
+
+static bool DecodeInteger(const uint8_t** p, const uint8_t* end, int prefixBits, uint32_t* result) {
+    const uint32_t mask = (1U << prefixBits) - 1;
+    uint32_t value = *(*p)++ & mask;
+    if (value == mask) {
+        int shift = 0;
+        uint8_t byte;
+        do {
+            if (*p == end || shift > 21) {
+                return false;
+            }
+            byte = *(*p)++;
+            value += (uint32_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+    }
+    *result = value;
+    return value < HPACK_MAX_INTEGER;
+}
+
+static bool DecodeString(const uint8_t** p, const uint8_t* end, struct TStringBuilder* out) {
+    if (*p == end) {
+        return false;
+    }
+    const bool huffman = **p & 0x80;
+    uint32_t length;
+    if (!DecodeInteger(p, end, 7, &length) || length > (size_t)(end - *p)) {
+        return false;
+    }
+    const uint8_t* data = *p;
+    *p += length;
+    // the fields are stored '\0'-terminated, a field with '\0' in it is malformed anyway (RFC 9113 8.2.1)
+    if (huffman) {
+        return DecodeHuffman(data, length, out);
+    }
+    if (memchr(data, '\0', length) != NULL) {
+        return false;
+    }
+    TStringBuilder_AppendBuf(out, (const char*)data, length);
+    return true;
+}
+
+void THpackDecoder_Init(struct THpackDecoder* self) {
+    self->Newest = 0;
+    self->Count = 0;
+    self->Size = 0;
+    self->MaxSize = HTTP2_HEADER_TABLE_SIZE;
+}
+
+static struct THpackEntry* GetEntry(struct THpackDecoder* self, size_t age) {
+    const size_t capacity = sizeof(self->Entries) / sizeof(self->Entries[0]);
+    return &self->Entries[(self->Newest + capacity - age) % capacity];
+}
+
+static void EvictOldest(struct THpackDecoder* self) {
+    struct THpackEntry* entry = GetEntry(self, self->Count - 1);
+    self->Size -= entry->NameLength + entry->ValueLength + HPACK_ENTRY_OVERHEAD;
+    free(entry->Data);
+    self->Count--;
+}
+
+static void EvictDownTo(struct THpackDecoder* self, size_t size) {
+    while (self->Size > size) {
+        EvictOldest(self);
+    }
+}
+
+void THpackDecoder_Destroy(struct THpackDecoder* self) {
+    EvictDownTo(self, 0);
+}
+
+static bool Insert(struct THpackDecoder* self, const char* name, size_t nameLength, const char* value, size_t valueLength) {
+    const size_t size = nameLength + valueLength + HPACK_ENTRY_OVERHEAD;
+    if (size > self->MaxSize) {
+        EvictDownTo(self, 0);  // a too large entry empties the table and is not added
+        return true;
+    }
+    EvictDownTo(self, self->MaxSize - size);
+    char* data = malloc(nameLength + valueLength);
+    if (data == NULL) {
+        return false;
+    }
+    memcpy(data, name, nameLength);
+    memcpy(data + nameLength, value, valueLength);
+    const size_t capacity = sizeof(self->Entries) / sizeof(self->Entries[0]);
+    self->Newest = (self->Newest + 1) % capacity;
+    self->Count++;
+    self->Size += size;
+    *GetEntry(self, 0) = (struct THpackEntry){ data, nameLength, valueLength };
+    return true;
+}
+
+// Appends the name (and the value) of the static or dynamic table entry
+static bool AppendIndexed(struct THpackDecoder* self, uint32_t index, bool withValue, struct TStringBuilder* out) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= HPACK_STATIC_TABLE_SIZE) {
+        TStringBuilder_AppendBuf(out, STATIC_TABLE[index - 1].Name, strlen(STATIC_TABLE[index - 1].Name) + 1);
+        if (withValue) {
+            TStringBuilder_AppendBuf(out, STATIC_TABLE[index - 1].Value, strlen(STATIC_TABLE[index - 1].Value) + 1);
+        }
+        return true;
+    }
+    if (index - HPACK_STATIC_TABLE_SIZE > self->Count) {
+        return false;
+    }
+    const struct THpackEntry* entry = GetEntry(self, index - HPACK_STATIC_TABLE_SIZE - 1);
+    TStringBuilder_AppendBuf(out, entry->Data, entry->NameLength);
+    TStringBuilder_AppendBuf(out, "", 1);
+    if (withValue) {
+        TStringBuilder_AppendBuf(out, entry->Data + entry->NameLength, entry->ValueLength);
+        TStringBuilder_AppendBuf(out, "", 1);
+    }
+    return true;
+}
+
+bool THpackDecoder_Decode(struct THpackDecoder* self, const uint8_t* data, size_t size, size_t limit,
+                          struct TStringBuilder* out) {
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    bool fieldSeen = false;
+    size_t kept = 0;  // the length `out` is cut back to after every field, once it is past the limit
+    while (p != end) {
+        if (kept != 0) {
+            TStringBuilder_Truncate(out, kept);
+        } else if (out->Length > limit) {
+            kept = out->Length;
+        }
+        const uint8_t first = *p;
+        uint32_t index;
+        if (first & 0x80) {
+            // indexed field
+            if (!DecodeInteger(&p, end, 7, &index) || !AppendIndexed(self, index, true, out)) {
+                return false;
+            }
+            fieldSeen = true;
+            continue;
+        }
+        if ((first & 0xE0) == 0x20) {
+            // dynamic table size update, only at the start of a block
+            if (fieldSeen || !DecodeInteger(&p, end, 5, &index) || index > HTTP2_HEADER_TABLE_SIZE) {
+                return false;
+            }
+            self->MaxSize = index;
+            EvictDownTo(self, self->MaxSize);
+            continue;
+        }
+        // a literal, with incremental indexing, without indexing or never indexed
+        const bool indexing = first & 0x40;
+        if (!DecodeInteger(&p, end, indexing ? 6 : 4, &index)) {
+            return false;
+        }
+        const size_t nameOffset = out->Length;
+        if (index != 0) {
+            if (!AppendIndexed(self, index, false, out)) {
+                return false;
+            }
+        } else if (!DecodeString(&p, end, out)) {
+            return false;
+        } else {
+            TStringBuilder_AppendBuf(out, "", 1);
+        }
+        const size_t valueOffset = out->Length;
+        if (!DecodeString(&p, end, out)) {
+            return false;
+        }
+        TStringBuilder_AppendBuf(out, "", 1);
+        if (indexing && !Insert(self, out->Data + nameOffset, valueOffset - nameOffset - 1,
+                                out->Data + valueOffset, out->Length - valueOffset - 1)) {
+            return false;
+        }
+        fieldSeen = true;
+    }
+    if (kept != 0) {
+        TStringBuilder_Truncate(out, kept);
+    }
+    return true;
+}
+
+static void EncodeInteger(struct TStringBuilder* out, uint8_t flags, int prefixBits, uint32_t value) {
+    const uint32_t mask = (1U << prefixBits) - 1;
+    char buf[8];
+    size_t n = 0;
+    if (value < mask) {
+        buf[n++] = flags | value;
+    } else {
+        buf[n++] = flags | mask;
+        for (value -= mask; value >= 0x80; value >>= 7) {
+            buf[n++] = (char)(0x80 | (value & 0x7F));
+        }
+        buf[n++] = (char)value;
+    }
+    TStringBuilder_AppendBuf(out, buf, n);
+}
+
+void Hpack_EncodeStatus(struct TStringBuilder* out, int code) {
+    static const struct {
+        int Code;
+        enum EHpackStaticIndex Index;
+    } STATUSES[] = {
+        {200, HPACK_STATUS_200}, {204, HPACK_STATUS_204}, {206, HPACK_STATUS_206}, {304, HPACK_STATUS_304},
+        {400, HPACK_STATUS_400}, {404, HPACK_STATUS_404}, {500, HPACK_STATUS_500},
+    };
+    for (size_t i = 0; i < sizeof(STATUSES) / sizeof(STATUSES[0]); ++i) {
+        if (STATUSES[i].Code == code) {
+            EncodeInteger(out, 0x80, 7, STATUSES[i].Index);
+            return;
+        }
+    }
+    char value[4];
+    snprintf(value, sizeof(value), "%03d", code);
+    Hpack_EncodeField(out, HPACK_STATUS_200, value, 3);  // the name is the same for all of them
+}
+
+void Hpack_EncodeField(struct TStringBuilder* out, enum EHpackStaticIndex name, const char* value, size_t length) {
+    EncodeInteger(out, 0x00, 4, name);
+    EncodeInteger(out, 0x00, 7, length);
+    TStringBuilder_AppendBuf(out, value, length);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "config.h"
+#include "stringbuilder.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * HPACK header compression (RFC 7541) for the HTTP/2 sessions.
+ *
+ * The decoder follows the dynamic table the client's encoder builds, the strings may be
+ * Huffman coded. Responses are encoded against the static table only: every name the server
+ * sends and the common statuses are in it, so encoding is a few byte copies, needs no state
+ * and never makes the client evict anything from its table.
+ */
+
+// Indices of the static table entries used to encode responses (RFC 7541 Appendix A)
+enum EHpackStaticIndex {
+    HPACK_STATUS_200 = 8,
+    HPACK_STATUS_204 = 9,
+    HPACK_STATUS_206 = 10,
+    HPACK_STATUS_304 = 11,
+    HPACK_STATUS_400 = 12,
+    HPACK_STATUS_404 = 13,
+    HPACK_STATUS_500 = 14,
+    HPACK_ACCEPT_RANGES = 18,
+    HPACK_CACHE_CONTROL = 24,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_RANGE = 30,
+    HPACK_CONTENT_TYPE = 31,
+    HPACK_DATE = 33,
+    HPACK_ETAG = 34,
+    HPACK_LAST_MODIFIED = 44,
+    HPACK_LINK = 45,
+    HPACK_RETRY_AFTER = 53,
+    HPACK_SERVER = 54,
+};
+
+// An entry of the dynamic table: the name and the value in one allocation
+struct THpackEntry {
+    char* Data;
+    size_t NameLength;
+    size_t ValueLength;
+};
+
+struct THpackDecoder {
+    // a ring, each entry takes at least 32 bytes of the table size
+    struct THpackEntry Entries[HTTP2_HEADER_TABLE_SIZE / 32];
+    size_t Newest;
+    size_t Count;
+    size_t Size;  // as defined by RFC 7541 4.1
+    size_t MaxSize;  // lowered by the encoder, at most HTTP2_HEADER_TABLE_SIZE
+};
+
+void THpackDecoder_Init(struct THpackDecoder* self);
+void THpackDecoder_Destroy(struct THpackDecoder* self);
+// Decodes a whole header block, appending every field to `out` as name '\0' value '\0'. Once `out`
+// grows past `limit` the fields that follow are only decoded into the dynamic table, so `out->Length > limit`
+// tells a block too large, and a few bytes referencing a large entry over and over can not take much memory.
+// Returns false on a compression error or a string with '\0' in it, the decoder can not be used afterwards.
+bool THpackDecoder_Decode(struct THpackDecoder* self, const uint8_t* data, size_t size, size_t limit,
+                          struct TStringBuilder* out);
+
+// Appends the :status field
+void Hpack_EncodeStatus(struct TStringBuilder* out, int code);
+// Appends a literal field without indexing, its name taken from the static table
+void Hpack_EncodeField(struct TStringBuilder* out, enum EHpackStaticIndex name, const char* value, size_t length);
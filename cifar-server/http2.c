@@ -0,0 +1,1070 @@
+#include "http2.h"
+
+#include "io.h"
+#include "resources.h"
+#include "stringutils.h"
+#include "timer_wheel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEBUG_MODE HTTP2_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#endif
+
+#define FRAME_HEADER_SIZE 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7FFFFFFF
+#define MIN_MAX_FRAME_SIZE 16384
+#define MAX_MAX_FRAME_SIZE 0xFFFFFF
+#define MAX_HEADER_BLOCK_SIZE (4 * MAX_REQUEST_HEAD_SIZE)  // compressed, across the CONTINUATION frames
+#define MAX_UPGRADE_SETTINGS 16  // in the HTTP2-Settings header
+
+// The client connection preface. A prior knowledge client sends it as the first thing, its first
+// PREFACE_HEAD_SIZE bytes parse as the head of a "PRI * HTTP/2.0" request.
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+#define PREFACE_SIZE (sizeof(PREFACE) - 1)
+#define PREFACE_HEAD_SIZE 18
+
+#define SWITCHING_PROTOCOLS "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+// CUSTOM_LINE_FOR_WARMUP without "Server: "
+#define SERVER_NAME (CUSTOM_LINE_FOR_WARMUP + sizeof("Server: ") - 1)
+
+enum EFrameType {
+    FRAME_DATA = 0,
+    FRAME_HEADERS = 1,
+    FRAME_PRIORITY = 2,
+    FRAME_RST_STREAM = 3,
+    FRAME_SETTINGS = 4,
+    FRAME_PUSH_PROMISE = 5,
+    FRAME_PING = 6,
+    FRAME_GOAWAY = 7,
+    FRAME_WINDOW_UPDATE = 8,
+    FRAME_CONTINUATION = 9,
+};
+
+enum EFrameFlag {
+    FLAG_END_STREAM = 0x1,
+    FLAG_ACK = 0x1,
+    FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8,
+    FLAG_PRIORITY = 0x20,
+};
+
+enum ESetting {
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH = 2,
+    SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 4,
+    SETTINGS_MAX_FRAME_SIZE = 5,
+};
+
+enum EHttp2Error {
+    NO_ERROR = 0,
+    PROTOCOL_ERROR = 1,
+    INTERNAL_ERROR = 2,
+    FLOW_CONTROL_ERROR = 3,
+    STREAM_CLOSED = 5,
+    FRAME_SIZE_ERROR = 6,
+    REFUSED_STREAM = 7,
+    COMPRESSION_ERROR = 9,
+};
+
+enum EBuildResult {
+    BUILD_OK,
+    BUILD_MALFORMED,  // reset with PROTOCOL_ERROR (RFC 9113 8.1.1)
+    BUILD_TOO_LARGE,  // answered with 431 like an HTTP/1.1 head
+};
+
+static uint32_t ReadUint32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void WriteUint32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void FillFrameHeader(uint8_t* p, size_t length, enum EFrameType type, uint8_t flags, uint32_t stream) {
+    p[0] = length >> 16;
+    p[1] = length >> 8;
+    p[2] = length;
+    p[3] = type;
+    p[4] = flags;
+    WriteUint32(p + 5, stream);
+}
+
+static void AppendFrame(struct THttp2Session* self, enum EFrameType type, uint8_t flags, uint32_t stream,
+                        const void* payload, size_t length) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    FillFrameHeader(header, length, type, flags, stream);
+    TStringBuilder_AppendBuf(&self->Output, (const char*)header, sizeof(header));
+    if (length != 0) {
+        TStringBuilder_AppendBuf(&self->Output, payload, length);
+    }
+}
+
+// Reserves the header of a frame whose payload is appended next, see PatchFrameHeader()
+static size_t BeginFrame(struct THttp2Session* self) {
+    const size_t at = self->Output.Length;
+    TStringBuilder_AppendBuf(&self->Output, "\0\0\0\0\0\0\0\0\0", FRAME_HEADER_SIZE);
+    return at;
+}
+
+static void PatchFrameHeader(struct THttp2Session* self, size_t at, enum EFrameType type, uint8_t flags, uint32_t stream) {
+    const size_t length = self->Output.Length - at - FRAME_HEADER_SIZE;
+    FillFrameHeader((uint8_t*)self->Output.Data + at, length, type, flags, stream);
+}
+
+// Ends the header block after the frame reserved at `at`: a block larger than the client's frame size goes on
+// in CONTINUATION frames, and END_HEADERS is set on the last of them
+static void EndHeaderBlock(struct THttp2Session* self, size_t at, uint8_t flags, uint32_t stream) {
+    const size_t max = HTTP2_MAX_FRAME_SIZE < self->PeerMaxFrameSize ? HTTP2_MAX_FRAME_SIZE : self->PeerMaxFrameSize;
+    const size_t length = self->Output.Length - at - FRAME_HEADER_SIZE;
+    if (length <= max) {
+        PatchFrameHeader(self, at, FRAME_HEADERS, flags | FLAG_END_HEADERS, stream);
+        return;
+    }
+    char* block = malloc(length);
+    if (block == NULL) {
+        abort();
+    }
+    memcpy(block, self->Output.Data + at + FRAME_HEADER_SIZE, length);
+    self->Output.Length = at;
+    self->Output.Data[at] = '\0';
+    enum EFrameType type = FRAME_HEADERS;
+    for (size_t offset = 0; offset < length; offset += max) {
+        const size_t size = length - offset < max ? length - offset : max;
+        const uint8_t last = offset + size == length ? FLAG_END_HEADERS : 0;
+        AppendFrame(self, type, last | (type == FRAME_HEADERS ? flags : 0), stream, block + offset, size);
+        type = FRAME_CONTINUATION;
+    }
+    free(block);
+}
+
+static void AppendWindowUpdate(struct THttp2Session* self, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    WriteUint32(payload, increment);
+    AppendFrame(self, FRAME_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+static void AppendRstStream(struct THttp2Session* self, uint32_t stream, enum EHttp2Error error) {
+    uint8_t payload[4];
+    WriteUint32(payload, error);
+    AppendFrame(self, FRAME_RST_STREAM, 0, stream, payload, sizeof(payload));
+}
+
+static void AppendGoAway(struct THttp2Session* self, enum EHttp2Error error) {
+    uint8_t payload[8];
+    WriteUint32(payload, self->LastStreamId);
+    WriteUint32(payload + 4, error);
+    AppendFrame(self, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    self->GoAwaySent = true;
+}
+
+// After a connection error nothing but the GOAWAY is sent
+static void ConnectionError(struct THttp2Session* self, enum EHttp2Error error) {
+    DEBUG_PRINT("http2: connection error %d\n", error);
+    if (!self->Failed) {
+        AppendGoAway(self, error);
+        self->Failed = true;
+    }
+}
+
+static struct THttp2Stream* FindStream(struct THttp2Session* self, uint32_t id) {
+    for (size_t i = 0; i < HTTP2_MAX_CONCURRENT_STREAMS; ++i) {
+        if (self->Streams[i].Id == id) {
+            return &self->Streams[i];
+        }
+    }
+    return NULL;
+}
+
+static void CloseStream(struct THttp2Session* self, struct THttp2Stream* stream) {
+    if (stream->FileFd != -1) {
+        close(stream->FileFd);
+    }
+    THttpResponse_Destroy(&stream->Response);
+    TStringBuilder_Destroy(&stream->Buffer);
+    stream->Id = 0;
+    --self->ActiveStreams;
+}
+
+static void StreamError(struct THttp2Session* self, uint32_t id, enum EHttp2Error error) {
+    DEBUG_PRINT("http2: stream %u error %d\n", id, error);
+    AppendRstStream(self, id, error);
+    struct THttp2Stream* stream = FindStream(self, id);
+    if (stream != NULL) {
+        CloseStream(self, stream);
+    }
+}
+
+// The body is the in-memory one, or the parts of the file with the multipart delimiters between them
+static void StartFilePart(struct THttp2Stream* stream, size_t index) {
+    const struct THttpResponse* response = &stream->Response;
+    stream->FilePart = index;
+    TStringBuilder_Clear(&stream->Buffer);
+    THttpResponse_FormatFilePartHeader(response, index, &stream->Buffer);
+    stream->Pending = stream->Buffer.Data;
+    stream->PendingLength = stream->Buffer.Length;
+    if (index < THttpResponse_GetFilePartCount(response)) {
+        const struct THttpByteRange part = THttpResponse_GetFilePart(response, index);
+        stream->FileOffset = part.Offset;
+        stream->FileRemaining = part.Length;
+    } else {
+        stream->FileRemaining = 0;
+    }
+}
+
+// The next piece of a streamed body, there is none once it has ended or failed
+static bool GenerateBody(struct THttp2Stream* stream) {
+    struct THttpResponse* response = &stream->Response;
+    enum EBodyStreamResult result = BODY_STREAM_MORE;
+    TStringBuilder_Clear(&stream->Buffer);
+    while (result == BODY_STREAM_MORE && stream->Buffer.Length == 0) {
+        result = response->BodyStream->Generate(response->BodyStream, &stream->Buffer);
+    }
+    if (result != BODY_STREAM_MORE) {
+        response->BodyStream->Destroy(response->BodyStream);
+        response->BodyStream = NULL;
+        stream->BodyFailed = result == BODY_STREAM_FAILED;
+    }
+    stream->Pending = stream->Buffer.Data;
+    stream->PendingLength = stream->BodyFailed ? 0 : stream->Buffer.Length;
+    return stream->PendingLength != 0;
+}
+
+static bool HasMoreData(struct THttp2Stream* stream) {
+    if (stream->PendingLength != 0 || stream->FileRemaining != 0) {
+        return true;
+    }
+    if (stream->Response.BodyStream != NULL) {
+        return GenerateBody(stream);
+    }
+    if (stream->FileFd == -1 || stream->FilePart == THttpResponse_GetFilePartCount(&stream->Response)) {
+        return false;
+    }
+    StartFilePart(stream, stream->FilePart + 1);
+    return HasMoreData(stream);
+}
+
+static void PrepareBody(struct THttp2Stream* stream) {
+    struct THttpResponse* response = &stream->Response;
+    if (response->should_use_sendfile) {
+        stream->FileFd = open(response->file_path_requested, O_RDONLY | O_CLOEXEC);
+        if (stream->FileFd == -1) {
+            DEBUG_PRINT("http2: failed to open %s: %s\n", response->file_path_requested, strerror(errno));
+            THttpResponse_Destroy(response);
+            THttpResponse_Init(response);
+            CreateErrorPage(response, HTTP_NOT_FOUND);
+        } else {
+            StartFilePart(stream, 0);
+            return;
+        }
+    }
+    // the DATA frames cut the body anywhere, so a rope is flattened behind Body once
+    TRope_CopyTo(&response->BodyRope, &response->Body);
+    TRope_Clear(&response->BodyRope);
+    stream->Pending = response->Body.Data;
+    stream->PendingLength = response->Body.Length;
+}
+
+static bool IsConnectionSpecific(const char* name) {
+    return strcmp(name, "connection") == 0 || strcmp(name, "keep-alive") == 0 ||
+           strcmp(name, "proxy-connection") == 0 || strcmp(name, "transfer-encoding") == 0 ||
+           strcmp(name, "upgrade") == 0;
+}
+
+static bool SetPseudoHeader(struct TStringView* field, char* value) {
+    if (field->Data != NULL) {
+        return false;  // repeated
+    }
+    field->Data = value;
+    field->Length = strlen(value);
+    return true;
+}
+
+// The request points into Fields: the pseudo-headers give the request line, the path is split
+// at '?' in place. It gets the semantics of a persistent HTTP/1.1 request.
+static enum EBuildResult BuildRequest(struct THttp2Session* self, struct THttpRequest* request) {
+    THttpRequest_Init(request);
+    request->Version = (struct TStringView){ "HTTP/2.0", 8 };
+    request->VersionMajor = 1;
+    request->VersionMinor = 1;
+    request->should_keep_alive = true;
+
+    if (self->Fields.Length > MAX_REQUEST_HEAD_SIZE) {
+        return BUILD_TOO_LARGE;
+    }
+    bool regularSeen = false;
+    char* p = self->Fields.Data;
+    char* const end = p + self->Fields.Length;
+    while (p != end) {
+        char* name = p;
+        char* value = name + strlen(name) + 1;
+        p = value + strlen(value) + 1;
+        if (strpbrk(value, "\r\n") != NULL) {
+            return BUILD_MALFORMED;
+        }
+        if (name[0] == ':') {
+            bool ok;
+            if (regularSeen) {
+                ok = false;
+            } else if (strcmp(name, ":method") == 0) {
+                ok = SetPseudoHeader(&request->Method, value);
+            } else if (strcmp(name, ":path") == 0) {
+                ok = SetPseudoHeader(&request->Path, value);
+            } else {
+                ok = strcmp(name, ":scheme") == 0 || strcmp(name, ":authority") == 0;
+            }
+            if (!ok) {
+                return BUILD_MALFORMED;
+            }
+            continue;
+        }
+        regularSeen = true;
+        for (const char* c = name; *c != '\0'; ++c) {
+            if (*c >= 'A' && *c <= 'Z') {
+                return BUILD_MALFORMED;
+            }
+        }
+        if (IsConnectionSpecific(name) || (strcmp(name, "te") == 0 && strcmp(value, "trailers") != 0)) {
+            return BUILD_MALFORMED;
+        }
+        if (request->HeaderCount == MAX_REQUEST_HEADERS) {
+            return BUILD_TOO_LARGE;
+        }
+        request->Headers[request->HeaderCount++] = (struct THttpHeader){
+            { name, value - name - 1 }, { value, p - value - 1 }
+        };
+    }
+    if (request->Method.Data == NULL || request->Path.Data == NULL || request->Path.Length == 0) {
+        return BUILD_MALFORMED;
+    }
+    char* query = memchr(request->Path.Data, '?', request->Path.Length);
+    if (query != NULL) {
+        *query = '\0';
+        request->QueryString.Data = query + 1;
+        request->QueryString.Length = request->Path.Length - (query + 1 - request->Path.Data);
+        request->Path.Length = query - request->Path.Data;
+    }
+    return BUILD_OK;
+}
+
+static struct THttp2Stream* OpenStream(struct THttp2Session* self, uint32_t id, bool remoteClosed) {
+    struct THttp2Stream* stream = FindStream(self, 0);
+    stream->Id = id;
+    stream->RemoteClosed = remoteClosed;
+    stream->HeadersSent = false;
+    stream->SendWindow = self->PeerInitialWindow;
+    THttpResponse_Init(&stream->Response);
+    stream->Pending = NULL;
+    stream->PendingLength = 0;
+    TStringBuilder_Init(&stream->Buffer);
+    stream->BodyFailed = false;
+    stream->FileFd = -1;
+    stream->FilePart = 0;
+    stream->FileOffset = 0;
+    stream->FileRemaining = 0;
+    ++self->ActiveStreams;
+    if (--self->StreamsLeft == 0 && !self->GoAwaySent) {
+        AppendGoAway(self, NO_ERROR);  // the client opens a new connection for the streams after this one
+    }
+    return stream;
+}
+
+static void HandleStream(struct THttp2Session* self, struct THttp2Stream* stream, const struct THttpRequest* request) {
+    DEBUG_PRINT("http2: stream %u %s %s\n", stream->Id, request->Method.Data, request->Path.Data);
+    self->Handler(request, &stream->Response, self->HandlerContext);
+    PrepareBody(stream);
+}
+
+static void ProcessHeaderBlock(struct THttp2Session* self, uint32_t id, bool endStream) {
+    // decoded even if the stream is refused, the client's encoder has updated its table for it
+    if (!THpackDecoder_Decode(&self->Decoder, (const uint8_t*)self->HeaderBlock.Data, self->HeaderBlock.Length,
+                              MAX_REQUEST_HEAD_SIZE, &self->Fields)) {
+        ConnectionError(self, COMPRESSION_ERROR);
+        return;
+    }
+    struct THttp2Stream* stream = FindStream(self, id);
+    if (stream != NULL) {
+        // trailers, they have to end the request
+        if (stream->RemoteClosed || !endStream) {
+            StreamError(self, id, stream->RemoteClosed ? STREAM_CLOSED : PROTOCOL_ERROR);
+        } else {
+            stream->RemoteClosed = true;
+        }
+        return;
+    }
+    if (id <= self->LastStreamId) {
+        StreamError(self, id, STREAM_CLOSED);
+        return;
+    }
+    self->LastStreamId = id;
+    if (self->GoAwaySent) {
+        return;  // above the last stream of the GOAWAY, the client retries it on another connection
+    }
+    if (self->ActiveStreams == HTTP2_MAX_CONCURRENT_STREAMS || self->StreamsLeft == 0) {
+        StreamError(self, id, REFUSED_STREAM);
+        return;
+    }
+
+    struct THttpRequest request;
+    const enum EBuildResult result = BuildRequest(self, &request);
+    if (result == BUILD_MALFORMED) {
+        StreamError(self, id, PROTOCOL_ERROR);
+        return;
+    }
+    stream = OpenStream(self, id, endStream);
+    if (result == BUILD_TOO_LARGE) {
+        CreateErrorPage(&stream->Response, HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE);
+        PrepareBody(stream);
+        return;
+    }
+    HandleStream(self, stream, &request);
+}
+
+static void CompleteHeaderBlock(struct THttp2Session* self, uint32_t id, bool endStream) {
+    self->ActivityMs = MonotonicMs();
+    TStringBuilder_Clear(&self->Fields);
+    ProcessHeaderBlock(self, id, endStream);
+    // the request has been handled, a buffer grown by a block too large is not kept for the connection's life
+    if (self->Fields.Capacity_ > MAX_REQUEST_HEAD_SIZE) {
+        TStringBuilder_Destroy(&self->Fields);
+        TStringBuilder_Init(&self->Fields);
+    }
+}
+
+// Removes the padding and the priority fields of a HEADERS or DATA frame
+static bool StripPadding(uint8_t flags, const uint8_t** payload, size_t* length, bool hasPriority) {
+    size_t padding = 0;
+    if (flags & FLAG_PADDED) {
+        if (*length == 0) {
+            return false;
+        }
+        padding = (*payload)[0];
+        ++*payload;
+        --*length;
+    }
+    if (hasPriority && (flags & FLAG_PRIORITY)) {
+        if (*length < 5) {
+            return false;
+        }
+        *payload += 5;
+        *length -= 5;
+    }
+    if (padding > *length) {
+        return false;
+    }
+    *length -= padding;
+    return true;
+}
+
+static void OnHeaders(struct THttp2Session* self, uint8_t flags, uint32_t id, const uint8_t* payload, size_t length) {
+    if (id == 0 || id % 2 == 0 || !StripPadding(flags, &payload, &length, true)) {
+        ConnectionError(self, PROTOCOL_ERROR);
+        return;
+    }
+    TStringBuilder_Clear(&self->HeaderBlock);
+    TStringBuilder_AppendBuf(&self->HeaderBlock, (const char*)payload, length);
+    self->HeaderBlockEndStream = flags & FLAG_END_STREAM;
+    if (flags & FLAG_END_HEADERS) {
+        CompleteHeaderBlock(self, id, self->HeaderBlockEndStream);
+    } else {
+        self->HeaderBlockStream = id;
+    }
+}
+
+static void OnContinuation(struct THttp2Session* self, uint8_t flags, uint32_t id, const uint8_t* payload, size_t length) {
+    if (self->HeaderBlockStream == 0 || id != self->HeaderBlockStream) {
+        ConnectionError(self, PROTOCOL_ERROR);
+        return;
+    }
+    if (self->HeaderBlock.Length + length > MAX_HEADER_BLOCK_SIZE) {
+        ConnectionError(self, PROTOCOL_ERROR);  // not even decoded, the table would go out of sync
+        return;
+    }
+    TStringBuilder_AppendBuf(&self->HeaderBlock, (const char*)payload, length);
+    if (flags & FLAG_END_HEADERS) {
+        self->HeaderBlockStream = 0;
+        CompleteHeaderBlock(self, id, self->HeaderBlockEndStream);
+    }
+}
+
+static void OnData(struct THttp2Session* self, uint8_t flags, uint32_t id, const uint8_t* payload, size_t length) {
+    if (id == 0) {
+        ConnectionError(self, PROTOCOL_ERROR);
+        return;
+    }
+    // request bodies are discarded, the windows are given back at once
+    if (length != 0) {
+        AppendWindowUpdate(self, 0, length);
+    }
+    const size_t frameLength = length;
+    if (!StripPadding(flags, &payload, &length, false)) {
+        ConnectionError(self, PROTOCOL_ERROR);
+        return;
+    }
+    struct THttp2Stream* stream = FindStream(self, id);
+    if (stream == NULL || stream->RemoteClosed) {
+        if (id > self->LastStreamId) {
+            ConnectionError(self, PROTOCOL_ERROR);  // the stream is idle
+        } else {
+            StreamError(self, id, STREAM_CLOSED);
+        }
+        return;
+    }
+    self->ActivityMs = MonotonicMs();
+    if (flags & FLAG_END_STREAM) {
+        stream->RemoteClosed = true;
+    } else if (frameLength != 0) {
+        AppendWindowUpdate(self, id, frameLength);
+    }
+}
+
+static bool AreSettingsValid(const uint8_t* payload, size_t length) {
+    for (const uint8_t* p = payload; p != payload + length; p += 6) {
+        const uint32_t value = ReadUint32(p + 2);
+        switch ((p[0] << 8) | p[1]) {
+            case SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return false;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > MAX_WINDOW) {
+                    return false;
+                }
+                break;
+            case SETTINGS_MAX_FRAME_SIZE:
+                if (value < MIN_MAX_FRAME_SIZE || value > MAX_MAX_FRAME_SIZE) {
+                    return false;
+                }
+                break;
+        }
+    }
+    return true;
+}
+
+// The payload has been validated. The server pushes nothing and its encoder uses no dynamic table,
+// so only the flow control settings matter.
+static void ApplySettings(struct THttp2Session* self, const uint8_t* payload, size_t length) {
+    for (const uint8_t* p = payload; p != payload + length; p += 6) {
+        const uint32_t value = ReadUint32(p + 2);
+        switch ((p[0] << 8) | p[1]) {
+            case SETTINGS_INITIAL_WINDOW_SIZE: {
+                // applies to the open streams as well (RFC 9113 6.9.2)
+                const int64_t delta = (int64_t)value - self->PeerInitialWindow;
+                for (size_t i = 0; i < HTTP2_MAX_CONCURRENT_STREAMS; ++i) {
+                    struct THttp2Stream* stream = &self->Streams[i];
+                    if (stream->Id != 0) {
+                        stream->SendWindow += delta;
+                        if (stream->SendWindow > MAX_WINDOW) {
+                            ConnectionError(self, FLOW_CONTROL_ERROR);
+                        }
+                    }
+                }
+                self->PeerInitialWindow = value;
+                break;
+            }
+            case SETTINGS_MAX_FRAME_SIZE:
+                self->PeerMaxFrameSize = value;
+                break;
+        }
+    }
+}
+
+static void OnSettings(struct THttp2Session* self, uint8_t flags, uint32_t id, const uint8_t* payload, size_t length) {
+    if (id != 0) {
+        ConnectionError(self, PROTOCOL_ERROR);
+        return;
+    }
+    if (flags & FLAG_ACK) {
+        if (length != 0) {
+            ConnectionError(self, FRAME_SIZE_ERROR);
+        }
+        return;
+    }
+    if (length % 6 != 0) {
+        ConnectionError(self, FRAME_SIZE_ERROR);
+        return;
+    }
+    if (!AreSettingsValid(payload, length)) {
+        ConnectionError(self, PROTOCOL_ERROR);  // FLOW_CONTROL_ERROR for the window size, close enough
+        return;
+    }
+    ApplySettings(self, payload, length);
+    self->SettingsReceived = true;
+    AppendFrame(self, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static void OnWindowUpdate(struct THttp2Session* self, uint32_t id, const uint8_t* payload, size_t length) {
+    if (length != 4) {
+        ConnectionError(self, FRAME_SIZE_ERROR);
+        return;
+    }
+    const uint32_t increment = ReadUint32(payload) & MAX_WINDOW;
+    if (id == 0) {
+        self->SendWindow += increment;
+        if (increment == 0 || self->SendWindow > MAX_WINDOW) {
+            ConnectionError(self, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+        }
+        return;
+    }
+    if (id > self->LastStreamId) {
+        ConnectionError(self, PROTOCOL_ERROR);
+        return;
+    }
+    struct THttp2Stream* stream = FindStream(self, id);
+    if (stream == NULL) {
+        return;  // completed already, the client may not know it yet
+    }
+    stream->SendWindow += increment;
+    if (increment == 0 || stream->SendWindow > MAX_WINDOW) {
+        StreamError(self, id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR);
+    }
+}
+
+static void OnFrame(struct THttp2Session* self, enum EFrameType type, uint8_t flags, uint32_t id,
+                    const uint8_t* payload, size_t length) {
+    DEBUG_PRINT("http2: frame type %d flags 0x%x stream %u length %zu\n", type, flags, id, length);
+    if (self->HeaderBlockStream != 0 && type != FRAME_CONTINUATION) {
+        ConnectionError(self, PROTOCOL_ERROR);
+        return;
+    }
+    if (!self->SettingsReceived && type != FRAME_SETTINGS) {
+        ConnectionError(self, PROTOCOL_ERROR);  // the preface ends with SETTINGS
+        return;
+    }
+    switch (type) {
+        case FRAME_DATA:
+            OnData(self, flags, id, payload, length);
+            break;
+        case FRAME_HEADERS:
+            OnHeaders(self, flags, id, payload, length);
+            break;
+        case FRAME_CONTINUATION:
+            OnContinuation(self, flags, id, payload, length);
+            break;
+        case FRAME_PRIORITY:
+            // the streams are served round robin whatever the client prefers
+            if (id == 0 || length != 5) {
+                ConnectionError(self, id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+            }
+            break;
+        case FRAME_RST_STREAM:
+            if (id == 0 || id > self->LastStreamId || length != 4) {
+                ConnectionError(self, length != 4 ? FRAME_SIZE_ERROR : PROTOCOL_ERROR);
+            } else {
+                struct THttp2Stream* stream = FindStream(self, id);
+                if (stream != NULL) {
+                    CloseStream(self, stream);
+                }
+            }
+            break;
+        case FRAME_SETTINGS:
+            OnSettings(self, flags, id, payload, length);
+            break;
+        case FRAME_PUSH_PROMISE:
+            ConnectionError(self, PROTOCOL_ERROR);  // clients never push
+            break;
+        case FRAME_PING:
+            if (id != 0 || length != 8) {
+                ConnectionError(self, id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+            } else if (!(flags & FLAG_ACK)) {
+                AppendFrame(self, FRAME_PING, FLAG_ACK, 0, payload, length);
+            }
+            break;
+        case FRAME_GOAWAY:
+            if (id != 0 || length < 8) {
+                ConnectionError(self, id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+            } else {
+                self->GoAwayReceived = true;
+            }
+            break;
+        case FRAME_WINDOW_UPDATE:
+            OnWindowUpdate(self, id, payload, length);
+            break;
+        default:
+            break;  // unknown frames are ignored
+    }
+}
+
+bool Http2_IsPriorKnowledge(const struct THttpRequest* request) {
+    return strcmp(request->Method.Data, "PRI") == 0 && strcmp(request->Path.Data, "*") == 0 &&
+           request->VersionMajor == 2 && request->VersionMinor == 0 && request->HeaderCount == 0;
+}
+
+static int DecodeBase64UrlChar(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '-') {
+        return 62;
+    }
+    if (c == '_') {
+        return 63;
+    }
+    return -1;
+}
+
+// The HTTP2-Settings header: the SETTINGS payload in base64url, returns false if it is not one
+static bool DecodeUpgradeSettings(struct TStringView value, uint8_t* payload, size_t* length) {
+    size_t size = value.Length;
+    while (size != 0 && value.Data[size - 1] == '=') {
+        --size;  // the padding is not supposed to be there, but tolerated
+    }
+    *length = 0;
+    uint32_t bits = 0;
+    int bitCount = 0;
+    for (size_t i = 0; i < size; ++i) {
+        const int sextet = DecodeBase64UrlChar(value.Data[i]);
+        if (sextet < 0) {
+            return false;
+        }
+        bits = (bits << 6) | sextet;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            if (*length == MAX_UPGRADE_SETTINGS * 6) {
+                return false;
+            }
+            payload[(*length)++] = bits >> bitCount;
+        }
+    }
+    return *length % 6 == 0 && AreSettingsValid(payload, *length);
+}
+
+bool Http2_IsUpgrade(const struct THttpRequest* request) {
+    if (!TStringView_EqualsCI(request->Method, "GET") || request->VersionMajor != 1 || request->VersionMinor < 1) {
+        return false;  // a request body would have to be read before switching
+    }
+    if (!THttpRequest_HasToken(request, "Upgrade", "h2c") || !THttpRequest_HasToken(request, "Connection", "Upgrade") ||
+        !THttpRequest_HasToken(request, "Connection", "HTTP2-Settings")) {
+        return false;
+    }
+    const struct TStringView* settings = THttpRequest_FindHeader(request, "HTTP2-Settings");
+    uint8_t payload[MAX_UPGRADE_SETTINGS * 6];
+    size_t length;
+    return settings != NULL && DecodeUpgradeSettings(*settings, payload, &length);
+}
+
+void THttp2Session_Init(struct THttp2Session* self, THttp2Handler handler, void* context, unsigned streams_left) {
+    self->Handler = handler;
+    self->HandlerContext = context;
+    TStringBuilder_Init(&self->Output);
+    TStringBuilder_Init(&self->Input);
+    self->PrefaceReceived = 0;
+    self->SettingsReceived = false;
+    THpackDecoder_Init(&self->Decoder);
+    TStringBuilder_Init(&self->HeaderBlock);
+    self->HeaderBlockStream = 0;
+    self->HeaderBlockEndStream = false;
+    TStringBuilder_Init(&self->Fields);
+    self->LastStreamId = 0;
+    self->StreamsLeft = streams_left != 0 ? streams_left : 1;
+    self->SendWindow = DEFAULT_WINDOW;
+    self->PeerInitialWindow = DEFAULT_WINDOW;
+    self->PeerMaxFrameSize = MIN_MAX_FRAME_SIZE;
+    for (size_t i = 0; i < HTTP2_MAX_CONCURRENT_STREAMS; ++i) {
+        self->Streams[i].Id = 0;
+    }
+    self->ActiveStreams = 0;
+    self->NextStream = 0;
+    self->ActivityMs = MonotonicMs();
+    self->PartialSinceMs = 0;
+    self->GoAwaySent = false;
+    self->GoAwayReceived = false;
+    self->Failed = false;
+}
+
+void THttp2Session_Destroy(struct THttp2Session* self) {
+    for (size_t i = 0; i < HTTP2_MAX_CONCURRENT_STREAMS; ++i) {
+        if (self->Streams[i].Id != 0) {
+            CloseStream(self, &self->Streams[i]);
+        }
+    }
+    TStringBuilder_Destroy(&self->Output);
+    TStringBuilder_Destroy(&self->Input);
+    THpackDecoder_Destroy(&self->Decoder);
+    TStringBuilder_Destroy(&self->HeaderBlock);
+    TStringBuilder_Destroy(&self->Fields);
+}
+
+void THttp2Session_Start(struct THttp2Session* self, const struct THttpRequest* upgrade) {
+    if (upgrade != NULL) {
+        TStringBuilder_AppendCStr(&self->Output, SWITCHING_PROTOCOLS);
+    } else {
+        self->PrefaceReceived = PREFACE_HEAD_SIZE;
+    }
+    uint8_t settings[6] = { 0, SETTINGS_MAX_CONCURRENT_STREAMS };
+    WriteUint32(settings + 2, HTTP2_MAX_CONCURRENT_STREAMS);
+    AppendFrame(self, FRAME_SETTINGS, 0, 0, settings, sizeof(settings));
+    if (upgrade == NULL) {
+        return;
+    }
+    // the client's settings come with the request, acknowledged implicitly by the 101 (RFC 7540 3.2.1)
+    uint8_t payload[MAX_UPGRADE_SETTINGS * 6];
+    size_t length;
+    if (DecodeUpgradeSettings(*THttpRequest_FindHeader(upgrade, "HTTP2-Settings"), payload, &length)) {
+        ApplySettings(self, payload, length);
+    }
+    self->LastStreamId = 1;
+    HandleStream(self, OpenStream(self, 1, true), upgrade);
+}
+
+static void ConsumeFrames(struct THttp2Session* self, const uint8_t** data, size_t* size) {
+    while (*size >= FRAME_HEADER_SIZE && !self->Failed) {
+        const uint8_t* p = *data;
+        const size_t length = ((size_t)p[0] << 16) | (p[1] << 8) | p[2];
+        if (length > HTTP2_MAX_FRAME_SIZE) {
+            ConnectionError(self, FRAME_SIZE_ERROR);
+            return;
+        }
+        if (*size < FRAME_HEADER_SIZE + length) {
+            return;
+        }
+        OnFrame(self, p[3], p[4], ReadUint32(p + 5) & MAX_WINDOW, p + FRAME_HEADER_SIZE, length);
+        *data += FRAME_HEADER_SIZE + length;
+        *size -= FRAME_HEADER_SIZE + length;
+    }
+}
+
+bool THttp2Session_Feed(struct THttp2Session* self, const char* data, size_t size) {
+    if (self->Failed) {
+        return false;
+    }
+    if (self->PrefaceReceived < PREFACE_SIZE) {
+        const size_t n = size < PREFACE_SIZE - self->PrefaceReceived ? size : PREFACE_SIZE - self->PrefaceReceived;
+        if (memcmp(data, PREFACE + self->PrefaceReceived, n) != 0) {
+            ConnectionError(self, PROTOCOL_ERROR);
+            return false;
+        }
+        self->PrefaceReceived += n;
+        data += n;
+        size -= n;
+    }
+
+    // whole frames are handled right from `data`, only a frame received in part is copied
+    const uint8_t* p;
+    size_t left;
+    if (self->Input.Length == 0) {
+        p = (const uint8_t*)data;
+        left = size;
+        ConsumeFrames(self, &p, &left);
+        TStringBuilder_AppendBuf(&self->Input, (const char*)p, left);
+    } else {
+        TStringBuilder_AppendBuf(&self->Input, data, size);
+        p = (const uint8_t*)self->Input.Data;
+        left = self->Input.Length;
+        ConsumeFrames(self, &p, &left);
+        memmove(self->Input.Data, p, left);
+        self->Input.Length = left;
+        self->Input.Data[left] = '\0';
+    }
+    // the time of a partial frame runs on while the frames before it complete
+    if (self->PrefaceReceived == PREFACE_SIZE && self->Input.Length == 0 && self->HeaderBlockStream == 0) {
+        self->PartialSinceMs = 0;
+    } else if (self->PartialSinceMs == 0) {
+        self->PartialSinceMs = MonotonicMs();
+    }
+    return !self->Failed;
+}
+
+static void WriteHeaders(struct THttp2Session* self, struct THttp2Stream* stream) {
+    const struct THttpResponse* response = &stream->Response;
+    struct TStringBuilder* out = &self->Output;
+    const size_t frame = BeginFrame(self);
+
+    char value[CONTENT_TYPE_SIZE];
+    Hpack_EncodeStatus(out, response->Code);
+    Hpack_EncodeField(out, HPACK_SERVER, SERVER_NAME, strlen(SERVER_NAME));
+    Hpack_EncodeField(out, HPACK_DATE, GetHttpDate(), HTTP_DATE_SIZE - 1);
+    if (response->file_modification_time != 0) {
+        const size_t length = FormatHttpDate(response->file_modification_time, value, sizeof(value));
+        Hpack_EncodeField(out, HPACK_LAST_MODIFIED, value, length);
+    }
+    if (response->ETag[0] != '\0') {
+        Hpack_EncodeField(out, HPACK_ETAG, response->ETag, strlen(response->ETag));
+    }
+    if (response->CacheControl) {
+        Hpack_EncodeField(out, HPACK_CACHE_CONTROL, response->CacheControl, strlen(response->CacheControl));
+    }
+    if (response->Link) {
+        Hpack_EncodeField(out, HPACK_LINK, response->Link, strlen(response->Link));
+    }
+    if (response->Code == HTTP_TOO_MANY_REQUESTS) {
+        const char* digits = FormatUIntBackwards(RATE_LIMIT_RETRY_AFTER, value + sizeof(value));
+        Hpack_EncodeField(out, HPACK_RETRY_AFTER, digits, value + sizeof(value) - digits);
+    }
+    if (response->should_use_sendfile) {
+        Hpack_EncodeField(out, HPACK_ACCEPT_RANGES, "bytes", 5);
+    }
+    if (THttpResponse_FormatContentRange(response, value, sizeof(value))) {
+        Hpack_EncodeField(out, HPACK_CONTENT_RANGE, value, strlen(value));
+    }
+    if (response->Code != HTTP_NOT_MODIFIED) {
+        const char* contentType = THttpResponse_GetContentType(response, value, sizeof(value));
+        if (contentType) {
+            Hpack_EncodeField(out, HPACK_CONTENT_TYPE, contentType, strlen(contentType));
+        }
+        if (response->BodyStream == NULL) {
+            const char* digits = FormatUIntBackwards(THttpResponse_GetContentLength(response), value + sizeof(value));
+            Hpack_EncodeField(out, HPACK_CONTENT_LENGTH, digits, value + sizeof(value) - digits);
+        }
+    }
+
+    stream->HeadersSent = true;
+    IoStats_Add(IO_STAT_RESPONSES, 1);
+    const bool end = !HasMoreData(stream) && !stream->BodyFailed;
+    EndHeaderBlock(self, frame, end ? FLAG_END_STREAM : 0, stream->Id);
+}
+
+// Writes the next DATA frame of the stream, false if its window or the connection's is closed
+static bool WriteData(struct THttp2Session* self, struct THttp2Stream* stream) {
+    int64_t window = stream->SendWindow < self->SendWindow ? stream->SendWindow : self->SendWindow;
+    if (window <= 0) {
+        return false;
+    }
+    size_t size = HTTP2_MAX_FRAME_SIZE < self->PeerMaxFrameSize ? HTTP2_MAX_FRAME_SIZE : self->PeerMaxFrameSize;
+    if ((int64_t)size > window) {
+        size = window;
+    }
+
+    const size_t frame = BeginFrame(self);
+    if (stream->PendingLength != 0) {
+        if (size > stream->PendingLength) {
+            size = stream->PendingLength;
+        }
+        TStringBuilder_AppendBuf(&self->Output, stream->Pending, size);
+        stream->Pending += size;
+        stream->PendingLength -= size;
+    } else {
+        if (size > stream->FileRemaining) {
+            size = stream->FileRemaining;
+        }
+        char buf[HTTP2_MAX_FRAME_SIZE];
+        const ssize_t got = pread(stream->FileFd, buf, size, stream->FileOffset);
+        if (got <= 0) {
+            // the file has been truncated or can not be read, the response can not be completed
+            DEBUG_PRINT("http2: failed to read %s\n", stream->Response.file_path_requested);
+            TStringBuilder_Truncate(&self->Output, frame);
+            StreamError(self, stream->Id, INTERNAL_ERROR);
+            return true;
+        }
+        size = got;
+        TStringBuilder_AppendBuf(&self->Output, buf, size);
+        stream->FileOffset += size;
+        stream->FileRemaining -= size;
+    }
+    stream->SendWindow -= size;
+    self->SendWindow -= size;
+    const bool end = !HasMoreData(stream) && !stream->BodyFailed;
+    PatchFrameHeader(self, frame, FRAME_DATA, end ? FLAG_END_STREAM : 0, stream->Id);
+    return true;
+}
+
+static void FinishStream(struct THttp2Session* self, struct THttp2Stream* stream) {
+    if (!stream->RemoteClosed) {
+        // the request body is not needed any more (RFC 9113 8.1)
+        AppendRstStream(self, stream->Id, NO_ERROR);
+    }
+    CloseStream(self, stream);
+}
+
+// The responses wait for the client's preface. An upgrading client reads the 101 on its own
+// and may have no room for a whole window of frames behind it (curl has not).
+static bool CanWriteFrames(const struct THttp2Session* self) {
+    return !self->Failed && self->SettingsReceived;
+}
+
+void THttp2Session_WriteFrames(struct THttp2Session* self) {
+    if (!CanWriteFrames(self)) {
+        return;
+    }
+    // one frame per stream in turn, so no response waits for all of a large one
+    const size_t written = self->Output.Length;
+    bool progress = true;
+    while (progress && self->ActiveStreams != 0 && self->Output.Length < HTTP2_OUTPUT_BATCH) {
+        progress = false;
+        for (size_t i = 0; i < HTTP2_MAX_CONCURRENT_STREAMS && self->Output.Length < HTTP2_OUTPUT_BATCH; ++i) {
+            struct THttp2Stream* stream = &self->Streams[(self->NextStream + i) % HTTP2_MAX_CONCURRENT_STREAMS];
+            if (stream->Id == 0) {
+                continue;
+            }
+            if (!stream->HeadersSent) {
+                WriteHeaders(self, stream);
+            } else if (!WriteData(self, stream)) {
+                continue;
+            }
+            progress = true;
+            if (stream->Id != 0 && stream->BodyFailed) {
+                StreamError(self, stream->Id, INTERNAL_ERROR);
+            } else if (stream->Id != 0 && !HasMoreData(stream)) {
+                FinishStream(self, stream);
+            }
+        }
+        self->NextStream = (self->NextStream + 1) % HTTP2_MAX_CONCURRENT_STREAMS;
+    }
+    if (self->Output.Length != written) {
+        self->ActivityMs = MonotonicMs();
+    }
+}
+
+bool THttp2Session_WantsWrite(const struct THttp2Session* self) {
+    if (!CanWriteFrames(self)) {
+        return false;
+    }
+    // a stream is closed as soon as its last frame is written, so an open one always has something to send
+    for (size_t i = 0; i < HTTP2_MAX_CONCURRENT_STREAMS; ++i) {
+        const struct THttp2Stream* stream = &self->Streams[i];
+        if (stream->Id != 0 && (!stream->HeadersSent || (stream->SendWindow > 0 && self->SendWindow > 0))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void THttp2Session_Shutdown(struct THttp2Session* self) {
+    if (!self->GoAwaySent) {
+        AppendGoAway(self, NO_ERROR);
+    }
+}
+
+bool THttp2Session_IsDone(const struct THttp2Session* self) {
+    return self->Failed || ((self->GoAwaySent || self->GoAwayReceived) && self->ActiveStreams == 0);
+}
+
+uint64_t THttp2Session_GetDeadline(const struct THttp2Session* self) {
+    uint64_t deadline = self->ActivityMs +
+                        (self->ActiveStreams != 0 ? SEND_PROGRESS_TIMEOUT : TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS);
+    if (self->PartialSinceMs != 0 && self->PartialSinceMs + HEADER_READ_TIMEOUT < deadline) {
+        deadline = self->PartialSinceMs + HEADER_READ_TIMEOUT;
+    }
+    return deadline;
+}
+
+bool THttp2Session_OnDeadline(struct THttp2Session* self) {
+    if (self->ActiveStreams != 0 || self->PartialSinceMs != 0 || self->GoAwaySent) {
+        return false;
+    }
+    THttp2Session_Shutdown(self);  // idle like a keep-alive connection
+    return true;
+}
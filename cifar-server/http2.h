@@ -0,0 +1,111 @@
+#pragma once
+
+#include "config.h"
+#include "hpack.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "stringbuilder.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * HTTP/2 over cleartext TCP (h2c, RFC 9113) without any I/O of its own.
+ *
+ * The session is fed whatever the client sends and collects the frames to send in Output,
+ * so the blocking workers and the epoll reactor drive it the same way. A request is handed
+ * to the handler as soon as its header block is complete, with the semantics of an HTTP/1.1
+ * request, so Handle serves both protocols. The responses are written as DATA frames round
+ * robin over the streams within the flow control windows the client grants: the images of
+ * a page are interleaved on a single connection instead of queueing behind each other.
+ *
+ * A session starts either from an HTTP/1.1 request with "Upgrade: h2c", which becomes
+ * stream 1, or from the "PRI * HTTP/2.0" head of the connection preface (prior knowledge).
+ */
+
+typedef void (*THttp2Handler)(const struct THttpRequest* request, struct THttpResponse* response, void* context);
+
+struct THttp2Stream {
+    uint32_t Id;  // 0 for a free slot
+    bool RemoteClosed;  // the request has ended, a body sent after it is a stream error
+    bool HeadersSent;
+    int64_t SendWindow;  // goes negative if the client shrinks SETTINGS_INITIAL_WINDOW_SIZE
+    struct THttpResponse Response;
+
+    // The body is sent from `Pending` (the in-memory body, a multipart delimiter or a piece of
+    // a streamed body in Buffer), then from the current part of the file
+    const char* Pending;
+    size_t PendingLength;
+    struct TStringBuilder Buffer;
+    bool BodyFailed;  // the streamed body can not be completed, the stream is reset
+    int FileFd;  // -1 when the response has no file part
+    size_t FilePart;
+    off_t FileOffset;
+    size_t FileRemaining;
+};
+
+struct THttp2Session {
+    THttp2Handler Handler;
+    void* HandlerContext;
+
+    struct TStringBuilder Output;  // frames to send, the owner writes and clears it
+    struct TStringBuilder Input;  // the beginning of a frame received in part
+    size_t PrefaceReceived;  // bytes of the client connection preface matched so far
+    bool SettingsReceived;  // the preface ends with the client's SETTINGS
+
+    struct THpackDecoder Decoder;
+    struct TStringBuilder HeaderBlock;  // HEADERS and CONTINUATION fragments up to END_HEADERS
+    uint32_t HeaderBlockStream;  // expecting CONTINUATION for it, 0 otherwise
+    bool HeaderBlockEndStream;
+    struct TStringBuilder Fields;  // the decoded block, the request points into it
+
+    uint32_t LastStreamId;  // the highest stream opened by the client
+    unsigned StreamsLeft;  // how many more streams the connection may serve, like MAX_REQUESTS_PER_CONNECTION
+    int64_t SendWindow;  // of the connection
+    uint32_t PeerInitialWindow;
+    uint32_t PeerMaxFrameSize;
+
+    struct THttp2Stream Streams[HTTP2_MAX_CONCURRENT_STREAMS];
+    size_t ActiveStreams;
+    size_t NextStream;  // where the next round robin pass starts
+
+    // Only whole HEADERS and DATA frames count as activity: PINGs or a frame trickling in a byte at
+    // a time do not keep a connection alive, and a frame or header block left unfinished has HEADER_READ_TIMEOUT
+    uint64_t ActivityMs;  // the last complete request header block or DATA frame received or sent
+    uint64_t PartialSinceMs;  // since when a frame or a header block has been received in part, 0 if none
+
+    bool GoAwaySent;
+    bool GoAwayReceived;
+    bool Failed;  // a connection error: the GOAWAY in Output is the last thing to send
+};
+
+// True for the head of the connection preface, the client knows the server speaks h2c
+bool Http2_IsPriorKnowledge(const struct THttpRequest* request);
+// True for a valid "Upgrade: h2c" request, it may be answered over HTTP/2
+bool Http2_IsUpgrade(const struct THttpRequest* request);
+
+// `streams_left` limits the streams like MAX_REQUESTS_PER_CONNECTION limits HTTP/1.1 requests
+void THttp2Session_Init(struct THttp2Session* self, THttp2Handler handler, void* context, unsigned streams_left);
+void THttp2Session_Destroy(struct THttp2Session* self);
+// Queues the 101 Switching Protocols (with `upgrade`) and the server preface. The upgrade request
+// becomes stream 1, without it the "PRI * HTTP/2.0" head is taken as received already.
+void THttp2Session_Start(struct THttp2Session* self, const struct THttpRequest* upgrade);
+// Consumes the bytes received, handling every request completed by them. Returns false on a
+// connection error: Output holds the GOAWAY, the connection is closed once it is sent.
+bool THttp2Session_Feed(struct THttp2Session* self, const char* data, size_t size);
+// Appends frames of the pending responses to Output, until it holds HTTP2_OUTPUT_BATCH bytes
+// or every stream waits for the client to open its flow control window
+void THttp2Session_WriteFrames(struct THttp2Session* self);
+// True if THttp2Session_WriteFrames has something to write right away
+bool THttp2Session_WantsWrite(const struct THttp2Session* self);
+// Sends GOAWAY: no new streams are accepted, the ones already started are completed
+void THttp2Session_Shutdown(struct THttp2Session* self);
+// True once the connection may be closed (after sending Output)
+bool THttp2Session_IsDone(const struct THttp2Session* self);
+// Monotonic ms when the client has waited on for too long: idle, not reading the responses or leaving a frame unfinished
+uint64_t THttp2Session_GetDeadline(const struct THttp2Session* self);
+// Called once the deadline has passed. An idle session sends GOAWAY and returns true, false means
+// the connection is to be closed right away: the client stalls a response or a frame, or has had its GOAWAY.
+bool THttp2Session_OnDeadline(struct THttp2Session* self);
@@ -1,165 +1,564 @@
 #include "http_request.h"
 #include "config.h"
+#include "http_response.h"
+#include "io.h"
+#include "timer_wheel.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
 
-#define CONNECTION_KEEP_ALIVE "Connection: keep-alive"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The head being received plus a full receive after it, so a head just under the limit still fits
+#define INPUT_BUFFER_SIZE (MAX_REQUEST_HEAD_SIZE + RECV_BUF_SIZE)
 
 /**
  * THttpRequest
  */
 
 void THttpRequest_Init(struct THttpRequest* self) {
-    memset(self, 0, sizeof(struct THttpRequest));
+    // the headers array is filled up to HeaderCount only
+    self->Method = self->Path = self->QueryString = self->Version = (struct TStringView){ NULL, 0 };
+    self->VersionMajor = 1;
+    self->VersionMinor = 0;
+    self->HeaderCount = 0;
     self->should_keep_alive = false;
 }
 
-void THttpRequest_Destroy(struct THttpRequest* self) {
-    free(self->Method);
-    free(self->Path);
-    free(self->QueryString);
+const struct TStringView* THttpRequest_FindHeader(const struct THttpRequest* self, const char* name) {
+    for (size_t i = 0; i < self->HeaderCount; ++i) {
+        if (TStringView_EqualsCI(self->Headers[i].Name, name)) {
+            return &self->Headers[i].Value;
+        }
+    }
+    return NULL;
 }
 
-static void SplitFullRequest(char* fullRequest, char** path, char** queryString) {
-    char* pos = strchr(fullRequest, '?');
-    if (pos == NULL) {
-        // no query string
-        *path = strdup(fullRequest);
-        *queryString = NULL;
-    } else {
-        *pos = '\0';
-        *path = strdup(fullRequest);
-        *queryString = strdup(pos + 1);
+bool THttpRequest_HasToken(const struct THttpRequest* self, const char* name, const char* token) {
+    for (size_t i = 0; i < self->HeaderCount; ++i) {
+        if (TStringView_EqualsCI(self->Headers[i].Name, name) && TStringView_HasToken(self->Headers[i].Value, token)) {
+            return true;
+        }
     }
+    return false;
 }
 
-static bool ParseRequestLine(char* line, struct THttpRequest* out) {
-    char* saveptr;
+// Entity tags are compared without the weak prefix, a GET is satisfied by a weak match
+static bool ListsETag(struct TStringView list, const char* etag, size_t etagLength) {
+    const char* p = list.Data;
+    const char* end = list.Data + list.Length;
+    while (p != end) {
+        if (*p == ',' || *p == ' ' || *p == '\t') {
+            ++p;
+            continue;
+        }
+        if (*p == '*') {
+            return true;
+        }
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if (*p != '"') {
+            return false;  // malformed, the header is ignored
+        }
+        const char* close = memchr(p + 1, '"', end - p - 1);
+        if (close == NULL) {
+            return false;
+        }
+        if ((size_t)(close + 1 - p) == etagLength && memcmp(p, etag, etagLength) == 0) {
+            return true;
+        }
+        p = close + 1;
+    }
+    return false;
+}
 
-    char* method = strtok_r(line, " ", &saveptr);
-    if (method == NULL) {
-        return false;
+// HTTP-date in the preferred format or either of the obsolete ones (RFC 9110 5.6.7)
+static bool ParseHttpDate(const char* value, time_t* result) {
+    static const char* FORMATS[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",
+        "%A, %d-%b-%y %H:%M:%S GMT",
+        "%a %b %e %H:%M:%S %Y",
+    };
+    for (size_t i = 0; i < sizeof(FORMATS) / sizeof(FORMATS[0]); ++i) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* end = strptime(value, FORMATS[i], &tm);
+        if (end != NULL && *end == '\0') {
+            *result = timegm(&tm);
+            return true;
+        }
     }
-    out->Method = strdup(method);
+    return false;
+}
 
-    char* fullRequest = strtok_r(NULL, " ", &saveptr);
-    if (fullRequest == NULL) {
-        return false;
+bool THttpRequest_IsNotModified(const struct THttpRequest* self, const char* etag, time_t last_modified) {
+    bool hasIfNoneMatch = false;
+    const size_t etagLength = strlen(etag);
+    for (size_t i = 0; i < self->HeaderCount; ++i) {
+        if (TStringView_EqualsCI(self->Headers[i].Name, "If-None-Match")) {
+            hasIfNoneMatch = true;
+            if (etagLength != 0 && ListsETag(self->Headers[i].Value, etag, etagLength)) {
+                return true;
+            }
+        }
     }
+    if (hasIfNoneMatch || last_modified == 0) {
+        return false;  // If-Modified-Since is only a fallback for clients without entity tags
+    }
+    const struct TStringView* since = THttpRequest_FindHeader(self, "If-Modified-Since");
+    time_t date;
+    return since != NULL && ParseHttpDate(since->Data, &date) && last_modified <= date;
+}
 
-    SplitFullRequest(fullRequest, &out->Path, &out->QueryString);
-    return true;
+bool THttpRequest_IsRangeCurrent(const struct THttpRequest* self, const char* etag, time_t last_modified) {
+    const struct TStringView* ifRange = THttpRequest_FindHeader(self, "If-Range");
+    if (ifRange == NULL) {
+        return true;
+    }
+    if (ifRange->Length != 0 && ifRange->Data[0] == '"') {
+        return strcmp(ifRange->Data, etag) == 0;  // a weak tag never matches
+    }
+    time_t date;
+    return last_modified != 0 && ParseHttpDate(ifRange->Data, &date) && date == last_modified;
 }
 
-static bool ParseHeaderLine(char* line, struct THttpRequest* out) {
-    // TODO
-    if(strcmp(line, CONNECTION_KEEP_ALIVE) == 0)
-    {
-        out->should_keep_alive = true;
+// A non-empty run of digits, false on overflow
+static bool ParseOffset(const char** p, const char* end, uint64_t* result) {
+    const char* begin = *p;
+    uint64_t value = 0;
+    for (; *p != end && '0' <= **p && **p <= '9'; ++*p) {
+        if (value > (UINT64_MAX - 9) / 10) {
+            return false;
+        }
+        value = value * 10 + (**p - '0');
+    }
+    *result = value;
+    return *p != begin;
+}
+
+// One range-spec: "first-last", "first-" or "-suffix_length". Returns false if it is malformed,
+// `*satisfiable` tells whether it overlaps the file, `range` is clamped to it then.
+static bool ParseRangeSpec(const char* p, const char* end, size_t size, struct THttpByteRange* range, bool* satisfiable) {
+    uint64_t first, last;
+    if (p != end && *p == '-') {
+        ++p;
+        if (!ParseOffset(&p, end, &last) || p != end) {
+            return false;
+        }
+        *satisfiable = last != 0 && size != 0;
+        range->Offset = last < size ? size - last : 0;
+        range->Length = size - range->Offset;
+        return true;
+    }
+    if (!ParseOffset(&p, end, &first) || p == end || *p++ != '-') {
+        return false;
+    }
+    if (p == end) {
+        last = UINT64_MAX;
+    } else if (!ParseOffset(&p, end, &last) || p != end || last < first) {
+        return false;
+    }
+    *satisfiable = first < size;
+    if (*satisfiable) {
+        range->Offset = first;
+        range->Length = (last < size ? last + 1 : size) - first;
     }
     return true;
 }
 
+// Sorts the ranges by offset and merges those that overlap or touch
+static size_t CoalesceRanges(struct THttpByteRange* ranges, size_t count) {
+    for (size_t i = 1; i < count; ++i) {
+        const struct THttpByteRange range = ranges[i];
+        size_t j = i;
+        for (; j != 0 && ranges[j - 1].Offset > range.Offset; --j) {
+            ranges[j] = ranges[j - 1];
+        }
+        ranges[j] = range;
+    }
+    size_t merged = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const off_t end = ranges[i].Offset + ranges[i].Length;
+        if (merged != 0 && ranges[i].Offset <= ranges[merged - 1].Offset + (off_t)ranges[merged - 1].Length) {
+            struct THttpByteRange* last = &ranges[merged - 1];
+            if (end > last->Offset + (off_t)last->Length) {
+                last->Length = end - last->Offset;
+            }
+        } else {
+            ranges[merged++] = ranges[i];
+        }
+    }
+    return merged;
+}
+
+enum EHttpRangeResult THttpRequest_GetRanges(const struct THttpRequest* self, size_t size,
+                                             struct THttpByteRange* ranges, size_t* count) {
+    const struct TStringView* header = THttpRequest_FindHeader(self, "Range");
+    static const char UNIT[] = "bytes=";
+    if (header == NULL || header->Length < sizeof(UNIT) - 1 || strncasecmp(header->Data, UNIT, sizeof(UNIT) - 1) != 0) {
+        return RANGE_NONE;
+    }
+    const char* p = header->Data + sizeof(UNIT) - 1;
+    const char* end = header->Data + header->Length;
+    size_t specs = 0;
+    *count = 0;
+    while (p != end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* specEnd = comma != NULL ? comma : end;
+        const char* b = p;
+        const char* e = specEnd;
+        while (b != e && (*b == ' ' || *b == '\t')) {
+            ++b;
+        }
+        while (e != b && (e[-1] == ' ' || e[-1] == '\t')) {
+            --e;
+        }
+        p = comma != NULL ? comma + 1 : end;
+        if (b == e) {
+            continue;  // empty list elements are allowed
+        }
+        if (++specs > MAX_BYTE_RANGES) {
+            return RANGE_NONE;  // so many small ranges cost more than the whole file
+        }
+        bool satisfiable;
+        if (!ParseRangeSpec(b, e, size, &ranges[*count], &satisfiable)) {
+            return RANGE_NONE;
+        }
+        *count += satisfiable;
+    }
+    if (specs == 0) {
+        return RANGE_NONE;
+    }
+    if (*count == 0) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    *count = CoalesceRanges(ranges, *count);
+    return RANGE_SATISFIABLE;
+}
+
 /**
  * THttpRequestParser
  */
 
-struct THttpRequestParser {
-    struct TStringBuilder Line;
-    size_t LineNum;
-    bool Complete;
-    bool Invalid;
-};
-
 void THttpRequestParser_Init(struct THttpRequestParser* self) {
-    TStringBuilder_Init(&self->Line);
-    self->LineNum = 0;
+    self->HeadSize = 0;
+    self->Scanned = 0;
     self->Complete = false;
     self->Invalid = false;
+    self->TooLarge = false;
 }
 
-void THttpRequestParser_Destroy(struct THttpRequestParser* self) {
-    TStringBuilder_Destroy(&self->Line);
+// The first `a` or `b` in [p, end), `end` if there is none. The request target is scanned
+// for ' ' and '?' at once, 16 bytes per step where SSE2 is available.
+static char* FindEither(char* p, char* end, char a, char b) {
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        const __m128i chunk = _mm_loadu_si128((const __m128i*)p);
+        const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p != end && *p != a && *p != b) {
+        ++p;
+    }
+    return p;
 }
 
-static void ProcessLine(struct THttpRequestParser* parser, struct THttpRequest* request) {
-    // HTTP uses CR+LF (\r\n) to separate the lines
-    TStringBuilder_ChopSuffix(&parser->Line, "\r\n");
-    // fprintf(stderr, "Line [len=%zu]: %s\n", parser->Line.Length, parser->Line.Data);
+static size_t SkipEmptyLines(const char* data, size_t size) {
+    // RFC 9112 2.2: empty lines before the request line are ignored
+    size_t i = 0;
+    while (i < size && (data[i] == '\r' || data[i] == '\n')) {
+        ++i;
+    }
+    return i;
+}
 
-    if (parser->Line.Length == 0) {
-        // We do not know how to parse request body, if any:(
-        parser->Complete = true;
-    } 
-    else 
-    {
-        if (parser->LineNum == 0) 
-        {
-            if (!ParseRequestLine(parser->Line.Data, request)) 
-            {
-                parser->Invalid = true;
-            }
+// The end of the head: the first empty line after the request line, CRLF or a bare LF.
+// Returns the size of the head including that line, 0 if it has not been received yet.
+// `*scanned` is where the search has stopped, the next call resumes there.
+static size_t FindHeadEnd(const char* data, size_t size, size_t* scanned) {
+    const size_t start = SkipEmptyLines(data, size);
+    size_t i = *scanned > start ? *scanned : start;
+    while (i < size) {
+        const char* lf = memchr(data + i, '\n', size - i);  // vectorized by the C library
+        if (lf == NULL) {
+            break;
         }
-        else
-        {
-            if (!ParseHeaderLine(parser->Line.Data, request)) {
-                parser->Invalid = true;
-            }
+        i = lf - data;
+        if (i + 1 < size && data[i + 1] == '\n') {
+            return i + 2;
+        }
+        if (i + 2 < size && data[i + 1] == '\r' && data[i + 2] == '\n') {
+            return i + 3;
+        }
+        if (i + 2 >= size) {
+            *scanned = i;  // the following line has not arrived yet
+            return 0;
         }
+        ++i;
     }
+    *scanned = size;
+    return 0;
+}
 
-    TStringBuilder_Clear(&parser->Line);
+// [line, end) without the line break, trailing CR is cut off
+static char* TrimCR(char* line, char* end) {
+    return (end != line && end[-1] == '\r') ? end - 1 : end;
 }
 
-static size_t Consume(struct THttpRequestParser* parser, const char* data, size_t size, struct THttpRequest* request) {
-    size_t total = 0;
-    while (size != 0) {
-        const char* eolnPtr = memchr(data, '\n', size);
-        size_t partLen;
-        if (eolnPtr != NULL) {
-            partLen = eolnPtr - data + 1; // 1 for newline
-            TStringBuilder_AppendBuf(&parser->Line, data, partLen);
-            ProcessLine(parser, request);
-            parser->LineNum++;
-        } else {
-            partLen = size;
-            TStringBuilder_AppendBuf(&parser->Line, data, partLen);
+static struct TStringView Terminate(char* begin, char* end) {
+    *end = '\0';
+    return (struct TStringView){ begin, end - begin };
+}
+
+// "HTTP/1.1", the version is optional
+static bool ParseVersion(struct THttpRequest* request) {
+    const char* v = request->Version.Data;
+    if (request->Version.Length == 0) {
+        return true;
+    }
+    if (request->Version.Length != 8 || memcmp(v, "HTTP/", 5) != 0 ||
+        v[5] < '0' || v[5] > '9' || v[6] != '.' || v[7] < '0' || v[7] > '9') {
+        return false;
+    }
+    request->VersionMajor = v[5] - '0';
+    request->VersionMinor = v[7] - '0';
+    return true;
+}
+
+// "GET /path?query HTTP/1.1"
+static bool ParseRequestLine(char* line, char* end, struct THttpRequest* request) {
+    char* space = memchr(line, ' ', end - line);
+    if (space == NULL || space == line) {
+        return false;
+    }
+    request->Method = Terminate(line, space);
+
+    char* target = space + 1;
+    char* delim = FindEither(target, end, ' ', '?');
+    if (delim == target) {
+        return false;
+    }
+    char* targetEnd = delim;
+    if (delim != end && *delim == '?') {
+        char* query = delim + 1;
+        targetEnd = memchr(query, ' ', end - query);
+        if (targetEnd == NULL) {
+            targetEnd = end;
         }
-        data += partLen;
-        size -= partLen;
-        total += partLen;
-        if (parser->Complete) {
-            break;
+        request->QueryString = (struct TStringView){ query, targetEnd - query };
+    }
+    char* version = (targetEnd != end) ? targetEnd + 1 : end;
+    request->Version = (struct TStringView){ version, end - version };
+
+    request->Path = Terminate(target, delim);
+    if (request->QueryString.Data != NULL) {
+        request->QueryString = Terminate((char*)request->QueryString.Data, targetEnd);
+    }
+    request->Version = Terminate((char*)request->Version.Data, end);
+    return ParseVersion(request);
+}
+
+// "Name: value", the whitespace around the value is not a part of it
+static bool ParseHeaderLine(char* line, char* end, struct THttpRequest* request) {
+    char* colon = memchr(line, ':', end - line);
+    // RFC 9112 5.1: no whitespace between the name and the colon, obsolete line folding is rejected
+    if (colon == NULL || colon == line || colon[-1] == ' ' || colon[-1] == '\t' || *line == ' ' || *line == '\t') {
+        return false;
+    }
+    char* value = colon + 1;
+    while (value != end && (*value == ' ' || *value == '\t')) {
+        ++value;
+    }
+    char* valueEnd = end;
+    while (valueEnd != value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+        --valueEnd;
+    }
+
+    struct THttpHeader* header = &request->Headers[request->HeaderCount++];
+    header->Name = Terminate(line, colon);
+    header->Value = Terminate(value, valueEnd);
+    return true;
+}
+
+static bool IsPersistent(const struct THttpRequest* request) {
+    if (request->VersionMajor != 1 || THttpRequest_HasToken(request, "Connection", "close")) {
+        return false;
+    }
+    // HTTP/1.1 connections persist unless closed explicitly, HTTP/1.0 ones only when asked to
+    return request->VersionMinor >= 1 || THttpRequest_HasToken(request, "Connection", "keep-alive");
+}
+
+static void ParseHead(struct THttpRequestParser* parser, char* data, size_t size, struct THttpRequest* request) {
+    char* p = data + SkipEmptyLines(data, size);
+    char* end = data + size;
+    bool isRequestLine = true;
+    while (p != end) {
+        char* lf = memchr(p, '\n', end - p);
+        char* lineEnd = TrimCR(p, lf);
+        if (lineEnd == p) {
+            break;  // the empty line that ends the head
         }
+        if (!isRequestLine && request->HeaderCount == MAX_REQUEST_HEADERS) {
+            parser->TooLarge = true;
+            return;
+        }
+        if (!(isRequestLine ? ParseRequestLine(p, lineEnd, request) : ParseHeaderLine(p, lineEnd, request))) {
+            parser->Invalid = true;
+            return;
+        }
+        isRequestLine = false;
+        p = lf + 1;
+    }
+    request->should_keep_alive = IsPersistent(request);
+    parser->Complete = true;
+}
+
+size_t THttpRequestParser_Parse(struct THttpRequestParser* parser, char* data, size_t size, struct THttpRequest* request) {
+    parser->HeadSize = size < MAX_REQUEST_HEAD_SIZE ? size : MAX_REQUEST_HEAD_SIZE;
+    const size_t headSize = FindHeadEnd(data, size, &parser->Scanned);
+    if (headSize == 0 ? size >= MAX_REQUEST_HEAD_SIZE : headSize > MAX_REQUEST_HEAD_SIZE) {
+        // a slow or hostile client must not make the server buffer without bound
+        parser->TooLarge = true;
+        return 0;
+    }
+    if (headSize != 0) {
+        parser->HeadSize = headSize;
+        ParseHead(parser, data, headSize, request);
+    }
+    return headSize;
+}
+
+/**
+ * THttpInputBuffer
+ */
+
+void THttpInputBuffer_Init(struct THttpInputBuffer* self) {
+    self->Data = NULL;
+    self->Begin = 0;
+    self->End = 0;
+}
+
+void THttpInputBuffer_Destroy(struct THttpInputBuffer* self) {
+    free(self->Data);
+    THttpInputBuffer_Init(self);
+}
+
+void THttpInputBuffer_Clear(struct THttpInputBuffer* self) {
+    self->Begin = 0;
+    self->End = 0;
+}
+
+bool THttpInputBuffer_HasData(const struct THttpInputBuffer* self) {
+    return self->Begin != self->End;
+}
+
+bool THttpInputBuffer_HasCompleteHead(const struct THttpInputBuffer* self) {
+    size_t scanned = 0;
+    return FindHeadEnd(self->Data + self->Begin, self->End - self->Begin, &scanned) != 0;
+}
+
+// Moves the unconsumed bytes to the front, so the whole tail is free for the next receive
+static bool PrepareSpace(struct THttpInputBuffer* self) {
+    if (self->Data == NULL && (self->Data = malloc(INPUT_BUFFER_SIZE)) == NULL) {
+        errno = ENOMEM;
+        return false;
+    }
+    if (self->Begin != 0) {
+        memmove(self->Data, self->Data + self->Begin, self->End - self->Begin);
+        self->End -= self->Begin;
+        self->Begin = 0;
+    }
+    return true;
+}
+
+ssize_t THttpInputBuffer_Recv(struct THttpInputBuffer* self, int sockfd) {
+    if (!PrepareSpace(self)) {
+        return -1;
+    }
+    // a head still incomplete is shorter than MAX_REQUEST_HEAD_SIZE, so at least RECV_BUF_SIZE is free here
+    ssize_t ret = recv(sockfd, self->Data + self->End, INPUT_BUFFER_SIZE - self->End, 0);
+    if (ret > 0) {
+        self->End += ret;
+    }
+    return ret;
+}
+
+bool THttpInputBuffer_Append(struct THttpInputBuffer* self, const char* data, size_t size) {
+    if (!PrepareSpace(self) || INPUT_BUFFER_SIZE - self->End < size) {
+        return false;
     }
-    return total;
+    memcpy(self->Data + self->End, data, size);
+    self->End += size;
+    return true;
 }
 
-http_receive_result_t THttpRequest_Receive(struct THttpRequest* self, int sockfd, bool connection_is_kept_alive)
+bool THttpInputBuffer_Feed(struct THttpInputBuffer* self, struct THttpRequestParser* parser, struct THttpRequest* request) {
+    const bool done = parser->Complete || parser->Invalid || parser->TooLarge;
+    if (!done && self->Begin != self->End) {
+        // the head stays where it is until the next request is read: the request points into it
+        self->Begin += THttpRequestParser_Parse(parser, self->Data + self->Begin, self->End - self->Begin, request);
+    }
+    return parser->Complete || parser->Invalid || parser->TooLarge;
+}
+
+/**
+ * Blocking receive
+ */
+
+http_receive_result_t THttpRequest_Receive(struct THttpRequest* self, int sockfd, struct THttpInputBuffer* input,
+                                           bool connection_is_kept_alive)
 {
-    char buf[RECV_BUF_SIZE];
     http_receive_result_t result = RECEIVE_RESULT_SUCCESS;
 
     struct THttpRequestParser parser;
     THttpRequestParser_Init(&parser);
     bool connection_is_still_alive = true;
+    // The whole head has to arrive within HEADER_READ_TIMEOUT of its first byte,
+    // so a client trickling a byte per poll() timeout can not hold the thread forever.
+    uint64_t header_deadline = 0;
 
-    do 
+    // a pipelined request may already be buffered, entirely or in part
+    if (THttpInputBuffer_HasData(input))
+    {
+        header_deadline = MonotonicMs() + HEADER_READ_TIMEOUT;
+        if (THttpInputBuffer_Feed(input, &parser, self))
+        {
+            connection_is_still_alive = false;
+        }
+    }
+
+    while (connection_is_still_alive)
     {
         if(connection_is_kept_alive)
         {
+            int timeout = TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS;
+            if (header_deadline != 0)
+            {
+                uint64_t now = MonotonicMs();
+                timeout = (now < header_deadline) ? (int)(header_deadline - now) : 0;
+            }
+
             struct pollfd poll_file_descriptor;
             poll_file_descriptor.fd = sockfd; // your socket handler 
             poll_file_descriptor.events = POLLIN;
-            switch(poll(&poll_file_descriptor, 1, TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS)) // nfds = 1
+            switch(poll(&poll_file_descriptor, 1, timeout)) // nfds = 1
             {
                 case -1:
                 {
@@ -176,6 +575,10 @@ http_receive_result_t THttpRequest_Receive(struct THttpRequest* self, int sockfd
                 }
                 default:
                 {
+                    if (poll_file_descriptor.revents == POLLERR && ReapZeroCopy(sockfd) != 0)
+                    {
+                        continue;  // only the completions of zero-copy sends, the client has sent nothing
+                    }
                     result = RECEIVE_RESULT_SUCCESS;
                 }
             }
@@ -183,7 +586,7 @@ http_receive_result_t THttpRequest_Receive(struct THttpRequest* self, int sockfd
 
         if(connection_is_still_alive)
         {
-            ssize_t ret = recv(sockfd, buf, RECV_BUF_SIZE, 0);
+            ssize_t ret = THttpInputBuffer_Recv(input, sockfd);
             if (-1 == ret) {
                 if (errno == EINTR || errno == EAGAIN) {
                     continue;
@@ -198,21 +601,24 @@ http_receive_result_t THttpRequest_Receive(struct THttpRequest* self, int sockfd
                 break;
             }
 
-            const size_t consumed = Consume(&parser, buf, ret, self);
-            if (consumed != (size_t)ret) {
-                parser.Invalid = true;
+            if (header_deadline == 0) {
+                header_deadline = MonotonicMs() + HEADER_READ_TIMEOUT;
             }
-            if (parser.Complete) {
+
+            if (THttpInputBuffer_Feed(input, &parser, self)) {
                 break;
             }
         }
-    }while (connection_is_still_alive);
+    }
 
-    if (parser.Invalid) 
+    if (parser.TooLarge)
+    {
+        result = RECEIVE_RESULT_HEADERS_TOO_LARGE;
+    }
+    else if (parser.Invalid) 
     {
         result = RECEIVE_RESULT_BAD_REQUEST;
     }
 
-    THttpRequestParser_Destroy(&parser);
     return result;
 }
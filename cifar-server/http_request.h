@@ -1,14 +1,39 @@
 #pragma once
 
-#include "stringbuilder.h"
+#include "config.h"
+#include "stringutils.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
 
+struct THttpByteRange;
+
+struct THttpHeader {
+    struct TStringView Name;
+    struct TStringView Value;  // without the surrounding whitespace
+};
+
+// Every field is a slice of the buffer the head was parsed from, valid until the next request
+// is read into it. The slices are '\0'-terminated in place, so they are C strings as well.
+// An absent query string has Data == NULL, an absent version is empty.
 struct THttpRequest {
-    char* Method;
-    char* Path;
-    char* QueryString;
-    bool should_keep_alive;
+    struct TStringView Method;
+    struct TStringView Path;
+    struct TStringView QueryString;
+    struct TStringView Version;
+    int VersionMajor;  // a request line without a version is taken for HTTP/1.0
+    int VersionMinor;
+    struct THttpHeader Headers[MAX_REQUEST_HEADERS];
+    size_t HeaderCount;
+    bool should_keep_alive;  // the client wants a persistent connection (RFC 9112 9.3)
+};
+
+enum EHttpRangeResult {
+    RANGE_NONE,  // no Range header, or one to ignore: malformed, not in bytes or with too many ranges
+    RANGE_SATISFIABLE,
+    RANGE_NOT_SATISFIABLE,  // none of the ranges overlaps the file, answered with 416
 };
 
 typedef enum http_receive_result
@@ -17,8 +42,67 @@ typedef enum http_receive_result
     RECEIVE_RESULT_DISCONNECTED,
     RECEIVE_RESULT_ERROR,
     RECEIVE_RESULT_BAD_REQUEST,
+    RECEIVE_RESULT_HEADERS_TOO_LARGE,
 }http_receive_result_t;
 
+struct THttpRequestParser {
+    size_t HeadSize;  // bytes of the request head received so far
+    size_t Scanned;  // of them, searched for the end of the head already
+    bool Complete;
+    bool Invalid;
+    bool TooLarge;  // the head exceeds MAX_REQUEST_HEAD_SIZE or MAX_REQUEST_HEADERS, answered with 431
+};
+
+// Bytes received on a connection and not consumed by a request head yet. A pipelining client
+// sends several requests back to back: whatever follows the current head is kept for the next one.
+// The head being received stays in place, the request is parsed right there.
+// The INPUT_BUFFER_SIZE bytes of storage are allocated on the first receive.
+struct THttpInputBuffer {
+    char* Data;
+    size_t Begin;
+    size_t End;
+};
+
+void THttpInputBuffer_Init(struct THttpInputBuffer* self);
+void THttpInputBuffer_Destroy(struct THttpInputBuffer* self);
+void THttpInputBuffer_Clear(struct THttpInputBuffer* self);
+bool THttpInputBuffer_HasData(const struct THttpInputBuffer* self);
+// True if a whole request head is buffered, so it can be answered without waiting for the client
+bool THttpInputBuffer_HasCompleteHead(const struct THttpInputBuffer* self);
+// Receives into the free space, the result is that of recv(). Fails with ENOMEM if the storage can not be allocated.
+ssize_t THttpInputBuffer_Recv(struct THttpInputBuffer* self, int sockfd);
+// Keeps bytes received elsewhere (io_uring buffers), returns false if they do not fit
+bool THttpInputBuffer_Append(struct THttpInputBuffer* self, const char* data, size_t size);
+// Feeds the buffered bytes to the parser up to the end of the request head,
+// returns true once the head is complete or known to be bad
+bool THttpInputBuffer_Feed(struct THttpInputBuffer* self, struct THttpRequestParser* parser, struct THttpRequest* request);
+
 void THttpRequest_Init(struct THttpRequest* self);
-http_receive_result_t THttpRequest_Receive(struct THttpRequest* self, int sockfd, bool connection_is_kept_alive);
-void THttpRequest_Destroy(struct THttpRequest* self);
+// Reads the next request head, the bytes received past it stay in `input`,
+// the request points into `input` as well
+http_receive_result_t THttpRequest_Receive(struct THttpRequest* self, int sockfd, struct THttpInputBuffer* input,
+                                           bool connection_is_kept_alive);
+// NULL if the request has no such header, the name is case-insensitive
+const struct TStringView* THttpRequest_FindHeader(const struct THttpRequest* self, const char* name);
+// True if any of the `name` headers lists `token`, like "close" in "Connection: Upgrade, close"
+bool THttpRequest_HasToken(const struct THttpRequest* self, const char* name, const char* token);
+// True if the client's copy is current (RFC 9110 13.1.2, 13.1.3): If-None-Match lists `etag`
+// (weak comparison) or "*", or, without If-None-Match, the resource has not changed since
+// If-Modified-Since. `etag` is quoted, an empty one or a zero `last_modified` never match.
+bool THttpRequest_IsNotModified(const struct THttpRequest* self, const char* etag, time_t last_modified);
+// False if If-Range names another version of the resource than `etag` (strong comparison)
+// or `last_modified` (exact match), the whole of it is sent then instead of the ranges
+bool THttpRequest_IsRangeCurrent(const struct THttpRequest* self, const char* etag, time_t last_modified);
+// Parses the Range header against a file of `size` bytes (RFC 9110 14.2). The satisfiable ranges
+// are stored in ascending order, overlapping and adjacent ones merged, up to MAX_BYTE_RANGES of them.
+enum EHttpRangeResult THttpRequest_GetRanges(const struct THttpRequest* self, size_t size,
+                                             struct THttpByteRange* ranges, size_t* count);
+
+void THttpRequestParser_Init(struct THttpRequestParser* self);
+// `data` holds everything received since the start of the head. It is parsed in place: the
+// delimiters are overwritten with '\0' and the request points into `data`. While the head is
+// incomplete, call again with the same start and more bytes, only the new ones are scanned.
+// Returns the size of the head once its end is found (the request may still be Invalid),
+// 0 before that or once the head has grown beyond MAX_REQUEST_HEAD_SIZE.
+// Allocates nothing.
+size_t THttpRequestParser_Parse(struct THttpRequestParser* self, char* data, size_t size, struct THttpRequest* request);
@@ -8,12 +8,20 @@
 #include <assert.h>
 #include <time.h>
 #include "resources.h"
+#include "stringutils.h"
 
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define CRLF "\r\n"
-#define CONNECTION_KEEP_ALIVE "Connection: keep-alive"
+#define FILE_PART_HEADER_SIZE 256  // the content types are short static strings
+#define CHUNK_SIZE_DIGITS 8
+#define CHUNK_SIZE_PLACEHOLDER "00000000"
+#define CHUNK_SIZE_HEADER_LENGTH (CHUNK_SIZE_DIGITS + 2)
+#define HEADER_PREFIX_SIZE 128
 #define DEBUG_MODE HTTP_RESPONSE_DEBUG_MODE
 
 #if(DEBUG_MODE == 1)
@@ -25,18 +33,36 @@
 #endif
 
 
+const char CONTENT_TYPE_HTML[] = "text/html";
+const char CONTENT_TYPE_PLAIN[] = "text/plain";
+const char CONTENT_TYPE_BMP[] = "image/bmp";
+const char CONTENT_TYPE_SVG[] = "image/svg+xml";
+const char CONTENT_TYPE_CSS[] = "text/css";
+
 const char* GetReasonPhrase(enum EHttpCode code) {
     switch (code) {
         case HTTP_OK:
             return "OK";
+        case HTTP_PARTIAL_CONTENT:
+            return "Partial Content";
+        case HTTP_NOT_MODIFIED:
+            return "Not Modified";
         case HTTP_BAD_REQUEST:
             return "Bad Request";
         case HTTP_NOT_FOUND:
             return "Not Found";
         case HTTP_METHOD_NOT_ALLOWED:
             return "Method Not Allowed";
+        case HTTP_RANGE_NOT_SATISFIABLE:
+            return "Range Not Satisfiable";
+        case HTTP_TOO_MANY_REQUESTS:
+            return "Too Many Requests";
+        case HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE:
+            return "Request Header Fields Too Large";
         case HTTP_INTERNAL_SERVER_ERROR:
             return "Internal Server Error";
+        case HTTP_VERSION_NOT_SUPPORTED:
+            return "HTTP Version Not Supported";
         default:
             return "";
     }
@@ -48,71 +74,426 @@ void THttpResponse_Init(struct THttpResponse* self) {
     self->should_use_sendfile = false;
     self->file_path_requested = NULL;
     self->sent_file_size = 0;
+    self->RangeCount = 0;
+    self->Boundary = 0;
+    self->BodyStream = NULL;
     self->file_modification_time = 0;
+    self->ETag[0] = '\0';
+    self->CacheControl = NULL;
+    self->Link = NULL;
+    self->KeepAlive = false;
+    self->KeepAliveMax = 0;
     TStringBuilder_Init(&self->Body);
+    TRope_Init(&self->BodyRope);
+    self->BodyCached = false;
+}
+
+void THttpResponse_SetNotModified(struct THttpResponse* self) {
+    self->Code = HTTP_NOT_MODIFIED;
+    self->should_use_sendfile = false;
+    self->sent_file_size = 0;
+    TStringBuilder_Clear(&self->Body);
+    TRope_Clear(&self->BodyRope);
+    self->BodyCached = false;
+}
+
+void THttpResponse_SetRanges(struct THttpResponse* self, const struct THttpByteRange* ranges, size_t count) {
+    static uint64_t nextBoundary = 0;
+    assert(self->should_use_sendfile && count <= MAX_BYTE_RANGES);
+    self->Code = HTTP_PARTIAL_CONTENT;
+    memcpy(self->Ranges, ranges, count * sizeof(*ranges));
+    self->RangeCount = count;
+    if (count > 1) {
+        // the boundary must not occur in the parts: consecutive ones are spread by an odd multiplier
+        // from a per-process seed, so a file can not be made to contain the boundary it is sent with
+        if (__atomic_load_n(&nextBoundary, __ATOMIC_RELAXED) == 0) {
+            __atomic_store_n(&nextBoundary, ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid(), __ATOMIC_RELAXED);
+        }
+        self->Boundary = __atomic_add_fetch(&nextBoundary, 1, __ATOMIC_RELAXED) * 0x9E3779B97F4A7C15ULL;
+    }
+}
+
+// Like snprintf(): returns the full length, writes at most `size` bytes of it
+static int FormatFilePartHeader(const struct THttpResponse* self, size_t index, char* buf, size_t size) {
+    if (index == self->RangeCount) {
+        return snprintf(buf, size, CRLF "--%016" PRIx64 "--" CRLF, self->Boundary);
+    }
+    const struct THttpByteRange* range = &self->Ranges[index];
+    return snprintf(buf, size, CRLF "--%016" PRIx64 CRLF "%s%s%s" "Content-Range: bytes %lld-%lld/%zu" CRLF CRLF,
+                    self->Boundary,
+                    self->ContentType ? "Content-Type: " : "", self->ContentType ? self->ContentType : "",
+                    self->ContentType ? CRLF : "",
+                    (long long)range->Offset, (long long)(range->Offset + range->Length - 1), self->sent_file_size);
 }
 
-bool THttpResponse_Send(struct THttpResponse* self, int sockfd) {
-    size_t contentLength = self->Body.Length;
+size_t THttpResponse_GetContentLength(const struct THttpResponse* self) {
     if(self->should_use_sendfile)
     {
-        contentLength = self->sent_file_size;
+        if (self->RangeCount == 1) {
+            return self->Ranges[0].Length;
+        }
+        if (self->RangeCount > 1) {
+            size_t length = FormatFilePartHeader(self, self->RangeCount, NULL, 0);
+            for (size_t i = 0; i < self->RangeCount; ++i) {
+                length += FormatFilePartHeader(self, i, NULL, 0) + self->Ranges[i].Length;
+            }
+            return length;
+        }
+        return self->sent_file_size;
     }
+    return self->Body.Length + self->BodyRope.Length;
+}
 
-    struct TStringBuilder headers;
-    TStringBuilder_Init(&headers);
+size_t THttpResponse_GetFilePartCount(const struct THttpResponse* self) {
+    if (!self->should_use_sendfile) {
+        return 0;
+    }
+    return self->RangeCount != 0 ? self->RangeCount : 1;
+}
 
-    TStringBuilder_Sprintf(&headers, "HTTP/1.1 %d %s" CRLF, self->Code, GetReasonPhrase(self->Code));
-    TStringBuilder_Sprintf(&headers, CONNECTION_KEEP_ALIVE CRLF);
-    TStringBuilder_Sprintf(&headers, CUSTOM_LINE_FOR_WARMUP CRLF);
+struct THttpByteRange THttpResponse_GetFilePart(const struct THttpResponse* self, size_t index) {
+    if (self->RangeCount == 0) {
+        return (struct THttpByteRange){ 0, self->sent_file_size };
+    }
+    return self->Ranges[index];
+}
 
-    if(self->should_use_sendfile)
-    {
-        DEBUG_PRINT("adding mtime header from %li\n", self->file_modification_time);
-        char time_string_buf[TIME_BUFFER_SIZE];
-        memset(time_string_buf, 0, sizeof(char) * TIME_BUFFER_SIZE);
-        struct tm tm = *gmtime(&self->file_modification_time);
-        strftime(time_string_buf, sizeof(time_string_buf) , "%a, %d %b %Y %H:%M:%S %Z", &tm);
-        
-        DEBUG_PRINT("will add time header: %s\n", time_string_buf);
-        TStringBuilder_Sprintf(&headers, "Date: %s" CRLF, time_string_buf);
+void THttpResponse_FormatFilePartHeader(const struct THttpResponse* self, size_t index, struct TStringBuilder* out) {
+    if (self->RangeCount > 1) {
+        char buf[FILE_PART_HEADER_SIZE];
+        const int length = FormatFilePartHeader(self, index, buf, sizeof(buf));
+        assert(length < (int)sizeof(buf));
+        TStringBuilder_AppendBuf(out, buf, length);
     }
+}
+
+static void ReleaseBodyStream(struct THttpResponse* self) {
+    if (self->BodyStream != NULL) {
+        self->BodyStream->Destroy(self->BodyStream);
+        self->BodyStream = NULL;
+    }
+}
 
-    if (self->ContentType) {
-        TStringBuilder_Sprintf(&headers, "Content-Type: %s" CRLF, self->ContentType);
+enum EBodyStreamResult THttpResponse_AppendChunk(struct THttpResponse* self, struct TStringBuilder* out) {
+    // the size goes in front of the piece, it is generated right behind a placeholder
+    const size_t at = out->Length;
+    enum EBodyStreamResult result = BODY_STREAM_MORE;
+    while (result == BODY_STREAM_MORE && out->Length == at) {
+        TStringBuilder_AppendCStr(out, CHUNK_SIZE_PLACEHOLDER CRLF);
+        result = self->BodyStream->Generate(self->BodyStream, out);
+        const size_t size = out->Length - at - CHUNK_SIZE_HEADER_LENGTH;
+        if (size == 0 || result == BODY_STREAM_FAILED) {
+            TStringBuilder_Truncate(out, at);  // a chunk of size 0 would end the body
+        } else {
+            // leading zeros are allowed in the chunk size (RFC 9112 7.1), so it fills the placeholder
+            size_t rest = size;
+            for (int i = CHUNK_SIZE_DIGITS - 1; i >= 0; --i, rest >>= 4) {
+                out->Data[at + i] = "0123456789abcdef"[rest & 0xF];
+            }
+            TStringBuilder_AppendCStr(out, CRLF);
+        }
+    }
+    if (result == BODY_STREAM_END) {
+        TStringBuilder_AppendCStr(out, "0" CRLF CRLF);
     }
-    TStringBuilder_Sprintf(&headers, "Content-Length: %zu" CRLF, contentLength);
-    TStringBuilder_AppendCStr(&headers, CRLF);
+    if (result != BODY_STREAM_MORE) {
+        ReleaseBodyStream(self);
+    }
+    return result;
+}
 
-    // fprintf(stderr, "RESPONSE {%s}\n", headers.Data);
+bool THttpResponse_DrainBodyStream(struct THttpResponse* self) {
+    enum EBodyStreamResult result = BODY_STREAM_MORE;
+    while (result == BODY_STREAM_MORE) {
+        result = self->BodyStream->Generate(self->BodyStream, &self->Body);
+    }
+    ReleaseBodyStream(self);
+    return result == BODY_STREAM_END;
+}
 
-    bool result = true;
+static char* FormatTwoDigits(char* p, int value) {
+    *p++ = (char)('0' + value / 10);
+    *p++ = (char)('0' + value % 10);
+    return p;
+}
 
-    if (!SendAll(sockfd, headers.Data, headers.Length)) {
-        result = false;
+size_t FormatHttpDate(time_t time, char* buf, size_t size) {
+    static const char DAYS[] = "SunMonTueWedThuFriSat";
+    static const char MONTHS[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    if (size < HTTP_DATE_SIZE || gmtime_r(&time, &tm) == NULL || tm.tm_year + 1900 > 9999) {
+        return 0;
     }
+    // without strftime(): the names must not follow the locale anyway
+    char* p = buf;
+    memcpy(p, DAYS + 3 * tm.tm_wday, 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    p = FormatTwoDigits(p, tm.tm_mday);
+    *p++ = ' ';
+    memcpy(p, MONTHS + 3 * tm.tm_mon, 3);
+    p += 3;
+    *p++ = ' ';
+    p = FormatTwoDigits(p, (tm.tm_year + 1900) / 100);
+    p = FormatTwoDigits(p, (tm.tm_year + 1900) % 100);
+    *p++ = ' ';
+    p = FormatTwoDigits(p, tm.tm_hour);
+    *p++ = ':';
+    p = FormatTwoDigits(p, tm.tm_min);
+    *p++ = ':';
+    p = FormatTwoDigits(p, tm.tm_sec);
+    memcpy(p, " GMT", sizeof(" GMT"));
+    return HTTP_DATE_SIZE - 1;
+}
 
-    if (result && self->Body.Length != 0) {
-        if (!SendAll(sockfd, self->Body.Data, self->Body.Length)) {
-            result = false;
+const char* GetHttpDate(void) {
+    static __thread time_t formattedSecond = -1;
+    static __thread char date[HTTP_DATE_SIZE];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != formattedSecond) {
+        FormatHttpDate(now.tv_sec, date, sizeof(date));
+        formattedSecond = now.tv_sec;
+    }
+    return date;
+}
+
+// Every response starts with the status line, Server and Content-Type, precomputed for the
+// statuses and the content types the server uses
+static const enum EHttpCode PREFIX_CODES[] = {
+    HTTP_OK, HTTP_PARTIAL_CONTENT, HTTP_NOT_MODIFIED, HTTP_BAD_REQUEST, HTTP_NOT_FOUND, HTTP_METHOD_NOT_ALLOWED,
+    HTTP_RANGE_NOT_SATISFIABLE, HTTP_TOO_MANY_REQUESTS, HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE,
+    HTTP_INTERNAL_SERVER_ERROR, HTTP_VERSION_NOT_SUPPORTED,
+};
+static const char* const PREFIX_CONTENT_TYPES[] = {
+    NULL, CONTENT_TYPE_HTML, CONTENT_TYPE_PLAIN, CONTENT_TYPE_BMP, CONTENT_TYPE_SVG, CONTENT_TYPE_CSS,
+};
+#define PREFIX_CODE_COUNT (sizeof(PREFIX_CODES) / sizeof(PREFIX_CODES[0]))
+#define PREFIX_CONTENT_TYPE_COUNT (sizeof(PREFIX_CONTENT_TYPES) / sizeof(PREFIX_CONTENT_TYPES[0]))
+
+static char g_header_prefixes[PREFIX_CODE_COUNT][PREFIX_CONTENT_TYPE_COUNT][HEADER_PREFIX_SIZE];
+static size_t g_header_prefix_lengths[PREFIX_CODE_COUNT][PREFIX_CONTENT_TYPE_COUNT];
+static pthread_once_t g_header_prefixes_once = PTHREAD_ONCE_INIT;
+
+static void AppendHeaderPrefixSlow(struct TStringBuilder* headers, enum EHttpCode code, const char* contentType) {
+    TStringBuilder_Sprintf(headers, "HTTP/1.1 %d %s" CRLF CUSTOM_LINE_FOR_WARMUP CRLF, code, GetReasonPhrase(code));
+    if (contentType) {
+        TStringBuilder_Sprintf(headers, "Content-Type: %s" CRLF, contentType);
+    }
+}
+
+static void BuildHeaderPrefixes(void) {
+    struct TStringBuilder prefix;
+    TStringBuilder_Init(&prefix);
+    for (size_t i = 0; i < PREFIX_CODE_COUNT; ++i) {
+        for (size_t j = 0; j < PREFIX_CONTENT_TYPE_COUNT; ++j) {
+            TStringBuilder_Clear(&prefix);
+            AppendHeaderPrefixSlow(&prefix, PREFIX_CODES[i], PREFIX_CONTENT_TYPES[j]);
+            assert(prefix.Length < HEADER_PREFIX_SIZE);
+            memcpy(g_header_prefixes[i][j], prefix.Data, prefix.Length);
+            g_header_prefix_lengths[i][j] = prefix.Length;
         }
     }
+    TStringBuilder_Destroy(&prefix);
+}
 
-    if(result && self->should_use_sendfile)
+static void AppendHeaderPrefix(struct TStringBuilder* headers, enum EHttpCode code, const char* contentType) {
+    pthread_once(&g_header_prefixes_once, BuildHeaderPrefixes);
+    for (size_t i = 0; i < PREFIX_CODE_COUNT; ++i) {
+        if (PREFIX_CODES[i] != code) {
+            continue;
+        }
+        for (size_t j = 0; j < PREFIX_CONTENT_TYPE_COUNT; ++j) {
+            if (PREFIX_CONTENT_TYPES[j] == contentType) {
+                TStringBuilder_AppendBuf(headers, g_header_prefixes[i][j], g_header_prefix_lengths[i][j]);
+                return;
+            }
+        }
+        break;
+    }
+    // a multipart type or a string of its own
+    AppendHeaderPrefixSlow(headers, code, contentType);
+}
+
+const char* THttpResponse_GetContentType(const struct THttpResponse* self, char* buf, size_t size) {
+    if (self->RangeCount > 1) {
+        snprintf(buf, size, "multipart/byteranges; boundary=%016" PRIx64, self->Boundary);
+        return buf;
+    }
+    return self->ContentType;
+}
+
+bool THttpResponse_FormatContentRange(const struct THttpResponse* self, char* buf, size_t size) {
+    if (self->RangeCount == 1) {
+        const struct THttpByteRange* range = &self->Ranges[0];
+        snprintf(buf, size, "bytes %lld-%lld/%zu", (long long)range->Offset,
+                 (long long)(range->Offset + range->Length - 1), self->sent_file_size);
+        return true;
+    }
+    if (self->Code == HTTP_RANGE_NOT_SATISFIABLE) {
+        snprintf(buf, size, "bytes */%zu", self->sent_file_size);
+        return true;
+    }
+    return false;
+}
+
+void THttpResponse_FormatHeaders(const struct THttpResponse* self, struct TStringBuilder* headers) {
+    const size_t contentLength = THttpResponse_GetContentLength(self);
+
+    char value[CONTENT_TYPE_SIZE];
+    // no body follows a 304, its headers describe the representation the client has
+    AppendHeaderPrefix(headers, self->Code,
+                       self->Code != HTTP_NOT_MODIFIED ? THttpResponse_GetContentType(self, value, sizeof(value)) : NULL);
+    TStringBuilder_AppendCStr(headers, "Date: ");
+    TStringBuilder_AppendBuf(headers, GetHttpDate(), HTTP_DATE_SIZE - 1);
+    TStringBuilder_AppendCStr(headers, CRLF);
+    if (self->KeepAlive) {
+        TStringBuilder_AppendCStr(headers, "Connection: keep-alive" CRLF "Keep-Alive: timeout=");
+        TStringBuilder_AppendUInt(headers, TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS / 1000);
+        TStringBuilder_AppendCStr(headers, ", max=");
+        TStringBuilder_AppendUInt(headers, self->KeepAliveMax);
+        TStringBuilder_AppendCStr(headers, CRLF);
+    } else {
+        TStringBuilder_AppendCStr(headers, "Connection: close" CRLF);
+    }
+
+    if (self->file_modification_time != 0)
     {
-        assert(self->file_path_requested != NULL);
-        int sent_file_fd = open(self->file_path_requested, O_RDONLY);
-        DEBUG_PRINT("sending file %s\n", self->file_path_requested);
-        
-        if (sent_file_fd == -1) 
-        {
-            perror("open file:");
-            printf("fd is -1\n");
-            return false;
+        DEBUG_PRINT("adding mtime header from %li\n", self->file_modification_time);
+        char date[HTTP_DATE_SIZE];
+        TStringBuilder_AppendCStr(headers, "Last-Modified: ");
+        TStringBuilder_AppendBuf(headers, date, FormatHttpDate(self->file_modification_time, date, sizeof(date)));
+        TStringBuilder_AppendCStr(headers, CRLF);
+    }
+    if (self->ETag[0] != '\0') {
+        TStringBuilder_AppendCStr(headers, "ETag: ");
+        TStringBuilder_AppendCStr(headers, self->ETag);
+        TStringBuilder_AppendCStr(headers, CRLF);
+    }
+    if (self->CacheControl) {
+        TStringBuilder_AppendCStr(headers, "Cache-Control: ");
+        TStringBuilder_AppendCStr(headers, self->CacheControl);
+        TStringBuilder_AppendCStr(headers, CRLF);
+    }
+    if (self->Link) {
+        TStringBuilder_AppendCStr(headers, "Link: ");
+        TStringBuilder_AppendCStr(headers, self->Link);
+        TStringBuilder_AppendCStr(headers, CRLF);
+    }
+
+    if (self->Code == HTTP_TOO_MANY_REQUESTS) {
+        TStringBuilder_AppendCStr(headers, "Retry-After: ");
+        TStringBuilder_AppendUInt(headers, RATE_LIMIT_RETRY_AFTER);
+        TStringBuilder_AppendCStr(headers, CRLF);
+    }
+    if (self->should_use_sendfile) {
+        TStringBuilder_AppendCStr(headers, "Accept-Ranges: bytes" CRLF);
+    }
+    if (THttpResponse_FormatContentRange(self, value, sizeof(value))) {
+        TStringBuilder_AppendCStr(headers, "Content-Range: ");
+        TStringBuilder_AppendCStr(headers, value);
+        TStringBuilder_AppendCStr(headers, CRLF);
+    }
+    if (self->Code == HTTP_NOT_MODIFIED) {
+        TStringBuilder_AppendCStr(headers, CRLF);
+        return;
+    }
+    if (self->BodyStream != NULL) {
+        TStringBuilder_AppendCStr(headers, "Transfer-Encoding: chunked" CRLF CRLF);
+        return;
+    }
+    TStringBuilder_AppendCStr(headers, "Content-Length: ");
+    TStringBuilder_AppendUInt(headers, contentLength);
+    TStringBuilder_AppendCStr(headers, CRLF CRLF);
+}
+
+// The headers and the body leave in one sendmsg(), and with a file part they are followed by
+// sendfile() with MSG_MORE in between, so a response is one train of full segments without TCP_CORK
+static bool SendWithFile(struct THttpResponse* self, int sockfd, bool more, struct TStringBuilder* headers) {
+    assert(self->file_path_requested != NULL);
+    int sent_file_fd = open(self->file_path_requested, O_RDONLY);
+    DEBUG_PRINT("sending file %s\n", self->file_path_requested);
+    if (sent_file_fd == -1) {
+        perror("open file:");
+        return false;
+    }
+
+    bool result = true;
+    struct TStringBuilder delimiter;
+    TStringBuilder_Init(&delimiter);
+    const size_t count = THttpResponse_GetFilePartCount(self);
+    for (size_t i = 0; result && i <= count; ++i) {
+        // the multipart delimiter before every part goes with whatever precedes the part
+        TStringBuilder_Clear(&delimiter);
+        THttpResponse_FormatFilePartHeader(self, i, &delimiter);
+        struct iovec iov[] = {
+            { .iov_base = headers->Data, .iov_len = i == 0 ? headers->Length : 0 },
+            { .iov_base = self->Body.Data, .iov_len = i == 0 ? self->Body.Length : 0 },
+            { .iov_base = delimiter.Data, .iov_len = delimiter.Length },
+        };
+        result = SendAllv(sockfd, iov, sizeof(iov) / sizeof(iov[0]), more || i != count);
+        if (result && i != count) {
+            const struct THttpByteRange part = THttpResponse_GetFilePart(self, i);
+            result = send_with_sendfile(sockfd, sent_file_fd, part.Offset, part.Length);
         }
+    }
+    TStringBuilder_Destroy(&delimiter);
+    close(sent_file_fd);
+    return result;
+}
 
-        result &= send_with_sendfile(sockfd, sent_file_fd, self->sent_file_size);
-        close(sent_file_fd);
+#if (USING_ZEROCOPY_SEND)
+// A cached body the kernel reads from the shared cache itself. The headers are copied all the same:
+// their buffer is reused right away, and a send of a few hundred bytes is not worth a completion.
+static bool SendZeroCopy(struct THttpResponse* self, int sockfd, bool more, struct TStringBuilder* headers) {
+    struct iovec head[] = {
+        { .iov_base = headers->Data, .iov_len = headers->Length },
+        { .iov_base = self->Body.Data, .iov_len = self->Body.Length },
+    };
+    assert(self->BodyRope.Count == 1);  // a cache slot is a single segment
+    struct iovec body = TRope_GetSegments(&self->BodyRope)[0];
+    const bool result = SendAllv(sockfd, head, sizeof(head) / sizeof(head[0]), true) &&
+                        SendAllvZeroCopy(sockfd, &body, 1, more);
+    TRope_Clear(&self->BodyRope);
+    return result;
+}
+#endif
+
+bool THttpResponse_Send(struct THttpResponse* self, int sockfd, bool more) {
+    struct TStringBuilder headers;
+    TStringBuilder_Init(&headers);
+    THttpResponse_FormatHeaders(self, &headers);
+    IoStats_Add(IO_STAT_RESPONSES, 1);
+
+    bool result = true;
+    if (self->should_use_sendfile) {
+        result = SendWithFile(self, sockfd, more, &headers);
+#if (USING_ZEROCOPY_SEND)
+    } else if (self->BodyCached && self->BodyRope.Length >= ZEROCOPY_MIN_SIZE) {
+        result = SendZeroCopy(self, sockfd, more, &headers);
+#endif
+    } else if (self->BodyStream == NULL) {
+        const struct iovec prefix[] = {
+            { .iov_base = headers.Data, .iov_len = headers.Length },
+            { .iov_base = self->Body.Data, .iov_len = self->Body.Length },
+        };
+        // the segments of the rope are sent from where they are, the templates and cached pages are not copied
+        size_t count;
+        struct iovec* iov = TRope_Gather(&self->BodyRope, prefix, sizeof(prefix) / sizeof(prefix[0]), &count);
+        result = SendAllv(sockfd, iov, count, more);
+        TRope_Clear(&self->BodyRope);  // consumed by the write
+    }
+
+    // the headers are sent together with the first chunk, every chunk goes out as soon as it is generated
+    while (result && self->BodyStream != NULL) {
+        const enum EBodyStreamResult chunk = THttpResponse_AppendChunk(self, &headers);
+        if (chunk == BODY_STREAM_FAILED) {
+            result = false;  // the client sees the body end without its last chunk
+        } else if (!SendAll(sockfd, headers.Data, headers.Length, more || chunk == BODY_STREAM_MORE)) {
+            result = false;
+        }
+        TStringBuilder_Clear(&headers);
     }
 
     TStringBuilder_Destroy(&headers);
@@ -125,5 +506,7 @@ void THttpResponse_Destroy(struct THttpResponse* self)
     {
         free(self->file_path_requested);  // freeing passed_real_path created by realpath in SendStaticFile
     }
+    ReleaseBodyStream(self);
     TStringBuilder_Destroy(&self->Body);
+    TRope_Destroy(&self->BodyRope);
 }
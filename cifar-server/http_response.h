@@ -1,30 +1,113 @@
 #pragma once
 
+#include "config.h"
+#include "rope.h"
 #include "stringbuilder.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <time.h>
 
+#define ETAG_SIZE 48  // a quoted tag with its '\0'
+#define CONTENT_TYPE_SIZE 128  // enough for the values built by the response: multipart types, Content-Range
+#define HTTP_DATE_SIZE 30  // an IMF-fixdate with its '\0'
+
+// The content types the header prefixes are precomputed for, any other string is formatted as it comes
+extern const char CONTENT_TYPE_HTML[];
+extern const char CONTENT_TYPE_PLAIN[];
+extern const char CONTENT_TYPE_BMP[];
+extern const char CONTENT_TYPE_SVG[];
+extern const char CONTENT_TYPE_CSS[];
+
 enum EHttpCode {
     HTTP_OK = 200,
+    HTTP_PARTIAL_CONTENT = 206,
+    HTTP_NOT_MODIFIED = 304,
     HTTP_BAD_REQUEST = 400,
     HTTP_NOT_FOUND = 404,
     HTTP_METHOD_NOT_ALLOWED = 405,
+    HTTP_RANGE_NOT_SATISFIABLE = 416,
+    HTTP_TOO_MANY_REQUESTS = 429,
+    HTTP_REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
     HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_VERSION_NOT_SUPPORTED = 505,
+};
+
+struct THttpByteRange {
+    off_t Offset;
+    size_t Length;
+};
+
+enum EBodyStreamResult {
+    BODY_STREAM_MORE,
+    BODY_STREAM_END,  // the last piece has been appended
+    BODY_STREAM_FAILED,  // the body can not be completed, the response has to be cut short
+};
+
+// A body generated while it is sent, so neither the memory it takes nor the time to its first
+// byte grow with its size. Sent with Transfer-Encoding: chunked, over HTTP/2 as DATA frames.
+struct THttpBodyStream {
+    // Appends the next piece of the body to `out`, about BODY_STREAM_CHUNK bytes
+    enum EBodyStreamResult (*Generate)(struct THttpBodyStream* self, struct TStringBuilder* out);
+    void (*Destroy)(struct THttpBodyStream* self);  // frees the stream itself as well
 };
 
 struct THttpResponse {
     enum EHttpCode Code;
     const char* ContentType; // static string
     struct TStringBuilder Body;
+    struct TRope BodyRope;  // follows Body, generated pages reference their constant parts in it
+    bool BodyCached;  // the rope is a shared cache slot, which never changes: it may be sent zero-copy
     bool should_use_sendfile;
     char *file_path_requested;  // guaranteed that the field will be valid if should_use_sendfile is true
-    size_t sent_file_size;  // specific field for sendfile
-    time_t file_modification_time;  // specific field for sendfile
+    size_t sent_file_size;  // specific field for sendfile, the size of the whole file
+    // Of the file, in ascending order: one is sent as a 206 with Content-Range, several as a
+    // multipart/byteranges body. With none the whole file is sent.
+    struct THttpByteRange Ranges[MAX_BYTE_RANGES];
+    size_t RangeCount;
+    uint64_t Boundary;  // of the multipart body
+    struct THttpBodyStream* BodyStream;  // owned, replaces Body and Content-Length when not NULL
+    time_t file_modification_time;  // sent as Last-Modified unless 0
+    char ETag[ETAG_SIZE];  // quoted entity tag, empty if the response has none
+    const char* CacheControl; // static string
+    const char* Link;  // the Link header, static string, NULL if none
+    bool KeepAlive;  // the connection stays open after the response: "Connection: keep-alive" or "close"
+    unsigned KeepAliveMax;  // how many more requests it may serve, advertised in the Keep-Alive header
 };
 
 const char* GetReasonPhrase(enum EHttpCode code);
 
+// IMF-fixdate, like "Sun, 06 Nov 1994 08:49:37 GMT", returns its length (0 if `size` is less than HTTP_DATE_SIZE)
+size_t FormatHttpDate(time_t time, char* buf, size_t size);
+// The current time for the Date header, formatted at most once a second by each thread
+const char* GetHttpDate(void);
+
 void THttpResponse_Init(struct THttpResponse* self);
-bool THttpResponse_Send(struct THttpResponse* self, int sockfd);
+// Turns the response into a 304 for a client that already has the representation: the body is
+// dropped, the validators and Cache-Control stay so the client can refresh its copy's freshness
+void THttpResponse_SetNotModified(struct THttpResponse* self);
+// Turns a response with a file into a 206 of `ranges` (ascending, not overlapping, `count` of them)
+void THttpResponse_SetRanges(struct THttpResponse* self, const struct THttpByteRange* ranges, size_t count);
+size_t THttpResponse_GetContentLength(const struct THttpResponse* self);
+// The file is sent as one or more parts: the whole file or each of the ranges
+size_t THttpResponse_GetFilePartCount(const struct THttpResponse* self);
+struct THttpByteRange THttpResponse_GetFilePart(const struct THttpResponse* self, size_t index);
+// Appends what precedes the part in a multipart body: the delimiter and the part's headers.
+// With `index` equal to the part count, the closing delimiter. Nothing for a single part.
+void THttpResponse_FormatFilePartHeader(const struct THttpResponse* self, size_t index, struct TStringBuilder* out);
+// Generates the next piece of the streamed body and appends it to `out` as a chunk, followed by
+// the last chunk once the body ends. The stream is released at its end or on a failure.
+enum EBodyStreamResult THttpResponse_AppendChunk(struct THttpResponse* self, struct TStringBuilder* out);
+// Generates the whole streamed body into Body, for a client that can not take chunks (HTTP/1.0).
+// Returns false if it can not be generated.
+bool THttpResponse_DrainBodyStream(struct THttpResponse* self);
+// The Content-Type as sent: with several ranges the multipart type is formatted into `buf`, NULL if none
+const char* THttpResponse_GetContentType(const struct THttpResponse* self, char* buf, size_t size);
+// The Content-Range of a single range 206 or a 416, false if the response has none
+bool THttpResponse_FormatContentRange(const struct THttpResponse* self, char* buf, size_t size);
+// Appends the status line and the headers (terminated by an empty line) to `headers`
+void THttpResponse_FormatHeaders(const struct THttpResponse* self, struct TStringBuilder* headers);
+// `more` is set when another response follows right away (pipelining), the segments are then filled up
+bool THttpResponse_Send(struct THttpResponse* self, int sockfd, bool more);
 void THttpResponse_Destroy(struct THttpResponse* self);
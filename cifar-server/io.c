@@ -1,7 +1,12 @@
 #include "io.h"
 #include "config.h"
 
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #if !defined(__APPLE__)
@@ -10,7 +15,10 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #define DEBUG_MODE IO_C_DEBUG_MODE
 
@@ -24,33 +32,155 @@
 
 #define UNUSED_VAR(var) ((void) var)
 
+static uint64_t g_local_stats[IO_STAT_COUNT];
+static uint64_t* g_stats = g_local_stats;
 
-bool SendAll(int sockfd, const void* data, size_t len)
+bool IoStats_Init(void)
 {
-    while (len != 0) {
-        ssize_t ret = send(sockfd, data, len, 0);
+#if (USING_IO_STATS)
+    void* shared = mmap(NULL, sizeof(g_local_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap io stats");
+        return false;
+    }
+    g_stats = shared;
+#endif
+    return true;
+}
+
+void IoStats_Add(enum EIoStat stat, uint64_t value)
+{
+#if (USING_IO_STATS)
+    __atomic_fetch_add(&g_stats[stat], value, __ATOMIC_RELAXED);
+#else
+    UNUSED_VAR(stat);
+    UNUSED_VAR(value);
+#endif
+}
+
+uint64_t IoStats_Get(enum EIoStat stat)
+{
+    return __atomic_load_n(&g_stats[stat], __ATOMIC_RELAXED);
+}
+
+bool SendAll(int sockfd, const void* data, size_t len, bool more)
+{
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+    return SendAllv(sockfd, &iov, 1, more);
+}
+
+static bool SendAllvWithFlags(int sockfd, struct iovec* iov, size_t count, bool more, int flags)
+{
+#ifdef MSG_MORE
+    if (more) {
+        flags |= MSG_MORE;
+    }
+#else
+    UNUSED_VAR(more);
+#endif
+    while (true) {
+        while (count != 0 && iov->iov_len == 0) {
+            ++iov;
+            --count;
+        }
+        if (count == 0) {
+            break;
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = count < IOV_MAX ? count : IOV_MAX };
+        IoStats_Add(IO_STAT_SEND_CALLS, 1);
+        IoStats_Add(IO_STAT_ZEROCOPY_SENDS, (flags & MSG_ZEROCOPY) != 0);
+        ssize_t ret = sendmsg(sockfd, &msg, flags);
         if (ret == -1) {
-            if (errno == EINTR || errno == EAGAIN) {
+            if (errno == EINTR) {
                 continue;
             }
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                // the completions not read yet have used up the socket's option memory, the rest is copied
+                DEBUG_PRINT("zero-copy send refused, copying\n");
+                ReapZeroCopy(sockfd);
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // SO_SNDTIMEO has expired: the peer does not read the response
+                DEBUG_PRINT("send made no progress in time, giving up\n");
+                return false;
+            }
             perror("send");
             return false;
         }
-        data += ret;
-        len -= ret;
+        for (; ret != 0 && (size_t)ret >= iov->iov_len; ++iov, --count) {
+            ret -= iov->iov_len;
+        }
+        if (ret != 0) {
+            iov->iov_base = (char*)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
     }
     return true;
 }
 
-bool send_with_sendfile(int sock_fd, int file_fd, int file_size)
+bool SendAllv(int sockfd, struct iovec* iov, size_t count, bool more)
+{
+    return SendAllvWithFlags(sockfd, iov, count, more, 0);
+}
+
+bool EnableZeroCopy(int fd)
+{
+    int yes = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == -1) {
+        perror("setsockopt SO_ZEROCOPY");
+        return false;
+    }
+    return true;
+}
+
+bool SendAllvZeroCopy(int sockfd, struct iovec* iov, size_t count, bool more)
+{
+    ReapZeroCopy(sockfd);  // keeps the queue short, a completion is usually there by the next response
+    return SendAllvWithFlags(sockfd, iov, count, more, MSG_ZEROCOPY);
+}
+
+size_t ReapZeroCopy(int fd)
+{
+    size_t completed = 0;
+    while (true) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // EAGAIN: the queue is empty
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            const struct sock_extended_err* err = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // a completion covers the consecutive sends numbered from ee_info to ee_data
+            const uint32_t sends = err->ee_data - err->ee_info + 1;
+            completed += sends;
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                IoStats_Add(IO_STAT_ZEROCOPY_COPIED, sends);
+            }
+        }
+    }
+    return completed;
+}
+
+bool send_with_sendfile(int sock_fd, int file_fd, off_t offset, size_t size)
 {
-    UNUSED_VAR(file_size);
     #if defined(__APPLE__) || defined(__OSX__)
     int attempt_counter = 0;
     while(attempt_counter < MAX_RESEND_ATTEMPTS)
     {
-        off_t offset = 0;
-        off_t bytes_sent = 0;
+        off_t bytes_sent = size;
+        IoStats_Add(IO_STAT_SENDFILE_CALLS, 1);
         ssize_t ret = sendfile(file_fd, sock_fd, offset, &bytes_sent, NULL, 0);
         if(ret == -1)
         {
@@ -58,6 +188,8 @@ bool send_with_sendfile(int sock_fd, int file_fd, int file_size)
             {
                 DEBUG_PRINT("sendfile error, trying again\n");
                 attempt_counter++;
+                offset += bytes_sent;
+                size -= bytes_sent;
                 continue;
             }
             perror("sendfile error:");
@@ -66,27 +198,86 @@ bool send_with_sendfile(int sock_fd, int file_fd, int file_size)
         return true;
     }
     #else
-    // TODO: may be unstable
-    int attempt_counter = 0;
-    while(attempt_counter < MAX_RESEND_ATTEMPTS)
+    const off_t end = offset + size;
+    while(offset < end)
     {
-        off_t offset = 0;
-        off_t bytes_sent = 0;
-        ssize_t ret = sendfile(sock_fd, file_fd, 0, file_size);
+        // a partial transfer means the socket buffer was full for SO_SNDTIMEO, which is
+        // still progress, so only a transfer of nothing at all is a missed deadline
+        IoStats_Add(IO_STAT_SENDFILE_CALLS, 1);
+        ssize_t ret = sendfile(sock_fd, file_fd, &offset, end - offset);
         if(ret == -1)
         {
-            if (errno == EINTR || errno == EAGAIN) 
+            if (errno == EINTR) 
             {
-                DEBUG_PRINT("sendfile error, trying again\n");
-                attempt_counter++;
                 continue;
             }
-            perror("sendfile error:");
+            if (errno != EAGAIN)
+            {
+                perror("sendfile error:");
+            }
             return false;
         }
-        return true;
+        if(ret == 0)
+        {
+            return false;  // the file was truncated
+        }
     }
+    return true;
     #endif
 
     return false;
-}
\ No newline at end of file
+}
+
+void AnswerAndClose(int fd, const char* response, size_t size)
+{
+    // the request has to be consumed: closing a socket with unread data resets the connection,
+    // and the reset may destroy the response before the client reads it
+    char buf[RECV_BUF_SIZE];
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+    IoStats_Add(IO_STAT_RESPONSES, 1);
+    IoStats_Add(IO_STAT_SEND_CALLS, 1);
+    if (send(fd, response, size, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        DEBUG_PRINT("failed to answer fd %d: errno %d\n", fd, errno);
+    }
+    close(fd);
+}
+
+bool SetSendTimeout(int fd, int timeout_ms)
+{
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+        perror("setsockopt SO_SNDTIMEO");
+        return false;
+    }
+    return true;
+}
+
+bool SetNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return false;
+    }
+    return true;
+}
+
+size_t RaiseOpenFilesLimit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        return 0;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            perror("setrlimit");
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+    return limit.rlim_cur;
+}
@@ -2,6 +2,45 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-bool SendAll(int sockfd, const void* data, size_t len);
-bool send_with_sendfile(int sock_fd, int file_fd, int file_size);
+enum EIoStat {
+    IO_STAT_RESPONSES,
+    IO_STAT_SEND_CALLS,  // send(), sendmsg()
+    IO_STAT_SENDFILE_CALLS,
+    IO_STAT_ZEROCOPY_SENDS,  // the sendmsg() calls with MSG_ZEROCOPY, counted among IO_STAT_SEND_CALLS too
+    IO_STAT_ZEROCOPY_COPIED,  // of them, the ones the kernel has completed by copying after all
+    IO_STAT_COUNT,
+};
+
+// Moves the counters to shared memory, so that they cover the forked workers as well
+bool IoStats_Init(void);
+void IoStats_Add(enum EIoStat stat, uint64_t value);
+uint64_t IoStats_Get(enum EIoStat stat);
+
+// `more` tells the kernel that more data follows right away, so it does not push a partial segment
+bool SendAll(int sockfd, const void* data, size_t len, bool more);
+// The same for the buffers in turn, written with a single sendmsg() unless the socket buffer fills up.
+// Modifies `iov` to track the progress.
+bool SendAllv(int sockfd, struct iovec* iov, size_t count, bool more);
+// Lets the socket take MSG_ZEROCOPY sends, without it the flag is ignored and the data is copied
+bool EnableZeroCopy(int fd);
+// SendAllv without copying the buffers into the socket: the kernel reads them until the peer has
+// acknowledged the data, long after the call returns. Only for memory that never changes or goes
+// away while the process lives, the shared cache slots.
+bool SendAllvZeroCopy(int sockfd, struct iovec* iov, size_t count, bool more);
+// Reads the completions of the zero-copy sends from the error queue of the socket, which makes
+// poll() report POLLERR until they are read. Returns how many there were.
+size_t ReapZeroCopy(int fd);
+// Sends `size` bytes of the file starting at `offset`
+bool send_with_sendfile(int sock_fd, int file_fd, off_t offset, size_t size);
+// Sends a short precomputed response without blocking and closes the socket,
+// for the acceptor to turn connections away
+void AnswerAndClose(int fd, const char* response, size_t size);
+// Blocking sends fail with EAGAIN once they make no progress for timeout_ms
+bool SetSendTimeout(int fd, int timeout_ms);
+bool SetNonBlocking(int fd);
+// Raises the soft RLIMIT_NOFILE to the hard one, returns the resulting soft limit
+size_t RaiseOpenFilesLimit(void);
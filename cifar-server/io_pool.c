@@ -0,0 +1,187 @@
+#include "io_pool.h"
+#include "config.h"
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_MODE IO_POOL_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+// the build environment predates cachestat(), the number is the same on every architecture
+#ifndef __NR_cachestat
+#define __NR_cachestat 451
+#endif
+
+struct TCachestatRange {
+    uint64_t Offset;
+    uint64_t Length;
+};
+
+struct TCachestat {
+    uint64_t Cached;
+    uint64_t Dirty;
+    uint64_t Writeback;
+    uint64_t Evicted;
+    uint64_t RecentlyEvicted;
+};
+
+// The jobs are slow by definition, a mutex around the queue costs nothing next to them
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_not_empty = PTHREAD_COND_INITIALIZER;
+static struct TIoJob* g_queue[IO_POOL_QUEUE_DEPTH];
+static size_t g_queue_head = 0;
+static size_t g_queue_size = 0;
+static bool g_started = false;
+
+static bool g_has_cachestat = true;
+
+static void TIoCompletions_Push(struct TIoCompletions* self, struct TIoJob* job) {
+    struct TIoJob* head = __atomic_load_n(&self->Head, __ATOMIC_RELAXED);
+    do {
+        job->Next = head;
+    } while (!__atomic_compare_exchange_n(&self->Head, &head, job, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        // the owner takes the whole list, so only the first job after that has to wake it
+        const uint64_t one = 1;
+        if (write(self->EventFd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write io completions");
+        }
+    }
+}
+
+static void* IoThreadMain(void* unused) {
+    (void) unused;
+    while (true) {
+        pthread_mutex_lock(&g_lock);
+        while (g_queue_size == 0) {
+            pthread_cond_wait(&g_not_empty, &g_lock);
+        }
+        struct TIoJob* job = g_queue[g_queue_head];
+        g_queue_head = (g_queue_head + 1) % IO_POOL_QUEUE_DEPTH;
+        g_queue_size--;
+        pthread_mutex_unlock(&g_lock);
+
+        job->Run(job);
+        TIoCompletions_Push(job->Owner, job);
+    }
+    return NULL;
+}
+
+bool IoPool_Start(void) {
+    if (g_started) {
+        return true;
+    }
+    for (int i = 0; i < IO_POOL_THREADS; ++i) {
+        pthread_t thread;
+        int ret = pthread_create(&thread, NULL, IoThreadMain, NULL);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+            return i != 0;  // fewer threads only make misses slower
+        }
+        pthread_detach(thread);
+        g_started = true;
+    }
+    DEBUG_PRINT("io pool: %d threads\n", IO_POOL_THREADS);
+    return true;
+}
+
+bool IoPool_Submit(struct TIoJob* job) {
+    if (!g_started) {
+        return false;
+    }
+    pthread_mutex_lock(&g_lock);
+    if (g_queue_size == IO_POOL_QUEUE_DEPTH) {
+        pthread_mutex_unlock(&g_lock);
+        DEBUG_PRINT("io pool: the queue is full\n");
+        return false;
+    }
+    g_queue[(g_queue_head + g_queue_size) % IO_POOL_QUEUE_DEPTH] = job;
+    g_queue_size++;
+    pthread_mutex_unlock(&g_lock);
+    pthread_cond_signal(&g_not_empty);
+    return true;
+}
+
+bool TIoCompletions_Init(struct TIoCompletions* self) {
+    self->Head = NULL;
+    self->EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->EventFd == -1) {
+        perror("eventfd");
+        return false;
+    }
+    return true;
+}
+
+struct TIoJob* TIoCompletions_TakeAll(struct TIoCompletions* self) {
+    // reset before taking: a job pushed after the exchange writes the eventfd again
+    uint64_t count;
+    if (read(self->EventFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read io completions");
+    }
+    return __atomic_exchange_n(&self->Head, NULL, __ATOMIC_ACQUIRE);
+}
+
+static bool IsByteCached(int fd, off_t offset) {
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    if (preadv2(fd, &iov, 1, offset, RWF_NOWAIT) == 1) {
+        return true;
+    }
+    // EAGAIN is a miss, a filesystem without RWF_NOWAIT support can not tell
+    return errno != EAGAIN;
+}
+
+bool IsFileRangeCached(int fd, off_t offset, size_t size) {
+    if (size == 0) {
+        return true;
+    }
+    if (__atomic_load_n(&g_has_cachestat, __ATOMIC_RELAXED)) {
+        struct TCachestatRange range = { .Offset = offset, .Length = size };
+        struct TCachestat stat;
+        if (syscall(__NR_cachestat, fd, &range, &stat, 0) == 0) {
+            const long page = sysconf(_SC_PAGESIZE);
+            const uint64_t pages = (offset + size + page - 1) / page - offset / page;
+            return stat.Cached >= pages;
+        }
+        if (errno == ENOSYS) {
+            __atomic_store_n(&g_has_cachestat, false, __ATOMIC_RELAXED);
+        }
+    }
+    // older kernels: readahead fills whole windows, so the ends of the range are a good guess
+    return IsByteCached(fd, offset) && IsByteCached(fd, offset + size - 1);
+}
+
+void WarmFileRange(int fd, off_t offset, size_t size) {
+    static __thread char* buf = NULL;
+    if (buf == NULL && (buf = malloc(IO_POOL_CHUNK)) == NULL) {
+        return;  // sendfile() will read the file itself
+    }
+    while (size != 0) {
+        ssize_t ret = pread(fd, buf, size < IO_POOL_CHUNK ? size : IO_POOL_CHUNK, offset);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return;  // the error shows up again when the range is sent
+        }
+        offset += ret;
+        size -= ret;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Bounded pool for blocking filesystem work.
+ *
+ * The event loops never call anything that may wait for the disk: path resolution,
+ * stat(), directory listings and reads of file ranges missing from the page cache are
+ * submitted here as jobs. A finished job is pushed to the completion list of its owner,
+ * whose eventfd wakes the owner's epoll loop. Whether a range is cached is checked with
+ * cachestat() (Linux 6.5+) or, on older kernels, with preadv2(RWF_NOWAIT) probes, so
+ * cached files are still sent inline with sendfile() and only the misses are handed off.
+ */
+
+struct TIoJob;
+struct TIoCompletions;
+
+typedef void (*TIoJobFunc)(struct TIoJob* job);
+
+struct TIoJob {
+    TIoJobFunc Run;  // called on an I/O thread, may block on the disk
+    struct TIoCompletions* Owner;  // gets the job back once Run has returned
+    struct TIoJob* Next;
+};
+
+// Finished jobs of one event loop: a lock-free stack filled by the I/O threads
+struct TIoCompletions {
+    struct TIoJob* Head;
+    int EventFd;  // readable while there may be finished jobs
+};
+
+// Starts IO_POOL_THREADS threads, once per process
+bool IoPool_Start(void);
+// Returns false if the pool is not running or its queue is full, the caller does the work itself then
+bool IoPool_Submit(struct TIoJob* job);
+
+bool TIoCompletions_Init(struct TIoCompletions* self);
+// Takes all the finished jobs (in no particular order) and rearms the eventfd
+struct TIoJob* TIoCompletions_TakeAll(struct TIoCompletions* self);
+
+// True if the whole range of the file is in the page cache, so sendfile() will not wait for the disk
+bool IsFileRangeCached(int fd, off_t offset, size_t size);
+// Reads the range into the page cache, blocks until it is there
+void WarmFileRange(int fd, off_t offset, size_t size);
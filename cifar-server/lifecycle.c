@@ -0,0 +1,365 @@
+#include "lifecycle.h"
+#include "config.h"
+
+#include "timer_wheel.h"
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_MODE LIFECYCLE_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+// the new binary finds its end of the handover socket here
+#define UPGRADE_FD 3
+#define UPGRADE_FD_ENV "CIFAR_SERVER_UPGRADE_FD"
+#define UPGRADE_FD_ENV_ENTRY UPGRADE_FD_ENV "=3"
+
+#define MAX_ARGS 64
+#define EXIT_GRACE_MS 1000  // lets the main thread (the prefork master) finish the drain itself
+
+extern char** environ;
+
+static int g_stop_fd = -1;
+static uint32_t g_stopping = 0;
+static uint64_t g_drain_deadline_ms = 0;
+
+static int g_listen_fds[MAX_REACTOR_SHARDS];
+static int g_listen_count = 0;
+static int g_upgrade_fd = -1;  // connection to the previous binary until the listeners are taken over
+
+// Resolved at start: after a deploy the path names the new binary, /proc/self/exe the old one
+static char g_exe_path[PATH_MAX];
+static char g_cmdline[4096];
+static char* g_argv[MAX_ARGS + 1];
+
+static void GetSignals(sigset_t* signals) {
+    sigemptyset(signals);
+    sigaddset(signals, SIGTERM);
+    sigaddset(signals, SIGUSR2);
+}
+
+static bool ReadCommandLine(void) {
+    ssize_t len = readlink("/proc/self/exe", g_exe_path, sizeof(g_exe_path) - 1);
+    if (len <= 0) {
+        return false;
+    }
+    g_exe_path[len] = '\0';
+
+    int fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    ssize_t size = read(fd, g_cmdline, sizeof(g_cmdline) - 1);
+    close(fd);
+    if (size <= 0) {
+        return false;
+    }
+    g_cmdline[size] = '\0';
+
+    int argc = 0;
+    for (ssize_t i = 0; i < size && argc < MAX_ARGS; i += strlen(g_cmdline + i) + 1) {
+        g_argv[argc++] = g_cmdline + i;
+    }
+    g_argv[argc] = NULL;
+    return true;
+}
+
+// The current environment plus the handover fd, built before fork(): malloc is not allowed after it
+static char** BuildEnvironment(void) {
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        ++count;
+    }
+    char** envp = malloc((count + 2) * sizeof(char*));
+    if (envp == NULL) {
+        return NULL;
+    }
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (strncmp(environ[i], UPGRADE_FD_ENV "=", sizeof(UPGRADE_FD_ENV)) != 0) {
+            envp[size++] = environ[i];
+        }
+    }
+    envp[size++] = UPGRADE_FD_ENV_ENTRY;
+    envp[size] = NULL;
+    return envp;
+}
+
+static bool SendListeners(int sockfd) {
+    union {
+        char Buf[CMSG_SPACE(sizeof(int) * MAX_REACTOR_SHARDS)];
+        struct cmsghdr Align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    char count = g_listen_count;
+    struct iovec iov = { .iov_base = &count, .iov_len = 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.Buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * g_listen_count);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * g_listen_count);
+    memcpy(CMSG_DATA(cmsg), g_listen_fds, sizeof(int) * g_listen_count);
+
+    if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) != 1) {
+        perror("sendmsg listeners");
+        return false;
+    }
+    return true;
+}
+
+static bool WaitUntilReady(int sockfd) {
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN, .revents = 0 };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, UPGRADE_READY_TIMEOUT);
+    } while (ret == -1 && errno == EINTR);
+    if (ret != 1) {
+        fprintf(stderr, "server: the new binary has not taken the listeners over in time\n");
+        return false;
+    }
+    char ready;
+    return recv(sockfd, &ready, 1, 0) == 1;  // 0: the new binary has died
+}
+
+static bool StartNewBinary(void) {
+    if (g_listen_count == 0 || g_argv[0] == NULL) {
+        return false;
+    }
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+        perror("socketpair");
+        return false;
+    }
+    char** envp = BuildEnvironment();
+    if (envp == NULL) {
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+
+    const pid_t pid = fork();
+    if (pid == 0) {
+        // only async-signal-safe calls until execve()
+        if (pair[1] == UPGRADE_FD) {
+            fcntl(UPGRADE_FD, F_SETFD, 0);
+        } else if (dup2(pair[1], UPGRADE_FD) == -1) {
+            _exit(127);
+        }
+        // the accepted connections must not stay open in the new binary after we close them
+        close_range(UPGRADE_FD + 1, ~0U, 0);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve(g_exe_path, g_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(pair[1]);
+    if (pid == -1) {
+        perror("fork");
+        close(pair[0]);
+        return false;
+    }
+
+    DEBUG_PRINT("lifecycle: started %s, pid %d\n", g_exe_path, pid);
+    const bool ok = SendListeners(pair[0]) && WaitUntilReady(pair[0]);
+    close(pair[0]);
+    if (!ok) {
+        kill(pid, SIGKILL);  // never two servers half sharing the listeners
+    }
+    return ok;
+}
+
+static void Stop(void) {
+    g_drain_deadline_ms = MonotonicMs() + DRAIN_TIMEOUT;
+    __atomic_store_n(&g_stopping, 1, __ATOMIC_RELEASE);
+    const uint64_t one = 1;
+    if (write(g_stop_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write stop fd");
+    }
+}
+
+static void* SignalThreadMain(void* unused) {
+    (void) unused;
+    sigset_t signals;
+    GetSignals(&signals);
+
+    while (true) {
+        int sig;
+        if (sigwait(&signals, &sig) != 0) {
+            continue;
+        }
+        if (sig == SIGTERM) {
+            printf("server: SIGTERM, draining\n");
+            break;
+        }
+        printf("server: SIGUSR2, handing the listeners over to %s\n", g_exe_path);
+        fflush(stdout);
+        if (StartNewBinary()) {
+            printf("server: the new binary is serving, draining\n");
+            break;
+        }
+        fprintf(stderr, "server: the upgrade has failed, still serving\n");
+    }
+    fflush(stdout);
+    Stop();
+
+    // normally the main thread returns first, this is for requests that do not finish in time
+    const uint64_t exitAt = g_drain_deadline_ms + EXIT_GRACE_MS;
+    for (uint64_t now = MonotonicMs(); now < exitAt; now = MonotonicMs()) {
+        const uint64_t left = exitAt - now;
+        struct timespec timeout = { .tv_sec = left / 1000, .tv_nsec = (left % 1000) * 1000000 };
+        if (sigtimedwait(&signals, NULL, &timeout) == SIGTERM) {
+            break;  // a second SIGTERM does not wait for the drain
+        }
+    }
+    printf("server: exiting without waiting for the rest of the requests\n");
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+    return NULL;
+}
+
+bool Lifecycle_Init(void) {
+    g_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_stop_fd == -1) {
+        perror("eventfd");
+        return false;
+    }
+    if (!ReadCommandLine()) {
+        fprintf(stderr, "server: can not read the command line, upgrades are disabled\n");
+        g_argv[0] = NULL;
+    }
+
+    sigset_t signals;
+    GetSignals(&signals);
+    int ret = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_sigmask: %s\n", strerror(ret));
+        return false;
+    }
+
+    pthread_t thread;
+    ret = pthread_create(&thread, NULL, SignalThreadMain, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void Lifecycle_ResetChildSignals(void) {
+    sigset_t signals;
+    GetSignals(&signals);
+    pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+}
+
+int Lifecycle_InheritListeners(int* fds, int max_count) {
+    const char* env = getenv(UPGRADE_FD_ENV);
+    if (env == NULL) {
+        return 0;
+    }
+    g_upgrade_fd = atoi(env);
+    unsetenv(UPGRADE_FD_ENV);
+    fcntl(g_upgrade_fd, F_SETFD, FD_CLOEXEC);
+
+    union {
+        char Buf[CMSG_SPACE(sizeof(int) * MAX_REACTOR_SHARDS)];
+        struct cmsghdr Align;
+    } control;
+    char count;
+    struct iovec iov = { .iov_base = &count, .iov_len = 1 };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.Buf;
+    msg.msg_controllen = sizeof(control.Buf);
+
+    ssize_t ret;
+    do {
+        ret = recvmsg(g_upgrade_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+    struct cmsghdr* cmsg = ret == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "server: no listeners from the previous binary, starting from scratch\n");
+        close(g_upgrade_fd);
+        g_upgrade_fd = -1;
+        return 0;
+    }
+
+    const int received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int* data = (int*)CMSG_DATA(cmsg);
+    int taken = 0;
+    for (int i = 0; i < received; ++i) {
+        if (taken < max_count) {
+            fds[taken++] = data[i];
+        } else {
+            close(data[i]);
+        }
+    }
+    printf("server: took %d listeners over from the previous binary\n", taken);
+    return taken;
+}
+
+void Lifecycle_SetListeners(const int* fds, int count) {
+    if (count > MAX_REACTOR_SHARDS) {
+        count = MAX_REACTOR_SHARDS;
+    }
+    memcpy(g_listen_fds, fds, sizeof(int) * count);
+    g_listen_count = count;
+
+    if (g_upgrade_fd != -1) {
+        const char ready = 1;
+        if (send(g_upgrade_fd, &ready, 1, MSG_NOSIGNAL) != 1) {
+            perror("send ready");
+        }
+        close(g_upgrade_fd);
+        g_upgrade_fd = -1;
+    }
+}
+
+int Lifecycle_GetStopFd(void) {
+    return g_stop_fd;
+}
+
+bool Lifecycle_IsStopping(void) {
+    return __atomic_load_n(&g_stopping, __ATOMIC_ACQUIRE) != 0;
+}
+
+void Lifecycle_SetStopping(void) {
+    if (!Lifecycle_IsStopping()) {
+        g_drain_deadline_ms = MonotonicMs() + DRAIN_TIMEOUT;
+        __atomic_store_n(&g_stopping, 1, __ATOMIC_RELEASE);
+    }
+}
+
+uint64_t Lifecycle_GetDrainDeadline(void) {
+    return g_drain_deadline_ms;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Graceful shutdown and zero-downtime binary upgrade.
+ *
+ * SIGTERM and SIGUSR2 are handled by a dedicated thread (sigwait), so the rest of the
+ * server never runs signal handlers. SIGUSR2 starts /proc/self/exe with the same arguments
+ * and passes it the listening sockets over a unix socket (SCM_RIGHTS): the kernel accept
+ * queues are never closed, so no connection attempt is refused during a deploy. Once the new
+ * binary reports that it has taken the listeners over, or on SIGTERM, the old process stops:
+ * the stop fd becomes readable, the accept loops leave the listeners alone, idle keep-alive
+ * connections are closed and the requests in flight get DRAIN_TIMEOUT to complete.
+ */
+
+// Blocks the signals in the calling thread (so in every thread created after it) and starts
+// the signal thread. Must be called before any other thread or process is started.
+bool Lifecycle_Init(void);
+// In a forked worker: the signal thread is not inherited, so the signals get their default actions back
+void Lifecycle_ResetChildSignals(void);
+
+// Fills `fds` with the listening sockets handed over by the previous binary,
+// returns their number, 0 if the server has been started from scratch
+int Lifecycle_InheritListeners(int* fds, int max_count);
+// The listeners to hand over on SIGUSR2. Also tells the previous binary, if any,
+// that the listeners have been taken over, so it starts draining.
+void Lifecycle_SetListeners(const int* fds, int count);
+
+// eventfd that becomes (and stays) readable once the server has to stop accepting.
+// Inherited by forked workers, so the master stops all of them with a single write.
+int Lifecycle_GetStopFd(void);
+bool Lifecycle_IsStopping(void);
+// For a process that has found the stop fd readable: the flag of the master is not shared with
+// forked workers, so they set their own, with their own drain deadline
+void Lifecycle_SetStopping(void);
+// Monotonic ms when the process exits whatever is still in flight, valid once stopping
+uint64_t Lifecycle_GetDrainDeadline(void);
@@ -0,0 +1,79 @@
+#include "mpmc_queue.h"
+
+#include <stdlib.h>
+
+bool TMpmcQueue_Init(struct TMpmcQueue* self, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    self->Cells = malloc(size * sizeof(struct TMpmcCell));
+    if (self->Cells == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        self->Cells[i].Sequence = i;
+        self->Cells[i].Value = -1;
+    }
+    self->Mask = size - 1;
+    self->EnqueuePos = 0;
+    self->DequeuePos = 0;
+    return true;
+}
+
+void TMpmcQueue_Destroy(struct TMpmcQueue* self) {
+    free(self->Cells);
+}
+
+bool TMpmcQueue_TryPush(struct TMpmcQueue* self, int value) {
+    struct TMpmcCell* cell;
+    uint64_t pos = __atomic_load_n(&self->EnqueuePos, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &self->Cells[pos & self->Mask];
+        uint64_t seq = __atomic_load_n(&cell->Sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&self->EnqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            // pos is reloaded by the failed CAS
+        } else if (diff < 0) {
+            return false;  // full
+        } else {
+            pos = __atomic_load_n(&self->EnqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    cell->Value = value;
+    __atomic_store_n(&cell->Sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool TMpmcQueue_TryPop(struct TMpmcQueue* self, int* value) {
+    struct TMpmcCell* cell;
+    uint64_t pos = __atomic_load_n(&self->DequeuePos, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &self->Cells[pos & self->Mask];
+        uint64_t seq = __atomic_load_n(&cell->Sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)seq - (int64_t)(pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&self->DequeuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;  // empty
+        } else {
+            pos = __atomic_load_n(&self->DequeuePos, __ATOMIC_RELAXED);
+        }
+    }
+    *value = cell->Value;
+    __atomic_store_n(&cell->Sequence, pos + self->Mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t TMpmcQueue_Size(const struct TMpmcQueue* self) {
+    // the dequeue position is read first, so the difference can not underflow
+    uint64_t dequeued = __atomic_load_n(&self->DequeuePos, __ATOMIC_RELAXED);
+    uint64_t enqueued = __atomic_load_n(&self->EnqueuePos, __ATOMIC_RELAXED);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue of ints (D. Vyukov's ring
+ * with per-cell sequence numbers). An uncontended operation is a couple of atomic
+ * instructions; waiting on a full or empty queue is left to the caller (the worker pool parks itself).
+ */
+
+struct TMpmcCell {
+    uint64_t Sequence;
+    int Value;
+};
+
+struct TMpmcQueue {
+    struct TMpmcCell* Cells;
+    uint64_t Mask;
+
+    uint64_t EnqueuePos __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint64_t DequeuePos __attribute__((aligned(CACHE_LINE_SIZE)));
+};
+
+// capacity is rounded up to a power of two
+bool TMpmcQueue_Init(struct TMpmcQueue* self, size_t capacity);
+void TMpmcQueue_Destroy(struct TMpmcQueue* self);
+
+// Approximate under concurrent access, meant for load decisions only
+size_t TMpmcQueue_Size(const struct TMpmcQueue* self);
+
+bool TMpmcQueue_TryPush(struct TMpmcQueue* self, int value);
+bool TMpmcQueue_TryPop(struct TMpmcQueue* self, int* value);
@@ -0,0 +1,254 @@
+#include "parking_lot.h"
+#include "config.h"
+
+#include "admission.h"
+#include "http2.h"
+#include "io.h"
+#include "lifecycle.h"
+#include "timer_wheel.h"
+
+#include <sys/epoll.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_MODE PARKING_LOT_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+static int g_epoll_fd = -1;
+static struct TWorkerPool* g_pool = NULL;
+
+struct TParkedConnection {
+    struct TTimer Timer;  // scheduled while the socket is parked
+    unsigned Requests;  // touched only by the worker that owns the socket
+    struct THttpInputBuffer Input;  // the same, its storage is reused by the next socket with this fd
+    struct THttp2Session* Http2;  // the session of a parked HTTP/2 connection, NULL otherwise
+    int NextWoken;  // the list of sockets the lot hands to the workers without an event, see StartDraining()
+};
+
+// indexed by fd
+static struct TParkedConnection* g_connections = NULL;
+static size_t g_max_fds = 0;
+
+// Workers schedule deadlines while the lot thread fires them, the critical sections are O(1)
+static pthread_mutex_t g_timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct TTimerWheel g_timers;
+static bool g_draining = false;  // under g_timers_lock as well: nothing is parked once it is set
+static int g_woken = -1;  // under g_timers_lock, the head of the NextWoken list
+
+static void CloseConnection(int fd) {
+    struct THttp2Session* session = (size_t)fd < g_max_fds ? g_connections[fd].Http2 : NULL;
+    if (session != NULL) {
+        g_connections[fd].Http2 = NULL;
+        THttp2Session_Destroy(session);
+        free(session);
+    }
+#if (USING_ADMISSION_CONTROL)
+    Admission_Close(fd);
+#else
+    close(fd);
+#endif
+}
+
+static void Park(int fd, bool is_new, uint64_t deadline_ms) {
+    struct TParkedConnection* connection = &g_connections[fd];
+    pthread_mutex_lock(&g_timers_lock);
+    if (g_draining) {
+        pthread_mutex_unlock(&g_timers_lock);
+        CloseConnection(fd);
+        return;
+    }
+    TTimerWheel_Schedule(&g_timers, &connection->Timer, deadline_ms);
+    pthread_mutex_unlock(&g_timers_lock);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    // one-shot: the lot hands the socket to exactly one worker and forgets about it until it is parked again
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(g_epoll_fd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) == -1) {
+        perror("epoll_ctl parking lot");
+        pthread_mutex_lock(&g_timers_lock);
+        TTimerWheel_Cancel(&g_timers, &connection->Timer);
+        pthread_mutex_unlock(&g_timers_lock);
+        CloseConnection(fd);
+    }
+}
+
+void ParkingLot_Park(int fd, bool is_new) {
+    if ((size_t)fd >= g_max_fds) {
+        CloseConnection(fd);
+        return;
+    }
+    if (is_new) {
+        g_connections[fd].Requests = 0;
+        THttpInputBuffer_Clear(&g_connections[fd].Input);
+    }
+    Park(fd, is_new, MonotonicMs() + TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS);
+}
+
+void ParkingLot_ParkHttp2(int fd, struct THttp2Session* session) {
+    // a socket always comes through ParkingLot_Park() first, so its fd fits
+    g_connections[fd].Http2 = session;
+    Park(fd, false, THttp2Session_GetDeadline(session));
+}
+
+struct THttp2Session* ParkingLot_TakeHttp2(int fd) {
+    struct THttp2Session* session = g_connections[fd].Http2;
+    g_connections[fd].Http2 = NULL;
+    return session;
+}
+
+unsigned ParkingLot_CountRequest(int fd) {
+    return ++g_connections[fd].Requests;
+}
+
+struct THttpInputBuffer* ParkingLot_GetInput(int fd) {
+    return &g_connections[fd].Input;
+}
+
+static void CloseIdleConnection(struct TTimer* timer, void* unused) {
+    (void) unused;
+    const int fd = (struct TParkedConnection*)timer - g_connections;
+    // the epoll event for this fd is handled by this same thread, so nobody can take it meanwhile
+    DEBUG_PRINT("parking lot: closing idle fd %d\n", fd);
+    CloseConnection(fd);  // also removes it from the epoll set
+}
+
+// An HTTP/2 connection with responses in flight is finished by a worker, the rest is closed
+static void CloseParkedConnection(struct TTimer* timer, void* unused) {
+    TTimerWheel_Cancel(&g_timers, timer);
+    struct TParkedConnection* connection = (struct TParkedConnection*)timer;
+    if (connection->Http2 != NULL && connection->Http2->ActiveStreams != 0) {
+        const int fd = connection - g_connections;
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        epoll_ctl(g_epoll_fd, EPOLL_CTL_MOD, fd, &event);  // disarmed, the worker is the only owner
+        connection->NextWoken = g_woken;
+        g_woken = fd;
+        return;
+    }
+    CloseIdleConnection(timer, unused);
+}
+
+// Called under g_timers_lock. The sockets readable in the current batch are not parked anymore,
+// they are dispatched as usual and their workers close them after the response.
+static void StartDraining(void) {
+    g_draining = true;
+    epoll_ctl(g_epoll_fd, EPOLL_CTL_DEL, Lifecycle_GetStopFd(), NULL);
+    DEBUG_PRINT("parking lot: draining, closing %zu idle connections\n", g_timers.Count);
+    TTimerWheel_ForEach(&g_timers, CloseParkedConnection, NULL);
+}
+
+static void* ParkingLotMain(void* unused) {
+    (void) unused;
+    struct epoll_event events[PARKING_LOT_MAX_EVENTS];
+
+    while (true) {
+        pthread_mutex_lock(&g_timers_lock);
+        int timeout = TTimerWheel_GetTimeout(&g_timers, MonotonicMs());
+        pthread_mutex_unlock(&g_timers_lock);
+        if (timeout == -1) {
+            // every socket parked from now on expires no sooner than this
+            timeout = TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS;
+        }
+
+        int count = epoll_wait(g_epoll_fd, events, PARKING_LOT_MAX_EVENTS, timeout);
+        if (count == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait parking lot");
+                return NULL;
+            }
+            count = 0;
+        }
+
+        const int stopFd = Lifecycle_GetStopFd();
+        bool stop = false;
+        pthread_mutex_lock(&g_timers_lock);
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.fd == stopFd) {
+                stop = true;
+                continue;
+            }
+            TTimerWheel_Cancel(&g_timers, &g_connections[events[i].data.fd].Timer);
+        }
+        if (stop) {
+            StartDraining();
+        }
+        TTimerWheel_Advance(&g_timers, MonotonicMs(), CloseIdleConnection, NULL);
+        int woken = g_woken;
+        g_woken = -1;
+        pthread_mutex_unlock(&g_timers_lock);
+
+        // outside of the lock: a full pool blocks the submission
+        while (woken != -1) {
+            const int fd = woken;
+            woken = g_connections[fd].NextWoken;
+            TWorkerPool_Submit(g_pool, fd);
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == stopFd) {
+                continue;
+            }
+            if (events[i].events == EPOLLERR && ReapZeroCopy(fd) != 0) {
+                // the completions of zero-copy sends wake the socket up as well, it stays parked
+                struct THttp2Session* session = g_connections[fd].Http2;
+                Park(fd, false, session != NULL ? THttp2Session_GetDeadline(session)
+                                                : MonotonicMs() + TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS);
+                continue;
+            }
+            DEBUG_PRINT("parking lot: fd %d is readable, dispatching\n", fd);
+            // a disconnected peer is dispatched as well, the worker sees EOF and closes the socket
+            TWorkerPool_Submit(g_pool, fd);
+        }
+    }
+    return NULL;
+}
+
+bool ParkingLot_Start(struct TWorkerPool* pool) {
+    g_pool = pool;
+    g_max_fds = RaiseOpenFilesLimit();
+    g_connections = calloc(g_max_fds, sizeof(struct TParkedConnection));
+    if (g_connections == NULL) {
+        return false;
+    }
+    TTimerWheel_Init(&g_timers, MonotonicMs());
+
+    g_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epoll_fd == -1) {
+        perror("epoll_create1");
+        return false;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = Lifecycle_GetStopFd();
+    if (epoll_ctl(g_epoll_fd, EPOLL_CTL_ADD, event.data.fd, &event) == -1) {
+        perror("epoll_ctl stop fd");
+        return false;
+    }
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, ParkingLotMain, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "http_request.h"
+#include "worker_pool.h"
+
+#include <stdbool.h>
+
+/**
+ * Keep-alive parking lot for the thread pool.
+ *
+ * Connections that have no request in flight are owned by a single epoll thread instead
+ * of a pool worker. Once a parked socket becomes readable it is submitted to the pool,
+ * so workers only ever run active requests. Sockets idle for longer than
+ * TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS are closed by the lot, their deadlines are kept
+ * in a timer wheel so the lot never scans all the parked sockets.
+ * Once the server stops, the parked sockets are closed and the returned ones are not parked again.
+ *
+ * An HTTP/2 connection waiting for the client is parked with its session and the session's own
+ * deadline. Whatever still needs the session (a parked socket that becomes readable, or one
+ * with streams in flight when the server stops) goes to a worker, which takes the session back.
+ */
+
+struct THttp2Session;
+
+bool ParkingLot_Start(struct TWorkerPool* pool);
+// Thread-safe. `is_new` is true for a just accepted socket, false when a worker returns it.
+void ParkingLot_Park(int fd, bool is_new);
+// Parks an HTTP/2 connection until THttp2Session_GetDeadline(), the lot owns the session meanwhile
+void ParkingLot_ParkHttp2(int fd, struct THttp2Session* session);
+// The session parked with the socket, NULL if it speaks HTTP/1.x. For the worker that owns the socket.
+struct THttp2Session* ParkingLot_TakeHttp2(int fd);
+// Called by the worker that owns the socket, returns how many requests it has started so far
+unsigned ParkingLot_CountRequest(int fd);
+// The bytes received past the last request of the socket, for the worker that owns it.
+// A socket with pipelined requests buffered here is served on instead of being parked:
+// epoll would never report the bytes that have already been received.
+struct THttpInputBuffer* ParkingLot_GetInput(int fd);
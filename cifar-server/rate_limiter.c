@@ -0,0 +1,184 @@
+#include "rate_limiter.h"
+#include "config.h"
+
+#include "io.h"
+#include "timer_wheel.h"
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_MODE RATE_LIMITER_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+#define STRINGIFY_IMPL(x) #x
+#define STRINGIFY(x) STRINGIFY_IMPL(x)
+
+static const char RATE_LIMITED_RESPONSE[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Retry-After: " STRINGIFY(RATE_LIMIT_RETRY_AFTER) "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+// Tokens are counted in thousandths, so a rate of N tokens per second is N per millisecond
+#define TOKEN_SCALE 1000
+
+// A bucket word: the low 32 bits are tokens * TOKEN_SCALE, the high 32 bits are the time of
+// the last refill (wrapping milliseconds). Zero stands for a full bucket of a new client.
+struct TRateSlot {
+    uint64_t Key;  // 0 while the slot is free
+    uint64_t Buckets[2];  // indexed by enum ERateLimit
+};
+
+static struct TRateSlot* g_slots = NULL;
+
+// indexed by fd: the client key of the connection, written by the acceptor before the
+// socket is handed over to anybody else
+static uint64_t* g_fd_keys = NULL;
+static size_t g_max_fds = 0;
+
+static const uint32_t RATES[] = {RATE_LIMIT_CONNECTIONS_PER_SEC, RATE_LIMIT_REQUESTS_PER_SEC};
+static const uint32_t CAPACITIES[] = {
+    RATE_LIMIT_CONNECTIONS_BURST * TOKEN_SCALE,
+    RATE_LIMIT_REQUESTS_BURST * TOKEN_SCALE,
+};
+
+bool RateLimiter_Init(void) {
+    // shared, so the limits hold across the worker processes forked after this call
+    const size_t slotsSize = (size_t)RATE_LIMIT_SHARDS * RATE_LIMIT_SHARD_SLOTS * sizeof(struct TRateSlot);
+    g_slots = mmap(NULL, slotsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_slots == MAP_FAILED) {
+        perror("mmap rate limiter");
+        g_slots = NULL;
+        return false;
+    }
+    g_max_fds = RaiseOpenFilesLimit();
+    g_fd_keys = calloc(g_max_fds, sizeof(uint64_t));
+    return g_fd_keys != NULL;
+}
+
+static uint64_t Mix(uint64_t x) {  // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+uint64_t RateLimiter_GetKey(const struct sockaddr* addr) {
+    uint64_t raw;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* addr4 = (const struct sockaddr_in*)addr;
+        raw = addr4->sin_addr.s_addr;
+    } else if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)addr;
+        if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+            uint32_t addr4;
+            memcpy(&addr4, &addr6->sin6_addr.s6_addr[12], sizeof(addr4));
+            raw = addr4;
+        } else {
+            // a single host usually owns the whole /64, mixed once more to keep it apart from IPv4
+            memcpy(&raw, addr6->sin6_addr.s6_addr, sizeof(raw));
+            raw = Mix(raw ^ 0x6);
+        }
+    } else {
+        return 0;
+    }
+    return Mix(raw) | 1;  // never 0, the key of a free slot
+}
+
+static uint64_t* FindBuckets(uint64_t key, uint32_t now) {
+    struct TRateSlot* shard = &g_slots[(key >> 48) % RATE_LIMIT_SHARDS * RATE_LIMIT_SHARD_SLOTS];
+    for (unsigned probe = 0; probe < RATE_LIMIT_PROBES; ++probe) {
+        struct TRateSlot* slot = &shard[(key + probe) & (RATE_LIMIT_SHARD_SLOTS - 1)];
+        uint64_t slotKey = __atomic_load_n(&slot->Key, __ATOMIC_ACQUIRE);
+        if (slotKey == key) {
+            return slot->Buckets;
+        }
+
+        bool reusable = (slotKey == 0);
+        if (!reusable) {
+            reusable = true;
+            for (int i = 0; i < 2; ++i) {
+                uint64_t bucket = __atomic_load_n(&slot->Buckets[i], __ATOMIC_RELAXED);
+                if (bucket != 0 && now - (uint32_t)(bucket >> 32) < RATE_LIMIT_IDLE_EVICTION) {
+                    reusable = false;
+                }
+            }
+        }
+        if (reusable && __atomic_compare_exchange_n(&slot->Key, &slotKey, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // a racing update of the previous owner may leak into the new buckets, it costs a token at most
+            __atomic_store_n(&slot->Buckets[0], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->Buckets[1], 0, __ATOMIC_RELAXED);
+            DEBUG_PRINT("rate limiter: new client %llx\n", (unsigned long long)key);
+            return slot->Buckets;
+        }
+        if (slotKey == key) {  // claimed by a concurrent request of the same client
+            return slot->Buckets;
+        }
+    }
+    return NULL;
+}
+
+bool RateLimiter_Take(uint64_t key, enum ERateLimit limit, uint64_t now_ms) {
+    if (key == 0) {
+        return true;
+    }
+    const uint32_t now = (uint32_t)now_ms;
+    uint64_t* buckets = FindBuckets(key, now);
+    if (buckets == NULL) {
+        return true;
+    }
+
+    uint64_t bucket = __atomic_load_n(&buckets[limit], __ATOMIC_RELAXED);
+    while (true) {
+        uint64_t tokens = CAPACITIES[limit];
+        if (bucket != 0) {
+            const uint32_t elapsed = now - (uint32_t)(bucket >> 32);
+            tokens = (uint32_t)bucket + (uint64_t)elapsed * RATES[limit];
+            if (tokens > CAPACITIES[limit]) {
+                tokens = CAPACITIES[limit];
+            }
+        }
+        if (tokens < TOKEN_SCALE) {
+            return false;
+        }
+        const uint64_t updated = ((uint64_t)now << 32) | (tokens - TOKEN_SCALE);
+        if (__atomic_compare_exchange_n(&buckets[limit], &bucket, updated, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+}
+
+bool RateLimiter_AdmitConnection(int fd, const struct sockaddr* addr) {
+    const uint64_t key = RateLimiter_GetKey(addr);
+    if ((size_t)fd < g_max_fds) {
+        g_fd_keys[fd] = key;
+    }
+    if (RateLimiter_Take(key, RATE_LIMIT_CONNECTIONS, MonotonicMs())) {
+        return true;
+    }
+    DEBUG_PRINT("rate limiter: too many connections, rejecting fd %d\n", fd);
+    AnswerAndClose(fd, RATE_LIMITED_RESPONSE, sizeof(RATE_LIMITED_RESPONSE) - 1);
+    return false;
+}
+
+bool RateLimiter_AllowRequest(int fd) {
+    if ((size_t)fd >= g_max_fds) {
+        return true;
+    }
+    return RateLimiter_Take(g_fd_keys[fd], RATE_LIMIT_REQUESTS, MonotonicMs());
+}
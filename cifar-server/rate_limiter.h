@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * Per-client token buckets, one for new connections and one for requests.
+ *
+ * Clients are keyed by their IPv4 address or the /64 prefix of their IPv6 address.
+ * The table is split into RATE_LIMIT_SHARDS shards of open-addressed slots; a slot is
+ * claimed with a compare-and-swap of its key and every bucket is a single 64-bit word
+ * (refill time and fixed-point tokens) updated with compare-and-swap, so no lock is
+ * ever taken. Slots idle for RATE_LIMIT_IDLE_EVICTION are reused by the next client
+ * whose probe sequence meets them, which makes eviction free. A client that finds no
+ * slot (a table full of active clients) is not limited. The table lives in shared memory,
+ * so forked worker processes enforce common limits.
+ */
+
+enum ERateLimit {
+    RATE_LIMIT_CONNECTIONS,
+    RATE_LIMIT_REQUESTS,
+};
+
+bool RateLimiter_Init(void);
+// 0 for address families that are not limited
+uint64_t RateLimiter_GetKey(const struct sockaddr* addr);
+// Takes a token from the client's bucket, returns false if it is empty
+bool RateLimiter_Take(uint64_t key, enum ERateLimit limit, uint64_t now_ms);
+
+// Accept time check: remembers the client of the socket for RateLimiter_AllowRequest().
+// Returns false if the connection has been answered with 429 and closed.
+bool RateLimiter_AdmitConnection(int fd, const struct sockaddr* addr);
+// Request time check for a socket that went through RateLimiter_AdmitConnection()
+bool RateLimiter_AllowRequest(int fd);
@@ -0,0 +1,359 @@
+#include "reactor.h"
+#include "config.h"
+
+#include "connection.h"
+#include "cpus.h"
+#include "http2.h"
+#include "io.h"
+#include "io_pool.h"
+#include "lifecycle.h"
+#include "rate_limiter.h"
+#include "timer_wheel.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_MODE REACTOR_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+struct TReactor {
+    int Index;
+    int EpollFd;
+    int ListenFd;
+    int Cpu;  // -1 if the reactor is not pinned
+    pthread_t Thread;
+    struct TTimerWheel Timers;  // connection deadlines, touched only by the reactor thread
+    struct TIoCompletions DiskCompletions;  // jobs of this reactor's connections back from the I/O pool
+    unsigned Connections;  // including the closed ones still waiting for the I/O pool
+    bool Draining;  // the listener is not watched anymore, the loop ends with the last connection
+    uint64_t DrainDeadlineMs;
+};
+
+// epoll_event.data.ptr of the listening socket, connections always have a non-NULL pointer there
+#define LISTENER_TAG NULL
+// and the lifecycle stop fd and the I/O pool completions these ones
+static char g_stop_tag;
+#define STOP_TAG ((void*)&g_stop_tag)
+static char g_disk_tag;
+#define DISK_TAG ((void*)&g_disk_tag)
+
+static void FreeConnection(struct TReactor* reactor, struct TConnection* connection) {
+    TConnection_Destroy(connection);
+    free(connection);
+    reactor->Connections--;
+}
+
+static void CloseConnection(struct TReactor* reactor, struct TConnection* connection) {
+    DEBUG_PRINT("closing fd %d\n", connection->Fd);
+    TTimerWheel_Cancel(&reactor->Timers, &connection->Timer);
+    close(connection->Fd);  // also removes the fd from the epoll set
+    if (connection->State == CONNECTION_STATE_WAITING_DISK) {
+        // an I/O thread still works with the connection, it is freed once the job is back
+        connection->Fd = -1;
+        return;
+    }
+    FreeConnection(reactor, connection);
+}
+
+// A connection between requests: closing it can not cut off a response
+static bool IsIdle(const struct TConnection* connection) {
+    return connection->State == CONNECTION_STATE_READING && connection->Parser.HeadSize == 0 &&
+           (connection->Http2 == NULL || connection->Http2->ActiveStreams == 0);
+}
+
+static void AcceptConnections(struct TReactor* reactor) {
+    while (true) {
+        struct sockaddr_storage addr;
+        socklen_t addrSize = sizeof(addr);
+        int newfd = accept4(reactor->ListenFd, (struct sockaddr*)&addr, &addrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+#if (USING_RATE_LIMITER)
+        if (!RateLimiter_AdmitConnection(newfd, (struct sockaddr*)&addr)) {
+            continue;
+        }
+#endif
+
+        struct TConnection* connection = malloc(sizeof(struct TConnection));
+        if (connection == NULL) {
+            close(newfd);
+            continue;
+        }
+        TConnection_Init(connection, newfd);
+#if (USING_IO_POOL)
+        connection->DiskCompletions = &reactor->DiskCompletions;
+#endif
+        reactor->Connections++;
+#if (USING_RATE_LIMITER)
+        connection->ClientKey = RateLimiter_GetKey((struct sockaddr*)&addr);
+#endif
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        // Registered once for both directions: with EPOLLET every readiness change is reported
+        // exactly once, so the connection never has to be re-armed with epoll_ctl(MOD).
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(reactor->EpollFd, EPOLL_CTL_ADD, newfd, &event) == -1) {
+            perror("epoll_ctl");
+            CloseConnection(reactor, connection);
+            continue;
+        }
+        TTimerWheel_Schedule(&reactor->Timers, &connection->Timer, TConnection_GetDeadline(connection));
+        DEBUG_PRINT("reactor %d accepted fd %d\n", reactor->Index, newfd);
+    }
+}
+
+static void ProcessConnection(struct TReactor* reactor, struct TConnection* connection) {
+    if (TConnection_Process(connection) == CONNECTION_STATE_CLOSED
+        || (reactor->Draining && IsIdle(connection))) {
+        CloseConnection(reactor, connection);
+        return;
+    }
+    // moving a timer between slots is O(1), so it is simply re-armed after every event
+    TTimerWheel_Schedule(&reactor->Timers, &connection->Timer, TConnection_GetDeadline(connection));
+}
+
+static void CompleteDiskJobs(struct TReactor* reactor) {
+    struct TIoJob* job = TIoCompletions_TakeAll(&reactor->DiskCompletions);
+    while (job != NULL) {
+        struct TIoJob* next = job->Next;
+        struct TConnection* connection = (struct TConnection*)((char*)job - offsetof(struct TConnection, DiskJob));
+        if (connection->Fd == -1) {
+            FreeConnection(reactor, connection);  // closed while the job was running
+        } else {
+            TConnection_CompleteDiskJob(connection);
+            ProcessConnection(reactor, connection);
+        }
+        job = next;
+    }
+}
+
+static void OnConnectionTimeout(struct TTimer* timer, void* reactor_ptr) {
+    struct TConnection* connection = (struct TConnection*)((char*)timer - offsetof(struct TConnection, Timer));
+    DEBUG_PRINT("fd %d has missed its deadline\n", connection->Fd);
+    CloseConnection(reactor_ptr, connection);
+}
+
+static void CloseIfIdle(struct TTimer* timer, void* reactor_ptr) {
+    struct TConnection* connection = (struct TConnection*)((char*)timer - offsetof(struct TConnection, Timer));
+    if (IsIdle(connection)) {
+        CloseConnection(reactor_ptr, connection);
+    }
+}
+
+// The listener stays open for the other reactors, processes and the next binary
+static void StartDraining(struct TReactor* reactor) {
+    reactor->Draining = true;
+    reactor->DrainDeadlineMs = MonotonicMs() + DRAIN_TIMEOUT;
+    Lifecycle_SetStopping();  // a prefork worker: no keep-alive and no upgrades from now on
+    epoll_ctl(reactor->EpollFd, EPOLL_CTL_DEL, reactor->ListenFd, NULL);
+    epoll_ctl(reactor->EpollFd, EPOLL_CTL_DEL, Lifecycle_GetStopFd(), NULL);
+    // every connection has a deadline, so the wheel knows all of them
+    TTimerWheel_ForEach(&reactor->Timers, CloseIfIdle, reactor);
+    DEBUG_PRINT("reactor %d is draining %u connections\n", reactor->Index, reactor->Connections);
+}
+
+static void* ReactorMain(void* reactor_ptr) {
+    struct TReactor* reactor = reactor_ptr;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    if (reactor->Cpu != -1 && PinCurrentThread(reactor->Cpu)) {
+        DEBUG_PRINT("reactor %d is pinned to cpu %d\n", reactor->Index, reactor->Cpu);
+    }
+
+    TTimerWheel_Init(&reactor->Timers, MonotonicMs());
+    while (true) {
+        int timeout = TTimerWheel_GetTimeout(&reactor->Timers, MonotonicMs());
+        int count = epoll_wait(reactor->EpollFd, events, REACTOR_MAX_EVENTS, timeout);
+        if (count == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                return NULL;
+            }
+            count = 0;
+        }
+
+        bool has_disk_completions = false;
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == LISTENER_TAG) {
+                if (!reactor->Draining) {
+                    AcceptConnections(reactor);
+                }
+                continue;
+            }
+            if (events[i].data.ptr == STOP_TAG) {
+                if (!reactor->Draining) {
+                    StartDraining(reactor);
+                }
+                continue;
+            }
+            if (events[i].data.ptr == DISK_TAG) {
+                has_disk_completions = true;
+                continue;
+            }
+
+            struct TConnection* connection = events[i].data.ptr;
+            if (events[i].events & EPOLLERR) {
+                CloseConnection(reactor, connection);
+                continue;
+            }
+            // EPOLLHUP/EPOLLRDHUP are handled by the state machine: recv() returns 0 there
+            ProcessConnection(reactor, connection);
+        }
+
+        // after the batch: a connection closed here can not be referenced by a pending event anymore
+        if (has_disk_completions) {
+            CompleteDiskJobs(reactor);
+        }
+        TTimerWheel_Advance(&reactor->Timers, MonotonicMs(), OnConnectionTimeout, reactor);
+
+        if (reactor->Draining && (reactor->Connections == 0 || MonotonicMs() >= reactor->DrainDeadlineMs)) {
+            DEBUG_PRINT("reactor %d has drained, %u connections are cut off\n", reactor->Index, reactor->Connections);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static bool TReactor_Init(struct TReactor* self, int index, int listen_fd, int cpu, bool shared_listener) {
+    self->Index = index;
+    self->ListenFd = listen_fd;
+    self->Cpu = cpu;
+    self->Connections = 0;
+    self->Draining = false;
+    self->DrainDeadlineMs = 0;
+    self->EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (self->EpollFd == -1) {
+        perror("epoll_create1");
+        return false;
+    }
+    if (!SetNonBlocking(listen_fd)) {
+        close(self->EpollFd);
+        return false;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    if (shared_listener) {
+        // EPOLLEXCLUSIVE wakes only one of the reactors per incoming connection instead of all of them
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    event.data.ptr = LISTENER_TAG;
+    if (epoll_ctl(self->EpollFd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        perror("epoll_ctl listener");
+        close(self->EpollFd);
+        return false;
+    }
+
+    // level-triggered and never read, so it wakes every reactor of every process
+    event.events = EPOLLIN;
+    event.data.ptr = STOP_TAG;
+    if (epoll_ctl(self->EpollFd, EPOLL_CTL_ADD, Lifecycle_GetStopFd(), &event) == -1) {
+        perror("epoll_ctl stop fd");
+        close(self->EpollFd);
+        return false;
+    }
+
+    if (!TIoCompletions_Init(&self->DiskCompletions)) {
+        close(self->EpollFd);
+        return false;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = DISK_TAG;
+    if (epoll_ctl(self->EpollFd, EPOLL_CTL_ADD, self->DiskCompletions.EventFd, &event) == -1) {
+        perror("epoll_ctl io completions");
+        close(self->DiskCompletions.EventFd);
+        close(self->EpollFd);
+        return false;
+    }
+    return true;
+}
+
+static bool RunReactors(struct TReactor* reactors, int count) {
+    // the calling thread runs the first loop itself
+    for (int i = 1; i < count; ++i) {
+        int ret = pthread_create(&reactors[i].Thread, NULL, ReactorMain, &reactors[i]);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+            return false;
+        }
+    }
+    ReactorMain(&reactors[0]);
+    if (!reactors[0].Draining) {
+        return false;
+    }
+    for (int i = 1; i < count; ++i) {
+        pthread_join(reactors[i].Thread, NULL);
+    }
+    return true;
+}
+
+bool RunReactor(int listen_fd) {
+    RaiseOpenFilesLimit();
+#if (USING_IO_POOL)
+    IoPool_Start();
+#endif
+
+    struct TReactor reactors[NUM_REACTOR_THREADS];
+    for (int i = 0; i < NUM_REACTOR_THREADS; ++i) {
+        if (!TReactor_Init(&reactors[i], i, listen_fd, -1, true)) {
+            return false;
+        }
+    }
+    return RunReactors(reactors, NUM_REACTOR_THREADS);
+}
+
+bool RunReactorWorker(int listen_fd, int cpu) {
+    RaiseOpenFilesLimit();
+#if (USING_IO_POOL)
+    IoPool_Start();
+#endif
+
+    struct TReactor reactor;
+    if (!TReactor_Init(&reactor, 0, listen_fd, cpu, true)) {
+        return false;
+    }
+    ReactorMain(&reactor);
+    return reactor.Draining;
+}
+
+bool RunShardedReactors(const int* listen_fds, const int* cpus, int count) {
+    RaiseOpenFilesLimit();
+#if (USING_IO_POOL)
+    IoPool_Start();
+#endif
+
+    struct TReactor reactors[MAX_REACTOR_SHARDS];
+    for (int i = 0; i < count; ++i) {
+        int cpu = SHOULD_PIN_REACTORS ? cpus[i] : -1;
+        if (!TReactor_Init(&reactors[i], i, listen_fds[i], cpu, false)) {
+            return false;
+        }
+    }
+    return RunReactors(reactors, count);
+}
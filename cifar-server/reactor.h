@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Serves the already listening socket with NUM_REACTOR_THREADS edge-triggered epoll loops.
+// Every loop owns the connections it has accepted, so no locking is needed on the hot path.
+// Once the lifecycle stop fd fires, the loops stop accepting and close idle connections,
+// the functions return true after the rest is served or DRAIN_TIMEOUT has passed.
+bool RunReactor(int listen_fd);
+
+// Share-nothing variant: reactor i serves its own SO_REUSEPORT listener listen_fds[i]
+// and, when SHOULD_PIN_REACTORS is set, runs pinned to cpus[i].
+bool RunShardedReactors(const int* listen_fds, const int* cpus, int count);
+
+// A single loop in the calling thread, for worker processes that share the listener
+// with other processes. cpu is -1 if the loop should not be pinned.
+bool RunReactorWorker(int listen_fd, int cpu);
@@ -1,9 +1,13 @@
 #include "resources.h"
 #include "config.h"
 #include "bmp.h"
+#include "crc32c.h"
+#include "http_request.h"
+#include "shared_cache.h"
 #include "stringutils.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -34,6 +38,8 @@ static size_t g_mapped_pictures_size = NULL;
  */
 
 #define PAGE_TITLE "CIFAR Dataset Browser"
+#define STYLESHEET_PATH "static/bootstrap.min.css"
+#define LOGO_PATH "static/logo_en.svg"
 
 #define BUFSIZE 4096
 #define CIFAR_PATH "cifar/data_batch_1.bin"
@@ -43,6 +49,55 @@ static size_t g_mapped_pictures_size = NULL;
 #define CIFAR_TABLE_SIZE 10
 #define CIFAR_IMG_PER_PAGE (CIFAR_TABLE_SIZE * CIFAR_TABLE_SIZE)
 #define CIFAR_NUM_PAGES (CIFAR_NUM_IMAGES / CIFAR_IMG_PER_PAGE)
+#define CIFAR_BMP_SLOT_SIZE 4096  // a 32x32 24-bit bitmap with its headers is 3126 bytes
+
+// generated once by whichever process needs them first, shared by all of them (see InitCaches())
+static struct TSharedCache g_bitmap_cache;
+static struct TSharedCache g_page_cache;
+static bool g_caches_ready = false;
+
+static bool InitCaches()
+{
+#if (USING_SHARED_CACHE == 1)
+    if (!g_caches_ready)
+    {
+        // called before the server forks, so the mappings are inherited by every worker
+        g_caches_ready = TSharedCache_Init(&g_bitmap_cache, CIFAR_NUM_IMAGES, CIFAR_BMP_SLOT_SIZE) &&
+                         TSharedCache_Init(&g_page_cache, CIFAR_NUM_PAGES, SHARED_CACHE_PAGE_SLOT);
+    }
+    return g_caches_ready;
+#else
+    return true;
+#endif
+}
+
+// Replaces the body with the cached entry, returns false on a miss. An entry never changes
+// once filled, so the body references it instead of copying it.
+static bool ServeFromCache(struct TSharedCache* cache, int index, struct THttpResponse* response)
+{
+    size_t size;
+    const char* data = g_caches_ready ? TSharedCache_Get(cache, index, &size) : NULL;
+    if (data == NULL)
+    {
+        return false;
+    }
+    TStringBuilder_Clear(&response->Body);
+    TRope_Clear(&response->BodyRope);
+    TRope_AppendRef(&response->BodyRope, data, size);
+    response->BodyCached = true;
+    return true;
+}
+
+static void StoreInCache(struct TSharedCache* cache, int index, struct THttpResponse* response)
+{
+    if (g_caches_ready)
+    {
+        const struct iovec body = { .iov_base = response->Body.Data, .iov_len = response->Body.Length };
+        size_t count;
+        const struct iovec* segments = TRope_Gather(&response->BodyRope, &body, 1, &count);
+        TSharedCache_PutSegments(cache, index, segments, count);
+    }
+}
 
 static const char* ERROR_TEMPLATE =
 "<html>\n"
@@ -62,27 +117,53 @@ static void FormatErrorPageTemplate(struct TStringBuilder* sb, int code, const c
     TStringBuilder_Sprintf(sb, ERROR_TEMPLATE, code, message, code, message);
 }
 
+// The errors a client runs into every day have their pages formatted once, responses reference them
+static const enum EHttpCode PREBUILT_ERRORS[] = {
+    HTTP_BAD_REQUEST, HTTP_NOT_FOUND, HTTP_METHOD_NOT_ALLOWED, HTTP_INTERNAL_SERVER_ERROR,
+};
+#define PREBUILT_ERROR_COUNT (sizeof(PREBUILT_ERRORS) / sizeof(PREBUILT_ERRORS[0]))
+
+static struct TStringBuilder g_error_pages[PREBUILT_ERROR_COUNT];
+static pthread_once_t g_error_pages_once = PTHREAD_ONCE_INIT;
+
+static void BuildErrorPages(void) {
+    for (size_t i = 0; i < PREBUILT_ERROR_COUNT; ++i) {
+        TStringBuilder_Init(&g_error_pages[i]);
+        FormatErrorPageTemplate(&g_error_pages[i], PREBUILT_ERRORS[i], GetReasonPhrase(PREBUILT_ERRORS[i]));
+    }
+}
+
 void CreateErrorPage(struct THttpResponse* response, enum EHttpCode code) {
     response->Code = code;
-    response->ContentType = "text/html";
+    response->ContentType = CONTENT_TYPE_HTML;
+    TRope_Clear(&response->BodyRope);
+    response->BodyCached = false;
+    pthread_once(&g_error_pages_once, BuildErrorPages);
+    for (size_t i = 0; i < PREBUILT_ERROR_COUNT; ++i) {
+        if (PREBUILT_ERRORS[i] == code) {
+            TStringBuilder_Clear(&response->Body);
+            TRope_AppendRef(&response->BodyRope, g_error_pages[i].Data, g_error_pages[i].Length);
+            return;
+        }
+    }
     FormatErrorPageTemplate(&response->Body, code, GetReasonPhrase(code));
 }
 
-static const char* INDEX_TEMPLATE_HEADER =
+static const char INDEX_TEMPLATE_HEADER[] =
 "<html>\n"
 "<head>\n"
 "  <title>" PAGE_TITLE "</title>\n"
 "  <meta charset=\"utf-8\">\n"
 "  <meta name=\"viewport\" content=\"width=device-width, initial-scale=1, shrink-to-fit=no\">\n"
-"  <link rel=\"stylesheet\" href=\"static/bootstrap.min.css\">\n"
+"  <link rel=\"stylesheet\" href=\"" STYLESHEET_PATH "\">\n"
 "  <style>.pic { width: 48px; height: 48px; }</style>"
 "</head>\n"
 "<body>\n"
 "  <div class=\"container\">\n"
-"    <img src=\"static/logo_en.svg\" width=\"232\" height=\"97\" class=\"float-right\">\n"
+"    <img src=\"" LOGO_PATH "\" width=\"232\" height=\"97\" class=\"float-right\">\n"
 "    <h1>" PAGE_TITLE "</h1>\n";
 
-static const char* DIR_OUTPUT_HEADER_TEMPLATE =
+static const char DIR_OUTPUT_HEADER_TEMPLATE[] =
 "<html>\n"
 "<head>\n"
 "  <title>" PAGE_TITLE "</title>\n"
@@ -94,41 +175,91 @@ static const char* DIR_OUTPUT_HEADER_TEMPLATE =
 "  <div class=\"container\">\n"
 "    <h1>" PAGE_TITLE "</h1>\n";
 
-static const char* INDEX_TEMPLATE_FOOTER =
+static const char INDEX_TEMPLATE_FOOTER[] =
 "  </div>\n"
 "</body>\n"
 "</html>\n";
 
+// Everything the page loads, so the browser fetches it while the page is still on its way
+static const char* g_preload_links[CIFAR_NUM_PAGES];  // formatted on the first request of a page
+
+static char* FormatPreloadLinks(int page) {
+    struct TStringBuilder links;
+    TStringBuilder_Init(&links);
+    TStringBuilder_AppendCStr(&links, "</" STYLESHEET_PATH ">; rel=preload; as=style, "
+                                      "</" LOGO_PATH ">; rel=preload; as=image");
+    const int first = page * CIFAR_IMG_PER_PAGE;
+    for (int img = first; img < first + CIFAR_IMG_PER_PAGE; ++img) {
+        TStringBuilder_Sprintf(&links, ", </images/%d.bmp>; rel=preload; as=image", img);
+    }
+#if (PREFETCH_NEXT_PAGE == 1)
+    const int next = (page + 1 < CIFAR_NUM_PAGES) ? (page + 1) * CIFAR_IMG_PER_PAGE : 0;
+    for (int img = next; img < next + CIFAR_IMG_PER_PAGE; ++img) {
+        TStringBuilder_Sprintf(&links, ", </images/%d.bmp>; rel=prefetch", img);
+    }
+#endif
+    return links.Data;
+}
+
+static const char* GetPreloadLinks(int page) {
+    const char* links = __atomic_load_n(&g_preload_links[page], __ATOMIC_ACQUIRE);
+    if (links != NULL) {
+        return links;
+    }
+    char* formatted = FormatPreloadLinks(page);
+    // a racing thread may have stored the same links first, they are kept for the life of the process
+    if (__atomic_compare_exchange_n(&g_preload_links[page], &links, formatted, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return formatted;
+    }
+    free(formatted);
+    return links;
+}
+
 void CreateIndexPage(struct THttpResponse* response, int page) {
     if (page < 0 || page >= CIFAR_NUM_PAGES) {
         CreateErrorPage(response, HTTP_NOT_FOUND);
         return;
     }
+    response->ContentType = CONTENT_TYPE_HTML;
+    response->Link = GetPreloadLinks(page);
+    if (ServeFromCache(&g_page_cache, page, response)) {
+        return;
+    }
+    // the markup is referenced from the templates, only the numbers are formatted
+    struct TRope* body = &response->BodyRope;
+    TRope_Reserve(body, 5 * CIFAR_IMG_PER_PAGE + 2 * CIFAR_TABLE_SIZE + 8);
+    TRope_AppendLiteral(body, INDEX_TEMPLATE_HEADER);
+    TRope_AppendLiteral(body, "<h3>Page ");
+    TRope_AppendInt(body, page);
+    TRope_AppendLiteral(body, "</h3>\n"
+                              "<div class=\"form-group\">\n"
+                              "<table>\n");
     int img = page * CIFAR_IMG_PER_PAGE;
-
-    response->ContentType = "text/html";
-    TStringBuilder_AppendCStr(&response->Body, INDEX_TEMPLATE_HEADER);
-    TStringBuilder_Sprintf(&response->Body, "<h3>Page %d</h3>\n", page);
-    TStringBuilder_AppendCStr(&response->Body, "<div class=\"form-group\">\n");
-
-    TStringBuilder_AppendCStr(&response->Body, "<table>\n");
     for (int i = 0; i < CIFAR_TABLE_SIZE; ++i) {
-        TStringBuilder_AppendCStr(&response->Body, "<tr>\n");
+        TRope_AppendLiteral(body, "<tr>\n");
         for (int j = 0; j < CIFAR_TABLE_SIZE; ++j) {
-            TStringBuilder_Sprintf(&response->Body, "<td><img class=\"pic\" src=\"images/%d.bmp\" alt=\"#%d\"></td>", img, img);
+            TRope_AppendLiteral(body, "<td><img class=\"pic\" src=\"images/");
+            TRope_AppendInt(body, img);
+            TRope_AppendLiteral(body, ".bmp\" alt=\"#");
+            TRope_AppendInt(body, img);
+            TRope_AppendLiteral(body, "\"></td>");
             ++img;
         }
-        TStringBuilder_AppendCStr(&response->Body, "</tr>\n");
+        TRope_AppendLiteral(body, "</tr>\n");
     }
-    TStringBuilder_AppendCStr(&response->Body, "</table>\n");
-    TStringBuilder_AppendCStr(&response->Body, "</div>\n");
-
-    TStringBuilder_AppendCStr(&response->Body, "<div class=\"form-group\">\n");
-    TStringBuilder_Sprintf(&response->Body, "<a href=\"?page=%d\" class=\"btn btn-secondary\">Previous</a>\n", (page > 0) ? page - 1 : CIFAR_NUM_PAGES - 1);
-    TStringBuilder_Sprintf(&response->Body, "<a href=\"?page=%d\" class=\"btn btn-primary\">Next</a>\n", (page + 1 < CIFAR_NUM_PAGES) ? page + 1 : 0);
-    TStringBuilder_AppendCStr(&response->Body, "</div>\n");
-
-    TStringBuilder_AppendCStr(&response->Body, INDEX_TEMPLATE_FOOTER);
+    TRope_AppendLiteral(body, "</table>\n"
+                              "</div>\n"
+                              "<div class=\"form-group\">\n"
+                              "<a href=\"?page=");
+    TRope_AppendInt(body, (page > 0) ? page - 1 : CIFAR_NUM_PAGES - 1);
+    TRope_AppendLiteral(body, "\" class=\"btn btn-secondary\">Previous</a>\n"
+                              "<a href=\"?page=");
+    TRope_AppendInt(body, (page + 1 < CIFAR_NUM_PAGES) ? page + 1 : 0);
+    TRope_AppendLiteral(body, "\" class=\"btn btn-primary\">Next</a>\n"
+                              "</div>\n");
+    TRope_AppendLiteral(body, INDEX_TEMPLATE_FOOTER);
+    StoreInCache(&g_page_cache, page, response);
 }
 
 #if (USING_MMAP_INSTEAD_READ == 1)
@@ -157,6 +288,10 @@ void unmap_gmapped_pictured()
 #if (USING_MMAP_INSTEAD_READ == 1)
 bool preload_pictures()
 {
+    if (!InitCaches())
+    {
+        return false;
+    }
     DEBUG_PRINT("preloading pictures\n");
     if(NULL == g_mapped_pictures_addr)
     {
@@ -190,12 +325,12 @@ bool preload_pictures()
 #else
 bool preload_pictures()
 {
-    return true;
+    return InitCaches();
 }
 #endif
 
 #if (USING_MMAP_INSTEAD_READ == 1)
-static bool Load(int n, char** data, size_t* size)
+static bool LoadBlob(int n, uint8_t* blob)
 {
     if(NULL == g_mapped_pictures_addr)
     {
@@ -232,13 +367,11 @@ static bool Load(int n, char** data, size_t* size)
         return false;
     }
 
-    uint8_t tmpBuf[CIFAR_BLOB_SIZE];
-    memcpy(tmpBuf, g_mapped_pictures_addr + n * CIFAR_BLOB_SIZE, CIFAR_BLOB_SIZE);
-    bool result = BuildBmpFileData(CIFAR_IMG_SIZE, CIFAR_IMG_SIZE, tmpBuf + 1, data, size);
-    return result;
+    memcpy(blob, g_mapped_pictures_addr + n * CIFAR_BLOB_SIZE, CIFAR_BLOB_SIZE);
+    return true;
 }
 #else
-static bool Load(int n, char** data, size_t* size) {
+static bool LoadBlob(int n, uint8_t* blob) {
     int fd = open(CIFAR_PATH, O_RDONLY);
     if (fd == -1) {
         return false;
@@ -247,42 +380,90 @@ static bool Load(int n, char** data, size_t* size) {
         close(fd);
         return false;
     }
-    uint8_t tmpBuf[CIFAR_BLOB_SIZE];
-    if (read(fd, tmpBuf, CIFAR_BLOB_SIZE) != CIFAR_BLOB_SIZE) {
+    if (read(fd, blob, CIFAR_BLOB_SIZE) != CIFAR_BLOB_SIZE) {
         close(fd);
         return false;
     }
-    bool result = BuildBmpFileData(CIFAR_IMG_SIZE, CIFAR_IMG_SIZE, tmpBuf + 1, data, size);
-    // "tmpBuf + 1" to skip a CIFAR class marker
     close(fd);
-    return result;
+    return true;
 }
 #endif
 
-void SendCifarBitmap(struct THttpResponse* response, int number) {
+// The dataset never changes, so an image's checksum is computed once per process.
+// Bit 32 marks the entry as known, a checksum may well be 0.
+static uint64_t g_bitmap_checksums[CIFAR_NUM_IMAGES];
+
+static bool GetBitmapChecksum(int n, uint8_t* blob, bool* loaded, uint32_t* checksum) {
+    uint64_t entry = __atomic_load_n(&g_bitmap_checksums[n], __ATOMIC_RELAXED);
+    if (entry == 0) {
+        if (!LoadBlob(n, blob)) {
+            return false;
+        }
+        *loaded = true;
+        entry = (1ULL << 32) | Crc32c(0, blob, CIFAR_BLOB_SIZE);
+        __atomic_store_n(&g_bitmap_checksums[n], entry, __ATOMIC_RELAXED);
+    }
+    *checksum = (uint32_t)entry;
+    return true;
+}
+
+// Replaces the body with the generated bitmap, `blob` already holds the image if `loaded`
+static bool BuildBitmap(int n, uint8_t* blob, bool loaded, struct THttpResponse* response) {
     char* data;
     size_t size;
-    if (0 <= number && number < CIFAR_NUM_IMAGES) {
-        if (Load(number, &data, &size)) {
-            response->ContentType = "image/bmp";
-            TStringBuilder_Clear(&response->Body);
-            TStringBuilder_AppendBuf(&response->Body, data, size);
-            free(data);
-        } else {
-            CreateErrorPage(response, HTTP_INTERNAL_SERVER_ERROR);
-        }
-    } else {
+    // "blob + 1" to skip a CIFAR class marker
+    if (!(loaded || LoadBlob(n, blob)) || !BuildBmpFileData(CIFAR_IMG_SIZE, CIFAR_IMG_SIZE, blob + 1, &data, &size)) {
+        return false;
+    }
+    TStringBuilder_Clear(&response->Body);
+    TStringBuilder_AppendBuf(&response->Body, data, size);
+    free(data);
+    StoreInCache(&g_bitmap_cache, n, response);
+    return true;
+}
+
+void SendCifarBitmap(struct THttpResponse* response, const struct THttpRequest* request, int number) {
+    uint8_t blob[CIFAR_BLOB_SIZE];
+    bool loaded = false;
+    uint32_t checksum;
+    if (!(0 <= number && number < CIFAR_NUM_IMAGES)) {
         CreateErrorPage(response, HTTP_NOT_FOUND);
+        return;
     }
+    if (!GetBitmapChecksum(number, blob, &loaded, &checksum)) {
+        CreateErrorPage(response, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    // the bitmap is built from the blob alone, so the blob's checksum is a strong validator
+    char etag[ETAG_SIZE];
+    snprintf(etag, sizeof(etag), "\"%08x\"", checksum);
+    if (THttpRequest_IsNotModified(request, etag, 0)) {
+        THttpResponse_SetNotModified(response);
+    } else if (!ServeFromCache(&g_bitmap_cache, number, response) && !BuildBitmap(number, blob, loaded, response)) {
+        CreateErrorPage(response, HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+    memcpy(response->ETag, etag, sizeof(etag));
+    response->CacheControl = IMAGES_CACHE_CONTROL;
+    response->ContentType = CONTENT_TYPE_BMP;
+}
+
+bool IsCifarBitmapInMemory(int number) {
+    if (!(0 <= number && number < CIFAR_NUM_IMAGES)) {
+        return true;  // a 404
+    }
+    size_t size;
+    return __atomic_load_n(&g_bitmap_checksums[number], __ATOMIC_RELAXED) != 0 &&
+           g_caches_ready && TSharedCache_Get(&g_bitmap_cache, number, &size) != NULL;
 }
 
 const struct {
     const char* Extension;
     const char* MimeType;
 } MIME_TYPES[] = {
-    {".svg", "image/svg+xml"},
-    {".css", "text/css"},
-    {".txt", "text/plain"},
+    {".svg", CONTENT_TYPE_SVG},
+    {".css", CONTENT_TYPE_CSS},
+    {".txt", CONTENT_TYPE_PLAIN},
     {NULL, NULL},
 };
 
@@ -312,90 +493,141 @@ static bool ReadWholeFile(int fd, struct TStringBuilder* body) {
 }
 #endif
 
-bool listdir(const char *name, int indent, struct THttpResponse* response)
+#define DIR_LISTING_MAX_DEPTH 32  // deeper directories are listed without their contents
+
+// The listing of a directory tree, one BODY_STREAM_CHUNK at a time: a depth-first walk that keeps
+// the open directories of the current path, so it can stop after any entry and go on from there
+struct TDirListingStream {
+    struct THttpBodyStream Base;
+    DIR* Dirs[DIR_LISTING_MAX_DEPTH];
+    size_t PathLengths[DIR_LISTING_MAX_DEPTH];  // of Path for each of the open directories
+    int Depth;
+    struct TStringBuilder Path;  // of the deepest open directory
+    char* PathRequested;
+    bool HeaderSent;
+};
+
+static void AppendDirListingEntry(struct TStringBuilder* out, const char* path, const char* name, int indent, bool is_dir)
 {
-    DIR *dir = opendir(name);
-    struct dirent *entry;
+    const char *shortend_path = strstr(path, "/static");
+    if(NULL != shortend_path)
+    {
+        TStringBuilder_Sprintf(out, is_dir ? "<div><a href=\"%s\">" : "<div><a href=\"%s/%s\">", shortend_path, name);
+    }
+    else
+    {
+        TStringBuilder_AppendCStr(out, "<div><a href=\"\">");
+    }
+    for(int i = 0; i < indent; i++)
+    {
+        TStringBuilder_AppendCStr(out, "-");
+    }
+    TStringBuilder_Sprintf(out, is_dir ? "[%s]\n" : "%s\n", name);
+    TStringBuilder_AppendCStr(out, "</a></div>\n");
+}
 
+static bool OpenListedDir(struct TDirListingStream* self)
+{
+    DIR *dir = opendir(self->Path.Data);
     if (NULL == dir)
     {
         perror("opendir");
         return false;
     }
+    self->Dirs[self->Depth] = dir;
+    self->PathLengths[self->Depth] = self->Path.Length;
+    self->Depth++;
+    return true;
+}
 
-    bool is_success = true;
-
-    for(entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
-        if (DT_DIR == entry->d_type) {
-            struct TStringBuilder path;
-            TStringBuilder_Init(&path);
-
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-            
-            TStringBuilder_Sprintf(&path, "%s/%s", name, entry->d_name);
-            char *shortend_path = strstr(path.Data, "/static");
-
-            if(NULL != shortend_path)
-            {
-                TStringBuilder_Sprintf(&response->Body, "<div><a href=\"%s\">", shortend_path);
-            }
-            else
-            {
-                TStringBuilder_AppendCStr(&response->Body, "<div><a href=\"\">");
-            }
-            
-            for(int i = 0; i < indent; i++)
-            {
-                TStringBuilder_AppendCStr(&response->Body, "-");
-            }
-            TStringBuilder_Sprintf(&response->Body, "[%s]\n", entry->d_name);
-            TStringBuilder_AppendCStr(&response->Body, "</a></div>\n");
+static enum EBodyStreamResult GenerateDirListing(struct THttpBodyStream* stream, struct TStringBuilder* out)
+{
+    struct TDirListingStream* self = (struct TDirListingStream*)stream;
+    if (!self->HeaderSent)
+    {
+        TStringBuilder_AppendCStr(out, DIR_OUTPUT_HEADER_TEMPLATE);
+        TStringBuilder_Sprintf(out, "<h3>Dir %s listing:</h3>\n", self->PathRequested);
+        TStringBuilder_AppendCStr(out, "<div class=\"form-group\">\n");
+        self->HeaderSent = true;
+    }
 
-            is_success = listdir(path.Data, indent + 1, response) & is_success;
-            if(!is_success)
+    const size_t start = out->Length;
+    while (self->Depth != 0 && out->Length - start < BODY_STREAM_CHUNK)
+    {
+        struct dirent *entry = readdir(self->Dirs[self->Depth - 1]);
+        if (NULL == entry)
+        {
+            closedir(self->Dirs[--self->Depth]);
+            if (self->Depth != 0)
             {
-                TStringBuilder_Destroy(&path);
-                return false;
+                TStringBuilder_Truncate(&self->Path, self->PathLengths[self->Depth - 1]);
             }
-            TStringBuilder_Destroy(&path);
+            continue;
         }
-        else
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
         {
-            char *shortend_path = strstr(name, "/static");
-            if(NULL != shortend_path)
-            {
-                TStringBuilder_Sprintf(&response->Body, "<div><a href=\"%s/%s\">", shortend_path, entry->d_name);
-            }
-            else
-            {
-                TStringBuilder_AppendCStr(&response->Body, "<div><a href=\"\">");
-            }
-
-            for(int i = 0; i < indent; i++)
-            {
-                TStringBuilder_AppendCStr(&response->Body, "-");
-            }
-            TStringBuilder_Sprintf(&response->Body,"%s\n", entry->d_name);
-            
-            TStringBuilder_AppendCStr(&response->Body, "</a></div>\n");
+            continue;
+        }
+        if (DT_DIR != entry->d_type)
+        {
+            AppendDirListingEntry(out, self->Path.Data, entry->d_name, self->Depth, false);
+            continue;
+        }
+        TStringBuilder_Sprintf(&self->Path, "/%s", entry->d_name);
+        AppendDirListingEntry(out, self->Path.Data, entry->d_name, self->Depth, true);
+        if (self->Depth == DIR_LISTING_MAX_DEPTH)
+        {
+            TStringBuilder_Truncate(&self->Path, self->PathLengths[self->Depth - 1]);
+        }
+        else if (!OpenListedDir(self))
+        {
+            return BODY_STREAM_FAILED;
         }
     }
-    closedir(dir);
-    return is_success;
+    if (self->Depth != 0)
+    {
+        return BODY_STREAM_MORE;
+    }
+    TStringBuilder_AppendCStr(out, "</div>\n");
+    TStringBuilder_AppendCStr(out, INDEX_TEMPLATE_FOOTER);
+    return BODY_STREAM_END;
 }
 
-bool prepare_page_for_the_dir_listing(const char *path, const char *path_requested, struct THttpResponse* response)
+static void DestroyDirListing(struct THttpBodyStream* stream)
 {
-    TStringBuilder_AppendCStr(&response->Body, DIR_OUTPUT_HEADER_TEMPLATE);
-    TStringBuilder_Sprintf(&response->Body, "<h3>Dir %s listing:</h3>\n", path_requested);
-    TStringBuilder_AppendCStr(&response->Body, "<div class=\"form-group\">\n");
-
-    bool ex_result = listdir(path, 1, response);
+    struct TDirListingStream* self = (struct TDirListingStream*)stream;
+    while (self->Depth != 0)
+    {
+        closedir(self->Dirs[--self->Depth]);
+    }
+    TStringBuilder_Destroy(&self->Path);
+    free(self->PathRequested);
+    free(self);
+}
 
-    TStringBuilder_AppendCStr(&response->Body, "</div>\n");
-    TStringBuilder_AppendCStr(&response->Body, INDEX_TEMPLATE_FOOTER);
-    return ex_result;
+// The listing is streamed as it is read, the top directory is opened right away so a failure is still a 500
+static bool StreamDirListing(const char *path, const char *path_requested, struct THttpResponse* response)
+{
+    struct TDirListingStream* stream = malloc(sizeof(struct TDirListingStream));
+    if (NULL == stream)
+    {
+        return false;
+    }
+    stream->Base.Generate = GenerateDirListing;
+    stream->Base.Destroy = DestroyDirListing;
+    stream->Depth = 0;
+    TStringBuilder_Init(&stream->Path);
+    TStringBuilder_AppendCStr(&stream->Path, path);
+    stream->PathRequested = strdup(path_requested);
+    stream->HeaderSent = false;
+    if (NULL == stream->PathRequested || !OpenListedDir(stream))
+    {
+        DestroyDirListing(&stream->Base);
+        return false;
+    }
+    response->ContentType = CONTENT_TYPE_HTML;
+    response->BodyStream = &stream->Base;
+    return true;
 }
 
 int percent_url_decode(char* out, const char* in)
@@ -436,7 +668,7 @@ int percent_url_decode(char* out, const char* in)
     return 0;
 }
 
-void SendStaticFile(struct THttpResponse* response, const char* path) {
+void SendStaticFile(struct THttpResponse* response, const struct THttpRequest* request, const char* path) {
     printf("requested path: %s\n", path);
 
     char *path_decoded = calloc(strlen(path) + 1, sizeof(char));
@@ -478,20 +710,52 @@ void SendStaticFile(struct THttpResponse* response, const char* path) {
     if(S_ISDIR(file_stat_buf.st_mode))
     {
         DEBUG_PRINT("given path is a folder\n");
-        if(prepare_page_for_the_dir_listing(passed_real_path, path, response) == false)
+        if(StreamDirListing(passed_real_path, path, response) == false)
         {
             CreateErrorPage(response, HTTP_INTERNAL_SERVER_ERROR);
         }
+        free(passed_real_path);
+        free(static_real_path);
+        free(path_decoded);
         return;
     }
 
     response->ContentType = GuessContentType(path);
+    response->file_modification_time = file_stat_buf.st_mtime;
+    // nanoseconds and size as well: a file rewritten within a second still gets a new tag
+    snprintf(response->ETag, ETAG_SIZE, "\"%lx.%lx-%llx\"", (long)file_stat_buf.st_mtim.tv_sec,
+             file_stat_buf.st_mtim.tv_nsec, (unsigned long long)file_stat_buf.st_size);
+    if (THttpRequest_IsNotModified(request, response->ETag, response->file_modification_time))
+    {
+        THttpResponse_SetNotModified(response);
+        free(passed_real_path);
+        free(static_real_path);
+        free(path_decoded);
+        return;
+    }
 
     #if (USING_SENDFILE == 1)
     response->should_use_sendfile = true;
     response->file_path_requested = passed_real_path;
     response->sent_file_size = file_stat_buf.st_size;
-    response->file_modification_time = file_stat_buf.st_mtime;
+
+    struct THttpByteRange ranges[MAX_BYTE_RANGES];
+    size_t range_count;
+    enum EHttpRangeResult range_result = RANGE_NONE;
+    if (THttpRequest_IsRangeCurrent(request, response->ETag, response->file_modification_time))
+    {
+        range_result = THttpRequest_GetRanges(request, response->sent_file_size, ranges, &range_count);
+    }
+    if (RANGE_SATISFIABLE == range_result)
+    {
+        THttpResponse_SetRanges(response, ranges, range_count);
+    }
+    else if (RANGE_NOT_SATISFIABLE == range_result)
+    {
+        // the error page is sent from memory, the size is only reported in Content-Range
+        CreateErrorPage(response, HTTP_RANGE_NOT_SATISFIABLE);
+        response->should_use_sendfile = false;
+    }
 
     // passed_real_path will be used later so can not be freed here
     free(static_real_path);
@@ -506,6 +770,8 @@ void SendStaticFile(struct THttpResponse* response, const char* path) {
     }
     if (!ReadWholeFile(fd, &response->Body)) {
         CreateErrorPage(response, HTTP_INTERNAL_SERVER_ERROR);
+        response->ETag[0] = '\0';
+        response->file_modification_time = 0;
     }
     close(fd);
     free(passed_real_path);
@@ -1,10 +1,15 @@
 #pragma once
 
 #include "http_response.h"
+
+struct THttpRequest;
 #define CUSTOM_LINE_FOR_WARMUP "Server: my custom cifar server"
 
 void CreateErrorPage(struct THttpResponse* response, enum EHttpCode code);
 void CreateIndexPage(struct THttpResponse* response, int page);
-void SendCifarBitmap(struct THttpResponse* response, int number);
-void SendStaticFile(struct THttpResponse* response, const char* path);
+// Both answer a request that the client's copy is still current with a 304
+void SendCifarBitmap(struct THttpResponse* response, const struct THttpRequest* request, int number);
+// False if SendCifarBitmap may still read the image from the disk: its checksum or its bitmap is not known yet
+bool IsCifarBitmapInMemory(int number);
+void SendStaticFile(struct THttpResponse* response, const struct THttpRequest* request, const char* path);
 bool preload_pictures();
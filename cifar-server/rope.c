@@ -0,0 +1,146 @@
+#include "rope.h"
+
+#include "stringutils.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_SEGMENTS 16
+#define SCRATCH_BLOCK_SIZE 2048  // the numbers of an index page fit into one
+#define MAX_INT_DIGITS 11  // "-2147483648"
+
+struct TRopeBlock {
+    struct TRopeBlock* Next;
+    size_t Used;
+    size_t Size;
+    char Data[];
+};
+
+void TRope_Init(struct TRope* self) {
+    self->Segments_ = NULL;
+    self->Count = 0;
+    self->Capacity_ = 0;
+    self->Length = 0;
+    self->Scratch_ = NULL;
+}
+
+void TRope_Destroy(struct TRope* self) {
+    while (self->Scratch_ != NULL) {
+        struct TRopeBlock* next = self->Scratch_->Next;
+        free(self->Scratch_);
+        self->Scratch_ = next;
+    }
+    free(self->Segments_);
+}
+
+void TRope_Clear(struct TRope* self) {
+    // the newest block is kept for the next pieces
+    if (self->Scratch_ != NULL) {
+        struct TRopeBlock* older = self->Scratch_->Next;
+        self->Scratch_->Next = NULL;
+        self->Scratch_->Used = 0;
+        while (older != NULL) {
+            struct TRopeBlock* next = older->Next;
+            free(older);
+            older = next;
+        }
+    }
+    self->Count = 0;
+    self->Length = 0;
+}
+
+void TRope_Reserve(struct TRope* self, size_t count) {
+    if (self->Count + count <= self->Capacity_) {
+        return;
+    }
+    size_t capacity = self->Capacity_ != 0 ? self->Capacity_ : INITIAL_SEGMENTS;
+    while (capacity < self->Count + count) {
+        capacity *= 2;
+    }
+    struct iovec* segments = realloc(self->Segments_, (ROPE_HEADROOM + capacity) * sizeof(struct iovec));
+    if (segments == NULL) {  // almost impossible with current allocators
+        abort();
+    }
+    self->Segments_ = segments;
+    self->Capacity_ = capacity;
+}
+
+// Extends the last segment when the bytes follow it right away: consecutive formatted pieces are one segment
+static void AppendSegment(struct TRope* self, const char* data, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    self->Length += size;
+    if (self->Count != 0) {
+        struct iovec* last = &self->Segments_[ROPE_HEADROOM + self->Count - 1];
+        if ((const char*)last->iov_base + last->iov_len == data) {
+            last->iov_len += size;
+            return;
+        }
+    }
+    TRope_Reserve(self, 1);
+    self->Segments_[ROPE_HEADROOM + self->Count] = (struct iovec){ .iov_base = (void*)data, .iov_len = size };
+    ++self->Count;
+}
+
+void TRope_AppendRef(struct TRope* self, const char* data, size_t size) {
+    AppendSegment(self, data, size);
+}
+
+static char* AllocateScratch(struct TRope* self, size_t size) {
+    struct TRopeBlock* block = self->Scratch_;
+    if (block == NULL || block->Size - block->Used < size) {
+        const size_t blockSize = size > SCRATCH_BLOCK_SIZE ? size : SCRATCH_BLOCK_SIZE;
+        block = malloc(sizeof(struct TRopeBlock) + blockSize);
+        if (block == NULL) {  // almost impossible with current allocators
+            abort();
+        }
+        block->Next = self->Scratch_;
+        block->Used = 0;
+        block->Size = blockSize;
+        self->Scratch_ = block;
+    }
+    char* result = block->Data + block->Used;
+    block->Used += size;
+    return result;
+}
+
+void TRope_AppendCopy(struct TRope* self, const char* data, size_t size) {
+    char* copy = AllocateScratch(self, size);
+    memcpy(copy, data, size);
+    AppendSegment(self, copy, size);
+}
+
+void TRope_AppendInt(struct TRope* self, int value) {
+    char digits[MAX_INT_DIGITS];
+    // unsigned, so that the magnitude of INT_MIN does not overflow
+    char* p = FormatUIntBackwards(value < 0 ? 0u - (unsigned)value : (unsigned)value, digits + sizeof(digits));
+    if (value < 0) {
+        *--p = '-';
+    }
+    TRope_AppendCopy(self, p, digits + sizeof(digits) - p);
+}
+
+const struct iovec* TRope_GetSegments(const struct TRope* self) {
+    return self->Segments_ != NULL ? self->Segments_ + ROPE_HEADROOM : NULL;
+}
+
+void TRope_CopyTo(const struct TRope* self, struct TStringBuilder* out) {
+    TStringBuilder_Reserve(out, self->Length);
+    const struct iovec* segments = TRope_GetSegments(self);
+    for (size_t i = 0; i < self->Count; ++i) {
+        TStringBuilder_AppendBuf(out, segments[i].iov_base, segments[i].iov_len);
+    }
+}
+
+struct iovec* TRope_Gather(struct TRope* self, const struct iovec* prefix, size_t prefix_count, size_t* count) {
+    assert(prefix_count <= ROPE_HEADROOM);
+    if (self->Segments_ == NULL) {
+        TRope_Reserve(self, 1);  // an empty rope has no array yet
+    }
+    struct iovec* first = self->Segments_ + ROPE_HEADROOM - prefix_count;
+    memcpy(first, prefix, prefix_count * sizeof(struct iovec));
+    *count = prefix_count + self->Count;
+    return first;
+}
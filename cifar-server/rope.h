@@ -0,0 +1,48 @@
+#pragma once
+
+#include "stringbuilder.h"
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * A body assembled from segments instead of one growing buffer.
+ *
+ * Constant bytes (the page templates, a cached entry) are referenced where they are and
+ * never copied, only the formatted pieces are written to a scratch arena of the rope, whose
+ * blocks never move once allocated. The segments are an iovec array that goes to sendmsg()
+ * as it is, with ROPE_HEADROOM slots in front of it for the headers.
+ */
+
+#define ROPE_HEADROOM 2
+
+struct TRopeBlock;
+
+struct TRope {
+    struct iovec* Segments_;  // ROPE_HEADROOM slots, then Count segments
+    size_t Count;
+    size_t Capacity_;  // segments, not counting the headroom
+    size_t Length;  // of all the segments
+    struct TRopeBlock* Scratch_;  // the newest block first
+};
+
+void TRope_Init(struct TRope* self);
+void TRope_Destroy(struct TRope* self);
+void TRope_Clear(struct TRope* self);
+// Makes room for `count` more segments, so that they are added without reallocations
+void TRope_Reserve(struct TRope* self, size_t count);
+
+// References `size` bytes at `data`, which must stay unchanged for as long as the rope is used
+void TRope_AppendRef(struct TRope* self, const char* data, size_t size);
+#define TRope_AppendLiteral(self, literal) TRope_AppendRef((self), (literal), sizeof(literal) - 1)
+// Copies the bytes to the scratch arena
+void TRope_AppendCopy(struct TRope* self, const char* data, size_t size);
+// Formats the decimal to the scratch arena
+void TRope_AppendInt(struct TRope* self, int value);
+
+const struct iovec* TRope_GetSegments(const struct TRope* self);
+// Flattens the rope onto the end of `out`, growing it once
+void TRope_CopyTo(const struct TRope* self, struct TStringBuilder* out);
+// The segments preceded by `prefix` (at most ROPE_HEADROOM of them) for a single gather write,
+// `count` is set to the number of them all. A write tracking its progress in the array consumes the rope.
+struct iovec* TRope_Gather(struct TRope* self, const struct iovec* prefix, size_t prefix_count, size_t* count);
@@ -0,0 +1,194 @@
+#include "router.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INT_PARAM "{int}"
+
+static struct TRouteNode* CreateNode(const char* label, size_t length) {
+    struct TRouteNode* node = calloc(1, sizeof(struct TRouteNode));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->Label = malloc(length + 1);
+    if (node->Label == NULL) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->Label, label, length);
+    node->Label[length] = '\0';
+    node->LabelLength = length;
+    return node;
+}
+
+static void DestroyNode(struct TRouteNode* node) {
+    if (node == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(node->Literals) / sizeof(node->Literals[0]); ++i) {
+        DestroyNode(node->Literals[i]);
+    }
+    DestroyNode(node->IntParam);
+    free(node->Label);
+    free(node);
+}
+
+void TRouter_Init(struct TRouter* self) {
+    self->Root = NULL;
+}
+
+void TRouter_Destroy(struct TRouter* self) {
+    DestroyNode(self->Root);
+    self->Root = NULL;
+}
+
+// Follows the literal bytes from `node`, splitting the label of an edge they leave halfway
+static struct TRouteNode* InsertLiteral(struct TRouteNode* node, const char* s, size_t length) {
+    while (length != 0) {
+        const unsigned char first = *s;
+        if (first >= 128) {
+            return NULL;
+        }
+        struct TRouteNode* child = node->Literals[first];
+        if (child == NULL) {
+            child = CreateNode(s, length);
+            node->Literals[first] = child;
+            return child;
+        }
+        size_t common = 1;
+        while (common < length && common < child->LabelLength && s[common] == child->Label[common]) {
+            ++common;
+        }
+        if (common < child->LabelLength) {
+            struct TRouteNode* middle = CreateNode(child->Label, common);
+            if (middle == NULL) {
+                return NULL;
+            }
+            child->LabelLength -= common;
+            memmove(child->Label, child->Label + common, child->LabelLength + 1);
+            middle->Literals[(unsigned char)child->Label[0]] = child;
+            node->Literals[first] = middle;
+            child = middle;
+        }
+        node = child;
+        s += common;
+        length -= common;
+    }
+    return node;
+}
+
+bool TRouter_Add(struct TRouter* self, const char* pattern, TRouteHandler handler) {
+    if (self->Root == NULL && (self->Root = CreateNode("", 0)) == NULL) {
+        return false;
+    }
+    struct TRouteNode* node = self->Root;
+    const char* p = pattern;
+    while (node != NULL && *p != '\0' && *p != '*') {
+        if (StartsWith(p, INT_PARAM)) {
+            if (node->IntParam == NULL) {
+                node->IntParam = CreateNode("", 0);
+            }
+            node = node->IntParam;
+            p += strlen(INT_PARAM);
+            continue;
+        }
+        const size_t literal = strcspn(p, "{*");
+        if (literal == 0) {
+            return false;  // a '{' that is no parameter
+        }
+        node = InsertLiteral(node, p, literal);
+        p += literal;
+    }
+    if (node == NULL) {
+        return false;
+    }
+    TRouteHandler* slot = &node->Handler;
+    if (*p == '*') {
+        if (p[1] != '\0') {
+            return false;  // only the rest of the path can be matched by anything
+        }
+        slot = &node->RestHandler;
+    }
+    if (*slot != NULL) {
+        return false;
+    }
+    *slot = handler;
+    return true;
+}
+
+static TRouteHandler MatchNode(const struct TRouteNode* node, const char* p, const char* end,
+                               struct TRouteMatch* match) {
+    if (p == end && node->Handler != NULL) {
+        return node->Handler;
+    }
+    if (p != end && (unsigned char)*p < 128) {
+        const struct TRouteNode* child = node->Literals[(unsigned char)*p];
+        if (child != NULL && (size_t)(end - p) >= child->LabelLength &&
+            memcmp(p, child->Label, child->LabelLength) == 0) {
+            TRouteHandler handler = MatchNode(child, p + child->LabelLength, end, match);
+            if (handler != NULL) {
+                return handler;
+            }
+        }
+    }
+    if (node->IntParam != NULL && match->ParamCount < ROUTER_MAX_PARAMS) {
+        const char* digits = p;
+        while (digits != end && *digits >= '0' && *digits <= '9') {
+            ++digits;
+        }
+        int value;
+        if (digits != p && ParseInt(p, digits - p, &value)) {
+            match->Params[match->ParamCount++] = value;
+            TRouteHandler handler = MatchNode(node->IntParam, digits, end, match);
+            if (handler != NULL) {
+                return handler;
+            }
+            --match->ParamCount;
+        }
+    }
+    if (node->RestHandler != NULL) {
+        match->Rest = (struct TStringView){ p, end - p };
+        return node->RestHandler;
+    }
+    return NULL;
+}
+
+TRouteHandler TRouter_Match(const struct TRouter* self, struct TStringView path, struct TRouteMatch* match) {
+    match->ParamCount = 0;
+    match->Rest = (struct TStringView){ path.Data + path.Length, 0 };
+    match->QueryCount = 0;
+    if (self->Root == NULL) {
+        return NULL;
+    }
+    return MatchNode(self->Root, path.Data, path.Data + path.Length, match);
+}
+
+void TRouteMatch_ParseQuery(struct TRouteMatch* self, struct TStringView query) {
+    self->QueryCount = 0;
+    const char* p = query.Data;
+    const char* end = query.Data + query.Length;
+    while (p < end && self->QueryCount < ROUTER_MAX_QUERY_PARAMS) {
+        const char* amp = memchr(p, '&', end - p);
+        const char* fieldEnd = amp != NULL ? amp : end;
+        if (fieldEnd != p) {
+            const char* eq = memchr(p, '=', fieldEnd - p);
+            const char* nameEnd = eq != NULL ? eq : fieldEnd;
+            const char* value = eq != NULL ? eq + 1 : fieldEnd;
+            self->QueryNames[self->QueryCount] = (struct TStringView){ p, nameEnd - p };
+            self->QueryValues[self->QueryCount] = (struct TStringView){ value, fieldEnd - value };
+            ++self->QueryCount;
+        }
+        p = fieldEnd + 1;
+    }
+}
+
+int TRouteMatch_GetIntQuery(const struct TRouteMatch* self, const char* name, int fallback) {
+    const size_t length = strlen(name);
+    for (size_t i = 0; i < self->QueryCount; ++i) {
+        if (self->QueryNames[i].Length == length && memcmp(self->QueryNames[i].Data, name, length) == 0) {
+            int result;
+            return ParseInt(self->QueryValues[i].Data, self->QueryValues[i].Length, &result) ? result : fallback;
+        }
+    }
+    return fallback;
+}
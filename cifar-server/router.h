@@ -0,0 +1,60 @@
+#pragma once
+
+#include "config.h"
+#include "stringutils.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Request paths are dispatched by a radix trie compiled from the route patterns once.
+ *
+ * A pattern is literal bytes with "{int}" standing for a non-negative decimal, captured as
+ * a parameter, and may end with "*" matching the rest of the path. Matching walks the path
+ * once without comparing it to every route: the literal edges of a node are indexed by
+ * their first byte, so dispatch costs the same however many routes there are. A literal
+ * edge is preferred to "{int}" and both to "*". The query string of a matched request is
+ * split into its fields in a single pass as well.
+ */
+
+struct THttpRequest;
+struct THttpResponse;
+struct TRouteMatch;
+
+typedef void (*TRouteHandler)(const struct THttpRequest* request, struct THttpResponse* response,
+                              const struct TRouteMatch* match);
+
+struct TRouteMatch {
+    int Params[ROUTER_MAX_PARAMS];  // in the order of the pattern
+    size_t ParamCount;
+    struct TStringView Rest;  // what "*" matched, empty otherwise
+    struct TStringView QueryNames[ROUTER_MAX_QUERY_PARAMS];
+    struct TStringView QueryValues[ROUTER_MAX_QUERY_PARAMS];  // not percent-decoded
+    size_t QueryCount;
+};
+
+// Nodes of the trie, a literal label is matched on the way into a node
+struct TRouteNode {
+    char* Label;
+    size_t LabelLength;
+    struct TRouteNode* Literals[128];  // by the first byte of the label, paths are ASCII
+    struct TRouteNode* IntParam;
+    TRouteHandler Handler;  // the path ends at this node
+    TRouteHandler RestHandler;  // "*" at this node
+};
+
+struct TRouter {
+    struct TRouteNode* Root;
+};
+
+void TRouter_Init(struct TRouter* self);
+void TRouter_Destroy(struct TRouter* self);
+// Returns false for a malformed pattern, one that is there already or no memory
+bool TRouter_Add(struct TRouter* self, const char* pattern, TRouteHandler handler);
+// Returns NULL if no route matches the path, `match` has the parameters otherwise
+TRouteHandler TRouter_Match(const struct TRouter* self, struct TStringView path, struct TRouteMatch* match);
+
+// Splits the query string ("a=1&b=2") into the fields of `match`
+void TRouteMatch_ParseQuery(struct TRouteMatch* self, struct TStringView query);
+// The value of the first field named `name` as an int, `fallback` if there is none or it is no int
+int TRouteMatch_GetIntQuery(const struct TRouteMatch* self, const char* name, int fallback);
@@ -1,13 +1,27 @@
 #include "server.h"
 #include "config.h"
 
+#include "admission.h"
 #include "handler.h"
+#include "io.h"
+#include "lifecycle.h"
+#include "parking_lot.h"
+#include "rate_limiter.h"
+#include "reactor.h"
 #include "resources.h"
+#include "uring.h"
+#include "worker_pool.h"
+
+#include "cpus.h"
+#include "timer_wheel.h"
 
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -18,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
 #define DEBUG_MODE SERVER_DEBUG_MODE
@@ -30,7 +45,24 @@
 #define DEBUG_PRINT_IF(condition, ...)
 #endif
 
-static int CreateSocketToListen(uint16_t port) {
+#define USING_REUSEPORT_LISTENERS (USING_EPOLL_REACTOR && USING_REUSEPORT_SHARDS)
+
+#define DRAIN_POLL_INTERVAL_MS 10
+
+// handed over by the previous binary on upgrade
+static int g_inherited_listeners[MAX_REACTOR_SHARDS];
+static int g_inherited_count = 0;
+
+static bool SetReusePort(int sockfd) {
+    int yes = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+        perror("setsockopt SO_REUSEPORT");
+        return false;
+    }
+    return true;
+}
+
+static int CreateSocketToListen(uint16_t port, bool reuse_port) {
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
 
@@ -62,6 +94,11 @@ static int CreateSocketToListen(uint16_t port) {
             continue;
         }
 
+        if (reuse_port && !SetReusePort(sockfd)) {
+            close(sockfd);
+            continue;
+        }
+
 #if (SHOULD_USE_TCP_CORK)
 #if !(defined(__APPLE__) || defined(__OSX__))
         yes = 1;
@@ -100,7 +137,150 @@ static int CreateSocketToListen(uint16_t port) {
     return sockfd;
 }
 
-#if (SHOULD_USE_THREADS)
+#if !(USING_EPOLL_REACTOR) && (SHOULD_USE_THREADS || !(USING_PREFORK))
+// Waits for the next connection on the non-blocking listener, returns -1 once the server stops.
+// Non-blocking because another process (the next binary) may take a connection first.
+static int AcceptUntilStopped(int sockfd, struct sockaddr_storage* addr)
+{
+    struct pollfd fds[2] = {
+        { .fd = sockfd, .events = POLLIN, .revents = 0 },
+        { .fd = Lifecycle_GetStopFd(), .events = POLLIN, .revents = 0 },
+    };
+    // checked on every iteration: under load accept() may never run out of connections
+    while (!Lifecycle_IsStopping())
+    {
+        socklen_t addrSize = sizeof(*addr);
+        int newfd = accept(sockfd, (struct sockaddr*)addr, &addrSize);
+        if (newfd != -1)
+        {
+            return newfd;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        {
+            perror("accept");
+        }
+        if (poll(fds, 2, -1) == -1 && errno != EINTR)
+        {
+            perror("poll");
+        }
+    }
+    return -1;
+}
+#endif
+
+#if (USING_REUSEPORT_LISTENERS)
+// Creates one more listener in the SO_REUSEPORT group of `sockfd`, bound to the same address
+static int CreateSiblingListener(int sockfd) {
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof addr;
+    if (getsockname(sockfd, (struct sockaddr*)&addr, &addrLen) == -1) {
+        perror("getsockname");
+        return -1;
+    }
+
+    int newfd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (newfd == -1) {
+        perror("server: socket");
+        return -1;
+    }
+
+    int yes = 1;
+    if (setsockopt(newfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 || !SetReusePort(newfd)) {
+        perror("setsockopt");
+        close(newfd);
+        return -1;
+    }
+    if (bind(newfd, (struct sockaddr*)&addr, addrLen) == -1) {
+        perror("server: bind");
+        close(newfd);
+        return -1;
+    }
+    return newfd;
+}
+
+// The listeners join the reuseport group in listen() order, so listener i is group index i.
+// The classic BPF program maps the CPU that handled the SYN to the index of the listener whose
+// reactor is pinned to that CPU, so the whole connection stays on one core.
+static bool AttachCpuSteering(int sockfd, const int* cpus, int count) {
+    struct sock_filter code[2 * MAX_REACTOR_SHARDS + 3];
+    int len = 0;
+
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < count; ++i) {
+        // if (A == cpus[i]) return i;
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    // a CPU outside of our affinity mask (e.g. an IRQ core): spread by modulo
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+
+    struct sock_fprog program = {
+        .len = len,
+        .filter = code,
+    };
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == -1) {
+        perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+        return false;
+    }
+    return true;
+}
+
+static void SetIncomingCpu(const int* sockfds, const int* cpus, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (setsockopt(sockfds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpus[i], sizeof(int)) == -1) {
+            perror("setsockopt SO_INCOMING_CPU");
+            return;
+        }
+    }
+}
+
+static bool RunServerImpl(int sockfd)
+{
+    int cpus[MAX_REACTOR_SHARDS];
+    const int count = GetAllowedCpus(cpus, MAX_REACTOR_SHARDS);
+
+    int sockfds[MAX_REACTOR_SHARDS];
+    sockfds[0] = sockfd;
+    for (int i = 1; i < count; ++i) {
+        sockfds[i] = i < g_inherited_count ? g_inherited_listeners[i] : CreateSiblingListener(sockfd);
+        if (sockfds[i] == -1) {
+            return false;
+        }
+    }
+    // fewer CPUs than the previous binary had: the extra shards leave the group
+    for (int i = count; i < g_inherited_count; ++i) {
+        close(g_inherited_listeners[i]);
+    }
+
+    for (int i = 0; i < count; ++i) {
+        if (listen(sockfds[i], REACTOR_BACKLOG) == -1)
+        {
+            perror("listen");
+            return false;
+        }
+    }
+
+    if (count > 1 && !AttachCpuSteering(sockfd, cpus, count)) {
+        // older kernels: fall back to the socket option hint
+        SetIncomingCpu(sockfds, cpus, count);
+    }
+
+    Lifecycle_SetListeners(sockfds, count);
+    printf("server: %d reuseport shards\n", count);
+    return RunShardedReactors(sockfds, cpus, count);
+}
+#elif (USING_EPOLL_REACTOR)
+static bool RunServerImpl(int sockfd)
+{
+    if (listen(sockfd, REACTOR_BACKLOG) == -1)
+    {
+        perror("listen");
+        return false;
+    }
+    return RunReactor(sockfd);
+}
+#elif (SHOULD_USE_THREADS)
 #if !(USING_THREAD_POOL)
 void* server_thread_main(void* serve_fd_ptr)
 {
@@ -129,15 +309,26 @@ static bool RunServerImpl(int sockfd)
     int created_thread_fd_args[NUM_THREADS];
     memset(created_threads, 0, sizeof(pthread_t *) * NUM_THREADS); // initially all threads are zero pointers
 
-    while (1)
+    if (!SetNonBlocking(sockfd))
+    {
+        return false;
+    }
+
+    struct sockaddr_storage theirAddr;
+    int newfd;
+    while ((newfd = AcceptUntilStopped(sockfd, &theirAddr)) != -1)
     {  // main accept() loop
-        struct sockaddr_storage theirAddr;
-        socklen_t addrSize = sizeof theirAddr;
-        int newfd = accept(sockfd, (struct sockaddr*)&theirAddr, &addrSize);
-        if (-1 == newfd) {
-            perror("accept");
-            continue;
+#if (USING_RATE_LIMITER)
+        if (!RateLimiter_AdmitConnection(newfd, (struct sockaddr*)&theirAddr))
+        {
+            continue;  // already answered with 429
         }
+#endif
+        // blocking sends give up once the client stops reading for SEND_PROGRESS_TIMEOUT
+        SetSendTimeout(newfd, SEND_PROGRESS_TIMEOUT);
+#if (USING_ZEROCOPY_SEND)
+        EnableZeroCopy(newfd);
+#endif
 
         DEBUG_PRINT("received new connection so creating new process\n");
 
@@ -174,171 +365,340 @@ static bool RunServerImpl(int sockfd)
             }
         }
     }
+
+    // the clients are told to close after the response in flight
+    const uint64_t now = MonotonicMs();
+    const uint64_t left = Lifecycle_GetDrainDeadline() > now ? Lifecycle_GetDrainDeadline() - now : 0;
+    struct timespec deadline;  // pthread_timedjoin_np() wants CLOCK_REALTIME
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += left / 1000 + (deadline.tv_nsec + (left % 1000) * 1000000) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + (left % 1000) * 1000000) % 1000000000;
+    for (int i = 0; i < NUM_THREADS; ++i)
+    {
+        if (NULL != created_threads[i] && 0 != pthread_timedjoin_np(*created_threads[i], NULL, &deadline))
+        {
+            return true;  // the rest is cut off by the exit
+        }
+    }
+    return true;
 }
 #else  // if using thread pool
 
-typedef enum thread_state
+// Connections waiting for a worker are spread over the per-worker queues of the pool.
+// Idle workers park on a futex, and the acceptor parks inside TWorkerPool_Submit once all
+// the queues are full, leaving the rest in the kernel accept queue.
+static struct TWorkerPool g_pool;
+
+static void CloseConnection(int fd)
 {
-    THREAD_STATE_INITIAL,
-    THREAD_STATE_RUNNING,
-    THREAD_STATE_AWAITING_TASK,
-    THREAD_STATE_PREPARE_FOR_TASK,
-    THREAD_STATE_STOPPED,
-} thread_state_t;
+#if (USING_ADMISSION_CONTROL)
+    Admission_Close(fd);
+#else
+    close(fd);
+#endif
+}
 
-static volatile thread_state_t current_thread_states[NUM_THREADS];
-static volatile int created_thread_fd_args[NUM_THREADS];
+static void ServeConnection(int fd, int thread_index)
+{
+    DEBUG_PRINT("thread %d is serving fd %d\n", thread_index, fd);
+#if (USING_KEEP_ALIVE_PARKING)
+    // the socket is readable, serve the request (and the ones pipelined after it) and give the connection back
+    struct THttpInputBuffer* input = ParkingLot_GetInput(fd);
+    struct THttp2Session* session = NULL;
+    bool keep_alive;
+#if (USING_HTTP2)
+    session = ParkingLot_TakeHttp2(fd);
+    if (session != NULL)
+    {
+        keep_alive = ServeHttp2(fd, input, session, true);
+    }
+    else
+#endif
+    do
+    {
+        keep_alive = ServeRequest(fd, input, GetRequestsLeft(ParkingLot_CountRequest(fd)), &session);
+    }
+    while (keep_alive && session == NULL && THttpInputBuffer_HasData(input));
 
-static pthread_mutex_t global_thread_mutexes[NUM_THREADS];
-static pthread_cond_t global_conditions[NUM_THREADS];
+    if (keep_alive && session != NULL)
+    {
+        ParkingLot_ParkHttp2(fd, session);  // an HTTP/2 session waits for the client
+    }
+    else if (keep_alive)
+    {
+        ParkingLot_Park(fd, false);
+    }
+    else
+    {
+        CloseConnection(fd);
+    }
+#else
+    ServeClient(fd);
+    CloseConnection(fd);
+#endif
+    DEBUG_PRINT("thread %d has finished the task\n", thread_index);
+}
 
-void* server_thread_main(void* thread_index_ptr)
+static bool RunServerImpl(int sockfd)
 {
-    int thread_index = *((int *) thread_index_ptr);
-    pthread_mutex_t *mutex_ptr = &global_thread_mutexes[thread_index];
-    pthread_cond_t *condition_ptr = &global_conditions[thread_index];
+    // with admission control the acceptor never stalls, so the backlog may be deep
+    if (listen(sockfd, USING_ADMISSION_CONTROL ? MAX_QUEUED_CONNECTIONS : BACKLOG) == -1)
+    {
+        perror("listen");
+        return false;
+    }
+
+    if (!TWorkerPool_Start(&g_pool, ServeConnection))
+    {
+        fprintf(stderr, "failed to start the worker pool\n");
+        return false;
+    }
+    printf("server: %u..%u workers\n", g_pool.MinThreads, g_pool.MaxThreads);
+
+    if (!SetNonBlocking(sockfd))
+    {
+        return false;
+    }
 
+#if (USING_ADMISSION_CONTROL)
+    if (!Admission_Init(sockfd, &g_pool))
+    {
+        return false;
+    }
+#endif
 
-    while(THREAD_STATE_STOPPED != current_thread_states[thread_index])
+#if (USING_KEEP_ALIVE_PARKING)
+    if (!ParkingLot_Start(&g_pool))
     {
-        switch(current_thread_states[thread_index])
+        fprintf(stderr, "failed to start the parking lot\n");
+        return false;
+    }
+#endif
+
+    struct sockaddr_storage theirAddr;
+    int newfd;
+    while ((newfd = AcceptUntilStopped(sockfd, &theirAddr)) != -1)
+    {  // main accept() loop
+#if (USING_RATE_LIMITER)
+        if (!RateLimiter_AdmitConnection(newfd, (struct sockaddr*)&theirAddr))
         {
-            case THREAD_STATE_INITIAL:
-            {
-                current_thread_states[thread_index] = THREAD_STATE_PREPARE_FOR_TASK;
-                break;
-            }
-            case THREAD_STATE_PREPARE_FOR_TASK:
-            {
-                pthread_mutex_lock(mutex_ptr);
-                created_thread_fd_args[thread_index] = -1;
-                current_thread_states[thread_index] = THREAD_STATE_AWAITING_TASK;
-                pthread_mutex_unlock(mutex_ptr);
-            }
-            case THREAD_STATE_AWAITING_TASK:
-            {
-                pthread_cond_wait(condition_ptr, mutex_ptr);
-                pthread_mutex_unlock(mutex_ptr);
+            continue;  // already answered with 429
+        }
+#endif
+#if (USING_ADMISSION_CONTROL)
+        if (!Admission_Admit(newfd))
+        {
+            continue;  // already answered with 503 or the health check response
+        }
+#endif
+        // blocking sends give up once the client stops reading for SEND_PROGRESS_TIMEOUT
+        SetSendTimeout(newfd, SEND_PROGRESS_TIMEOUT);
+#if (USING_ZEROCOPY_SEND)
+        EnableZeroCopy(newfd);
+#endif
 
-                current_thread_states[thread_index] = THREAD_STATE_RUNNING;
-                break;
-            }
-            case THREAD_STATE_RUNNING:
-            {
-                DEBUG_PRINT("thread %d is running the task\n", thread_index);
-                DEBUG_PRINT_IF(-1 == created_thread_fd_args[thread_index], "received wrond fd!\n");
-                ServeClient(created_thread_fd_args[thread_index]);
-                close(created_thread_fd_args[thread_index]);
-                DEBUG_PRINT("thread %d has finished the task\n", thread_index);
-
-                current_thread_states[thread_index] = THREAD_STATE_PREPARE_FOR_TASK;
-                break;
-            }
-            default:
-                assert(false);  // unreachable
+#if (USING_KEEP_ALIVE_PARKING)
+        // even the first request is dispatched only once it has arrived
+        DEBUG_PRINT("received new connection, parking fd %d\n", newfd);
+        ParkingLot_Park(newfd, true);
+#else
+        DEBUG_PRINT("received new connection, queueing fd %d\n", newfd);
+#if (USING_ADMISSION_CONTROL)
+        if (!TWorkerPool_TrySubmit(&g_pool, newfd))
+        {
+            CloseConnection(newfd);  // only possible if the queues hold less than MAX_QUEUED_CONNECTIONS
         }
+#else
+        TWorkerPool_Submit(&g_pool, newfd);
+#endif
+#endif
     }
-    
-    return NULL;
+
+    // the parking lot closes the idle connections, the workers finish the requests in flight
+    const uint64_t deadline = Lifecycle_GetDrainDeadline();
+    while (!TWorkerPool_IsIdle(&g_pool) && MonotonicMs() < deadline)
+    {
+        usleep(DRAIN_POLL_INTERVAL_MS * 1000);
+    }
+    DEBUG_PRINT_IF(!TWorkerPool_IsIdle(&g_pool), "drain deadline has passed with requests in flight\n");
+    return true;
+}
+#endif // !(USING_THREAD_POOL)
+#elif (USING_PREFORK)  // !(SHOULD_USE_THREADS)
+
+#define MIN_WORKER_LIFETIME_MS 1000  // a worker dying faster is restarted with a delay
+#define PREFORK_REAP_INTERVAL_MS 100
+
+struct TPreforkWorker {
+    pid_t Pid;
+    uint64_t StartedAtMs;
+};
+
+static pid_t StartWorker(int sockfd, int index, const int* cpus, int cpu_count)
+{
+    const pid_t master = getpid();
+    fflush(stdout);  // otherwise every worker repeats the buffered output when it exits
+    const pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        // a worker must not outlive the master that supervises it
+        Lifecycle_ResetChildSignals();
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master)
+        {
+            exit(EXIT_FAILURE);
+        }
+        const int cpu = (SHOULD_PIN_REACTORS && cpu_count > 0) ? cpus[index % cpu_count] : -1;
+        // returns true once drained after the master has written the stop fd
+        exit(RunReactorWorker(sockfd, cpu) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    DEBUG_PRINT("started worker %d, pid %d\n", index, pid);
+    return pid;
 }
 
 static bool RunServerImpl(int sockfd)
 {
-    if (listen(sockfd, BACKLOG) == -1)
+    if (listen(sockfd, REACTOR_BACKLOG) == -1)
     {
         perror("listen");
         return false;
     }
 
-    int create_thread_result = -1;
-    int thread_await_result = -1;
-
-    pthread_t* created_threads = calloc(NUM_THREADS, sizeof(pthread_t *));
-    static volatile int created_thread_index_args[NUM_THREADS];
+    // the master reaps the workers itself to know when they have to be restarted
+    struct sigaction sa;
+    sa.sa_handler = SIG_DFL;
+    sa.sa_flags = 0;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGCHLD, &sa, NULL) == -1)
+    {
+        perror("sigaction");
+        return false;
+    }
 
-    memset(current_thread_states, THREAD_STATE_INITIAL, sizeof(thread_state_t) * NUM_THREADS);
-    memset(created_thread_fd_args, 0, sizeof(int) * NUM_THREADS);
-    memset(created_thread_index_args, -1, sizeof(int) * NUM_THREADS);
+    int cpus[MAX_REACTOR_SHARDS];
+    const int cpu_count = GetAllowedCpus(cpus, MAX_REACTOR_SHARDS);
 
-    for(int i = 0; i < NUM_THREADS; i++)
+    // the listener, the shared caches and the rate limiter table are inherited by every worker
+    struct TPreforkWorker workers[NUM_PREFORK_WORKERS];
+    for (int i = 0; i < NUM_PREFORK_WORKERS; ++i)
     {
-        pthread_mutex_init(&global_thread_mutexes[i], NULL);
-        pthread_cond_init(&global_conditions[i], NULL);
-
-        bool is_creation_successful = false;
-        while(!is_creation_successful)
+        workers[i].Pid = StartWorker(sockfd, i, cpus, cpu_count);
+        workers[i].StartedAtMs = MonotonicMs();
+        if (workers[i].Pid == -1)
         {
-            created_threads[i] = malloc(sizeof(pthread_t));
-            memset(created_threads[i], 0, sizeof(pthread_t));
+            return false;
+        }
+    }
 
-            created_thread_index_args[i] = i;
-            DEBUG_PRINT("passing index %d to thread\n", created_thread_index_args[i]);
-            create_thread_result = pthread_create(created_threads[i], NULL, server_thread_main, (void*) &created_thread_index_args[i]);
-            if (NULL != create_thread_result)
+    // The workers watch the stop fd themselves, the master only stops restarting them.
+    // Polled rather than blocked in waitpid(): the master has to notice the stop as well.
+    int alive = NUM_PREFORK_WORKERS;
+    while (alive > 0)
+    {
+        int status;
+        const pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
             {
-                free(created_threads[i]);
-                created_threads[i] = NULL;
-                created_thread_index_args[i] = -1;
                 continue;
             }
-            is_creation_successful = true;
+            perror("waitpid");
+            return false;
         }
-    }
-
-    while (TRUE)
-    {  // main accept() loop
-        struct sockaddr_storage theirAddr;
-        socklen_t addrSize = sizeof theirAddr;
-        int newfd = accept(sockfd, (struct sockaddr*)&theirAddr, &addrSize);
-        if (-1 == newfd) {
-            perror("accept");
+        if (pid == 0)
+        {
+            if (!Lifecycle_IsStopping())
+            {
+                struct pollfd stop = { .fd = Lifecycle_GetStopFd(), .events = POLLIN, .revents = 0 };
+                poll(&stop, 1, PREFORK_REAP_INTERVAL_MS);
+                continue;
+            }
+            if (MonotonicMs() >= Lifecycle_GetDrainDeadline())
+            {
+                fprintf(stderr, "server: %d workers have not drained in time, killing them\n", alive);
+                for (int i = 0; i < NUM_PREFORK_WORKERS; ++i)
+                {
+                    if (workers[i].Pid != -1)
+                    {
+                        kill(workers[i].Pid, SIGKILL);
+                    }
+                }
+                return true;
+            }
+            usleep(DRAIN_POLL_INTERVAL_MS * 1000);
             continue;
         }
 
-        DEBUG_PRINT("received new connection so searching for non-active thread\n");
-        int thread_index = 0;
-        bool found_victim_thread = false;
-
-        while(!found_victim_thread)
+        for (int i = 0; i < NUM_PREFORK_WORKERS; ++i)
         {
-            pthread_mutex_lock(&global_thread_mutexes[thread_index]);
-            if(THREAD_STATE_AWAITING_TASK == current_thread_states[thread_index])
+            if (workers[i].Pid != pid)
+            {
+                continue;
+            }
+            if (Lifecycle_IsStopping())
             {
-                found_victim_thread = true;
-                DEBUG_PRINT("thread %d is not active, so assigning the task to it\n", thread_index);
+                DEBUG_PRINT("worker %d (pid %d) has drained\n", i, pid);
+                workers[i].Pid = -1;
+                --alive;
+                continue;
+            }
+            if (WIFSIGNALED(status))
+            {
+                fprintf(stderr, "server: worker %d (pid %d) was killed by signal %d, restarting\n", i, pid, WTERMSIG(status));
             }
-            pthread_mutex_unlock(&global_thread_mutexes[thread_index]);
-            if(!found_victim_thread)
+            else
             {
-                thread_index = (thread_index + 1) % NUM_THREADS;
+                fprintf(stderr, "server: worker %d (pid %d) exited with %d, restarting\n", i, pid, WEXITSTATUS(status));
             }
+            if (MonotonicMs() - workers[i].StartedAtMs < MIN_WORKER_LIFETIME_MS)
+            {
+                sleep(1);  // do not spin on a worker that crashes right away
+            }
+            workers[i].Pid = StartWorker(sockfd, i, cpus, cpu_count);
+            while (workers[i].Pid == -1)
+            {
+                sleep(1);
+                workers[i].Pid = StartWorker(sockfd, i, cpus, cpu_count);
+            }
+            workers[i].StartedAtMs = MonotonicMs();
         }
-
-        pthread_mutex_lock(&global_thread_mutexes[thread_index]);
-        created_thread_fd_args[thread_index] = newfd;
-        pthread_cond_signal(&global_conditions[thread_index]);
-        pthread_mutex_unlock(&global_thread_mutexes[thread_index]);
     }
+    return true;
 }
-#endif // !(USING_THREAD_POOL)
-#else  // (SHOULD_USE_THREADS)
+#else  // !(SHOULD_USE_THREADS) && !(USING_PREFORK)
 static bool RunServerImpl(int sockfd) {
     if (listen(sockfd, BACKLOG) == -1) {
         perror("listen");
         return false;
     }
 
-    while (1) {  // main accept() loop
-        struct sockaddr_storage theirAddr;
-        socklen_t addrSize = sizeof theirAddr;
-        int newfd = accept(sockfd, (struct sockaddr*)&theirAddr, &addrSize);
-        if (newfd == -1) {
-            perror("accept");
-            continue;
+    if (!SetNonBlocking(sockfd)) {
+        return false;
+    }
+
+    struct sockaddr_storage theirAddr;
+    int newfd;
+    while ((newfd = AcceptUntilStopped(sockfd, &theirAddr)) != -1) {  // main accept() loop
+#if (USING_RATE_LIMITER)
+        if (!RateLimiter_AdmitConnection(newfd, (struct sockaddr*)&theirAddr))
+        {
+            continue;  // already answered with 429
         }
+#endif
+        SetSendTimeout(newfd, SEND_PROGRESS_TIMEOUT);
+#if (USING_ZEROCOPY_SEND)
+        EnableZeroCopy(newfd);
+#endif
 
         DEBUG_PRINT("received new connection so creating new process\n");
 
+        fflush(stdout);  // otherwise the child repeats the buffered output when it exits
         const pid_t pid = fork();
         if (pid == -1) {
             perror("fork");
@@ -349,6 +709,7 @@ static bool RunServerImpl(int sockfd) {
             fprintf(stderr, "Child born\n");
             #endif
             close(sockfd); // child doesn't need the listener
+            Lifecycle_ResetChildSignals();
             ServeClient(newfd);
             #ifdef DEBUG
             fprintf(stderr, "Child dead\n");
@@ -357,6 +718,17 @@ static bool RunServerImpl(int sockfd) {
         }
         close(newfd); // parent doesn't need this
     }
+    return true;  // every child finishes its own client
+}
+#endif
+
+#if (USING_IO_URING)
+static bool RunUringServerImpl(int sockfd) {
+    if (listen(sockfd, REACTOR_BACKLOG) == -1) {
+        perror("listen");
+        return false;
+    }
+    return RunUringServer(sockfd);
 }
 #endif
 
@@ -378,16 +750,42 @@ bool RunServer(uint16_t port) {
         return false;
     }
     
-    if (!IgnoreSignal(SIGCHLD) || !IgnoreSignal(SIGPIPE))
+    if (!IgnoreSignal(SIGCHLD) || !IgnoreSignal(SIGPIPE) || !Lifecycle_Init())
     {
         return false;
     }
-    int sockfd = CreateSocketToListen(port);
+    // on upgrade the previous binary keeps serving until the dataset above is loaded
+    g_inherited_count = Lifecycle_InheritListeners(g_inherited_listeners, MAX_REACTOR_SHARDS);
+    int sockfd = g_inherited_count > 0 ? g_inherited_listeners[0] : CreateSocketToListen(port, USING_REUSEPORT_LISTENERS);
     if (sockfd == -1)
     {
         return false;
     }
+#if (USING_RATE_LIMITER)
+    if (!RateLimiter_Init())
+    {
+        fprintf(stderr, "failed to allocate the rate limiter\n");
+        close(sockfd);
+        return false;
+    }
+#endif
+    if (!IoStats_Init())
+    {
+        close(sockfd);
+        return false;
+    }
+#if !(USING_REUSEPORT_LISTENERS)
+    Lifecycle_SetListeners(&sockfd, 1);  // the previous binary starts draining
+#endif
     printf("server: waiting for connections on http://localhost:%hu/\n", port);
+#if (USING_IO_URING)
+    if (IsUringSupported()) {
+        bool res = RunUringServerImpl(sockfd);
+        close(sockfd);
+        return res;
+    }
+    printf("server: io_uring is not supported by the kernel, using the regular backend\n");
+#endif
     bool res = RunServerImpl(sockfd);
     close(sockfd);
     return res;
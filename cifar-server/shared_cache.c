@@ -0,0 +1,72 @@
+#include "shared_cache.h"
+
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <string.h>
+
+enum {
+    SHARED_CACHE_EMPTY = 0,
+    SHARED_CACHE_FILLING,
+    SHARED_CACHE_READY,
+};
+
+bool TSharedCache_Init(struct TSharedCache* self, size_t count, size_t slot_size) {
+    const size_t entriesSize = count * sizeof(struct TSharedCacheEntry);
+    self->MappingSize = entriesSize + count * slot_size;
+    void* mapping = mmap(NULL, self->MappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        perror("mmap shared cache");
+        return false;
+    }
+    // anonymous mappings are zeroed, so every entry starts as SHARED_CACHE_EMPTY
+    self->Entries = mapping;
+    self->Data = (char*)mapping + entriesSize;
+    self->Count = count;
+    self->SlotSize = slot_size;
+    return true;
+}
+
+void TSharedCache_Destroy(struct TSharedCache* self) {
+    munmap(self->Entries, self->MappingSize);
+}
+
+const char* TSharedCache_Get(const struct TSharedCache* self, size_t index, size_t* size) {
+    if (index >= self->Count) {
+        return NULL;
+    }
+    const struct TSharedCacheEntry* entry = &self->Entries[index];
+    if (__atomic_load_n(&entry->State, __ATOMIC_ACQUIRE) != SHARED_CACHE_READY) {
+        return NULL;
+    }
+    *size = entry->Size;
+    return self->Data + index * self->SlotSize;
+}
+
+void TSharedCache_Put(struct TSharedCache* self, size_t index, const char* data, size_t size) {
+    const struct iovec segment = { .iov_base = (void*)data, .iov_len = size };
+    TSharedCache_PutSegments(self, index, &segment, 1);
+}
+
+void TSharedCache_PutSegments(struct TSharedCache* self, size_t index, const struct iovec* segments, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size += segments[i].iov_len;
+    }
+    if (index >= self->Count || size > self->SlotSize) {
+        return;
+    }
+    struct TSharedCacheEntry* entry = &self->Entries[index];
+    uint32_t expected = SHARED_CACHE_EMPTY;
+    // a concurrent producer of the same entry just keeps its own copy for this one response
+    if (!__atomic_compare_exchange_n(&entry->State, &expected, SHARED_CACHE_FILLING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    char* slot = self->Data + index * self->SlotSize;
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(slot, segments[i].iov_base, segments[i].iov_len);
+        slot += segments[i].iov_len;
+    }
+    entry->Size = size;
+    __atomic_store_n(&entry->State, SHARED_CACHE_READY, __ATOMIC_RELEASE);
+}
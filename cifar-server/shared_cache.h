@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/**
+ * Write-once cache of generated responses in an anonymous MAP_SHARED mapping.
+ *
+ * Created before the server forks, so every process sees the same memory: an entry
+ * produced by one worker is served by all of them. Entries are fixed-size slots that
+ * are filled once and never change afterwards, which lets readers use the data without
+ * any locking. Untouched slots cost no memory, the kernel backs pages on first write.
+ */
+
+struct TSharedCacheEntry {
+    uint32_t State;  // SHARED_CACHE_EMPTY -> SHARED_CACHE_FILLING -> SHARED_CACHE_READY
+    uint32_t Size;
+};
+
+struct TSharedCache {
+    struct TSharedCacheEntry* Entries;
+    char* Data;
+    size_t Count;
+    size_t SlotSize;
+    size_t MappingSize;
+};
+
+bool TSharedCache_Init(struct TSharedCache* self, size_t count, size_t slot_size);
+void TSharedCache_Destroy(struct TSharedCache* self);
+
+// Returns NULL if the entry has not been filled yet
+const char* TSharedCache_Get(const struct TSharedCache* self, size_t index, size_t* size);
+// Does nothing if the entry is already (being) filled or does not fit into a slot.
+// A process that dies while filling leaves the entry uncached, never half-written.
+void TSharedCache_Put(struct TSharedCache* self, size_t index, const char* data, size_t size);
+// The same for an entry in pieces, they are copied into the slot one after another
+void TSharedCache_PutSegments(struct TSharedCache* self, size_t index, const struct iovec* segments, size_t count);
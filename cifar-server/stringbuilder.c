@@ -1,4 +1,5 @@
 #include "stringbuilder.h"
+#include "stringutils.h"
 
 #include <stdarg.h>
 #include <stdbool.h>
@@ -45,6 +46,10 @@ void TStringBuilder_Destroy(struct TStringBuilder* self) {
     free(self->Data);
 }
 
+void TStringBuilder_Reserve(struct TStringBuilder* self, size_t size) {
+    TStringBuilder_AllocateFreeSpace(self, self->Length + size);
+}
+
 void TStringBuilder_AppendCStr(struct TStringBuilder* self, const char* data) {
     TStringBuilder_AppendBuf(self, data, strlen(data));
 }
@@ -56,6 +61,12 @@ void TStringBuilder_AppendBuf(struct TStringBuilder* self, const char* data, siz
     TStringBuilder_EnsureNullTerminated(self);
 }
 
+void TStringBuilder_AppendUInt(struct TStringBuilder* self, uint64_t value) {
+    char digits[MAX_UINT64_DIGITS];
+    const char* p = FormatUIntBackwards(value, digits + sizeof(digits));
+    TStringBuilder_AppendBuf(self, p, digits + sizeof(digits) - p);
+}
+
 static bool VsprintfImpl(struct TStringBuilder* self, const char* format, va_list params, size_t* addLength) {
     const size_t freeSpace = self->Capacity_ - self->Length; // does not include '\0'
 
@@ -98,6 +109,11 @@ void TStringBuilder_Clear(struct TStringBuilder* self) {
     TStringBuilder_EnsureNullTerminated(self);
 }
 
+void TStringBuilder_Truncate(struct TStringBuilder* self, size_t length) {
+    self->Length = length;
+    TStringBuilder_EnsureNullTerminated(self);
+}
+
 void TStringBuilder_ChopSuffix(struct TStringBuilder* self, const char* suffix) {
     const size_t suffLen = strlen(suffix);
     if (suffLen <= self->Length &&
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 // To produce warnings about format mismatch
 #ifdef __GNUC__
@@ -20,6 +21,11 @@ void TStringBuilder_Destroy(struct TStringBuilder* self);
 
 void TStringBuilder_AppendCStr(struct TStringBuilder* self, const char* data);
 void TStringBuilder_AppendBuf(struct TStringBuilder* self, const char* data, size_t size);
+void TStringBuilder_AppendUInt(struct TStringBuilder* self, uint64_t value);
 void TStringBuilder_Sprintf(struct TStringBuilder* self, const char* format, ...) PRINTF_FORMAT(2, 3);
+// Makes room for `size` more bytes, so that they are appended without reallocations
+void TStringBuilder_Reserve(struct TStringBuilder* self, size_t size);
 void TStringBuilder_Clear(struct TStringBuilder* self);
 void TStringBuilder_ChopSuffix(struct TStringBuilder* self, const char* suffix);
+// Drops everything past `length`, which must not exceed the current length
+void TStringBuilder_Truncate(struct TStringBuilder* self, size_t length);
@@ -1,52 +1,50 @@
 #include "stringutils.h"
 
-#include <stdio.h>
-#include <stdlib.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 
-/**
- * Parse query string
- */
-
-#define MAX_INT_LEN 9
-
-static int ParseInt(const char* s, size_t len) {
-    if (len > MAX_INT_LEN) {
-        return 0;
+bool ParseInt(const char* s, size_t len, int* result) {
+    const bool negative = len != 0 && s[0] == '-';
+    size_t i = negative ? 1 : 0;
+    if (i == len) {
+        return false;
     }
-
-    // We need a null-terminated string for scanf()
-    char tmp[MAX_INT_LEN + 1];
-    memcpy(tmp, s, len);
-    tmp[len] = '\0';
-
-    int result;
-    if (sscanf(tmp, "%d", &result) == 1) {
-        return result;
+    int64_t value = 0;
+    for (; i < len; ++i) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        value = value * 10 + (s[i] - '0');
+        if (value > (int64_t)INT_MAX + negative) {
+            return false;
+        }
     }
-    return 0;
+    *result = negative ? (int)-value : (int)value;
+    return true;
 }
 
-int GetIntParam(const char* queryString, const char* name) {
-    const size_t len = strlen(queryString);
-    const size_t nameLen = strlen(name);
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
-    size_t i = 0;
-    while (i < len) {
-        size_t j = i;
-        while (j < len && queryString[j] != '&') {
-            ++j;
-        }
-        // [i, j) = "key=value"
-        if (j - i > nameLen && strncmp(queryString + i, name, nameLen) == 0) {
-            size_t eqPos = i + nameLen;
-            if (queryString[eqPos] == '=') {
-                return ParseInt(queryString + eqPos + 1, j - eqPos - 1);
-            }
-        }
-        i = j + 1;
+char* FormatUIntBackwards(uint64_t value, char* end) {
+    char* p = end;
+    while (value >= 100) {
+        const char* pair = DIGIT_PAIRS + 2 * (value % 100);
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (value >= 10) {
+        *--p = DIGIT_PAIRS[2 * value + 1];
+        *--p = DIGIT_PAIRS[2 * value];
+    } else {
+        *--p = (char)('0' + value);
     }
-    return 0;
+    return p;
 }
 
 bool StartsWith(const char* s, const char* prefix) {
@@ -58,3 +56,30 @@ bool EndsWithCI(const char* s, const char* suffix) {
     const size_t suffLen = strlen(suffix);
     return suffLen <= sLen && strcasecmp(s + sLen - suffLen, suffix) == 0;
 }
+
+bool TStringView_EqualsCI(struct TStringView view, const char* s) {
+    return strlen(s) == view.Length && strncasecmp(view.Data, s, view.Length) == 0;
+}
+
+bool TStringView_HasToken(struct TStringView list, const char* token) {
+    const char* p = list.Data;
+    const char* end = list.Data + list.Length;
+    while (p != end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* itemEnd = comma != NULL ? comma : end;
+        // the list elements are separated by optional whitespace as well
+        const char* b = p;
+        const char* e = itemEnd;
+        while (b != e && (*b == ' ' || *b == '\t')) {
+            ++b;
+        }
+        while (e != b && (e[-1] == ' ' || e[-1] == '\t')) {
+            --e;
+        }
+        if (TStringView_EqualsCI((struct TStringView){ b, e - b }, token)) {
+            return true;
+        }
+        p = comma != NULL ? comma + 1 : end;
+    }
+    return false;
+}
@@ -1,8 +1,28 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
-int GetIntParam(const char* queryString, const char* name);
+#define MAX_UINT64_DIGITS 20
+
+// A slice of a buffer owned by someone else
+struct TStringView {
+    const char* Data;
+    size_t Length;
+};
+
+// case-insensitive
+bool TStringView_EqualsCI(struct TStringView view, const char* s);
+// True if the comma-separated list (like the Connection header) has `token`, case-insensitive
+bool TStringView_HasToken(struct TStringView list, const char* token);
+
+// A whole decimal with an optional '-', false if it is anything else or does not fit an int
+bool ParseInt(const char* s, size_t len, int* result);
+
+// Writes the decimal digits of `value` right before `end`, returns where they start.
+// Two digits per division, for the numbers of every response (Content-Length and the like).
+char* FormatUIntBackwards(uint64_t value, char* end);
 
 bool StartsWith(const char* s, const char* prefix);
 
@@ -1,18 +1,123 @@
+#include "config.h"
+#include "crc32c.h"
+#include "handler.h"
+#include "hpack.h"
+#include "http2.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "io.h"
+#include "io_pool.h"
+#include "lifecycle.h"
+#include "mpmc_queue.h"
+#include "rate_limiter.h"
+#include "reactor.h"
+#include "resources.h"
+#include "rope.h"
+#include "router.h"
 #include "stringbuilder.h"
 #include "stringutils.h"
+#include "timer_wheel.h"
+#include "worker_pool.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The int field `name` of the query string, 0 if there is none, as the handlers see it
+static int GetQueryInt(const char* query, const char* name) {
+    struct TRouteMatch match;
+    TRouteMatch_ParseQuery(&match, (struct TStringView){ query, strlen(query) });
+    return TRouteMatch_GetIntQuery(&match, name, 0);
+}
 
 static void TestQueryString() {
-    assert(GetIntParam("", "res") == 0);
-    assert(GetIntParam("res=1", "res") == 1);
-    assert(GetIntParam("result=1", "res") == 0);
-    assert(GetIntParam("a=10&b=20&c=30", "a") == 10);
-    assert(GetIntParam("a=10&b=20&c=30", "b") == 20);
-    assert(GetIntParam("a=10&b=20&c=30", "c") == 30);
-    assert(GetIntParam("a=10&b=20&c=30", "d") == 0);
+    assert(GetQueryInt("", "res") == 0);
+    assert(GetQueryInt("res=1", "res") == 1);
+    assert(GetQueryInt("result=1", "res") == 0);
+    assert(GetQueryInt("a=10&b=20&c=30", "a") == 10);
+    assert(GetQueryInt("a=10&b=20&c=30", "b") == 20);
+    assert(GetQueryInt("a=10&b=20&c=30", "c") == 30);
+    assert(GetQueryInt("a=10&b=20&c=30", "d") == 0);
+    assert(GetQueryInt("a=-7", "a") == -7);
+    assert(GetQueryInt("a=12x", "a") == 0);
+    assert(GetQueryInt("a=2147483648", "a") == 0);
+
+    int value;
+    assert(ParseInt("2147483647", 10, &value) && value == 2147483647);
+    assert(ParseInt("-2147483648", 11, &value) && value == -2147483647 - 1);
+    assert(!ParseInt("-", 1, &value) && !ParseInt("", 0, &value) && !ParseInt(" 1", 2, &value));
+}
+
+static void TestRouteHandlerA(const struct THttpRequest* request, struct THttpResponse* response,
+                              const struct TRouteMatch* match) {
+    (void) request, (void) response, (void) match;
+}
+
+static void TestRouteHandlerB(const struct THttpRequest* request, struct THttpResponse* response,
+                              const struct TRouteMatch* match) {
+    (void) request, (void) response, (void) match;
+}
+
+static TRouteHandler MatchPath(const struct TRouter* router, const char* path, struct TRouteMatch* match) {
+    return TRouter_Match(router, (struct TStringView){ path, strlen(path) }, match);
+}
+
+static void TestRouter() {
+    struct TRouter router;
+    TRouter_Init(&router);
+    struct TRouteMatch match;
+    assert(MatchPath(&router, "/", &match) == NULL);
+
+    assert(TRouter_Add(&router, "/", TestRouteHandlerA));
+    assert(TRouter_Add(&router, "/images/{int}.bmp", TestRouteHandlerA));
+    assert(TRouter_Add(&router, "/images/{int}/{int}.png", TestRouteHandlerB));
+    assert(TRouter_Add(&router, "/imagery", TestRouteHandlerB));  // splits the "/images/" edge
+    assert(TRouter_Add(&router, "/static/*", TestRouteHandlerB));
+    assert(TRouter_Add(&router, "/static/index", TestRouteHandlerA));
+    assert(!TRouter_Add(&router, "/", TestRouteHandlerB));
+    assert(!TRouter_Add(&router, "/a{b}", TestRouteHandlerB));
+    assert(!TRouter_Add(&router, "/a*b", TestRouteHandlerB));
+
+    assert(MatchPath(&router, "/", &match) == TestRouteHandlerA);
+    assert(MatchPath(&router, "/imagery", &match) == TestRouteHandlerB);
+    assert(MatchPath(&router, "/images/42.bmp", &match) == TestRouteHandlerA);
+    assert(match.ParamCount == 1 && match.Params[0] == 42);
+    assert(MatchPath(&router, "/images/3/14.png", &match) == TestRouteHandlerB);
+    assert(match.ParamCount == 2 && match.Params[0] == 3 && match.Params[1] == 14);
+    assert(MatchPath(&router, "/images/42.bmpx", &match) == NULL);
+    assert(MatchPath(&router, "/images/-1.bmp", &match) == NULL);
+    assert(MatchPath(&router, "/images/99999999999.bmp", &match) == NULL);
+    assert(MatchPath(&router, "/images/.bmp", &match) == NULL);
+    assert(MatchPath(&router, "/image", &match) == NULL);
+    assert(MatchPath(&router, "/\xff", &match) == NULL);
+
+    // a literal route is preferred to the rest of the path
+    assert(MatchPath(&router, "/static/index", &match) == TestRouteHandlerA);
+    assert(MatchPath(&router, "/static/indexes/", &match) == TestRouteHandlerB);
+    assert(match.Rest.Length == 8 && strncmp(match.Rest.Data, "indexes/", 8) == 0);
+    assert(MatchPath(&router, "/static/", &match) == TestRouteHandlerB && match.Rest.Length == 0);
+
+    const char* query = "page=7&flag&=x&&page=8&bad=1a";
+    TRouteMatch_ParseQuery(&match, (struct TStringView){ query, strlen(query) });
+    assert(match.QueryCount == 5);
+    assert(TRouteMatch_GetIntQuery(&match, "page", 0) == 7);
+    assert(TRouteMatch_GetIntQuery(&match, "flag", -1) == -1);
+    assert(TRouteMatch_GetIntQuery(&match, "bad", -1) == -1);
+    assert(TRouteMatch_GetIntQuery(&match, "missing", 3) == 3);
+    TRouter_Destroy(&router);
 }
 
 static void TestStringBuilder1() {
@@ -45,6 +150,46 @@ static void TestStringBuilder2() {
     TStringBuilder_Destroy(&sb);
 }
 
+static void TestRope() {
+    static const char TEMPLATE[] = "<td>";
+    struct TRope rope;
+    TRope_Init(&rope);
+    TRope_AppendLiteral(&rope, TEMPLATE);
+    TRope_AppendInt(&rope, 0);
+    TRope_AppendInt(&rope, -2147483647 - 1);  // follows the previous number in the arena, one segment
+    TRope_AppendLiteral(&rope, "</td>");
+    TRope_AppendCopy(&rope, "", 0);
+    assert(rope.Count == 3 && rope.Length == 21);
+    assert(TRope_GetSegments(&rope)[0].iov_base == TEMPLATE);  // referenced, not copied
+
+    struct TStringBuilder flat;
+    TStringBuilder_Init(&flat);
+    TStringBuilder_AppendCStr(&flat, ">");
+    TRope_CopyTo(&rope, &flat);
+    assert(strcmp(flat.Data, "><td>0-2147483648</td>") == 0);
+
+    // the headers go in front of the segments for a single write
+    const struct iovec prefix[] = {
+        { .iov_base = "A", .iov_len = 1 },
+        { .iov_base = "B", .iov_len = 1 },
+    };
+    size_t count;
+    const struct iovec* iov = TRope_Gather(&rope, prefix, 2, &count);
+    assert(count == 5 && iov[1].iov_base == prefix[1].iov_base && iov[2].iov_base == TEMPLATE);
+
+    // the scratch arena grows by blocks, the pieces already in the rope stay where they are
+    TRope_Clear(&rope);
+    for (int i = 0; i < 1000; ++i) {
+        TRope_AppendInt(&rope, i);
+        TRope_AppendLiteral(&rope, ",");
+    }
+    TStringBuilder_Clear(&flat);
+    TRope_CopyTo(&rope, &flat);
+    assert(flat.Length == rope.Length && StartsWith(flat.Data, "0,1,2,") && EndsWithCI(flat.Data, "998,999,"));
+    TStringBuilder_Destroy(&flat);
+    TRope_Destroy(&rope);
+}
+
 static void TestStartsWith() {
     assert(StartsWith("", ""));
     assert(!StartsWith("", "a"));
@@ -64,12 +209,1243 @@ static void TestEndsWith() {
     assert(!EndsWithCI("aaa", "ab"));
 }
 
+static void TestMpmcQueue() {
+    struct TMpmcQueue queue;
+    assert(TMpmcQueue_Init(&queue, 3));  // rounded up to 4
+
+    int value;
+    assert(!TMpmcQueue_TryPop(&queue, &value));
+    for (int i = 0; i < 4; ++i) {
+        assert(TMpmcQueue_TryPush(&queue, i));
+    }
+    assert(!TMpmcQueue_TryPush(&queue, 4));
+    for (int i = 0; i < 4; ++i) {
+        assert(TMpmcQueue_TryPop(&queue, &value));
+        assert(value == i);
+    }
+    assert(!TMpmcQueue_TryPop(&queue, &value));
+
+    TMpmcQueue_Destroy(&queue);
+}
+
+#define QUEUE_TEST_THREADS 4
+#define QUEUE_TEST_ITEMS 100000
+
+static void* QueueProducer(void* queue) {
+    for (int i = 1; i <= QUEUE_TEST_ITEMS; ++i) {
+        while (!TMpmcQueue_TryPush(queue, i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void* QueueConsumer(void* queue) {
+    int64_t sum = 0;
+    for (int i = 0; i < QUEUE_TEST_ITEMS; ++i) {
+        int value;
+        while (!TMpmcQueue_TryPop(queue, &value)) {
+            sched_yield();
+        }
+        sum += value;
+    }
+    return (void*)(intptr_t)sum;
+}
+
+static void TestMpmcQueueThreads() {
+    struct TMpmcQueue queue;
+    assert(TMpmcQueue_Init(&queue, 16));  // small on purpose: both sides run into a full or empty ring
+
+    pthread_t producers[QUEUE_TEST_THREADS];
+    pthread_t consumers[QUEUE_TEST_THREADS];
+    for (int i = 0; i < QUEUE_TEST_THREADS; ++i) {
+        pthread_create(&producers[i], NULL, QueueProducer, &queue);
+        pthread_create(&consumers[i], NULL, QueueConsumer, &queue);
+    }
+
+    int64_t total = 0;
+    for (int i = 0; i < QUEUE_TEST_THREADS; ++i) {
+        void* sum;
+        pthread_join(producers[i], NULL);
+        pthread_join(consumers[i], &sum);
+        total += (intptr_t)sum;
+    }
+    assert(total == (int64_t)QUEUE_TEST_THREADS * QUEUE_TEST_ITEMS * (QUEUE_TEST_ITEMS + 1) / 2);
+
+    TMpmcQueue_Destroy(&queue);
+}
+
+struct TTestTimer {
+    struct TTimer Timer;
+    uint64_t Deadline;
+    uint64_t FiredAt;
+};
+
+static void RecordFiring(struct TTimer* timer, void* now_ptr) {
+    ((struct TTestTimer*)timer)->FiredAt = *(uint64_t*)now_ptr;
+}
+
+static void CancelTimer(struct TTimer* timer, void* wheel) {
+    TTimerWheel_Cancel(wheel, timer);
+}
+
+static void TestTimerWheel() {
+    struct TTimerWheel wheel;
+    TTimerWheel_Init(&wheel, 1000);
+    assert(TTimerWheel_GetTimeout(&wheel, 1000) == -1);
+
+    // spread over all the levels, including one beyond the range of the wheel
+    const uint64_t offsets[] = {0, 1, 250, 6400, 6500, 409600, 500000, 30000000, 2000000000};
+    enum { COUNT = sizeof(offsets) / sizeof(offsets[0]) };
+    struct TTestTimer timers[COUNT];
+    for (int i = 0; i < COUNT; ++i) {
+        TTimer_Init(&timers[i].Timer);
+        timers[i].Deadline = 1000 + offsets[i];
+        timers[i].FiredAt = 0;
+        TTimerWheel_Schedule(&wheel, &timers[i].Timer, timers[i].Deadline);
+    }
+    struct TTestTimer cancelled;
+    TTimer_Init(&cancelled.Timer);
+    cancelled.FiredAt = 0;
+    TTimerWheel_Schedule(&wheel, &cancelled.Timer, 1500);
+    TTimerWheel_Cancel(&wheel, &cancelled.Timer);
+    assert(!TTimer_IsScheduled(&cancelled.Timer));
+
+    uint64_t now = 1000;
+    while (wheel.Count != 0) {
+        int timeout = TTimerWheel_GetTimeout(&wheel, now);
+        assert(timeout >= 0 && timeout <= TIMER_WHEEL_SIZE * TIMER_WHEEL_TICK_MS);
+        now += timeout;
+        TTimerWheel_Advance(&wheel, now, RecordFiring, &now);
+    }
+    for (int i = 0; i < COUNT; ++i) {
+        assert(!TTimer_IsScheduled(&timers[i].Timer));
+        assert(timers[i].FiredAt >= timers[i].Deadline);
+        assert(timers[i].FiredAt <= timers[i].Deadline + TIMER_WHEEL_TICK_MS);
+    }
+    assert(cancelled.FiredAt == 0);
+
+    // what the backends do when draining: visit every timer and cancel it on the spot
+    for (int i = 0; i < COUNT; ++i) {
+        TTimerWheel_Schedule(&wheel, &timers[i].Timer, now + offsets[i]);
+    }
+    TTimerWheel_ForEach(&wheel, CancelTimer, &wheel);
+    assert(wheel.Count == 0);
+    for (int i = 0; i < COUNT; ++i) {
+        assert(!TTimer_IsScheduled(&timers[i].Timer));
+    }
+}
+
+static void TestRequestParser() {
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    char head[] = "\r\nGET /images/1.bmp?page=2&x=y HTTP/1.1\r\nHost: localhost\r\n"
+                  "connection:   Keep-Alive \r\nX-Empty:\nAccept: */*\r\n\r\nGET /next";
+    const size_t headSize = strlen(head) - strlen("GET /next");
+
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    // the head arrives in pieces, its end is only found with the last one
+    assert(THttpRequestParser_Parse(&parser, head, 20, &request) == 0);
+    assert(parser.HeadSize == 20 && !parser.Complete);
+    assert(THttpRequestParser_Parse(&parser, head, headSize - 1, &request) == 0);
+    assert(THttpRequestParser_Parse(&parser, head, strlen(head), &request) == headSize);
+    assert(parser.Complete && !parser.Invalid && !parser.TooLarge);
+
+    assert(strcmp(request.Method.Data, "GET") == 0 && request.Method.Length == 3);
+    assert(strcmp(request.Path.Data, "/images/1.bmp") == 0 && request.Path.Length == 13);
+    assert(strcmp(request.QueryString.Data, "page=2&x=y") == 0);
+    assert(strcmp(request.Version.Data, "HTTP/1.1") == 0);
+    assert(request.HeaderCount == 4);
+    assert(strcmp(THttpRequest_FindHeader(&request, "HOST")->Data, "localhost") == 0);
+    assert(strcmp(THttpRequest_FindHeader(&request, "Connection")->Data, "Keep-Alive") == 0);
+    assert(THttpRequest_FindHeader(&request, "X-Empty")->Length == 0);
+    assert(THttpRequest_FindHeader(&request, "Cookie") == NULL);
+    assert(request.should_keep_alive);
+
+    // the delimiters are overwritten in place, so the sizes are taken beforehand
+    char noQuery[] = "HEAD /static/ HTTP/1.0\r\n\r\n";
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    assert(THttpRequestParser_Parse(&parser, noQuery, sizeof(noQuery) - 1, &request) == sizeof(noQuery) - 1);
+    assert(parser.Complete);
+    assert(strcmp(request.Path.Data, "/static/") == 0 && request.QueryString.Data == NULL);
+    assert(request.HeaderCount == 0 && !request.should_keep_alive);
+
+    char* invalid[] = {
+        (char[]){"GET\r\n\r\n"},
+        (char[]){"GET  / HTTP/1.1\r\n\r\n"},
+        (char[]){"GET / HTTP/1.1\r\nHost : x\r\n\r\n"},
+        (char[]){"GET / HTTP/1.1\r\nNoColon\r\n\r\n"},
+        (char[]){"GET / HTTP/1.1\r\nA: b\r\n folded\r\n\r\n"},
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        THttpRequestParser_Init(&parser);
+        THttpRequest_Init(&request);
+        const size_t size = strlen(invalid[i]);
+        assert(THttpRequestParser_Parse(&parser, invalid[i], size, &request) == size);
+        assert(parser.Invalid && !parser.Complete);
+    }
+
+    // bad versions are rejected, unsupported ones are left to the handler (505)
+    char badVersion[] = "GET / HTTP/1.x\r\n\r\n";
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    THttpRequestParser_Parse(&parser, badVersion, sizeof(badVersion) - 1, &request);
+    assert(parser.Invalid);
+    char http2[] = "GET / HTTP/2.0\r\n\r\n";
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    THttpRequestParser_Parse(&parser, http2, sizeof(http2) - 1, &request);
+    assert(parser.Complete && request.VersionMajor == 2 && !request.should_keep_alive);
+
+    char manyHeaders[(MAX_REQUEST_HEADERS + 1) * 6 + 32] = "GET / HTTP/1.1\r\n";
+    for (int i = 0; i <= MAX_REQUEST_HEADERS; ++i) {
+        strcat(manyHeaders, "A: b\r\n");
+    }
+    strcat(manyHeaders, "\r\n");
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    THttpRequestParser_Parse(&parser, manyHeaders, strlen(manyHeaders), &request);
+    assert(parser.TooLarge);
+}
+
+static bool IsDiskRequest(const char* head) {
+    char buf[256];
+    strcpy(buf, head);
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    THttpRequestParser_Parse(&parser, buf, strlen(buf), &request);
+    assert(parser.Complete);
+    return IsFilesystemRequest(&request);
+}
+
+static void TestDiskRequests() {
+    // nothing has been read from the dataset yet, so an image goes to the I/O pool like a static file
+    assert(IsDiskRequest("GET /images/5.bmp HTTP/1.1\r\n\r\n"));
+    assert(!IsCifarBitmapInMemory(5));
+    assert(IsDiskRequest("GET /static/style.css HTTP/1.1\r\n\r\n"));
+    assert(!IsDiskRequest("GET /images/10000.bmp HTTP/1.1\r\n\r\n"));  // a 404
+    assert(!IsDiskRequest("GET /?page=3 HTTP/1.1\r\n\r\n"));
+    assert(!IsDiskRequest("HEAD /images/5.bmp HTTP/1.1\r\n\r\n"));
+}
+
+static bool IsPersistent(const char* head) {
+    char buf[256];
+    strcpy(buf, head);
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    THttpRequestParser_Parse(&parser, buf, strlen(buf), &request);
+    assert(parser.Complete);
+    return request.should_keep_alive;
+}
+
+static void TestPersistentConnections() {
+    // HTTP/1.1 persists by default, HTTP/1.0 only when asked to
+    assert(IsPersistent("GET / HTTP/1.1\r\nHost: x\r\n\r\n"));
+    assert(!IsPersistent("GET / HTTP/1.0\r\nHost: x\r\n\r\n"));
+    assert(!IsPersistent("GET /\r\n\r\n"));
+    assert(IsPersistent("GET / HTTP/1.0\r\nconnection: Keep-Alive\r\n\r\n"));
+    assert(IsPersistent("GET / HTTP/1.0\r\nConnection: TE,keep-alive \r\n\r\n"));
+    // "close" wins, in any position and in any of the Connection headers
+    assert(!IsPersistent("GET / HTTP/1.1\r\nCONNECTION: close\r\n\r\n"));
+    assert(!IsPersistent("GET / HTTP/1.1\r\nConnection: Upgrade , Close\r\n\r\n"));
+    assert(!IsPersistent("GET / HTTP/1.0\r\nConnection: keep-alive\r\nConnection: close\r\n\r\n"));
+    assert(IsPersistent("GET / HTTP/1.1\r\nConnection: closed\r\n\r\n"));
+
+    struct THttpResponse response;
+    struct TStringBuilder headers;
+    THttpResponse_Init(&response);
+    TStringBuilder_Init(&headers);
+    THttpResponse_FormatHeaders(&response, &headers);
+    assert(strstr(headers.Data, "Connection: close\r\n") != NULL);
+    assert(strstr(headers.Data, "Keep-Alive") == NULL);
+    TStringBuilder_Clear(&headers);
+    response.KeepAlive = true;
+    response.KeepAliveMax = 7;
+    THttpResponse_FormatHeaders(&response, &headers);
+    char expected[64];
+    snprintf(expected, sizeof(expected), "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=7\r\n",
+             TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS / 1000);
+    assert(strstr(headers.Data, expected) != NULL);
+    TStringBuilder_Destroy(&headers);
+    THttpResponse_Destroy(&response);
+}
+
+static void TestPreforkDrain() {
+    // the worker process only sees the stop fd written by the master, its own flag has to follow
+    fflush(stdout);
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(Lifecycle_Init());
+        const int listener = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        assert(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(listener, 1) == 0);
+        const uint64_t one = 1;
+        assert(write(Lifecycle_GetStopFd(), &one, sizeof(one)) == sizeof(one));
+        assert(!Lifecycle_IsStopping() && GetRequestsLeft(1) != 0);
+
+        assert(RunReactorWorker(listener, -1));
+        assert(Lifecycle_IsStopping() && GetRequestsLeft(1) == 0);
+        assert(Lifecycle_GetDrainDeadline() > MonotonicMs());
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+static void TestResponseHeaders() {
+    char digits[MAX_UINT64_DIGITS];
+    char* end = digits + sizeof(digits);
+    assert(end - FormatUIntBackwards(0, end) == 1 && *FormatUIntBackwards(0, end) == '0');
+    assert(memcmp(FormatUIntBackwards(1994, end), "1994", 4) == 0);
+    assert(memcmp(FormatUIntBackwards(UINT64_MAX, digits + sizeof(digits)), "18446744073709551615", 20) == 0);
+    struct TStringBuilder sb;
+    TStringBuilder_Init(&sb);
+    TStringBuilder_AppendUInt(&sb, 10);
+    TStringBuilder_AppendUInt(&sb, 9);
+    TStringBuilder_AppendUInt(&sb, 100200);
+    assert(strcmp(sb.Data, "109100200") == 0 && sb.Length == 9);
+    TStringBuilder_Destroy(&sb);
+
+    // the same as strftime() in the C locale
+    char date[HTTP_DATE_SIZE];
+    assert(FormatHttpDate(784111777, date, sizeof(date)) == HTTP_DATE_SIZE - 1);
+    assert(strcmp(date, "Sun, 06 Nov 1994 08:49:37 GMT") == 0);
+    assert(FormatHttpDate(951868799, date, sizeof(date)) == HTTP_DATE_SIZE - 1);
+    assert(strcmp(date, "Tue, 29 Feb 2000 23:59:59 GMT") == 0);
+    assert(FormatHttpDate(784111777, date, HTTP_DATE_SIZE - 1) == 0);
+    const char* now = GetHttpDate();
+    assert(strlen(now) == HTTP_DATE_SIZE - 1 && EndsWithCI(now, " GMT"));
+
+    // the precomputed prefix of a known content type and the formatted one are the same
+    char contentType[] = "text/html";
+    struct THttpResponse response;
+    struct TStringBuilder headers;
+    struct TStringBuilder formatted;
+    THttpResponse_Init(&response);
+    TStringBuilder_Init(&headers);
+    TStringBuilder_Init(&formatted);
+    TStringBuilder_AppendCStr(&response.Body, "hi");
+    response.ContentType = CONTENT_TYPE_HTML;
+    THttpResponse_FormatHeaders(&response, &headers);
+    assert(StartsWith(headers.Data, "HTTP/1.1 200 OK\r\n" CUSTOM_LINE_FOR_WARMUP "\r\nContent-Type: text/html\r\nDate: "));
+    assert(strstr(headers.Data, "\r\nContent-Length: 2\r\n\r\n") == headers.Data + headers.Length - 23);
+    response.ContentType = contentType;
+    THttpResponse_FormatHeaders(&response, &formatted);
+    // unless the second has just changed in between
+    assert(strcmp(headers.Data, formatted.Data) == 0 || strstr(headers.Data, GetHttpDate()) == NULL);
+    TStringBuilder_Destroy(&formatted);
+
+    // the common errors reference pages built once, the others are formatted
+    CreateErrorPage(&response, HTTP_NOT_FOUND);
+    assert(response.Body.Length == 0 && response.BodyRope.Count == 1);
+    struct TStringBuilder body;
+    TStringBuilder_Init(&body);
+    TRope_CopyTo(&response.BodyRope, &body);
+    assert(strstr(body.Data, "<h1>404 Not Found</h1>") != NULL);
+    assert(THttpResponse_GetContentLength(&response) == body.Length);
+    TStringBuilder_Clear(&headers);
+    THttpResponse_FormatHeaders(&response, &headers);
+    assert(StartsWith(headers.Data, "HTTP/1.1 404 Not Found\r\n"));
+    CreateErrorPage(&response, HTTP_TOO_MANY_REQUESTS);
+    assert(response.BodyRope.Count == 0 && strstr(response.Body.Data, "<h1>429 Too Many Requests</h1>") != NULL);
+    TStringBuilder_Clear(&headers);
+    THttpResponse_FormatHeaders(&response, &headers);
+    char retryAfter[32];
+    snprintf(retryAfter, sizeof(retryAfter), "\r\nRetry-After: %d\r\n", RATE_LIMIT_RETRY_AFTER);
+    assert(strstr(headers.Data, retryAfter) != NULL);
+    TStringBuilder_Destroy(&body);
+    TStringBuilder_Destroy(&headers);
+    THttpResponse_Destroy(&response);
+}
+
+static void TestCrc32c() {
+    // the check value of CRC-32C and the vectors of RFC 3720 B.4
+    assert(Crc32c(0, "123456789", 9) == 0xE3069283);
+    uint8_t buf[32];
+    memset(buf, 0, sizeof(buf));
+    assert(Crc32c(0, buf, sizeof(buf)) == 0x8A9136AA);
+    memset(buf, 0xFF, sizeof(buf));
+    assert(Crc32c(0, buf, sizeof(buf)) == 0x62A8AB43);
+    for (int i = 0; i < 32; ++i) {
+        buf[i] = i;
+    }
+    assert(Crc32c(0, buf, sizeof(buf)) == 0x46DD794E);
+    // continued over the pieces, unaligned ones included
+    assert(Crc32c(Crc32c(0, buf, 3), buf + 3, 29) == 0x46DD794E);
+    assert(Crc32c(0, NULL, 0) == 0);
+}
+
+static bool IsNotModified(const char* head, const char* etag, time_t lastModified) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", head);
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    THttpRequestParser_Parse(&parser, buf, strlen(buf), &request);
+    assert(parser.Complete);
+    return THttpRequest_IsNotModified(&request, etag, lastModified);
+}
+
+static void TestGatherSend() {
+    int sockets[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    char head[] = "head;";
+    char body[] = "body";
+    struct iovec iov[] = {
+        { .iov_base = head, .iov_len = strlen(head) },
+        { .iov_base = NULL, .iov_len = 0 },
+        { .iov_base = body, .iov_len = strlen(body) },
+    };
+    const uint64_t sends = IoStats_Get(IO_STAT_SEND_CALLS);
+    assert(SendAllv(sockets[0], iov, 3, false));
+    assert(IoStats_Get(IO_STAT_SEND_CALLS) == sends + 1);  // one syscall for all the buffers
+
+    char received[16] = {0};
+    assert(recv(sockets[1], received, sizeof(received), 0) == 9);
+    assert(strcmp(received, "head;body") == 0);
+
+    // nothing to send is no syscall
+    assert(SendAllv(sockets[0], iov + 1, 1, false));
+    assert(IoStats_Get(IO_STAT_SEND_CALLS) == sends + 1);
+    close(sockets[0]);
+    close(sockets[1]);
+}
+
+static void TestZeroCopySend() {
+    // MSG_ZEROCOPY takes TCP, over loopback the kernel completes the sends by copying after all
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addrLength = sizeof(addr);
+    assert(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(listener, 1) == 0);
+    assert(getsockname(listener, (struct sockaddr*)&addr, &addrLength) == 0);
+    const int client = socket(AF_INET, SOCK_STREAM, 0);
+    assert(connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    const int server = accept(listener, NULL, NULL);
+    assert(server != -1 && EnableZeroCopy(server));
+
+    static char data[256 * 1024];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = (char)(i * 7);
+    }
+    const uint64_t sends = IoStats_Get(IO_STAT_ZEROCOPY_SENDS);
+    const uint64_t copied = IoStats_Get(IO_STAT_ZEROCOPY_COPIED);
+    struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
+    assert(SendAllvZeroCopy(server, &iov, 1, false));
+    const uint64_t zerocopySends = IoStats_Get(IO_STAT_ZEROCOPY_SENDS) - sends;
+    assert(zerocopySends != 0);
+
+    static char received[sizeof(data)];
+    size_t size = 0;
+    while (size < sizeof(received)) {
+        const ssize_t ret = recv(client, received + size, sizeof(received) - size, 0);
+        assert(ret > 0);
+        size += ret;
+    }
+    assert(memcmp(received, data, sizeof(data)) == 0);
+
+    // a completion is queued once the data is acknowledged, poll() reports it as POLLERR
+    size_t completed = 0;
+    for (int i = 0; i < 100 && completed < zerocopySends; ++i) {
+        struct pollfd pfd = { .fd = server, .events = 0 };
+        poll(&pfd, 1, 10);
+        completed += ReapZeroCopy(server);
+    }
+    assert(completed == zerocopySends);
+    assert(IoStats_Get(IO_STAT_ZEROCOPY_COPIED) - copied == zerocopySends);
+    assert(ReapZeroCopy(server) == 0);
+
+    // a response with a cached body, the headers are copied in a send of their own
+    struct THttpResponse response;
+    THttpResponse_Init(&response);
+    response.ContentType = CONTENT_TYPE_HTML;
+    TRope_AppendRef(&response.BodyRope, data, ZEROCOPY_MIN_SIZE);
+    response.BodyCached = true;
+    struct TStringBuilder headers;
+    TStringBuilder_Init(&headers);
+    THttpResponse_FormatHeaders(&response, &headers);
+    const uint64_t responseSends = IoStats_Get(IO_STAT_ZEROCOPY_SENDS);
+    assert(THttpResponse_Send(&response, server, false));
+    assert(IoStats_Get(IO_STAT_ZEROCOPY_SENDS) - responseSends == (USING_ZEROCOPY_SEND ? 1 : 0));
+    const size_t responseSize = headers.Length + ZEROCOPY_MIN_SIZE;
+    size = 0;
+    while (size < responseSize) {
+        const ssize_t ret = recv(client, received + size, responseSize - size, 0);
+        assert(ret > 0);
+        size += ret;
+    }
+    // the Date may have ticked in between
+    assert(memcmp(received, headers.Data, 32) == 0);
+    assert(memcmp(received + headers.Length, data, ZEROCOPY_MIN_SIZE) == 0);
+    TStringBuilder_Destroy(&headers);
+    THttpResponse_Destroy(&response);
+
+    close(server);
+    close(client);
+    close(listener);
+}
+
+static void TestConditionalRequests() {
+    const char* etag = "\"5e8f2a01\"";
+    const time_t mtime = 784111777;  // Sun, 06 Nov 1994 08:49:37 GMT
+    assert(!IsNotModified("GET / HTTP/1.1\r\n\r\n", etag, mtime));
+    assert(IsNotModified("GET / HTTP/1.1\r\nIf-None-Match: \"5e8f2a01\"\r\n\r\n", etag, mtime));
+    assert(IsNotModified("GET / HTTP/1.1\r\nif-none-match: \"a\", W/\"5e8f2a01\"\r\n\r\n", etag, 0));
+    assert(IsNotModified("GET / HTTP/1.1\r\nIf-None-Match: \"a\"\r\nIf-None-Match: \"5e8f2a01\"\r\n\r\n", etag, 0));
+    assert(IsNotModified("GET / HTTP/1.1\r\nIf-None-Match: *\r\n\r\n", etag, 0));
+    assert(!IsNotModified("GET / HTTP/1.1\r\nIf-None-Match: \"5e8f2a0\"\r\n\r\n", etag, 0));
+    assert(!IsNotModified("GET / HTTP/1.1\r\nIf-None-Match: 5e8f2a01\r\n\r\n", etag, 0));
+    // If-Modified-Since in all three date formats, and only without If-None-Match
+    assert(IsNotModified("GET / HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n", etag, mtime));
+    assert(IsNotModified("GET / HTTP/1.1\r\nIf-Modified-Since: Sunday, 06-Nov-94 08:49:37 GMT\r\n\r\n", etag, mtime));
+    assert(IsNotModified("GET / HTTP/1.1\r\nIf-Modified-Since: Sun Nov  6 08:49:37 1994\r\n\r\n", etag, mtime));
+    assert(!IsNotModified("GET / HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:36 GMT\r\n\r\n", etag, mtime));
+    assert(!IsNotModified("GET / HTTP/1.1\r\nIf-Modified-Since: yesterday\r\n\r\n", etag, mtime));
+    assert(!IsNotModified("GET / HTTP/1.1\r\nIf-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n", etag, 0));
+    assert(!IsNotModified("GET / HTTP/1.1\r\nIf-None-Match: \"a\"\r\n"
+                          "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n", etag, mtime));
+
+    struct THttpResponse response;
+    struct TStringBuilder headers;
+    THttpResponse_Init(&response);
+    TStringBuilder_Init(&headers);
+    TStringBuilder_AppendCStr(&response.Body, "BM...");
+    response.ContentType = "image/bmp";
+    response.file_modification_time = mtime;
+    snprintf(response.ETag, ETAG_SIZE, "%s", etag);
+    response.CacheControl = IMAGES_CACHE_CONTROL;
+    THttpResponse_SetNotModified(&response);
+    assert(THttpResponse_GetContentLength(&response) == 0);
+    THttpResponse_FormatHeaders(&response, &headers);
+    assert(StartsWith(headers.Data, "HTTP/1.1 304 Not Modified\r\n"));
+    assert(strstr(headers.Data, "\r\nETag: \"5e8f2a01\"\r\n") != NULL);
+    assert(strstr(headers.Data, "\r\nLast-Modified: Sun, 06 Nov 1994 08:49:37 GMT\r\n") != NULL);
+    assert(strstr(headers.Data, "\r\nCache-Control: " IMAGES_CACHE_CONTROL "\r\n") != NULL);
+    assert(strstr(headers.Data, "Content-Length") == NULL);
+    TStringBuilder_Destroy(&headers);
+    THttpResponse_Destroy(&response);
+}
+
+static enum EHttpRangeResult GetRanges(const char* range, size_t size, struct THttpByteRange* ranges, size_t* count) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "GET / HTTP/1.1\r\nRange: %s\r\n\r\n", range);
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    THttpRequestParser_Parse(&parser, buf, strlen(buf), &request);
+    assert(parser.Complete);
+    return THttpRequest_GetRanges(&request, size, ranges, count);
+}
+
+static bool IsRange(const struct THttpByteRange* range, off_t offset, size_t length) {
+    return range->Offset == offset && range->Length == length;
+}
+
+static void TestByteRanges() {
+    struct THttpByteRange r[MAX_BYTE_RANGES];
+    size_t n;
+    assert(GetRanges("bytes=0-99", 1000, r, &n) == RANGE_SATISFIABLE && n == 1 && IsRange(&r[0], 0, 100));
+    assert(GetRanges("bytes=900-", 1000, r, &n) == RANGE_SATISFIABLE && n == 1 && IsRange(&r[0], 900, 100));
+    assert(GetRanges("bytes=-100", 1000, r, &n) == RANGE_SATISFIABLE && n == 1 && IsRange(&r[0], 900, 100));
+    assert(GetRanges("bytes=-5000", 1000, r, &n) == RANGE_SATISFIABLE && n == 1 && IsRange(&r[0], 0, 1000));
+    assert(GetRanges("bytes=990-5000", 1000, r, &n) == RANGE_SATISFIABLE && n == 1 && IsRange(&r[0], 990, 10));
+    // sorted, the overlapping and adjacent ones merged, the unsatisfiable ones dropped
+    assert(GetRanges("Bytes=500-599, 0-9,,10-19 ,550-700, 2000-", 1000, r, &n) == RANGE_SATISFIABLE);
+    assert(n == 2 && IsRange(&r[0], 0, 20) && IsRange(&r[1], 500, 201));
+    assert(GetRanges("bytes=1000-", 1000, r, &n) == RANGE_NOT_SATISFIABLE);
+    assert(GetRanges("bytes=-0", 1000, r, &n) == RANGE_NOT_SATISFIABLE);
+    assert(GetRanges("bytes=0-", 0, r, &n) == RANGE_NOT_SATISFIABLE);
+    // malformed ones are ignored
+    assert(GetRanges("bytes=9-0", 1000, r, &n) == RANGE_NONE);
+    assert(GetRanges("bytes=a-b", 1000, r, &n) == RANGE_NONE);
+    assert(GetRanges("bytes=0-1-2", 1000, r, &n) == RANGE_NONE);
+    assert(GetRanges("bytes=", 1000, r, &n) == RANGE_NONE);
+    assert(GetRanges("items=0-1", 1000, r, &n) == RANGE_NONE);
+    assert(GetRanges("bytes=99999999999999999999-", 1000, r, &n) == RANGE_NONE);
+    char many[256] = "bytes=0-0";
+    for (int i = 1; i <= MAX_BYTE_RANGES; ++i) {
+        snprintf(many + strlen(many), sizeof(many) - strlen(many), ",%d-%d", 2 * i, 2 * i);
+    }
+    assert(GetRanges(many, 1000, r, &n) == RANGE_NONE);
+
+    // a multipart body over sendfile() is exactly as long as announced
+    char path[] = "/tmp/cifar-test-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    char content[1000];
+    for (size_t i = 0; i < sizeof(content); ++i) {
+        content[i] = 'a' + i % 26;
+    }
+    assert(write(fd, content, sizeof(content)) == sizeof(content));
+    close(fd);
+
+    struct THttpResponse response;
+    THttpResponse_Init(&response);
+    response.ContentType = "text/plain";
+    response.should_use_sendfile = true;
+    response.file_path_requested = strdup(path);
+    response.sent_file_size = sizeof(content);
+    assert(GetRanges("bytes=0-9,500-599,-3", sizeof(content), r, &n) == RANGE_SATISFIABLE && n == 3);
+    THttpResponse_SetRanges(&response, r, n);
+    assert(THttpResponse_GetFilePartCount(&response) == 3);
+
+    int sockets[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == 0);
+    assert(THttpResponse_Send(&response, sockets[0], false));
+    close(sockets[0]);
+    static char received[4096];
+    size_t size = 0;
+    ssize_t ret;
+    while ((ret = read(sockets[1], received + size, sizeof(received) - 1 - size)) > 0) {
+        size += ret;
+    }
+    close(sockets[1]);
+    received[size] = '\0';
+
+    assert(StartsWith(received, "HTTP/1.1 206 Partial Content\r\n"));
+    assert(strstr(received, "Content-Type: multipart/byteranges; boundary=") != NULL);
+    const char* body = strstr(received, "\r\n\r\n") + 4;
+    size_t contentLength = 0;
+    assert(sscanf(strstr(received, "Content-Length: "), "Content-Length: %zu", &contentLength) == 1);
+    assert(contentLength == size - (body - received));
+    assert(strstr(body, "Content-Range: bytes 0-9/1000\r\n\r\nabcdefghij\r\n--") != NULL);
+    assert(strstr(body, "Content-Range: bytes 997-999/1000\r\n\r\njkl\r\n--") != NULL);
+    assert(memcmp(received + size - 4, "--\r\n", 4) == 0);
+
+    THttpResponse_Destroy(&response);
+    unlink(path);
+}
+
+static void TestLinkHeader() {
+    struct THttpResponse response;
+    THttpResponse_Init(&response);
+    response.Link = "</a.css>; rel=preload; as=style";
+    struct TStringBuilder headers;
+    TStringBuilder_Init(&headers);
+    THttpResponse_FormatHeaders(&response, &headers);
+    assert(StartsWith(headers.Data, "HTTP/1.1 200 OK\r\n"));
+    assert(strstr(headers.Data, "\r\nLink: </a.css>; rel=preload; as=style\r\n") != NULL);
+    assert(strstr(strstr(headers.Data, "Link: ") + 1, "Link: ") == NULL);  // only once
+
+    // index pages get their links formatted once and shared by every response
+    struct THttpResponse page;
+    THttpResponse_Init(&page);
+    CreateIndexPage(&page, 3);
+    assert(page.Link != NULL && strstr(page.Link, "</images/300.bmp>; rel=preload; as=image") != NULL);
+    const char* links = page.Link;
+    THttpResponse_Destroy(&page);
+    THttpResponse_Init(&page);
+    CreateIndexPage(&page, 3);
+    assert(page.Link == links);
+    THttpResponse_Destroy(&page);
+    TStringBuilder_Destroy(&headers);
+    THttpResponse_Destroy(&response);
+}
+
+// Emits "ab", nothing, "cde", then ends or fails
+struct TTestBodyStream {
+    struct THttpBodyStream Base;
+    int Step;
+    bool Fail;
+    bool* Destroyed;
+};
+
+static enum EBodyStreamResult GenerateTestBody(struct THttpBodyStream* base, struct TStringBuilder* out) {
+    struct TTestBodyStream* self = (struct TTestBodyStream*)base;
+    switch (self->Step++) {
+        case 0:
+            TStringBuilder_AppendCStr(out, "ab");
+            return BODY_STREAM_MORE;
+        case 1:
+            return BODY_STREAM_MORE;
+        case 2:
+            TStringBuilder_AppendCStr(out, "cde");
+            return BODY_STREAM_MORE;
+        default:
+            return self->Fail ? BODY_STREAM_FAILED : BODY_STREAM_END;
+    }
+}
+
+static void DestroyTestBody(struct THttpBodyStream* base) {
+    *((struct TTestBodyStream*)base)->Destroyed = true;
+    free(base);
+}
+
+static struct THttpBodyStream* CreateTestBody(bool fail, bool* destroyed) {
+    struct TTestBodyStream* self = calloc(1, sizeof(struct TTestBodyStream));
+    self->Base.Generate = GenerateTestBody;
+    self->Base.Destroy = DestroyTestBody;
+    self->Fail = fail;
+    self->Destroyed = destroyed;
+    *destroyed = false;
+    return &self->Base;
+}
+
+static void TestChunkedBody() {
+    bool destroyed;
+    struct THttpResponse response;
+    THttpResponse_Init(&response);
+    response.BodyStream = CreateTestBody(false, &destroyed);
+    struct TStringBuilder out;
+    TStringBuilder_Init(&out);
+    THttpResponse_FormatHeaders(&response, &out);
+    assert(strstr(out.Data, "\r\nTransfer-Encoding: chunked\r\n\r\n") != NULL);
+    assert(strstr(out.Data, "Content-Length") == NULL);
+
+    // an empty piece is no chunk, it would end the body
+    TStringBuilder_Clear(&out);
+    assert(THttpResponse_AppendChunk(&response, &out) == BODY_STREAM_MORE);
+    assert(strcmp(out.Data, "00000002\r\nab\r\n") == 0);
+    assert(THttpResponse_AppendChunk(&response, &out) == BODY_STREAM_MORE);
+    assert(strcmp(out.Data, "00000002\r\nab\r\n00000003\r\ncde\r\n") == 0);
+    TStringBuilder_Clear(&out);
+    assert(THttpResponse_AppendChunk(&response, &out) == BODY_STREAM_END);
+    assert(strcmp(out.Data, "0\r\n\r\n") == 0);
+    assert(destroyed && response.BodyStream == NULL);
+    THttpResponse_Destroy(&response);
+
+    // a failed body gets no last chunk
+    THttpResponse_Init(&response);
+    response.BodyStream = CreateTestBody(true, &destroyed);
+    TStringBuilder_Clear(&out);
+    assert(THttpResponse_AppendChunk(&response, &out) == BODY_STREAM_MORE);
+    assert(THttpResponse_AppendChunk(&response, &out) == BODY_STREAM_MORE);
+    TStringBuilder_Clear(&out);
+    assert(THttpResponse_AppendChunk(&response, &out) == BODY_STREAM_FAILED);
+    assert(out.Length == 0 && destroyed && response.BodyStream == NULL);
+    THttpResponse_Destroy(&response);
+
+    // an HTTP/1.0 client gets the whole body with a Content-Length
+    THttpResponse_Init(&response);
+    response.BodyStream = CreateTestBody(false, &destroyed);
+    assert(THttpResponse_DrainBodyStream(&response));
+    assert(destroyed && strcmp(response.Body.Data, "abcde") == 0);
+    TStringBuilder_Clear(&out);
+    THttpResponse_FormatHeaders(&response, &out);
+    assert(strstr(out.Data, "\r\nContent-Length: 5\r\n") != NULL);
+    THttpResponse_Destroy(&response);
+
+    // a stream never pulled is released with the response
+    THttpResponse_Init(&response);
+    response.BodyStream = CreateTestBody(false, &destroyed);
+    THttpResponse_Destroy(&response);
+    assert(destroyed);
+    TStringBuilder_Destroy(&out);
+}
+
+static void AssertHpackFields(const struct TStringBuilder* fields, const char* const* expected, size_t count) {
+    const char* p = fields->Data;
+    for (size_t i = 0; i < 2 * count; ++i) {
+        assert(strcmp(p, expected[i]) == 0);
+        p += strlen(p) + 1;
+    }
+    assert(p == fields->Data + fields->Length);
+}
+
+static void TestHpack() {
+    struct THpackDecoder decoder;
+    struct TStringBuilder fields;
+    TStringBuilder_Init(&fields);
+
+    // RFC 7541 C.3.1, plain literals
+    THpackDecoder_Init(&decoder);
+    static const uint8_t plain[] = "\x82\x86\x84\x41\x0f" "www.example.com";
+    static const char* const plainFields[] = {
+        ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com",
+    };
+    assert(THpackDecoder_Decode(&decoder, plain, sizeof(plain) - 1, MAX_REQUEST_HEAD_SIZE, &fields));
+    AssertHpackFields(&fields, plainFields, 4);
+    THpackDecoder_Destroy(&decoder);
+
+    // RFC 7541 C.4, Huffman coded and referring to the dynamic table built by the previous blocks
+    THpackDecoder_Init(&decoder);
+    static const uint8_t first[] = "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4\xff";
+    static const uint8_t second[] = "\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf";
+    static const uint8_t third[] = "\x82\x87\x85\xbf\x40\x88\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f"
+                                   "\x89\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf";
+    static const char* const secondFields[] = {
+        ":method", "GET", ":scheme", "http", ":path", "/", ":authority", "www.example.com",
+        "cache-control", "no-cache",
+    };
+    static const char* const thirdFields[] = {
+        ":method", "GET", ":scheme", "https", ":path", "/index.html", ":authority", "www.example.com",
+        "custom-key", "custom-value",
+    };
+    TStringBuilder_Clear(&fields);
+    assert(THpackDecoder_Decode(&decoder, first, sizeof(first) - 1, MAX_REQUEST_HEAD_SIZE, &fields));
+    AssertHpackFields(&fields, plainFields, 4);
+    TStringBuilder_Clear(&fields);
+    assert(THpackDecoder_Decode(&decoder, second, sizeof(second) - 1, MAX_REQUEST_HEAD_SIZE, &fields));
+    AssertHpackFields(&fields, secondFields, 5);
+    TStringBuilder_Clear(&fields);
+    assert(THpackDecoder_Decode(&decoder, third, sizeof(third) - 1, MAX_REQUEST_HEAD_SIZE, &fields));
+    AssertHpackFields(&fields, thirdFields, 5);
+    assert(decoder.Count == 3 && decoder.Size == 164);
+
+    // an index past the tables, a truncated string
+    static const uint8_t badIndex[] = "\xc2";
+    static const uint8_t truncated[] = "\x41\x0f" "www";
+    assert(!THpackDecoder_Decode(&decoder, badIndex, 1, MAX_REQUEST_HEAD_SIZE, &fields));
+    THpackDecoder_Destroy(&decoder);
+    THpackDecoder_Init(&decoder);
+    assert(!THpackDecoder_Decode(&decoder, truncated, sizeof(truncated) - 1, MAX_REQUEST_HEAD_SIZE, &fields));
+    THpackDecoder_Destroy(&decoder);
+
+    // responses: an indexed status and literals without indexing, which the decoder reads back
+    TStringBuilder_Clear(&fields);
+    struct TStringBuilder block;
+    TStringBuilder_Init(&block);
+    Hpack_EncodeStatus(&block, 404);
+    Hpack_EncodeStatus(&block, 429);
+    Hpack_EncodeField(&block, HPACK_CONTENT_TYPE, "text/html", 9);
+    assert(block.Data[0] == (char)0x8d);
+    THpackDecoder_Init(&decoder);
+    static const char* const responseFields[] = { ":status", "404", ":status", "429", "content-type", "text/html" };
+    assert(THpackDecoder_Decode(&decoder, (const uint8_t*)block.Data, block.Length, MAX_REQUEST_HEAD_SIZE, &fields));
+    AssertHpackFields(&fields, responseFields, 3);
+    assert(decoder.Count == 0);
+    THpackDecoder_Destroy(&decoder);
+
+    // a large entry referenced over and over: the output stops growing, the table keeps up with the block
+    TStringBuilder_Clear(&block);
+    TStringBuilder_AppendBuf(&block, "\x40\x01x\x7f\x01", 5);  // "x" with a 128 byte value, indexed
+    for (int i = 0; i < 128; ++i) {
+        TStringBuilder_AppendBuf(&block, "a", 1);
+    }
+    for (int i = 0; i < 30000; ++i) {
+        TStringBuilder_AppendBuf(&block, "\xbe", 1);  // the newest dynamic entry
+    }
+    TStringBuilder_AppendBuf(&block, "\x40\x01y\x01z", 5);
+    TStringBuilder_Clear(&fields);
+    THpackDecoder_Init(&decoder);
+    assert(THpackDecoder_Decode(&decoder, (const uint8_t*)block.Data, block.Length, MAX_REQUEST_HEAD_SIZE, &fields));
+    assert(fields.Length > MAX_REQUEST_HEAD_SIZE && fields.Length <= MAX_REQUEST_HEAD_SIZE + 2 + 129);
+    assert(decoder.Count == 2);
+    static const char* const lastFields[] = { "y", "z" };
+    TStringBuilder_Clear(&fields);
+    assert(THpackDecoder_Decode(&decoder, (const uint8_t*)"\xbe", 1, MAX_REQUEST_HEAD_SIZE, &fields));
+    AssertHpackFields(&fields, lastFields, 1);
+    THpackDecoder_Destroy(&decoder);
+    TStringBuilder_Destroy(&block);
+    TStringBuilder_Destroy(&fields);
+}
+
+static void HandleHttp2TestStream(const struct THttpRequest* request, struct THttpResponse* response, void* context) {
+    ++*(int*)context;
+    assert(TStringView_EqualsCI(request->Method, "GET"));
+    assert(strcmp(request->Path.Data, "/") == 0);
+    assert(request->QueryString.Data == NULL);
+    assert(request->VersionMajor == 1 && request->VersionMinor == 1);
+    response->ContentType = "text/plain";
+    TStringBuilder_AppendCStr(&response->Body, "hello");
+}
+
+// The next frame of `output` at `*offset`, its payload is returned
+static const uint8_t* NextHttp2Frame(const struct TStringBuilder* output, size_t* offset,
+                                     int* type, int* flags, uint32_t* stream, size_t* length) {
+    const uint8_t* p = (const uint8_t*)output->Data + *offset;
+    assert(*offset + 9 <= output->Length);
+    *length = ((size_t)p[0] << 16) | (p[1] << 8) | p[2];
+    *type = p[3];
+    *flags = p[4];
+    *stream = ((uint32_t)p[5] << 24) | (p[6] << 16) | (p[7] << 8) | p[8];
+    *offset += 9 + *length;
+    assert(*offset <= output->Length);
+    return p + 9;
+}
+
+static void TestHttp2Session() {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    // SETTINGS with SETTINGS_INITIAL_WINDOW_SIZE of 3
+    static const char settings[] = "\x00\x00\x06\x04\x00\x00\x00\x00\x00" "\x00\x04\x00\x00\x00\x03";
+    // HEADERS of RFC 7541 C.3.1 with END_STREAM | END_HEADERS, for stream 1 and stream 3
+    static const char headers1[] = "\x00\x00\x14\x01\x05\x00\x00\x00\x01"
+                                   "\x82\x86\x84\x41\x0f" "www.example.com";
+    static const char headers3[] = "\x00\x00\x04\x01\x05\x00\x00\x00\x03" "\x82\x86\x84\xbe";
+    static const char windowUpdate1[] = "\x00\x00\x04\x08\x00\x00\x00\x00\x01" "\x00\x00\x00\x02";
+
+    int handled = 0;
+    struct THttp2Session* session = malloc(sizeof(*session));
+    THttp2Session_Init(session, HandleHttp2TestStream, &handled, 100);
+    THttp2Session_Start(session, NULL);
+
+    // fed in pieces: the rest of the preface, the settings split inside the frame header
+    const size_t head = strlen("PRI * HTTP/2.0\r\n\r\n");
+    assert(THttp2Session_Feed(session, preface + head, sizeof(preface) - 1 - head));
+    assert(THttp2Session_Feed(session, settings, 4));
+    assert(THttp2Session_Feed(session, settings + 4, sizeof(settings) - 1 - 4));
+    char both[sizeof(headers1) + sizeof(headers3)];
+    memcpy(both, headers1, sizeof(headers1) - 1);
+    memcpy(both + sizeof(headers1) - 1, headers3, sizeof(headers3) - 1);
+    assert(THttp2Session_Feed(session, both, sizeof(headers1) - 1 + sizeof(headers3) - 1));
+    assert(handled == 2 && session->ActiveStreams == 2);
+
+    size_t offset = 0;
+    int type, flags;
+    uint32_t stream;
+    size_t length;
+    const uint8_t* payload = NextHttp2Frame(&session->Output, &offset, &type, &flags, &stream, &length);
+    assert(type == 4 && flags == 0 && stream == 0 && length == 6);  // the server's SETTINGS
+    NextHttp2Frame(&session->Output, &offset, &type, &flags, &stream, &length);
+    assert(type == 4 && flags == 1 && length == 0);  // the ACK
+    assert(offset == session->Output.Length);
+
+    // the headers of both, then 3 bytes of each body: the windows are closed
+    THttp2Session_WriteFrames(session);
+    int headersSeen = 0;
+    int dataSeen = 0;
+    while (offset != session->Output.Length) {
+        payload = NextHttp2Frame(&session->Output, &offset, &type, &flags, &stream, &length);
+        assert(stream == 1 || stream == 3);
+        if (type == 1) {
+            assert(flags == 4 && payload[0] == 0x88);  // END_HEADERS, :status 200
+            ++headersSeen;
+        } else {
+            assert(type == 0 && flags == 0 && length == 3 && memcmp(payload, "hel", 3) == 0);
+            ++dataSeen;
+        }
+    }
+    assert(headersSeen == 2 && dataSeen == 2);
+    assert(!THttp2Session_WantsWrite(session));
+
+    // stream 1 gets the rest, stream 3 keeps waiting
+    assert(THttp2Session_Feed(session, windowUpdate1, sizeof(windowUpdate1) - 1));
+    assert(THttp2Session_WantsWrite(session));
+    THttp2Session_WriteFrames(session);
+    payload = NextHttp2Frame(&session->Output, &offset, &type, &flags, &stream, &length);
+    assert(type == 0 && flags == 1 && stream == 1 && length == 2 && memcmp(payload, "lo", 2) == 0);
+    assert(offset == session->Output.Length);
+    assert(session->ActiveStreams == 1 && !THttp2Session_WantsWrite(session));
+
+    // the stream in flight is completed after GOAWAY
+    THttp2Session_Shutdown(session);
+    assert(!THttp2Session_IsDone(session));
+    THttp2Session_Destroy(session);
+
+    // a frame other than SETTINGS after the preface is a connection error
+    THttp2Session_Init(session, HandleHttp2TestStream, &handled, 100);
+    THttp2Session_Start(session, NULL);
+    assert(THttp2Session_Feed(session, preface + head, sizeof(preface) - 1 - head));
+    assert(!THttp2Session_Feed(session, headers1, sizeof(headers1) - 1));
+    assert(THttp2Session_IsDone(session) && handled == 2);
+    THttp2Session_Destroy(session);
+    free(session);
+}
+
+static void HandleHttp2LongLink(const struct THttpRequest* request, struct THttpResponse* response, void* context) {
+    (void) request;
+    response->Link = context;
+    response->ContentType = "text/plain";
+}
+
+static void TestHttp2Continuation() {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static const char settings[] = "\x00\x00\x00\x04\x00\x00\x00\x00\x00";
+    static const char headers1[] = "\x00\x00\x14\x01\x05\x00\x00\x00\x01"
+                                   "\x82\x86\x84\x41\x0f" "www.example.com";
+    // a Link longer than two frames of the default SETTINGS_MAX_FRAME_SIZE
+    static char link[40000];
+    memset(link, 'l', sizeof(link) - 1);
+    link[sizeof(link) - 1] = '\0';
+
+    struct THttp2Session* session = malloc(sizeof(*session));
+    THttp2Session_Init(session, HandleHttp2LongLink, link, 100);
+    THttp2Session_Start(session, NULL);
+    const size_t head = strlen("PRI * HTTP/2.0\r\n\r\n");
+    assert(THttp2Session_Feed(session, preface + head, sizeof(preface) - 1 - head));
+    assert(THttp2Session_Feed(session, settings, sizeof(settings) - 1));
+    assert(THttp2Session_Feed(session, headers1, sizeof(headers1) - 1));
+    size_t offset = session->Output.Length;
+    THttp2Session_WriteFrames(session);
+
+    int type, flags;
+    uint32_t stream;
+    size_t length;
+    size_t block = 0;
+    NextHttp2Frame(&session->Output, &offset, &type, &flags, &stream, &length);
+    assert(type == 1 && flags == 1 && stream == 1 && length == 16384);  // END_STREAM, no END_HEADERS
+    block += length;
+    NextHttp2Frame(&session->Output, &offset, &type, &flags, &stream, &length);
+    assert(type == 9 && flags == 0 && stream == 1 && length == 16384);
+    block += length;
+    NextHttp2Frame(&session->Output, &offset, &type, &flags, &stream, &length);
+    assert(type == 9 && flags == 4 && stream == 1 && length <= 16384);  // END_HEADERS
+    block += length;
+    assert(offset == session->Output.Length && block > sizeof(link) - 1);
+    THttp2Session_Destroy(session);
+    free(session);
+}
+
+static void TestHttp2Deadlines() {
+    static const char preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+    static const char settings[] = "\x00\x00\x00\x04\x00\x00\x00\x00\x00";
+    static const char ping[] = "\x00\x00\x08\x06\x00\x00\x00\x00\x00" "12345678";
+    static const char headers1[] = "\x00\x00\x14\x01\x05\x00\x00\x00\x01"
+                                   "\x82\x86\x84\x41\x0f" "www.example.com";
+    const size_t head = strlen("PRI * HTTP/2.0\r\n\r\n");
+
+    int handled = 0;
+    struct THttp2Session* session = malloc(sizeof(*session));
+    THttp2Session_Init(session, HandleHttp2TestStream, &handled, 100);
+    THttp2Session_Start(session, NULL);
+    assert(THttp2Session_Feed(session, preface + head, sizeof(preface) - 1 - head));
+    assert(THttp2Session_Feed(session, settings, sizeof(settings) - 1));
+    assert(session->PartialSinceMs == 0);
+    assert(THttp2Session_GetDeadline(session) == session->ActivityMs + TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS);
+
+    // PINGs do not keep the connection alive, a frame left unfinished gets HEADER_READ_TIMEOUT
+    session->ActivityMs = 1;
+    assert(THttp2Session_Feed(session, ping, sizeof(ping) - 1));
+    assert(session->ActivityMs == 1 && session->PartialSinceMs == 0);
+    assert(THttp2Session_Feed(session, ping, 5));
+    const uint64_t partialSince = session->PartialSinceMs;
+    assert(partialSince != 0 && THttp2Session_GetDeadline(session) == 1 + TIMEOUT_FOR_KEEP_ALIVE_CONNECTIONS);
+    session->ActivityMs = MonotonicMs();
+    assert(THttp2Session_GetDeadline(session) == partialSince + HEADER_READ_TIMEOUT);
+    // the next frame started along with the end of this one does not restart the time
+    char pings[2 * sizeof(ping)];
+    memcpy(pings, ping + 5, sizeof(ping) - 1 - 5);
+    memcpy(pings + sizeof(ping) - 1 - 5, ping, 5);
+    assert(THttp2Session_Feed(session, pings, sizeof(ping) - 1));
+    assert(session->PartialSinceMs == partialSince);
+    assert(!THttp2Session_OnDeadline(session));  // a stalled frame closes the connection
+    assert(THttp2Session_Feed(session, ping + 5, sizeof(ping) - 1 - 5));
+    assert(session->PartialSinceMs == 0);
+
+    // a request is activity, the deadline of a session with a response in flight is the send progress one
+    session->ActivityMs = 1;
+    assert(THttp2Session_Feed(session, headers1, sizeof(headers1) - 1));
+    assert(handled == 1 && session->ActivityMs > 1 && session->ActiveStreams == 1);
+    assert(THttp2Session_GetDeadline(session) == session->ActivityMs + SEND_PROGRESS_TIMEOUT);
+    assert(!THttp2Session_OnDeadline(session));
+    THttp2Session_WriteFrames(session);
+    assert(session->ActiveStreams == 0);
+
+    // an idle session says GOAWAY once, then it is closed
+    assert(THttp2Session_OnDeadline(session) && session->GoAwaySent && THttp2Session_IsDone(session));
+    assert(!THttp2Session_OnDeadline(session));
+    THttp2Session_Destroy(session);
+    free(session);
+}
+
+static void TestRequestHeadLimit() {
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+
+    static char head[MAX_REQUEST_HEAD_SIZE + 16];
+    const char* requestLine = "GET / HTTP/1.1\r\n";
+    memcpy(head, requestLine, strlen(requestLine));
+    memset(head + strlen(requestLine), 'a', sizeof(head) - strlen(requestLine));
+    assert(THttpRequestParser_Parse(&parser, head, strlen(requestLine), &request) == 0);
+    assert(!parser.TooLarge);
+    assert(THttpRequestParser_Parse(&parser, head, sizeof(head), &request) == 0);
+    assert(parser.TooLarge);
+    assert(!parser.Complete);
+    assert(parser.HeadSize <= MAX_REQUEST_HEAD_SIZE);
+}
+
+static void TestPipelinedRequests() {
+    struct THttpInputBuffer input;
+    THttpInputBuffer_Init(&input);
+    const char* first = "GET /a HTTP/1.1\r\nConnection: keep-alive\r\n\r\n";
+    const char* second = "GET /b?x=1 HTTP/1.0\r\n\r\n";
+    const char* third = "GET /c HTTP/1.1\r\nHo";
+    assert(THttpInputBuffer_Append(&input, first, strlen(first)));
+    assert(THttpInputBuffer_Append(&input, second, strlen(second)));
+    assert(THttpInputBuffer_Append(&input, third, strlen(third)));
+
+    struct THttpRequestParser parser;
+    struct THttpRequest request;
+    const char* paths[] = {"/a", "/b"};
+    for (int i = 0; i < 2; ++i) {
+        assert(THttpInputBuffer_HasCompleteHead(&input));
+        THttpRequestParser_Init(&parser);
+        THttpRequest_Init(&request);
+        assert(THttpInputBuffer_Feed(&input, &parser, &request));
+        assert(parser.Complete && !parser.Invalid);
+        assert(strcmp(request.Path.Data, paths[i]) == 0);
+        assert(request.should_keep_alive == (i == 0));
+        // a finished head takes nothing more
+        assert(THttpInputBuffer_Feed(&input, &parser, &request));
+    }
+
+    // the third head is incomplete, it stays buffered until the rest arrives
+    assert(!THttpInputBuffer_HasCompleteHead(&input));
+    THttpRequestParser_Init(&parser);
+    THttpRequest_Init(&request);
+    assert(!THttpInputBuffer_Feed(&input, &parser, &request));
+    assert(THttpInputBuffer_HasData(&input));
+    assert(THttpInputBuffer_Append(&input, "st: x\r\n\r\n", 9));
+    assert(THttpInputBuffer_Feed(&input, &parser, &request));
+    assert(strcmp(request.Path.Data, "/c") == 0);
+    assert(!THttpInputBuffer_HasData(&input));
+    THttpInputBuffer_Destroy(&input);
+}
+
+static void TestRateLimiter() {
+    assert(RateLimiter_Init());
+
+    struct sockaddr_in client;
+    memset(&client, 0, sizeof(client));
+    client.sin_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.1", &client.sin_addr);
+    struct sockaddr_in6 mapped;
+    memset(&mapped, 0, sizeof(mapped));
+    mapped.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "::ffff:192.0.2.1", &mapped.sin6_addr);
+    struct sockaddr_in other = client;
+    inet_pton(AF_INET, "192.0.2.2", &other.sin_addr);
+
+    const uint64_t key = RateLimiter_GetKey((struct sockaddr*)&client);
+    assert(key != 0);
+    assert(RateLimiter_GetKey((struct sockaddr*)&mapped) == key);
+    assert(RateLimiter_GetKey((struct sockaddr*)&other) != key);
+
+    const uint64_t now = 5000;
+    for (int i = 0; i < RATE_LIMIT_REQUESTS_BURST; ++i) {
+        assert(RateLimiter_Take(key, RATE_LIMIT_REQUESTS, now));
+    }
+    assert(!RateLimiter_Take(key, RATE_LIMIT_REQUESTS, now));
+    // the buckets are independent, and so are the clients
+    assert(RateLimiter_Take(key, RATE_LIMIT_CONNECTIONS, now));
+    assert(RateLimiter_Take(RateLimiter_GetKey((struct sockaddr*)&other), RATE_LIMIT_REQUESTS, now));
+
+    // refilled at RATE_LIMIT_REQUESTS_PER_SEC
+    const uint64_t oneToken = (1000 + RATE_LIMIT_REQUESTS_PER_SEC - 1) / RATE_LIMIT_REQUESTS_PER_SEC;
+    assert(RateLimiter_Take(key, RATE_LIMIT_REQUESTS, now + oneToken));
+    assert(!RateLimiter_Take(key, RATE_LIMIT_REQUESTS, now + oneToken));
+}
+
+enum { POOL_TEST_ITEMS = 1000 };
+static uint32_t g_pool_test_seen[POOL_TEST_ITEMS];
+static uint32_t g_pool_test_done = 0;
+
+static void CountPoolItem(int fd, int worker_index) {
+    (void) worker_index;
+    __atomic_add_fetch(&g_pool_test_seen[fd], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_pool_test_done, 1, __ATOMIC_RELEASE);
+}
+
+static void* SubmitEvenPoolItems(void* pool_ptr) {
+    for (int i = 0; i < POOL_TEST_ITEMS / 2; ++i) {
+        TWorkerPool_Submit(pool_ptr, i * 2);
+    }
+    return NULL;
+}
+
+static void* SubmitOddPoolItems(void* pool_ptr) {
+    for (int i = 0; i < POOL_TEST_ITEMS / 2; ++i) {
+        TWorkerPool_Submit(pool_ptr, i * 2 + 1);
+    }
+    return NULL;
+}
+
+static void TestWorkerPool() {
+    static struct TWorkerPool pool;
+    assert(TWorkerPool_Start(&pool, CountPoolItem));
+    assert(pool.MinThreads >= 1 && pool.MinThreads <= pool.MaxThreads);
+
+    pthread_t producers[2];
+    pthread_create(&producers[0], NULL, SubmitEvenPoolItems, &pool);
+    pthread_create(&producers[1], NULL, SubmitOddPoolItems, &pool);
+    pthread_join(producers[0], NULL);
+    pthread_join(producers[1], NULL);
+    while (!TWorkerPool_IsIdle(&pool)) {
+        sched_yield();
+    }
+    assert(__atomic_load_n(&g_pool_test_done, __ATOMIC_ACQUIRE) == POOL_TEST_ITEMS);
+    for (int i = 0; i < POOL_TEST_ITEMS; ++i) {
+        assert(g_pool_test_seen[i] == 1);
+    }
+    assert(TWorkerPool_GetPending(&pool) == 0);
+}
+
+#define IO_POOL_TEST_JOBS 8
+
+static int g_io_pool_test_runs = 0;
+
+static void CountIoJob(struct TIoJob* job) {
+    (void) job;
+    __atomic_add_fetch(&g_io_pool_test_runs, 1, __ATOMIC_RELAXED);
+}
+
+static void TestIoPool() {
+    // a file that has just been read is in the page cache
+    char buf[64];
+    int fd = open("static/logo_en.svg", O_RDONLY);
+    assert(fd != -1);
+    ssize_t size = read(fd, buf, sizeof(buf));
+    assert(size > 0);
+    assert(IsFileRangeCached(fd, 0, size));
+    assert(IsFileRangeCached(fd, 0, 0));
+    close(fd);
+
+    struct TIoJob jobs[IO_POOL_TEST_JOBS];
+    struct TIoCompletions completions;
+    assert(!IoPool_Submit(&jobs[0]));  // not started yet
+    assert(IoPool_Start());
+    assert(TIoCompletions_Init(&completions));
+    for (int i = 0; i < IO_POOL_TEST_JOBS; ++i) {
+        jobs[i].Run = CountIoJob;
+        jobs[i].Owner = &completions;
+        assert(IoPool_Submit(&jobs[i]));
+    }
+    int completed = 0;
+    while (completed < IO_POOL_TEST_JOBS) {
+        for (struct TIoJob* job = TIoCompletions_TakeAll(&completions); job != NULL; job = job->Next) {
+            assert(job >= jobs && job < jobs + IO_POOL_TEST_JOBS);
+            completed++;
+        }
+        sched_yield();
+    }
+    assert(completed == IO_POOL_TEST_JOBS);
+    assert(__atomic_load_n(&g_io_pool_test_runs, __ATOMIC_RELAXED) == IO_POOL_TEST_JOBS);
+    close(completions.EventFd);
+}
+
 int main(void) {
     TestQueryString();
+    TestRouter();
     TestStringBuilder1();
     TestStringBuilder2();
+    TestRope();
     TestStartsWith();
     TestEndsWith();
+    TestMpmcQueue();
+    TestMpmcQueueThreads();
+    TestTimerWheel();
+    TestRequestParser();
+    TestDiskRequests();
+    TestPersistentConnections();
+    TestPreforkDrain();
+    TestResponseHeaders();
+    TestCrc32c();
+    TestGatherSend();
+    TestZeroCopySend();
+    TestConditionalRequests();
+    TestByteRanges();
+    TestLinkHeader();
+    TestChunkedBody();
+    TestHpack();
+    TestHttp2Session();
+    TestHttp2Continuation();
+    TestHttp2Deadlines();
+    TestRequestHeadLimit();
+    TestPipelinedRequests();
+    TestRateLimiter();
+    TestWorkerPool();
+    TestIoPool();
     printf("TESTS PASSED\n");
     return 0;
 }
@@ -0,0 +1,150 @@
+#include "timer_wheel.h"
+#include "config.h"
+
+#include <string.h>
+#include <time.h>
+
+uint64_t MonotonicMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void TTimer_Init(struct TTimer* self) {
+    self->Next = NULL;
+    self->Pprev = NULL;
+    self->Expires = 0;
+}
+
+bool TTimer_IsScheduled(const struct TTimer* self) {
+    return self->Pprev != NULL;
+}
+
+void TTimerWheel_Init(struct TTimerWheel* self, uint64_t now_ms) {
+    memset(self->Slots, 0, sizeof(self->Slots));
+    self->Now = 0;
+    self->StartMs = now_ms;
+    self->Count = 0;
+}
+
+static void Link(struct TTimer** head, struct TTimer* timer) {
+    timer->Next = *head;
+    if (*head != NULL) {
+        (*head)->Pprev = &timer->Next;
+    }
+    *head = timer;
+    timer->Pprev = head;
+}
+
+static void Unlink(struct TTimer* timer) {
+    *timer->Pprev = timer->Next;
+    if (timer->Next != NULL) {
+        timer->Next->Pprev = timer->Pprev;
+    }
+    timer->Next = NULL;
+    timer->Pprev = NULL;
+}
+
+// Picks the lowest level where the timer is less than a full turn away. A cascaded timer that
+// is due right now lands in the current level 0 slot, which is processed after the cascades.
+static void Place(struct TTimerWheel* self, struct TTimer* timer) {
+    int level = 0;
+    for (; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        const int shift = level * TIMER_WHEEL_BITS;
+        if ((timer->Expires >> shift) - (self->Now >> shift) < TIMER_WHEEL_SIZE) {
+            break;
+        }
+    }
+    const int shift = level * TIMER_WHEEL_BITS;
+    const uint64_t maxBlock = (self->Now >> shift) + TIMER_WHEEL_SIZE - 1;
+    uint64_t block = timer->Expires >> shift;
+    if (block > maxBlock) {
+        block = maxBlock;  // beyond the wheel range: parked in the farthest slot, re-placed on cascade
+    }
+    Link(&self->Slots[level][block & (TIMER_WHEEL_SIZE - 1)], timer);
+}
+
+void TTimerWheel_Schedule(struct TTimerWheel* self, struct TTimer* timer, uint64_t deadline_ms) {
+    if (TTimer_IsScheduled(timer)) {
+        Unlink(timer);
+    } else {
+        self->Count++;
+    }
+    uint64_t ms = deadline_ms > self->StartMs ? deadline_ms - self->StartMs : 0;
+    timer->Expires = (ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;  // never fire early
+    if (timer->Expires <= self->Now) {
+        timer->Expires = self->Now + 1;  // the current slot has already been processed
+    }
+    Place(self, timer);
+}
+
+void TTimerWheel_Cancel(struct TTimerWheel* self, struct TTimer* timer) {
+    if (TTimer_IsScheduled(timer)) {
+        Unlink(timer);
+        self->Count--;
+    }
+}
+
+static void Cascade(struct TTimerWheel* self, int level) {
+    const int shift = level * TIMER_WHEEL_BITS;
+    struct TTimer** slot = &self->Slots[level][(self->Now >> shift) & (TIMER_WHEEL_SIZE - 1)];
+    struct TTimer* timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+        struct TTimer* next = timer->Next;
+        timer->Pprev = NULL;
+        Place(self, timer);
+        timer = next;
+    }
+}
+
+void TTimerWheel_Advance(struct TTimerWheel* self, uint64_t now_ms, TTimerCallback callback, void* ctx) {
+    const uint64_t target = now_ms > self->StartMs ? (now_ms - self->StartMs) / TIMER_WHEEL_TICK_MS : 0;
+    while (self->Now < target) {
+        if (self->Count == 0) {
+            self->Now = target;  // nothing to cascade or fire
+            break;
+        }
+        self->Now++;
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if ((self->Now & ((1ULL << (level * TIMER_WHEEL_BITS)) - 1)) != 0) {
+                break;
+            }
+            Cascade(self, level);
+        }
+
+        struct TTimer** slot = &self->Slots[0][self->Now & (TIMER_WHEEL_SIZE - 1)];
+        while (*slot != NULL) {
+            struct TTimer* timer = *slot;
+            Unlink(timer);
+            self->Count--;
+            callback(timer, ctx);  // may schedule timers, including this one
+        }
+    }
+}
+
+int TTimerWheel_GetTimeout(const struct TTimerWheel* self, uint64_t now_ms) {
+    if (self->Count == 0) {
+        return -1;
+    }
+    // the nearest non-empty level 0 slot, but no further than the next cascade of level 1
+    uint64_t tick = self->Now + 1;
+    while ((tick & (TIMER_WHEEL_SIZE - 1)) != 0 && self->Slots[0][tick & (TIMER_WHEEL_SIZE - 1)] == NULL) {
+        ++tick;
+    }
+    const uint64_t tickMs = self->StartMs + tick * TIMER_WHEEL_TICK_MS;
+    return tickMs > now_ms ? (int)(tickMs - now_ms) : 0;
+}
+
+void TTimerWheel_ForEach(struct TTimerWheel* self, TTimerCallback callback, void* ctx) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        for (int i = 0; i < TIMER_WHEEL_SIZE; ++i) {
+            struct TTimer* timer = self->Slots[level][i];
+            while (timer != NULL) {
+                struct TTimer* next = timer->Next;
+                callback(timer, ctx);
+                timer = next;
+            }
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Hierarchical timer wheel for per-connection deadlines.
+ *
+ * TIMER_WHEEL_LEVELS levels of 64 slots, level L slot covers 64^L ticks of
+ * TIMER_WHEEL_TICK_MS. Scheduling and cancelling are O(1) list operations on an
+ * intrusive timer, and advancing costs O(1) per tick plus the (rare) cascades of the
+ * upper levels, so millions of keep-alive connections can be tracked with no sorting.
+ * Not thread-safe: every wheel is owned by one thread.
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct TTimer {
+    struct TTimer* Next;
+    struct TTimer** Pprev;  // NULL when the timer is not scheduled
+    uint64_t Expires;  // tick
+};
+
+struct TTimerWheel {
+    uint64_t Now;  // current tick
+    uint64_t StartMs;
+    size_t Count;
+    struct TTimer* Slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+
+typedef void (*TTimerCallback)(struct TTimer* timer, void* ctx);
+
+uint64_t MonotonicMs(void);
+
+void TTimer_Init(struct TTimer* self);
+bool TTimer_IsScheduled(const struct TTimer* self);
+
+void TTimerWheel_Init(struct TTimerWheel* self, uint64_t now_ms);
+// (Re)schedules the timer to fire at deadline_ms (MonotonicMs() clock)
+void TTimerWheel_Schedule(struct TTimerWheel* self, struct TTimer* timer, uint64_t deadline_ms);
+void TTimerWheel_Cancel(struct TTimerWheel* self, struct TTimer* timer);
+// Fires every timer due by now_ms, a timer is unscheduled before its callback is called
+void TTimerWheel_Advance(struct TTimerWheel* self, uint64_t now_ms, TTimerCallback callback, void* ctx);
+// Calls the callback for every scheduled timer, which may cancel the timer it gets
+void TTimerWheel_ForEach(struct TTimerWheel* self, TTimerCallback callback, void* ctx);
+// Milliseconds until the wheel may have something to fire, -1 if nothing is scheduled (epoll_wait timeout)
+int TTimerWheel_GetTimeout(const struct TTimerWheel* self, uint64_t now_ms);
@@ -0,0 +1,781 @@
+#include "uring.h"
+#include "config.h"
+
+#include "connection.h"
+#include "io.h"
+#include "lifecycle.h"
+#include "timer_wheel.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_MODE URING_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+#define URING_BUFFER_GROUP 0
+
+/**
+ * Raw io_uring plumbing (no liburing in the build environment)
+ */
+
+struct TUring {
+    int Fd;
+    unsigned SqEntries;
+    unsigned* SqHead;
+    unsigned* SqTail;
+    unsigned* SqMask;
+    unsigned* SqArray;
+    unsigned SqLocalTail;  // SQEs up to here are filled but not yet published to the kernel
+    struct io_uring_sqe* Sqes;
+
+    unsigned* CqHead;
+    unsigned* CqTail;
+    unsigned* CqMask;
+    struct io_uring_cqe* Cqes;
+
+    void* SqRing;
+    size_t SqRingSize;
+    void* CqRing;
+    size_t CqRingSize;
+    size_t SqesSize;
+};
+
+static int UringSetup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int UringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int UringRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static bool TUring_Init(struct TUring* self, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // A multishot accept and every in-flight connection may post completions at once.
+    // The ring is created disabled: a single issuer ring belongs to the thread that enables it.
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_R_DISABLED;
+    params.cq_entries = entries * 4;
+
+    self->Fd = UringSetup(entries, &params);
+    if (self->Fd == -1 && errno == EINVAL) {
+        // kernels before 6.0 do not know about the single issuer hint
+        params.flags = IORING_SETUP_CQSIZE;
+        self->Fd = UringSetup(entries, &params);
+    }
+    if (self->Fd == -1) {
+        return false;
+    }
+
+    self->SqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    self->CqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (self->CqRingSize > self->SqRingSize) {
+            self->SqRingSize = self->CqRingSize;
+        }
+        self->CqRingSize = self->SqRingSize;
+    }
+
+    self->SqRing = mmap(NULL, self->SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        self->Fd, IORING_OFF_SQ_RING);
+    if (self->SqRing == MAP_FAILED) {
+        perror("mmap sq ring");
+        close(self->Fd);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        self->CqRing = self->SqRing;
+    } else {
+        self->CqRing = mmap(NULL, self->CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            self->Fd, IORING_OFF_CQ_RING);
+        if (self->CqRing == MAP_FAILED) {
+            perror("mmap cq ring");
+            munmap(self->SqRing, self->SqRingSize);
+            close(self->Fd);
+            return false;
+        }
+    }
+
+    self->SqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    self->Sqes = mmap(NULL, self->SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      self->Fd, IORING_OFF_SQES);
+    if (self->Sqes == MAP_FAILED) {
+        perror("mmap sqes");
+        if (self->CqRing != self->SqRing) {
+            munmap(self->CqRing, self->CqRingSize);
+        }
+        munmap(self->SqRing, self->SqRingSize);
+        close(self->Fd);
+        return false;
+    }
+
+    char* sq = self->SqRing;
+    self->SqEntries = params.sq_entries;
+    self->SqHead = (unsigned*)(sq + params.sq_off.head);
+    self->SqTail = (unsigned*)(sq + params.sq_off.tail);
+    self->SqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    self->SqArray = (unsigned*)(sq + params.sq_off.array);
+    self->SqLocalTail = *self->SqTail;
+
+    char* cq = self->CqRing;
+    self->CqHead = (unsigned*)(cq + params.cq_off.head);
+    self->CqTail = (unsigned*)(cq + params.cq_off.tail);
+    self->CqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    self->Cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Must be called by the thread that is going to submit
+static void TUring_Enable(struct TUring* self) {
+    // EBADFD: the ring was not created disabled (older kernel), nothing to do
+    if (UringRegister(self->Fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) == -1 && errno != EBADFD) {
+        perror("io_uring_register enable");
+    }
+}
+
+static void TUring_Destroy(struct TUring* self) {
+    munmap(self->Sqes, self->SqesSize);
+    if (self->CqRing != self->SqRing) {
+        munmap(self->CqRing, self->CqRingSize);
+    }
+    munmap(self->SqRing, self->SqRingSize);
+    close(self->Fd);
+}
+
+// Publishes the filled SQEs and optionally waits for completions, the only syscall of the loop.
+// The wait gives up after timeoutMs unless it is -1 (the timeout argument appeared in 5.11).
+static void TUring_Submit(struct TUring* self, unsigned waitNr, int timeoutMs) {
+    unsigned toSubmit = self->SqLocalTail - *self->SqTail;
+    __atomic_store_n(self->SqTail, self->SqLocalTail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    unsigned flags = waitNr != 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (waitNr != 0 && timeoutMs != -1) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    while (true) {
+        int ret = (flags & IORING_ENTER_EXT_ARG)
+            ? UringEnter(self->Fd, toSubmit, waitNr, flags, &arg, sizeof(arg))
+            : UringEnter(self->Fd, toSubmit, waitNr, flags, NULL, 0);
+        if (ret >= 0) {
+            return;
+        }
+        if (errno == EINTR) {
+            toSubmit = 0;  // the submission part has already been done
+            continue;
+        }
+        if (errno == ETIME) {
+            return;  // nothing completed in time
+        }
+        if (errno != EBUSY && errno != EAGAIN) {  // EBUSY: the completion queue has to be reaped first
+            perror("io_uring_enter");
+        }
+        return;
+    }
+}
+
+static struct io_uring_sqe* TUring_GetSqe(struct TUring* self) {
+    while (self->SqLocalTail - __atomic_load_n(self->SqHead, __ATOMIC_ACQUIRE) >= self->SqEntries) {
+        TUring_Submit(self, 0, -1);
+    }
+    unsigned index = self->SqLocalTail & *self->SqMask;
+    struct io_uring_sqe* sqe = &self->Sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    self->SqArray[index] = index;
+    self->SqLocalTail++;
+    return sqe;
+}
+
+/**
+ * Provided buffer ring: the kernel picks a receive buffer when data arrives,
+ * so idle connections do not pin any receive memory.
+ */
+
+struct TBufferRing {
+    struct io_uring_buf_ring* Ring;
+    size_t RingSize;
+    char* Buffers;
+    unsigned Mask;
+    uint16_t Tail;
+};
+
+static void TBufferRing_Recycle(struct TBufferRing* self, uint16_t bufferId) {
+    struct io_uring_buf* buf = &self->Ring->bufs[self->Tail & self->Mask];
+    buf->addr = (uint64_t)(uintptr_t)(self->Buffers + (size_t)bufferId * RECV_BUF_SIZE);
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bufferId;
+    self->Tail++;
+    __atomic_store_n(&self->Ring->tail, self->Tail, __ATOMIC_RELEASE);
+}
+
+static bool TBufferRing_Init(struct TBufferRing* self, int ringFd, unsigned entries) {
+    self->RingSize = entries * sizeof(struct io_uring_buf);
+    self->Ring = mmap(NULL, self->RingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (self->Ring == MAP_FAILED) {
+        return false;
+    }
+    self->Buffers = malloc((size_t)entries * RECV_BUF_SIZE);
+    if (self->Buffers == NULL) {
+        munmap(self->Ring, self->RingSize);
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)self->Ring;
+    reg.ring_entries = entries;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (UringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        free(self->Buffers);
+        munmap(self->Ring, self->RingSize);
+        return false;
+    }
+
+    self->Mask = entries - 1;
+    self->Tail = 0;
+    for (unsigned i = 0; i < entries; ++i) {
+        TBufferRing_Recycle(self, i);
+    }
+    return true;
+}
+
+static void TBufferRing_Destroy(struct TBufferRing* self) {
+    free(self->Buffers);
+    munmap(self->Ring, self->RingSize);
+}
+
+static bool RegisterSparseFiles(int ringFd, unsigned count) {
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = count;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return UringRegister(ringFd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) != -1;
+}
+
+bool IsUringSupported(void) {
+    struct TUring ring;
+    if (!TUring_Init(&ring, 8)) {
+        return false;
+    }
+
+    bool supported = true;
+    const size_t probeSize = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probeSize);
+    if (probe == NULL || UringRegister(ring.Fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == -1) {
+        supported = false;
+    } else {
+        const int required[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SPLICE, IORING_OP_CLOSE};
+        for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); ++i) {
+            if (required[i] > probe->last_op || !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = false;
+            }
+        }
+    }
+    free(probe);
+
+    // both appeared in 5.19 together with multishot accept
+    struct TBufferRing buffers;
+    if (supported && !RegisterSparseFiles(ring.Fd, 1)) {
+        supported = false;
+    }
+    if (supported && !TBufferRing_Init(&buffers, ring.Fd, 1)) {
+        supported = false;
+    } else if (supported) {
+        TBufferRing_Destroy(&buffers);
+    }
+
+    TUring_Destroy(&ring);
+    return supported;
+}
+
+/**
+ * Connections
+ */
+
+enum EUringOp {
+    URING_OP_ACCEPT = 0,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_SPLICE_IN,   // file -> pipe
+    URING_OP_SPLICE_OUT,  // pipe -> socket
+    URING_OP_CLOSE,
+    URING_OP_STOP,    // poll on the lifecycle stop fd, then the drain timeout
+    URING_OP_CANCEL,  // the result of a cancellation, nothing to do
+};
+#define URING_OP_MASK 7
+
+struct TUringConnection {
+    struct TConnection Base;  // Base.Fd is the index in the fixed file table
+    int Pipe[2];
+    size_t PipeBytes;
+    unsigned InFlight;
+    bool Failed;
+    bool Closing;  // the close is submitted, no deadline any more
+    // all the open connections of the ring, to find the idle ones when draining
+    struct TUringConnection* Next;
+    struct TUringConnection* Prev;
+};
+
+struct TUringWorker {
+    int Index;
+    int ListenFd;
+    unsigned MaxConnections;
+    struct TUring Ring;
+    struct TBufferRing Buffers;
+    pthread_t Thread;
+
+    struct TUringConnection* Connections;
+    unsigned ConnectionCount;
+    struct TTimerWheel Timers;  // the deadline of every open connection
+    bool Draining;
+    uint64_t DrainDeadlineMs;
+    struct __kernel_timespec DrainTimeout;  // read by the kernel when the timeout is submitted
+};
+
+static uint64_t MakeUserData(struct TUringConnection* connection, enum EUringOp op) {
+    return (uint64_t)(uintptr_t)connection | op;
+}
+
+static void SubmitAccept(struct TUringWorker* worker) {
+    struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->ListenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;  // accepted sockets go straight into the fixed file table
+    sqe->user_data = MakeUserData(NULL, URING_OP_ACCEPT);
+}
+
+static void SubmitCancel(struct TUringWorker* worker, uint64_t user_data) {
+    struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->user_data = MakeUserData(NULL, URING_OP_CANCEL);
+}
+
+static void SubmitRecv(struct TUringWorker* worker, struct TUringConnection* connection) {
+    struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->Base.Fd;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->len = RECV_BUF_SIZE;
+    sqe->user_data = MakeUserData(connection, URING_OP_RECV);
+    connection->InFlight++;
+}
+
+static void SubmitClose(struct TUringWorker* worker, struct TUringConnection* connection) {
+    DEBUG_PRINT("ring %d: closing connection %d\n", worker->Index, connection->Base.Fd);
+    connection->Closing = true;
+    TTimerWheel_Cancel(&worker->Timers, &connection->Base.Timer);
+    if (connection->Pipe[0] != -1) {
+        close(connection->Pipe[0]);
+        close(connection->Pipe[1]);
+        connection->Pipe[0] = connection->Pipe[1] = -1;
+    }
+    struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = connection->Base.Fd + 1;
+    sqe->user_data = MakeUserData(connection, URING_OP_CLOSE);
+}
+
+static struct io_uring_sqe* SubmitSplice(struct TUringWorker* worker, struct TUringConnection* connection,
+                                         enum EUringOp op, size_t len) {
+    struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    if (op == URING_OP_SPLICE_IN) {
+        sqe->splice_fd_in = connection->Base.FileFd;
+        sqe->splice_off_in = connection->Base.FileOffset;
+        sqe->fd = connection->Pipe[1];
+        sqe->off = (uint64_t)-1;
+    } else {
+        sqe->splice_fd_in = connection->Pipe[0];
+        sqe->splice_off_in = (uint64_t)-1;
+        sqe->fd = connection->Base.Fd;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->off = (uint64_t)-1;
+    }
+    sqe->user_data = MakeUserData(connection, op);
+    connection->InFlight++;
+    return sqe;
+}
+
+static void SubmitResponse(struct TUringWorker* worker, struct TUringConnection* connection);
+
+// The head is complete: answers it and the pipelined requests already buffered after it in one batch
+static void Respond(struct TUringWorker* worker, struct TUringConnection* connection) {
+    TConnection_PrepareResponse(&connection->Base);
+    while (TConnection_PrepareBufferedResponse(&connection->Base)) {
+    }
+    SubmitResponse(worker, connection);
+}
+
+static void OnResponseSent(struct TUringWorker* worker, struct TUringConnection* connection) {
+    if (worker->Draining || !TConnection_StartNextRequest(&connection->Base)) {
+        SubmitClose(worker, connection);
+    } else if (TConnection_ParseInput(&connection->Base)) {
+        Respond(worker, connection);  // the batch was full, the rest is buffered already
+    } else {
+        SubmitRecv(worker, connection);
+    }
+}
+
+// Submits the rest of the response as one linked chain: send(headers and body) ->
+// splice(file -> pipe) -> splice(pipe -> socket). A short or failed step cancels the rest
+// of the chain, the next call then continues from the recorded progress. The parts of a
+// multipart 206 follow one another the same way, each with its delimiter sent first.
+static void SubmitResponse(struct TUringWorker* worker, struct TUringConnection* connection) {
+    struct TConnection* base = &connection->Base;
+    if (base->OutputSent == base->Output.Length && connection->PipeBytes == 0 && base->FileRemaining == 0 &&
+        !TConnection_NextResponsePart(base)) {
+        OnResponseSent(worker, connection);
+        return;
+    }
+    const bool haveOutput = base->OutputSent < base->Output.Length;
+
+    if (base->FileRemaining != 0 && connection->Pipe[0] == -1 && pipe2(connection->Pipe, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        connection->Pipe[0] = connection->Pipe[1] = -1;
+        SubmitClose(worker, connection);
+        return;
+    }
+
+    struct io_uring_sqe* previous = NULL;
+    if (haveOutput) {
+        struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = base->Fd;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->addr = (uint64_t)(uintptr_t)(base->Output.Data + base->OutputSent);
+        sqe->len = base->Output.Length - base->OutputSent;
+        // the file follows in the same chain, the end of Output waits for it to fill a segment
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (base->FileRemaining != 0 ? MSG_MORE : 0);
+        sqe->user_data = MakeUserData(connection, URING_OP_SEND);
+        connection->InFlight++;
+        previous = sqe;
+    }
+
+    if (connection->PipeBytes != 0) {
+        if (previous != NULL) {
+            previous->flags |= IOSQE_IO_LINK;
+        }
+        SubmitSplice(worker, connection, URING_OP_SPLICE_OUT, connection->PipeBytes);
+    } else if (base->FileRemaining != 0) {
+        size_t chunk = base->FileRemaining < URING_SPLICE_CHUNK ? base->FileRemaining : URING_SPLICE_CHUNK;
+        if (previous != NULL) {
+            previous->flags |= IOSQE_IO_LINK;
+        }
+        struct io_uring_sqe* in = SubmitSplice(worker, connection, URING_OP_SPLICE_IN, chunk);
+        in->flags |= IOSQE_IO_LINK;
+        SubmitSplice(worker, connection, URING_OP_SPLICE_OUT, chunk);
+    }
+}
+
+// After every completion: the phase or its start may have changed
+static void ScheduleDeadline(struct TUringWorker* worker, struct TUringConnection* connection) {
+    if (!connection->Closing) {
+        TTimerWheel_Schedule(&worker->Timers, &connection->Base.Timer, TConnection_GetDeadline(&connection->Base));
+    }
+}
+
+static void OnAccept(struct TUringWorker* worker, const struct io_uring_cqe* cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !worker->Draining) {
+        SubmitAccept(worker);  // the multishot request has terminated, re-arm it
+    }
+    if (cqe->res < 0) {
+        DEBUG_PRINT("ring %d: accept failed: %s\n", worker->Index, strerror(-cqe->res));
+        return;
+    }
+
+    struct TUringConnection* connection = malloc(sizeof(struct TUringConnection));
+    if (connection == NULL) {
+        struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->file_index = cqe->res + 1;
+        sqe->user_data = MakeUserData(NULL, URING_OP_CLOSE);
+        return;
+    }
+    TConnection_Init(&connection->Base, cqe->res);
+    connection->Pipe[0] = connection->Pipe[1] = -1;
+    connection->PipeBytes = 0;
+    connection->InFlight = 0;
+    connection->Failed = false;
+    connection->Closing = false;
+    connection->Prev = NULL;
+    connection->Next = worker->Connections;
+    if (worker->Connections != NULL) {
+        worker->Connections->Prev = connection;
+    }
+    worker->Connections = connection;
+    worker->ConnectionCount++;
+    DEBUG_PRINT("ring %d: accepted connection %d\n", worker->Index, cqe->res);
+    SubmitRecv(worker, connection);
+    ScheduleDeadline(worker, connection);
+}
+
+static void OnRecv(struct TUringWorker* worker, struct TUringConnection* connection, const struct io_uring_cqe* cqe) {
+    connection->InFlight--;
+    if (cqe->res == -ENOBUFS && !connection->Failed) {
+        SubmitRecv(worker, connection);  // all buffers are in use right now, they are recycled below
+        return;
+    }
+    uint16_t bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res <= 0 || connection->Failed) {
+        if (cqe->res > 0) {
+            TBufferRing_Recycle(&worker->Buffers, bufferId);  // arrived while its cancellation was on the way
+        }
+        SubmitClose(worker, connection);
+        return;
+    }
+
+    const char* data = worker->Buffers.Buffers + (size_t)bufferId * RECV_BUF_SIZE;
+    bool complete = TConnection_FeedInput(&connection->Base, data, cqe->res);
+    TBufferRing_Recycle(&worker->Buffers, bufferId);
+
+    if (complete) {
+        Respond(worker, connection);
+    } else {
+        SubmitRecv(worker, connection);
+    }
+}
+
+static void OnWrite(struct TUringWorker* worker, struct TUringConnection* connection,
+                    enum EUringOp op, const struct io_uring_cqe* cqe) {
+    connection->InFlight--;
+    struct TConnection* base = &connection->Base;
+
+    if (cqe->res == -ECANCELED) {
+        // an earlier step of the chain was short or failed
+    } else if (cqe->res <= 0) {
+        connection->Failed = true;  // sends are never empty, so 0 is no progress: closed as by the epoll path
+    } else if (op == URING_OP_SEND) {
+        base->PhaseStartMs = MonotonicMs();
+        base->OutputSent += cqe->res;
+    } else if (op == URING_OP_SPLICE_IN) {
+        connection->PipeBytes += cqe->res;
+        base->FileOffset += cqe->res;
+        base->FileRemaining -= cqe->res;
+    } else {
+        base->PhaseStartMs = MonotonicMs();  // only what reaches the socket is progress
+        connection->PipeBytes -= cqe->res;
+    }
+
+    if (connection->InFlight != 0) {
+        return;  // wait for the whole chain
+    }
+    if (connection->Failed) {
+        SubmitClose(worker, connection);
+    } else {
+        SubmitResponse(worker, connection);
+    }
+}
+
+// Idle too long, a head that does not end or a response that does not move: cancels whatever the
+// connection waits for, the completions see Failed and close it
+static void OnConnectionTimeout(struct TTimer* timer, void* worker_ptr) {
+    struct TUringWorker* worker = worker_ptr;
+    struct TUringConnection* connection =
+        (struct TUringConnection*)((char*)timer - offsetof(struct TUringConnection, Base.Timer));
+    DEBUG_PRINT("ring %d: connection %d has missed its deadline\n", worker->Index, connection->Base.Fd);
+    connection->Failed = true;
+    // the ops that are not in flight complete the cancellation with -ENOENT
+    SubmitCancel(worker, MakeUserData(connection, URING_OP_RECV));
+    SubmitCancel(worker, MakeUserData(connection, URING_OP_SEND));
+    SubmitCancel(worker, MakeUserData(connection, URING_OP_SPLICE_IN));
+    SubmitCancel(worker, MakeUserData(connection, URING_OP_SPLICE_OUT));
+}
+
+static void RemoveConnection(struct TUringWorker* worker, struct TUringConnection* connection) {
+    if (connection->Prev != NULL) {
+        connection->Prev->Next = connection->Next;
+    } else {
+        worker->Connections = connection->Next;
+    }
+    if (connection->Next != NULL) {
+        connection->Next->Prev = connection->Prev;
+    }
+    worker->ConnectionCount--;
+}
+
+static void SubmitStopPoll(struct TUringWorker* worker) {
+    struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = Lifecycle_GetStopFd();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = MakeUserData(NULL, URING_OP_STOP);
+}
+
+// Stops accepting (the listener stays open for the next binary) and cancels the receive of
+// every connection waiting for its next request, the connections busy with a response are
+// closed after it is sent
+static void StartDraining(struct TUringWorker* worker) {
+    worker->Draining = true;
+    worker->DrainDeadlineMs = MonotonicMs() + DRAIN_TIMEOUT;
+    SubmitCancel(worker, MakeUserData(NULL, URING_OP_ACCEPT));
+
+    for (struct TUringConnection* connection = worker->Connections; connection != NULL; connection = connection->Next) {
+        const struct TConnection* base = &connection->Base;
+        if (base->State == CONNECTION_STATE_READING && base->Parser.HeadSize == 0 && connection->InFlight == 1) {
+            SubmitCancel(worker, MakeUserData(connection, URING_OP_RECV));  // completes with -ECANCELED
+        }
+    }
+
+    worker->DrainTimeout.tv_sec = DRAIN_TIMEOUT / 1000;
+    worker->DrainTimeout.tv_nsec = (DRAIN_TIMEOUT % 1000) * 1000000;
+    struct io_uring_sqe* sqe = TUring_GetSqe(&worker->Ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&worker->DrainTimeout;
+    sqe->len = 1;
+    sqe->user_data = MakeUserData(NULL, URING_OP_STOP);
+    DEBUG_PRINT("ring %d: draining %u connections\n", worker->Index, worker->ConnectionCount);
+}
+
+static void OnCompletion(struct TUringWorker* worker, const struct io_uring_cqe* cqe) {
+    enum EUringOp op = cqe->user_data & URING_OP_MASK;
+    struct TUringConnection* connection = (struct TUringConnection*)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+    switch (op) {
+        case URING_OP_ACCEPT:
+            OnAccept(worker, cqe);
+            break;
+        case URING_OP_RECV:
+            OnRecv(worker, connection, cqe);
+            ScheduleDeadline(worker, connection);
+            break;
+        case URING_OP_SEND:
+        case URING_OP_SPLICE_IN:
+        case URING_OP_SPLICE_OUT:
+            OnWrite(worker, connection, op, cqe);
+            ScheduleDeadline(worker, connection);
+            break;
+        case URING_OP_CLOSE:
+            if (connection != NULL) {
+                RemoveConnection(worker, connection);
+                TConnection_Destroy(&connection->Base);
+                free(connection);
+            }
+            break;
+        case URING_OP_STOP:
+            if (!worker->Draining) {
+                StartDraining(worker);
+            }
+            break;  // otherwise the drain timeout, the loop checks the deadline itself
+        default:
+            break;
+    }
+}
+
+static void* UringWorkerMain(void* worker_ptr) {
+    struct TUringWorker* worker = worker_ptr;
+    struct TUring* ring = &worker->Ring;
+
+    TUring_Enable(ring);
+    TTimerWheel_Init(&worker->Timers, MonotonicMs());
+    SubmitAccept(worker);
+    SubmitStopPoll(worker);
+    while (!worker->Draining || (worker->ConnectionCount != 0 && MonotonicMs() < worker->DrainDeadlineMs)) {
+        TUring_Submit(ring, 1, TTimerWheel_GetTimeout(&worker->Timers, MonotonicMs()));
+
+        unsigned head = *ring->CqHead;
+        unsigned tail = __atomic_load_n(ring->CqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = ring->Cqes[head & *ring->CqMask];
+            // release the slot before handling: the handler may submit and wait for more
+            ++head;
+            __atomic_store_n(ring->CqHead, head, __ATOMIC_RELEASE);
+            OnCompletion(worker, &cqe);
+            if (head == tail) {
+                tail = __atomic_load_n(ring->CqTail, __ATOMIC_ACQUIRE);
+            }
+        }
+        TTimerWheel_Advance(&worker->Timers, MonotonicMs(), OnConnectionTimeout, worker);
+    }
+    return NULL;
+}
+
+static bool TUringWorker_Init(struct TUringWorker* self, int index, int listen_fd, unsigned max_connections) {
+    self->Index = index;
+    self->ListenFd = listen_fd;
+    self->MaxConnections = max_connections;
+    self->Connections = NULL;
+    self->ConnectionCount = 0;
+    self->Draining = false;
+    self->DrainDeadlineMs = 0;
+    if (!TUring_Init(&self->Ring, URING_ENTRIES)) {
+        perror("io_uring_setup");
+        return false;
+    }
+    if (!RegisterSparseFiles(self->Ring.Fd, self->MaxConnections)) {
+        perror("io_uring_register files");
+        TUring_Destroy(&self->Ring);
+        return false;
+    }
+    if (!TBufferRing_Init(&self->Buffers, self->Ring.Fd, URING_RECV_BUFFERS)) {
+        perror("io_uring_register buffer ring");
+        TUring_Destroy(&self->Ring);
+        return false;
+    }
+    return true;
+}
+
+bool RunUringServer(int listen_fd) {
+    // the fixed file table may not be larger than RLIMIT_NOFILE
+    size_t maxConnections = RaiseOpenFilesLimit();
+    if (maxConnections > URING_MAX_CONNECTIONS) {
+        maxConnections = URING_MAX_CONNECTIONS;
+    }
+
+    struct TUringWorker workers[NUM_URING_THREADS];
+    for (int i = 0; i < NUM_URING_THREADS; ++i) {
+        if (!TUringWorker_Init(&workers[i], i, listen_fd, maxConnections)) {
+            return false;
+        }
+    }
+
+    // the calling thread runs the first ring itself
+    for (int i = 1; i < NUM_URING_THREADS; ++i) {
+        int ret = pthread_create(&workers[i].Thread, NULL, UringWorkerMain, &workers[i]);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+            return false;
+        }
+    }
+    UringWorkerMain(&workers[0]);
+    if (!workers[0].Draining) {
+        return false;
+    }
+    for (int i = 1; i < NUM_URING_THREADS; ++i) {
+        pthread_join(workers[i].Thread, NULL);
+    }
+    return true;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Checks that the kernel provides everything the io_uring backend relies on:
+// multishot accept into a sparse fixed file table, provided buffer rings, splice and close.
+bool IsUringSupported(void);
+
+// Serves the already listening socket with NUM_URING_THREADS rings. The whole connection
+// lifecycle (accept, recv, send, file splice, close) runs through the rings, so a request
+// normally costs a single io_uring_enter() batch shared with other connections.
+bool RunUringServer(int listen_fd);
@@ -0,0 +1,266 @@
+#include "worker_pool.h"
+#include "config.h"
+
+#include "cpus.h"
+#include "futex.h"
+#include "io.h"
+#include "timer_wheel.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEBUG_MODE WORKER_POOL_DEBUG_MODE
+
+#if(DEBUG_MODE == 1)
+#define DEBUG_PRINT(...) {do{printf(__VA_ARGS__);}while(0);}
+#define DEBUG_PRINT_IF(condition, ...) {do{if((condition)){printf(__VA_ARGS__);};}while(0);}
+#else
+#define DEBUG_PRINT(...)
+#define DEBUG_PRINT_IF(condition, ...)
+#endif
+
+struct TWorkerArgs {
+    struct TWorkerPool* Pool;
+    unsigned Slot;
+};
+
+static unsigned Clamp(unsigned value, unsigned min, unsigned max) {
+    return value < min ? min : (value > max ? max : value);
+}
+
+static bool TryTake(struct TWorkerPool* self, unsigned own, int* fd) {
+    if (TMpmcQueue_TryPop(&self->Slots[own].Queue, fd)) {
+        return true;
+    }
+    // steal, starting next to the own slot so the thieves do not all hit the same victim
+    const unsigned slots = __atomic_load_n(&self->SlotsInUse, __ATOMIC_ACQUIRE);
+    for (unsigned i = 1; i < slots; ++i) {
+        if (TMpmcQueue_TryPop(&self->Slots[(own + i) % slots].Queue, fd)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void Notify(uint32_t* events, uint32_t* waiters, int count) {
+    __atomic_add_fetch(events, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) != 0) {
+        FutexWake(events, count);
+    }
+}
+
+static void Dispatch(struct TWorkerPool* self, unsigned slot, int fd) {
+    Notify(&self->SpaceEvents, &self->SpaceWaiters, 1);
+
+    if ((size_t)fd < self->MaxFds) {
+        const uint64_t enqueued = __atomic_load_n(&self->EnqueuedAtMs[fd], __ATOMIC_RELAXED);
+        const uint64_t now = MonotonicMs();
+        const uint32_t waited = now > enqueued ? (uint32_t)(now - enqueued) : 0;
+        // racy read-modify-write on purpose: a lost sample does not matter for an average
+        const uint32_t ewma = __atomic_load_n(&self->WaitEwmaMs, __ATOMIC_RELAXED);
+        __atomic_store_n(&self->WaitEwmaMs, (ewma * 7 + waited) / 8, __ATOMIC_RELAXED);
+    }
+
+    self->Handler(fd, (int)slot);
+    __atomic_add_fetch(&self->Completed, 1, __ATOMIC_SEQ_CST);
+}
+
+static void* WorkerMain(void* args_ptr) {
+    struct TWorkerArgs args = *(struct TWorkerArgs*)args_ptr;
+    free(args_ptr);
+    struct TWorkerPool* self = args.Pool;
+
+    while (true) {
+        int fd;
+        if (TryTake(self, args.Slot, &fd)) {
+            Dispatch(self, args.Slot, fd);
+            continue;
+        }
+
+        // register as idle before the re-check, see Notify()
+        const uint32_t events = __atomic_load_n(&self->WorkEvents, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&self->IdleThreads, 1, __ATOMIC_SEQ_CST);
+        if (TryTake(self, args.Slot, &fd)) {
+            __atomic_sub_fetch(&self->IdleThreads, 1, __ATOMIC_SEQ_CST);
+            Dispatch(self, args.Slot, fd);
+            continue;
+        }
+        const bool woken = FutexWaitTimeout(&self->WorkEvents, events, POOL_IDLE_TIMEOUT_MS);
+        __atomic_sub_fetch(&self->IdleThreads, 1, __ATOMIC_SEQ_CST);
+        if (woken) {
+            continue;
+        }
+
+        unsigned threads = __atomic_load_n(&self->Threads, __ATOMIC_RELAXED);
+        if (threads > self->MinThreads &&
+            __atomic_compare_exchange_n(&self->Threads, &threads, threads - 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            // whatever is left in the own queue is stolen by the others
+            DEBUG_PRINT("worker pool: worker %u is idle, exiting (%u left)\n", args.Slot, threads - 1);
+            __atomic_store_n(&self->Slots[args.Slot].Running, 0, __ATOMIC_RELEASE);
+            Notify(&self->WorkEvents, &self->IdleThreads, 1);
+            return NULL;
+        }
+    }
+}
+
+static bool SpawnWorker(struct TWorkerPool* self) {
+    for (unsigned slot = 0; slot < self->MaxThreads; ++slot) {
+        uint32_t running = 0;
+        if (!__atomic_compare_exchange_n(&self->Slots[slot].Running, &running, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        struct TWorkerArgs* args = malloc(sizeof(struct TWorkerArgs));
+        if (args == NULL) {
+            __atomic_store_n(&self->Slots[slot].Running, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+        args->Pool = self;
+        args->Slot = slot;
+
+        pthread_t thread;
+        int ret = pthread_create(&thread, NULL, WorkerMain, args);
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+            free(args);
+            __atomic_store_n(&self->Slots[slot].Running, 0, __ATOMIC_RELEASE);
+            return false;
+        }
+        pthread_detach(thread);
+
+        __atomic_add_fetch(&self->Threads, 1, __ATOMIC_SEQ_CST);
+        unsigned inUse = __atomic_load_n(&self->SlotsInUse, __ATOMIC_RELAXED);
+        while (slot + 1 > inUse && !__atomic_compare_exchange_n(&self->SlotsInUse, &inUse, slot + 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        DEBUG_PRINT("worker pool: started worker %u\n", slot);
+        return true;
+    }
+    return false;
+}
+
+static void* SupervisorMain(void* pool_ptr) {
+    struct TWorkerPool* self = pool_ptr;
+    uint64_t lastCompleted = 0;
+
+    while (true) {
+        usleep(POOL_ADJUST_INTERVAL_MS * 1000);
+
+        const uint64_t completed = __atomic_load_n(&self->Completed, __ATOMIC_RELAXED);
+        const bool stalled = (completed == lastCompleted);
+        lastCompleted = completed;
+
+        const size_t pending = TWorkerPool_GetPending(self);
+        if (pending == 0 || __atomic_load_n(&self->IdleThreads, __ATOMIC_SEQ_CST) != 0) {
+            continue;
+        }
+        // every thread is busy and the queues do not drain fast enough
+        if (!stalled && __atomic_load_n(&self->WaitEwmaMs, __ATOMIC_RELAXED) < POOL_GROW_LATENCY_MS) {
+            continue;
+        }
+        const unsigned threads = __atomic_load_n(&self->Threads, __ATOMIC_RELAXED);
+        unsigned toStart = Clamp(pending, 1, self->MaxThreads - threads);
+        DEBUG_PRINT_IF(threads < self->MaxThreads, "worker pool: %zu sockets wait, adding %u workers\n", pending, toStart);
+        while (threads < self->MaxThreads && toStart-- > 0 && SpawnWorker(self)) {
+        }
+    }
+    return NULL;
+}
+
+bool TWorkerPool_Start(struct TWorkerPool* self, TWorkerPoolHandler handler) {
+    const unsigned cpus = GetCpuBudget();
+    self->MaxThreads = Clamp(cpus * POOL_MAX_THREADS_PER_CPU, 1, POOL_MAX_THREADS);
+    self->MinThreads = Clamp(cpus * POOL_MIN_THREADS_PER_CPU, 1, self->MaxThreads);
+    self->Handler = handler;
+    self->SlotsInUse = 0;
+    self->Threads = 0;
+    self->IdleThreads = 0;
+    self->NextSlot = 0;
+    self->Submitted = 0;
+    self->Completed = 0;
+    self->WaitEwmaMs = 0;
+    self->WorkEvents = 0;
+    self->SpaceEvents = 0;
+    self->SpaceWaiters = 0;
+
+    self->MaxFds = RaiseOpenFilesLimit();
+    self->EnqueuedAtMs = calloc(self->MaxFds, sizeof(uint64_t));
+    self->Slots = aligned_alloc(CACHE_LINE_SIZE, self->MaxThreads * sizeof(struct TWorkerSlot));
+    if (self->EnqueuedAtMs == NULL || self->Slots == NULL) {
+        return false;
+    }
+    for (unsigned i = 0; i < self->MaxThreads; ++i) {
+        self->Slots[i].Running = 0;
+        if (!TMpmcQueue_Init(&self->Slots[i].Queue, POOL_WORKER_QUEUE_DEPTH)) {
+            return false;
+        }
+    }
+
+    DEBUG_PRINT("worker pool: %u cpus available, %u..%u workers\n", cpus, self->MinThreads, self->MaxThreads);
+    for (unsigned i = 0; i < self->MinThreads; ++i) {
+        if (!SpawnWorker(self)) {
+            return false;
+        }
+    }
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, SupervisorMain, self);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+bool TWorkerPool_TrySubmit(struct TWorkerPool* self, int fd) {
+    if ((size_t)fd < self->MaxFds) {
+        __atomic_store_n(&self->EnqueuedAtMs[fd], MonotonicMs(), __ATOMIC_RELAXED);
+    }
+    // counted before the push, so Completed never runs ahead of it
+    __atomic_add_fetch(&self->Submitted, 1, __ATOMIC_SEQ_CST);
+    const unsigned slots = __atomic_load_n(&self->SlotsInUse, __ATOMIC_ACQUIRE);
+    const uint64_t first = __atomic_fetch_add(&self->NextSlot, 1, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < slots; ++i) {
+        if (TMpmcQueue_TryPush(&self->Slots[(first + i) % slots].Queue, fd)) {
+            Notify(&self->WorkEvents, &self->IdleThreads, 1);
+            return true;
+        }
+    }
+    __atomic_sub_fetch(&self->Submitted, 1, __ATOMIC_SEQ_CST);
+    return false;
+}
+
+void TWorkerPool_Submit(struct TWorkerPool* self, int fd) {
+    while (true) {
+        const uint32_t events = __atomic_load_n(&self->SpaceEvents, __ATOMIC_SEQ_CST);
+        if (TWorkerPool_TrySubmit(self, fd)) {
+            return;
+        }
+        __atomic_add_fetch(&self->SpaceWaiters, 1, __ATOMIC_SEQ_CST);
+        if (TWorkerPool_TrySubmit(self, fd)) {
+            __atomic_sub_fetch(&self->SpaceWaiters, 1, __ATOMIC_SEQ_CST);
+            return;
+        }
+        FutexWait(&self->SpaceEvents, events);
+        __atomic_sub_fetch(&self->SpaceWaiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+size_t TWorkerPool_GetPending(const struct TWorkerPool* self) {
+    size_t pending = 0;
+    const unsigned slots = __atomic_load_n(&self->SlotsInUse, __ATOMIC_ACQUIRE);
+    for (unsigned i = 0; i < slots; ++i) {
+        pending += TMpmcQueue_Size(&self->Slots[i].Queue);
+    }
+    return pending;
+}
+
+bool TWorkerPool_IsIdle(const struct TWorkerPool* self) {
+    const uint64_t completed = __atomic_load_n(&self->Completed, __ATOMIC_SEQ_CST);
+    return completed == __atomic_load_n(&self->Submitted, __ATOMIC_SEQ_CST);
+}
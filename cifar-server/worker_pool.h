@@ -0,0 +1,60 @@
+#pragma once
+
+#include "mpmc_queue.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Elastic thread pool of socket handlers with per-worker queues and work stealing.
+ *
+ * Every worker slot owns a bounded lock-free queue. Producers spread the sockets over the
+ * queues round-robin, a worker drains its own queue first and then steals from the others,
+ * so a burst that lands on a few queues is still spread over all the running threads.
+ * The pool starts with a thread count derived from GetCpuBudget(). A supervisor thread
+ * adds workers while sockets wait in the queues for longer than POOL_GROW_LATENCY_MS
+ * (or do not move at all) and nobody is idle, and workers that stay idle for
+ * POOL_IDLE_TIMEOUT_MS exit, down to the minimum.
+ */
+
+typedef void (*TWorkerPoolHandler)(int fd, int worker_index);
+
+struct TWorkerSlot {
+    struct TMpmcQueue Queue;
+    uint32_t Running;  // 1 while a thread owns the slot
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct TWorkerPool {
+    struct TWorkerSlot* Slots;
+    unsigned MinThreads;
+    unsigned MaxThreads;
+    TWorkerPoolHandler Handler;
+
+    unsigned SlotsInUse;  // high-water mark of the slots, producers and thieves look at them only
+    unsigned Threads;
+    unsigned IdleThreads;
+    uint64_t NextSlot;
+    uint64_t Submitted;
+    uint64_t Completed;
+    uint32_t WaitEwmaMs;  // how long the recently dispatched sockets have been queued
+
+    // eventcounts: idle workers wait for work, producers wait for space in the queues
+    uint32_t WorkEvents __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t SpaceEvents __attribute__((aligned(CACHE_LINE_SIZE)));
+    uint32_t SpaceWaiters;
+
+    uint64_t* EnqueuedAtMs;  // indexed by fd
+    size_t MaxFds;
+};
+
+// Starts the initial workers and the supervisor
+bool TWorkerPool_Start(struct TWorkerPool* self, TWorkerPoolHandler handler);
+// Returns false if every queue is full
+bool TWorkerPool_TrySubmit(struct TWorkerPool* self, int fd);
+// Waits while every queue is full
+void TWorkerPool_Submit(struct TWorkerPool* self, int fd);
+// Sockets waiting for a worker (approximate)
+size_t TWorkerPool_GetPending(const struct TWorkerPool* self);
+// Every submitted socket has been handled: nothing is queued and no worker runs a task
+bool TWorkerPool_IsIdle(const struct TWorkerPool* self);